@@ -4,7 +4,8 @@
 
 static int successful_grab = 0;
 
-#define GRABBER_PIPE_CH 1
+// past the channels used by the streams themselves
+#define GRABBER_PIPE_CH MAX_STREAMS
 
 // camera helper callback whenever a frame arrives
 static void _cam_metadata_helper_cb( int ch,camera_image_metadata_t meta,
@@ -23,6 +24,7 @@ static void _cam_metadata_helper_cb( int ch,camera_image_metadata_t meta,
 // called to fetch one camera frame to get its metadata
 static int metadataGrabber(const char* process_name, context_data* context)
 {
+    successful_grab = 0;
     pipe_client_set_camera_helper_cb(GRABBER_PIPE_CH, _cam_metadata_helper_cb, context);
 
     if(pipe_client_open(GRABBER_PIPE_CH, context->input_pipe_name, process_name, \
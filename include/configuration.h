@@ -56,16 +56,16 @@
 int configure_frame_format(const int format, context_data *ctx);
 
 /**
- * @brief      Given the configuration name (optional, can be NULL) and the name of the
- *             configuration file, parse all of the data and fill in the context data
- *             structure with all of the needed information to set up the stream.
+ * @brief      Parse the configuration file and fill in a context data
+ *             structure for every stream it lists with all of the needed
+ *             information to set up that stream.
  *
- * @param[in]  config_file_name     Complete path and file name of the configuration file
- * @param[in]  config_name          Optional configuration name. Can be NULL.
- * @param[in]  ctx                  Pointer to the context structure to be filled in.
+ * @param[out] streams              Array of context structures to be filled in
+ * @param[in]  max_streams          Number of entries in streams
+ * @param[out] n_streams            Number of streams that were configured
  *
  * @return     0 on success, -1 on failure
  */
-int config_file_read(context_data *ctx);
+int config_file_read(context_data *streams, int max_streams, int *n_streams);
 
 #endif // CONFIGURATION_H
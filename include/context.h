@@ -44,21 +44,71 @@
 #include <modal_pipe.h>
 #include <pthread.h>
 #include <gst/rtsp-server/rtsp-server.h>
+#include "frame_queue.h"
+#include "gop_cache.h"
+#include "nal_parser.h"
+#include "rate_control.h"
+#include "tone_map.h"
+#include "encoder.h"
 
 // Definition of the default port used by the RTSP server
 #define MAX_RTSP_PORT_SIZE 8
 #define DEFAULT_RTSP_PORT "8900"
 
+// Streams one process can serve, each on its own mount point
+#define MAX_STREAMS 8
+#define MAX_MOUNT_POINT_LENGTH 64
+#define DEFAULT_MOUNT_POINT "/live"
+
 #define MAX_OVERLAY_FILE_NAME_STRING_LENGTH 64
 #define MAX_IMAGE_FORMAT_STRING_LENGTH 16
 
+#define DEFAULT_APPSRC_MAX_LATENCY_MS 100
+#define MAX_MULTICAST_ADDRESS_LENGTH 64
+#define ENCODE_LATENCY_SLOTS 16
+#define RTP_MTU_BYTES 1400  // payloader default
+
+// What to throw away when the app source is full
+typedef enum drop_policy_t {
+    DROP_POLICY_AUTO,       // oldest for raw streams, keyframe for encoded
+    DROP_POLICY_OLDEST,     // keep the newest frame, drop whatever is waiting
+    DROP_POLICY_NEWEST,     // keep what is waiting, drop new frames
+    DROP_POLICY_KEYFRAME    // drop whole GOPs, resume at the next keyframe
+} drop_policy_t;
+
+// What to do when the source pipe backs up
+typedef enum backlog_recovery_t {
+    BACKLOG_RECOVERY_AUTO,          // flush for raw streams, skip-to-idr for encoded
+    BACKLOG_RECOVERY_FLUSH,         // throw away everything in the pipe
+    BACKLOG_RECOVERY_SKIP_TO_IDR,   // discard frames until the next keyframe
+    BACKLOG_RECOVERY_DROP_NON_REF   // discard non-reference frames, then skip-to-idr
+} backlog_recovery_t;
+
+// Where we are in recovering from a backed up source pipe
+typedef enum backlog_state_t {
+    BACKLOG_STATE_OK,
+    BACKLOG_STATE_DROP_NON_REF,
+    BACKLOG_STATE_SKIP_TO_IDR
+} backlog_state_t;
+
+// Who gets the cached GOP replayed to them when they start playing. The
+// media and its app source are shared, so a replay reaches everyone watching.
+typedef enum gop_replay_t {
+    GOP_REPLAY_OFF,
+    GOP_REPLAY_FIRST_CLIENT     // only when nobody else is watching
+} gop_replay_t;
+
+// Which RTP transports clients may pick
+typedef enum multicast_mode_t {
+    MULTICAST_OFF,          // unicast UDP or TCP for every client
+    MULTICAST_ALLOW,        // clients asking for multicast share one stream
+    MULTICAST_FORCE         // multicast only, one stream for everyone
+} multicast_mode_t;
+
 // Structure to contain all needed information, so we can pass it to callbacks
 typedef struct _context_data {
 
-    GstElement *test_source;
-    GstElement *test_caps_filter;
-    GstElement *overlay_queue;
-    GstElement *image_overlay;
+    // elements of the current media pipeline, NULL for stages it skips
     GstElement *app_source;
     GstElement *app_source_filter;
     GstElement *scaler_queue;
@@ -69,23 +119,45 @@ typedef struct _context_data {
     GstElement *video_rotate;
     GstElement *video_rotate_filter;
     GstElement *encoder_queue;
-    GstElement *omx_encoder;
-#ifndef PLATFORM_APQ8096
-    GstElement *omx_h265_encoder;
-#endif
-    GstElement *h264_parser;
-    GstElement *h265_parser;
+    GstElement *encoder;
+    GstElement *encoder_parser;
     GstElement *rtp_filter;
     GstElement *rtp_queue;
     GstElement *rtp_payload;
     GstElement *rtp_h265_payload;
 
+    // latest parameter sets from the encoded stream, and the header built
+    // from them that goes in front of the first frame a client sees
+    nal_param_sets_t param_sets;
     GstBuffer *h264_sps_nal;
     GstBuffer *h265_sps_nal;
-    GstMapInfo sps_info;
 
+    // preallocated buffers for frames going into app_source
+    GstBufferPool *frame_pool;
+    int frame_pool_buffers;
+    int frame_pool_huge_pages;
+    atomic_uint frame_pool_hits;    // bumped from the pipe and feeder threads
+    atomic_uint frame_pool_misses;
+
+    // hand off between the pipe reader and the feeder thread
+    frame_queue_t frame_queue;
+    int frame_queue_depth;
+
+    // shared by all streams, each one has its own mount point
     GstRTSPServer *rtsp_server;
     int num_rtsp_clients;
+    char mount_point[MAX_MOUNT_POINT_LENGTH];
+    GstElement *pipeline;
+
+    // source pipe state for this stream
+    int pipe_ch;
+    int first_client;
+    int first_run;
+    int meta_data_dumped;           // first frame's metadata logged once
+    int closing_pipe_intentionally;
+    int source_pipe_size;
+    pthread_t feeder_thread;
+    volatile int feeder_running;
 
     uint32_t input_parameters_initialized;
     uint32_t input_frame_size;
@@ -93,6 +165,7 @@ typedef struct _context_data {
     int input_frame_height;
     int input_frame_rate;
     int input_format;
+    int source_frame_rate;          // pipe's frame rate, before the decimator
 
     char input_frame_format[MAX_IMAGE_FORMAT_STRING_LENGTH];
     char input_frame_caps_format[MAX_IMAGE_FORMAT_STRING_LENGTH];
@@ -108,12 +181,182 @@ typedef struct _context_data {
     uint32_t output_frame_rate;
     uint32_t output_frame_decimator;
 
+    // encoder for raw streams, see encoder and codec in the config file.
+    // Resolved from auto to what's installed for the codec when the stream
+    // is set up.
+    encoder_backend_t encoder_backend;
+    encoder_codec_t codec;
+    uint32_t gop_size;
+
+    // slices per frame, see slices in the config file. 0 or 1 encodes and
+    // sends whole frames.
+    uint32_t encode_slices;
+
+    // keyframes forced for joining clients and PLI/FIR, see
+    // keyframe-on-demand. A request stays pending until the next frame goes
+    // into the encoder at least keyframe_min_interval_ms after the last one.
+    int keyframe_on_demand;
+    uint32_t keyframe_min_interval_ms;
+    atomic_int keyframe_pending;
+    gint64 keyframe_last_us;        // encoder's streaming thread only
+    atomic_uint keyframe_requests;
+    atomic_uint keyframes_forced;
+
+    // changes from the control pipe the feeder applies before its next
+    // frame, 0 for no change, protected by lock
+    atomic_int reconfigure_pending;
+    uint32_t reconfigure_width;
+    uint32_t reconfigure_height;
+    uint32_t reconfigure_decimator;
+
+    // requested output size, see output-width and output-scale. 0 means
+    // work it out from the other one or the scale factor.
+    uint32_t output_resize_width;
+    uint32_t output_resize_height;
+    double output_scale;
+
     uint32_t input_frame_number;
     uint32_t output_frame_number;
     guint64 initial_timestamp;
     guint64 last_timestamp;
 
-    volatile int need_data;
+    // feeding is set once the app source first asks for data. need_data
+    // follows the app source need-data/enough-data signals after that.
+    atomic_int feeding;
+    atomic_int need_data;
+    pthread_mutex_t flow_lock;
+    pthread_cond_t flow_cond;
+    drop_policy_t drop_policy;
+    uint32_t appsrc_max_latency_ms;
+
+    backlog_recovery_t backlog_recovery;
+    backlog_state_t backlog_state;
+    int backlog_resync;
+    uint32_t backlog_frames_skipped;
+
+    // frames since the last keyframe, replayed to clients joining mid-GOP
+    gop_cache_t gop_cache;
+    gop_replay_t gop_replay;
+    atomic_int gop_replay_pending;
+
+    // clients that haven't been sent a keyframe yet, protected by lock
+    GList *pending_clients;
+
+    // warm standby between clients, see standby-timeout-s
+    int standby_timeout_s;
+    int standby;
+    int standby_resume;
+    gint64 standby_since_us;
+    GstRTSPMedia *standby_media;
+
+    // riding out a camera server restart, see source-recovery
+    int source_recovery;
+    int source_outage;
+    gint64 last_frame_us;           // when the last real frame went out
+    gint64 outage_last_frame_us;    // last_frame_us when the outage started
+    uint32_t outage_filler_frames;
+    GstBuffer *last_frame;          // raw frame repeated during an outage
+
+    // read frames from the pipe straight into gstreamer buffers instead of
+    // going through the camera helper and a memcpy
+    int zero_copy_ingest;
+
+    // convert and rotate raw frames to NV12 ourselves in the feeder instead
+    // of in the pipeline, see fused-convert
+    int fused_convert_enable;
+    int fused_convert;              // enabled and supported for this stream
+    uint8_t *convert_band;
+    uint8_t *convert_full;          // full size NV12 when scaling after conversion
+    uint8_t *scale_scratch;
+
+    // RAW16 to 8 bit mapping done as part of the fused conversion, see
+    // raw16-tone-map
+    tone_map_mode_t raw16_tone_map;
+    uint32_t raw16_min;
+    uint32_t raw16_max;
+    double raw16_gamma;
+    tone_map_t tone_map;
+    uint8_t *tone_mapped;           // GRAY8 frame before conversion
+    uint32_t convert_frames;
+    gint64 convert_time_us;
+
+    // simulcast, see renditions in the config file. The source stream reads
+    // the pipe and isn't mounted itself, each rendition is mounted and fed
+    // encoded frames from its own branch of the source's pipeline.
+    struct _context_data *simulcast_parent;
+    int simulcast_users;            // renditions of this source with clients
+    int simulcast_active;           // rendition is taking frames, simulcast_lock
+    pthread_mutex_t simulcast_lock;
+    GstElement *simulcast_encoder;
+    uint32_t rendition_width;       // 0 means the same as the source
+    uint32_t rendition_height;
+    uint32_t rendition_fps;
+
+    // adaptive bitrate for streams we encode ourselves, see adaptive-bitrate
+    int abr_enable;
+    uint32_t abr_min_bitrate;
+    uint32_t abr_max_bitrate;       // 0 means the stream's bitrate
+    uint32_t abr_min_fps;
+    char abr_log_file[MODAL_PIPE_MAX_PATH_LEN];
+    rate_control_t rate_control;
+    gint64 abr_waiting_since_us;    // clients but no receiver report yet, main loop only
+    int abr_no_report_warned;
+    GstRTSPMedia *media;            // media serving the stream, main loop only
+
+    // ULPFEC protection of the outgoing RTP, see fec-percentage
+    uint32_t fec_percentage;
+    uint32_t fec_pt;
+
+    // retransmission of lost packets, see rtx-time-ms. The history is kept
+    // by rtprtxsend, bounded by time and by packets derived from bytes.
+    uint32_t rtx_time_ms;
+    uint32_t rtx_history_bytes;
+    uint32_t rtx_history_packets;
+    uint32_t rtx_last_requests;
+    uint32_t rtx_last_packets;
+
+    // multicast RTP output, see multicast in the config file. The address
+    // pool is shared by all streams, each media gets its own group.
+    multicast_mode_t multicast;
+    char multicast_address_min[MAX_MULTICAST_ADDRESS_LENGTH];
+    char multicast_address_max[MAX_MULTICAST_ADDRESS_LENGTH];
+    int multicast_port_min;
+    int multicast_port_max;
+    int multicast_ttl;
+
+    // spread the RTP packets of large frames out, see pacing-window-ms
+    uint32_t pacing_window_ms;
+    uint32_t pacing_burst_packets;
+    gint64 pacing_window_us;        // after limiting to the frame period
+    atomic_uint pacing_packets;
+    atomic_uint pacing_sends;       // lists handed to the sink, one sendmmsg each
+    atomic_uint pacing_frames_paced;
+    atomic_uint pacing_max_burst;
+    // big frames are handed to a thread of their own to be spread out so
+    // the payloader's streaming thread never sleeps
+    pthread_t pacing_thread;
+    int pacing_running;
+    GAsyncQueue *pacing_queue;
+    GstPad *pacing_pad;             // payloader src the bursts go out on
+    atomic_uint pacing_pending;     // frames queued or still being sent
+
+    // time frames spend in the encoder, matched up by PTS between probes
+    // on either side of it. Printed with the egress stats.
+    GstClockTime encode_pts[ENCODE_LATENCY_SLOTS];
+    gint64 encode_in_us[ENCODE_LATENCY_SLOTS];
+    unsigned int encode_slot;
+    uint32_t encode_frames;
+    gint64 encode_latency_us;
+    gint64 encode_latency_max_us;
+
+    // egress stats, printed every so often while there are clients
+    guint64 egress_last_bytes;
+    gint64 egress_last_us;
+
+    // ingest stats, printed when the last client disconnects
+    uint32_t ingest_frames;
+    guint64 ingest_bytes_copied;
+    gint64 ingest_time_us;
 
     pthread_mutex_t lock;
 
@@ -0,0 +1,106 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file control.h
+ *
+ * This file contains the control pipe, which changes stream settings while
+ * clients are connected instead of restarting and dropping all of them.
+ * Commands are written to /run/mpa/voxl-streamer/control one per line, e.g.
+ *
+ *   echo "set_bitrate /live 2000000" > /run/mpa/voxl-streamer/control
+ *
+ * The mount point can be left out when there is only one stream. Commands
+ * arrive on the pipe's own thread and are handed to the RTSP main loop to
+ * be carried out, replies go to the log and to the pipe's data channel.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#include "context.h"
+
+typedef enum control_command_t {
+    CONTROL_SET_BITRATE,
+    CONTROL_SET_GOP,
+    CONTROL_SET_DECIMATOR,
+    CONTROL_SET_RESOLUTION,
+    CONTROL_STATUS
+} control_command_t;
+
+typedef struct control_request_t {
+    control_command_t command;
+    char mount[MAX_MOUNT_POINT_LENGTH];     // empty if none was given
+    uint32_t value;                         // bitrate, GOP or decimator
+    uint32_t width;                         // for set_resolution
+    uint32_t height;
+} control_request_t;
+
+typedef void (*control_apply_cb)(const control_request_t *request);
+
+/**
+ * @brief      Create the control pipe. Commands are held until a main loop
+ *             is attached with control_attach.
+ *
+ * @param[in]  apply  Called on the main loop for each command
+ *
+ * @return     0 on success, -1 if the pipe couldn't be made
+ */
+int control_init(control_apply_cb apply);
+
+/**
+ * @brief      Set the main loop context commands are carried out on. Set it
+ *             to NULL while there is no main loop running, commands wait
+ *             until the next one is attached.
+ *
+ * @param[in]  context  The main loop's context, can be NULL
+ */
+void control_attach(GMainContext *context);
+
+/**
+ * @brief      Reply to a command, goes to the log and the control pipe's
+ *             data channel
+ *
+ * @param[in]  format  printf style format
+ */
+void control_reply(const char *format, ...) G_GNUC_PRINTF(1, 2);
+
+/**
+ * @brief      Close the control pipe and drop any waiting commands
+ */
+void control_deinit(void);
+
+#endif // CONTROL_H
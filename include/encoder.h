@@ -0,0 +1,194 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file encoder.h
+ *
+ * This file contains the encoder backends for raw streams. Each backend is
+ * a gstreamer encoder element, this hides the differences in their
+ * property names and units so the pipeline can drive any of them with the
+ * same bitrate and GOP settings. Rotation, scaling and conversion all happen
+ * before the encoder so every backend sees the same NV12 frames.
+ *
+ * The OMX encoders are the hardware ones on VOXL. x264, openh264 and x265
+ * are software fallbacks, tuned for latency rather than compression, so the
+ * pipeline also runs on machines without OMX like a desktop or CI box.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+typedef enum encoder_codec_t {
+    ENCODER_CODEC_H264,
+    ENCODER_CODEC_H265
+} encoder_codec_t;
+
+typedef enum encoder_backend_t {
+    ENCODER_AUTO,           // first installed backend for the codec
+    ENCODER_OMX_H264,
+    ENCODER_OMX_H265,
+    ENCODER_X264,
+    ENCODER_OPENH264,
+    ENCODER_X265
+} encoder_backend_t;
+
+/**
+ * @brief      Name of a codec as used in the config file
+ *
+ * @param[in]  codec  The codec
+ *
+ * @return     Name, "h264" or "h265"
+ */
+const char *encoder_codec_name(encoder_codec_t codec);
+
+/**
+ * @brief      Look up a codec by its config file name
+ *
+ * @param[in]  name   Name, "h264" or "h265"
+ * @param[out] codec  The codec
+ *
+ * @return     0 on success, -1 if there's no such codec
+ */
+int encoder_codec_from_name(const char *name, encoder_codec_t *codec);
+
+/**
+ * @brief      Name of a backend as used in the config file
+ *
+ * @param[in]  backend  The backend
+ *
+ * @return     Name, e.g. "omx-h264"
+ */
+const char *encoder_name(encoder_backend_t backend);
+
+/**
+ * @brief      Look up a backend by its config file name
+ *
+ * @param[in]  name     Name, e.g. "x264"
+ * @param[out] backend  The backend
+ *
+ * @return     0 on success, -1 if there's no such backend
+ */
+int encoder_from_name(const char *name, encoder_backend_t *backend);
+
+/**
+ * @brief      Pick the backend to use, checking its element is installed
+ *
+ * A requested backend that makes the other codec is ignored with a
+ * warning and one is picked for the codec as if it was ENCODER_AUTO.
+ *
+ * @param[in]  requested  Backend from the config file, can be ENCODER_AUTO
+ * @param[in]  codec      Codec to encode to
+ * @param[out] resolved   Backend to use
+ *
+ * @return     0 on success, -1 if it isn't available
+ */
+int encoder_resolve(encoder_backend_t requested, encoder_codec_t codec,
+                    encoder_backend_t *resolved);
+
+/**
+ * @brief      Codec a backend produces
+ *
+ * @param[in]  backend  The backend, ENCODER_AUTO counts as H264
+ *
+ * @return     The codec
+ */
+encoder_codec_t encoder_codec(encoder_backend_t backend);
+
+/**
+ * @brief      Check if a backend produces H265 rather than H264
+ *
+ * @param[in]  backend  The backend
+ *
+ * @return     1 for H265, 0 for H264
+ */
+int encoder_is_h265(encoder_backend_t backend);
+
+/**
+ * @brief      Make and configure an encoder element
+ *
+ * @param[in]  backend   Resolved backend
+ * @param[in]  name      Element name, can be NULL
+ * @param[in]  bitrate   Target bitrate in bits per second
+ * @param[in]  gop_size  Frames from one keyframe to the next
+ * @param[in]  slices    Slices to split each frame into, 0 or 1 for whole
+ *                       frames
+ *
+ * @return     The element, NULL if it couldn't be made
+ */
+GstElement *encoder_create(encoder_backend_t backend, const char *name,
+                           uint32_t bitrate, uint32_t gop_size, uint32_t slices);
+
+/**
+ * @brief      Change the bitrate of a running encoder
+ *
+ * @param[in]  encoder  Element from encoder_create
+ * @param[in]  backend  Its backend
+ * @param[in]  bitrate  Target bitrate in bits per second
+ */
+void encoder_set_bitrate(GstElement *encoder, encoder_backend_t backend, uint32_t bitrate);
+
+/**
+ * @brief      Change the keyframe interval of an encoder. Unless
+ *             encoder_gop_is_live says otherwise the encoder has to be
+ *             stopped to READY or below for this to take.
+ *
+ * @param[in]  encoder   Element from encoder_create
+ * @param[in]  backend   Its backend
+ * @param[in]  gop_size  Frames from one keyframe to the next
+ */
+void encoder_set_gop(GstElement *encoder, encoder_backend_t backend, uint32_t gop_size);
+
+/**
+ * @brief      Whether an encoder takes a new keyframe interval while it is
+ *             playing. Most only read it when they start.
+ *
+ * @param[in]  encoder  Element from encoder_create
+ * @param[in]  backend  Its backend
+ *
+ * @return     1 if encoder_set_gop works on a playing encoder, 0 if not
+ */
+int encoder_gop_is_live(GstElement *encoder, encoder_backend_t backend);
+
+/**
+ * @brief      Caps of the encoder's output, byte-stream H264 or H265
+ *
+ * @param[in]  backend  The backend
+ *
+ * @return     New caps, unref when done
+ */
+GstCaps *encoder_caps(encoder_backend_t backend);
+
+#endif // ENCODER_H
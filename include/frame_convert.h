@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file frame_convert.h
+ *
+ * This file contains the fused raw frame converter. It turns a raw frame
+ * from the pipe into NV12 for the encoder and rotates it in the same pass,
+ * replacing a videoscale -> videoconvert -> videoflip chain that would walk
+ * over the whole frame three times on three threads.
+ *
+ * The frame is worked through in bands of FRAME_CONVERT_BAND_ROWS rows.
+ * Each band is converted into a small scratch buffer that stays in cache
+ * and then written out rotated in square blocks, so the rotation doesn't
+ * stride across the whole output frame for every pixel.
+ */
+
+#ifndef FRAME_CONVERT_H
+#define FRAME_CONVERT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_CONVERT_BAND_ROWS 16
+
+/**
+ * @brief      Check if a frame can go through frame_convert_nv12
+ *
+ * @param[in]  format    Pipe image format, IMAGE_FORMAT_*
+ * @param[in]  width     Frame width, has to be even
+ * @param[in]  height    Frame height, has to be even
+ * @param[in]  rotation  Clockwise rotation, 0, 90, 180 or 270
+ *
+ * @return     1 if supported, 0 if not
+ */
+int frame_convert_supported(int format, int width, int height, int rotation);
+
+/**
+ * @brief      Size of the scratch buffer frame_convert_nv12 needs
+ *
+ * @param[in]  width   Frame width
+ *
+ * @return     Size in bytes
+ */
+size_t frame_convert_band_size(int width);
+
+/**
+ * @brief      Convert a frame to NV12 and rotate it in one pass
+ *
+ * @param[in]  src       Frame as it came off the pipe, tightly packed
+ * @param[in]  format    Pipe image format, IMAGE_FORMAT_*
+ * @param[in]  width     Frame width before rotation
+ * @param[in]  height    Frame height before rotation
+ * @param[in]  rotation  Clockwise rotation, 0, 90, 180 or 270
+ * @param[out] dst       NV12 frame at the rotated size, width * height * 3/2
+ * @param      band      Scratch of frame_convert_band_size(width) bytes
+ */
+void frame_convert_nv12(const uint8_t *src, int format, int width, int height,
+                        int rotation, uint8_t *dst, uint8_t *band);
+
+#endif // FRAME_CONVERT_H
@@ -0,0 +1,97 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file frame_pool.h
+ *
+ * This file contains the API for the preallocated frame buffer pool. All
+ * frames pushed into the app source come from here so the hot path never
+ * has to go to the heap once the stream is running.
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include "context.h"
+
+#define DEFAULT_FRAME_POOL_BUFFERS 8
+
+/**
+ * @brief      Create and preallocate the frame pool in the context. The slot
+ *             size is derived from input_frame_size for raw streams or the
+ *             frame dimensions for encoded streams.
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ *
+ * @return     0 on success, -1 on failure
+ */
+int frame_pool_create(context_data *ctx);
+
+/**
+ * @brief      Size of one pool slot for the current input. Raw streams use
+ *             input_frame_size, encoded streams a generous keyframe bound.
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ *
+ * @return     Slot size in bytes
+ */
+gsize frame_pool_slot_size(context_data *ctx);
+
+/**
+ * @brief      Get a buffer of the requested size from the pool. Falls back to
+ *             a heap allocated buffer (and counts a miss) if the pool is empty
+ *             or the frame does not fit in a slot.
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ * @param[in]  size    Number of bytes needed
+ *
+ * @return     New buffer owned by the caller, NULL on failure
+ */
+GstBuffer *frame_pool_acquire(context_data *ctx, gsize size);
+
+/**
+ * @brief      Deactivate and release the pool. Buffers still in flight in
+ *             the pipeline keep their memory until they are released.
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ */
+void frame_pool_destroy(context_data *ctx);
+
+/**
+ * @brief      Print and reset the pool hit/miss counters
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ */
+void frame_pool_print_stats(context_data *ctx);
+
+#endif // FRAME_POOL_H
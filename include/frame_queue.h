@@ -0,0 +1,131 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file frame_queue.h
+ *
+ * This file contains the API for the lock-free hand off between the pipe
+ * reader thread and the feeder thread that pushes frames into gstreamer.
+ * There is exactly one producer and one consumer per queue.
+ *
+ * In mailbox mode only the newest frame is kept, a frame that wasn't picked
+ * up before the next one arrived is overwritten. This is used for raw frames
+ * where latency matters more than completeness.
+ *
+ * In fifo mode frames are kept in order in a fixed size ring and new frames
+ * are dropped when the ring is full. This is used for encoded frames which
+ * depend on each other.
+ */
+
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <gst/gst.h>
+
+#define FRAME_QUEUE_MAX_DEPTH 16
+#define DEFAULT_FRAME_QUEUE_DEPTH 4
+
+typedef enum frame_queue_mode_t {
+    FRAME_QUEUE_MAILBOX,
+    FRAME_QUEUE_FIFO
+} frame_queue_mode_t;
+
+typedef struct frame_queue_t {
+    frame_queue_mode_t mode;
+    unsigned int depth;
+
+    // mailbox mode
+    _Atomic(GstBuffer*) mailbox;
+
+    // fifo mode, head is only written by the producer and tail only by the
+    // consumer
+    GstBuffer *ring[FRAME_QUEUE_MAX_DEPTH];
+    atomic_uint head;
+    atomic_uint tail;
+
+    // posted once per push so the consumer can sleep
+    sem_t ready;
+    int initialized;
+
+    atomic_uint overwritten;
+    atomic_uint dropped;
+} frame_queue_t;
+
+/**
+ * @brief      Initialize a queue
+ *
+ * @param[in]  q       Queue to initialize
+ * @param[in]  mode    Mailbox or fifo
+ * @param[in]  depth   Ring depth for fifo mode, clamped to FRAME_QUEUE_MAX_DEPTH
+ *
+ * @return     0 on success, -1 on failure
+ */
+int frame_queue_init(frame_queue_t *q, frame_queue_mode_t mode, unsigned int depth);
+
+/**
+ * @brief      Release any buffers left in the queue and tear it down. The
+ *             producer and consumer must both be stopped.
+ *
+ * @param[in]  q       Queue to tear down
+ */
+void frame_queue_deinit(frame_queue_t *q);
+
+/**
+ * @brief      Producer side. Hands a buffer to the queue, never blocks.
+ *
+ * @param[in]  q       The queue
+ * @param[in]  buf     Buffer, ownership passes to the queue
+ *
+ * @return     0 if queued, 1 if it replaced an unread frame (mailbox), -1 if
+ *             the queue was full and buf was dropped (fifo)
+ */
+int frame_queue_push(frame_queue_t *q, GstBuffer *buf);
+
+/**
+ * @brief      Consumer side. Waits for a buffer.
+ *
+ * @param[in]  q           The queue
+ * @param[in]  timeout_ms  How long to wait before giving up
+ *
+ * @return     Buffer owned by the caller, or NULL on timeout
+ */
+GstBuffer *frame_queue_pop(frame_queue_t *q, int timeout_ms);
+
+/**
+ * @brief      Consumer side. Number of frames waiting in the queue.
+ */
+unsigned int frame_queue_count(frame_queue_t *q);
+
+#endif // FRAME_QUEUE_H
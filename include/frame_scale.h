@@ -0,0 +1,90 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file frame_scale.h
+ *
+ * This file contains the downscaler used to bring raw frames to the output
+ * resolution before they're encoded. Sizes that divide evenly use a box
+ * filter, everything else is bilinear. Both work a row at a time with SSE2
+ * or NEON doing the heavy lifting where it's available.
+ */
+
+#ifndef FRAME_SCALE_H
+#define FRAME_SCALE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief      Size of the scratch buffer the scale functions need
+ *
+ * @param[in]  src_width  Source frame width
+ * @param[in]  dst_width  Destination frame width
+ *
+ * @return     Size in bytes
+ */
+size_t frame_scale_scratch_size(int src_width, int dst_width);
+
+/**
+ * @brief      Scale one plane of 1 byte (luma, GRAY8) or 2 byte (interleaved
+ *             NV12 chroma) elements
+ *
+ * @param[in]  src      Source plane, tightly packed
+ * @param[in]  src_w    Source width in elements
+ * @param[in]  src_h    Source height
+ * @param[out] dst      Destination plane, tightly packed
+ * @param[in]  dst_w    Destination width in elements
+ * @param[in]  dst_h    Destination height
+ * @param[in]  elem     Bytes per element, 1 or 2
+ * @param      scratch  Scratch of frame_scale_scratch_size() bytes
+ */
+void frame_scale_plane(const uint8_t *src, int src_w, int src_h,
+                       uint8_t *dst, int dst_w, int dst_h,
+                       int elem, uint8_t *scratch);
+
+/**
+ * @brief      Scale an NV12 frame, sizes have to be even
+ *
+ * @param[in]  src      Source frame
+ * @param[in]  src_w    Source width
+ * @param[in]  src_h    Source height
+ * @param[out] dst      Destination frame
+ * @param[in]  dst_w    Destination width
+ * @param[in]  dst_h    Destination height
+ * @param      scratch  Scratch of frame_scale_scratch_size() bytes
+ */
+void frame_scale_nv12(const uint8_t *src, int src_w, int src_h,
+                      uint8_t *dst, int dst_w, int dst_h, uint8_t *scratch);
+
+#endif // FRAME_SCALE_H
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file gop_cache.h
+ *
+ * This file contains the API for the GOP cache. For encoded input streams
+ * the feeder keeps every frame since the most recent keyframe so that a
+ * client joining mid-GOP can be sent a decodable picture right away instead
+ * of waiting for the camera server's next IDR.
+ *
+ * Frames are copied into memory the cache owns, holding on to the buffers
+ * themselves would keep a whole GOP's worth of frame pool slots out of use.
+ *
+ * The cache is only touched from the feeder thread so it has no locking.
+ */
+
+#ifndef GOP_CACHE_H
+#define GOP_CACHE_H
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+// Room for twice the default gop-size of 150, e.g. 10 s at 30 fps. That
+// many frames at 10 Mbps comes to about 12.5 MB. Longer or bigger GOPs
+// aren't cached and their clients wait for the next keyframe.
+#define GOP_CACHE_MAX_FRAMES 300
+#define GOP_CACHE_MAX_BYTES  (16*1024*1024)
+
+typedef struct gop_cache_frame_t {
+    gsize offset;               // into the cache's data
+    gsize size;
+    GstClockTime duration;
+    GstBufferFlags flags;
+} gop_cache_frame_t;
+
+typedef struct gop_cache_t {
+    uint8_t *data;              // GOP_CACHE_MAX_BYTES, made on first use
+    gop_cache_frame_t frames[GOP_CACHE_MAX_FRAMES];
+    int n_frames;
+    gsize n_bytes;
+    // set when the current GOP didn't fit, nothing can be replayed until
+    // the next keyframe starts a new one
+    int overflowed;
+} gop_cache_t;
+
+/**
+ * @brief      Add a frame that was just pushed into the pipeline. A keyframe
+ *             starts a new GOP, a delta frame is appended to the current one.
+ *             The frame's data is copied, the buffer isn't kept.
+ *
+ * @param[in]  cache   The cache
+ * @param[in]  buf     Frame, GST_BUFFER_FLAG_DELTA_UNIT marks non-keyframes
+ */
+void gop_cache_add(gop_cache_t *cache, GstBuffer *buf);
+
+/**
+ * @brief      Drop every cached frame, the memory is kept for the next GOP
+ *
+ * @param[in]  cache   The cache
+ */
+void gop_cache_clear(gop_cache_t *cache);
+
+/**
+ * @brief      Drop every cached frame and free the cache's memory
+ *
+ * @param[in]  cache   The cache
+ */
+void gop_cache_free(gop_cache_t *cache);
+
+/**
+ * @brief      Check if the cache holds a complete GOP starting at a keyframe
+ *
+ * @param[in]  cache   The cache
+ *
+ * @return     Number of frames that can be replayed, 0 if none
+ */
+int gop_cache_replayable(gop_cache_t *cache);
+
+/**
+ * @brief      Copy a cached frame out into a new buffer, with the duration
+ *             and flags it came in with
+ *
+ * @param[in]  cache   The cache
+ * @param[in]  i       Frame number from 0, below gop_cache_replayable
+ *
+ * @return     New buffer owned by the caller, NULL on failure
+ */
+GstBuffer *gop_cache_get_frame(gop_cache_t *cache, int i);
+
+#endif // GOP_CACHE_H
@@ -0,0 +1,105 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file nal_parser.h
+ *
+ * This file contains helpers for looking inside Annex-B H264/H265 byte
+ * streams coming from the camera server.
+ */
+
+#ifndef NAL_PARSER_H
+#define NAL_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest parameter set we keep, anything bigger is ignored
+#define NAL_PARAM_SET_MAX_SIZE 256
+
+// Worst case size of the header written by nal_param_sets_write
+#define NAL_PARAM_SETS_MAX_HEADER (3 * (4 + NAL_PARAM_SET_MAX_SIZE))
+
+typedef struct nal_param_set_t {
+    uint8_t data[NAL_PARAM_SET_MAX_SIZE];   // NAL without the start code
+    size_t  size;                           // 0 if we haven't seen one
+} nal_param_set_t;
+
+/**
+ * Latest parameter sets seen in a stream. Only one of each is kept, the
+ * camera server never uses more than one SPS/PPS id. The VPS is only used
+ * for H265.
+ */
+typedef struct nal_param_sets_t {
+    nal_param_set_t vps;
+    nal_param_set_t sps;
+    nal_param_set_t pps;
+} nal_param_sets_t;
+
+/**
+ * What nal_parse_au found in an access unit
+ */
+typedef struct nal_au_info_t {
+    int keyframe;               // contains an IDR/IRAP picture
+    int droppable;              // has slices and no later picture references them
+    int has_param_sets;         // contains a VPS, SPS or PPS
+    int param_sets_changed;     // one of those differs from what we had
+} nal_au_info_t;
+
+/**
+ * @brief      Scan an Annex-B access unit in a single pass, classifying
+ *             the picture and picking up any parameter sets.
+ *
+ * @param      ps        Parameter sets seen so far, updated in place
+ * @param[in]  data      Annex-B data
+ * @param[in]  size      Number of bytes in data
+ * @param[in]  is_h265   0 for H264, 1 for H265
+ * @param[out] info      What was found in the access unit
+ */
+void nal_parse_au(nal_param_sets_t *ps, const uint8_t *data, size_t size,
+                  int is_h265, nal_au_info_t *info);
+
+/**
+ * @brief      Write the stored parameter sets as an Annex-B stream header
+ *             (VPS, SPS, PPS), ready to be sent ahead of a keyframe.
+ *
+ * @param[in]  ps        Parameter sets to write
+ * @param[out] out       Where to write the header
+ * @param[in]  max       Size of out, NAL_PARAM_SETS_MAX_HEADER always fits
+ *
+ * @return     Number of bytes written, 0 if there was nothing to write or
+ *             it didn't fit
+ */
+size_t nal_param_sets_write(const nal_param_sets_t *ps, uint8_t *out, size_t max);
+
+#endif // NAL_PARSER_H
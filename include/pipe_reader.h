@@ -0,0 +1,95 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file pipe_reader.h
+ *
+ * This file contains the API for the direct pipe reader. Instead of letting
+ * the libmodal_pipe camera helper read each frame into its own buffer (which
+ * we then have to copy into a gstreamer buffer) the direct reader reads the
+ * metadata first, asks for a destination buffer, and reads the frame data
+ * straight into it.
+ */
+
+#ifndef PIPE_READER_H
+#define PIPE_READER_H
+
+#include <gst/gst.h>
+#include <modal_pipe.h>
+
+#define PIPE_READER_MAX_CH 8
+
+/**
+ * Called after the metadata for a frame has been read. Return a buffer of at
+ * least meta.size_bytes to read the frame into, or NULL to discard the frame.
+ */
+typedef GstBuffer* (*pipe_reader_alloc_cb)(int ch, camera_image_metadata_t meta, void* context);
+
+/**
+ * Called once the frame data has been read into the buffer returned by the
+ * alloc callback. Ownership of the buffer passes to the callback.
+ */
+typedef void (*pipe_reader_frame_cb)(int ch, camera_image_metadata_t meta, GstBuffer* buf, void* context);
+
+/**
+ * Called when the pipe closes or a read fails, the reader thread exits after.
+ */
+typedef void (*pipe_reader_disconnect_cb)(int ch, void* context);
+
+/**
+ * @brief      Start the reader thread for a channel that has already been
+ *             opened with pipe_client_open() without a helper.
+ *
+ * @param[in]  ch             Pipe channel
+ * @param[in]  alloc_cb       Buffer allocation callback
+ * @param[in]  frame_cb       Frame callback
+ * @param[in]  disconnect_cb  Disconnect callback, can be NULL
+ * @param[in]  context        Passed through to the callbacks
+ *
+ * @return     0 on success, -1 on failure
+ */
+int pipe_reader_start(int ch,
+                      pipe_reader_alloc_cb alloc_cb,
+                      pipe_reader_frame_cb frame_cb,
+                      pipe_reader_disconnect_cb disconnect_cb,
+                      void* context);
+
+/**
+ * @brief      Stop and join the reader thread for a channel. Safe to call if
+ *             the reader was never started. Call this before closing the pipe.
+ *
+ * @param[in]  ch     Pipe channel
+ */
+void pipe_reader_stop(int ch);
+
+#endif // PIPE_READER_H
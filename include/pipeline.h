@@ -40,12 +40,17 @@
 #ifndef PIPELINE_H
 #define PIPELINE_H
 
+#include "pipe_reader.h"
+#include "rate_control.h"
+
 /**
- * @brief      Initializes the pipeline module with a pointer to the context
+ * @brief      Ties a stream context to the media factory serving it so the
+ *             pipeline for that stream can be built on demand
  *
- * @param[in]  ctx     Pointer to the application context data structure
+ * @param[in]  factory Media factory for the stream's mount point
+ * @param[in]  ctx     Pointer to the stream's context data structure
  */
-void pipeline_init(context_data *ctx);
+void pipeline_init(GstRTSPMediaFactory *factory, context_data *ctx);
 
 /**
  * @brief      Custom pipeline element creation method as specified in the
@@ -59,6 +64,133 @@ void pipeline_init(context_data *ctx);
 GstElement *create_custom_element(GstRTSPMediaFactory *factory,
                                   const GstRTSPUrl *url);
 
-void pipeline_deinit(void);
+/**
+ * @brief      Stops and releases the pipeline built for a stream, if any
+ *
+ * @param[in]  ctx     Pointer to the stream's context data structure
+ */
+void pipeline_deinit(context_data *ctx);
+
+/**
+ * @brief      Stops the thread pacing a stream's packets and drops whatever
+ *             it hadn't sent yet. Called when the media goes away, it's safe
+ *             to call if pacing isn't running.
+ *
+ * @param[in]  ctx     Pointer to the stream's context data structure
+ */
+void pipeline_stop_pacer(context_data *ctx);
+
+/**
+ * @brief      Update the stream size for pre-encoded input, e.g. when the
+ *             camera server reconfigures its encoder. The new caps go out
+ *             ahead of the next frame pushed into the app source.
+ *
+ * @param[in]  ctx     Pointer to the application context data structure
+ * @param[in]  width   New width of the encoded frames
+ * @param[in]  height  New height of the encoded frames
+ */
+void pipeline_set_encoded_size(context_data *ctx, uint32_t width, uint32_t height);
+
+/**
+ * @brief      Update the caps of a raw stream's pipeline after its output
+ *             size or frame rate changed. Call from the feeder thread so the
+ *             new caps go out ahead of the next frame pushed into the app
+ *             source, the encoder restarts with them.
+ *
+ * @param[in]  ctx     Pointer to the stream's context data structure
+ */
+void pipeline_update_raw_caps(context_data *ctx);
+
+/**
+ * @brief      Builds and starts the shared pipeline for a simulcast source.
+ *             Raw frames pushed into the source's app source are converted
+ *             and rotated once, then teed into one encoder per rendition.
+ *             Each rendition's encoded frames are handed to frame_cb with
+ *             the rendition's context, like frames read off a pipe.
+ *
+ * @param[in]  src           Context of the raw source stream
+ * @param[in]  renditions    Contexts of the renditions to encode
+ * @param[in]  n_renditions  Number of renditions
+ * @param[in]  frame_cb      Callback for the encoded frames
+ *
+ * @return     Pointer to the running pipeline on success, NULL on failure.
+ */
+GstElement *pipeline_create_simulcast(context_data *src, context_data *renditions[],
+                                      int n_renditions, pipe_reader_frame_cb frame_cb);
+
+/**
+ * @brief      Asks the encoder of a raw stream or rendition for a keyframe,
+ *             e.g. for a client joining mid-GOP. Requests are coalesced, the
+ *             keyframe comes with the next frame that's at least
+ *             keyframe-min-interval-ms after the last forced one. Does
+ *             nothing for pre-encoded streams.
+ *
+ * @param[in]  ctx     Pointer to the stream's context data structure
+ */
+void pipeline_request_keyframe(context_data *ctx);
+
+/**
+ * @brief      Set up the RTP side of a new media before it is prepared,
+ *             e.g. forward error correction
+ *
+ * @param[in]  ctx     Pointer to the stream's context data structure
+ * @param[in]  media   The media that was just made for the stream
+ */
+void pipeline_configure_media(context_data *ctx, GstRTSPMedia *media);
+
+/**
+ * @brief      Fetch the most recent RTCP receiver report clients sent about
+ *             the video stream of a media. With several clients it is the
+ *             one from the client losing the most.
+ *
+ * @param[in]  media   Media serving the stream
+ * @param[out] report  Filled in with the report
+ *
+ * @return     0 on success, -1 if no client has reported yet
+ */
+int pipeline_get_rtcp_report(GstRTSPMedia *media, rate_control_report_t *report);
+
+/**
+ * @brief      Change the bitrate of the encoder we run for a stream, takes
+ *             effect while playing
+ *
+ * @param[in]  ctx      Pointer to the stream's context data structure
+ * @param[in]  bitrate  New target bitrate
+ */
+void pipeline_set_bitrate(context_data *ctx, uint32_t bitrate);
+
+/**
+ * @brief      Change the keyframe interval of the encoder we run for a
+ *             stream. Encoders that only read it when they start are
+ *             restarted in place before their next frame, which starts a
+ *             new GOP.
+ *
+ * @param[in]  ctx       Pointer to the stream's context data structure
+ * @param[in]  gop_size  Frames from one keyframe to the next
+ *
+ * @return     0 if it was changed on the running encoder, 1 if the encoder
+ *             is being restarted for it, -1 if there's no encoder to change
+ */
+int pipeline_set_gop(context_data *ctx, uint32_t gop_size);
+
+/**
+ * @brief      Total bytes the UDP sinks of a media have sent so far, unicast
+ *             and multicast. Clients on TCP interleaved transport aren't
+ *             included.
+ *
+ * @param[in]  media   Media serving the stream
+ *
+ * @return     Bytes sent
+ */
+guint64 pipeline_get_bytes_served(GstRTSPMedia *media);
+
+/**
+ * @brief      Retransmission counters of a media since it was prepared
+ *
+ * @param[in]  media     Media serving the stream
+ * @param[out] requests  Number of packets clients asked for again
+ * @param[out] packets   Number of packets that were retransmitted
+ */
+void pipeline_get_rtx_stats(GstRTSPMedia *media, guint *requests, guint *packets);
 
 #endif // PIPELINE_H
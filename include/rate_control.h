@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file rate_control.h
+ *
+ * This file contains the API for the adaptive bitrate controller. It takes
+ * the RTCP receiver reports clients send back about a stream we encode and
+ * decides what bitrate, and if that isn't enough what frame rate, the
+ * encoder should run at. Loss backs off multiplicatively, a round trip time
+ * well above the lowest seen means queues are building up along the link,
+ * and a clean link is probed slowly upwards again.
+ *
+ * The controller is only run from the main loop so it has no locking.
+ */
+
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// One RTCP receiver report block about our stream
+typedef struct rate_control_report_t {
+    uint32_t seq;               // extended highest sequence number received
+    double fraction_lost;       // 0 to 1 since the previous report
+    double jitter_ms;
+    double rtt_ms;              // 0 if the client didn't report one
+} rate_control_report_t;
+
+typedef struct rate_control_t {
+    uint32_t min_bitrate;
+    uint32_t max_bitrate;
+    uint32_t bitrate;
+    uint32_t max_decimator;     // 1 if the frame rate can't be changed
+    uint32_t decimator;
+    uint32_t last_seq;
+    int have_report;
+    double min_rtt_ms;
+    int64_t last_decrease_us;
+    int64_t start_us;
+    const char *name;
+    FILE *log;
+} rate_control_t;
+
+/**
+ * @brief      Start a controller at the given bitrate
+ *
+ * @param[in]  rc             The controller
+ * @param[in]  bitrate        Starting bitrate
+ * @param[in]  min_bitrate    Lowest bitrate to go down to
+ * @param[in]  max_bitrate    Highest bitrate to go up to
+ * @param[in]  max_decimator  Largest frame rate divider to use once the
+ *                            bitrate is at its minimum, 1 to never drop frames
+ * @param[in]  log_file       CSV file to append every decision to, NULL or
+ *                            empty for none
+ * @param[in]  name           Name of the stream for logging
+ */
+void rate_control_init(rate_control_t *rc, uint32_t bitrate,
+                       uint32_t min_bitrate, uint32_t max_bitrate,
+                       uint32_t max_decimator, const char *log_file,
+                       const char *name);
+
+/**
+ * @brief      Feed the latest receiver report to the controller. Reports
+ *             that were already seen are ignored.
+ *
+ * @param[in]  rc      The controller
+ * @param[in]  report  Latest receiver report
+ * @param[in]  now_us  Monotonic time in microseconds
+ *
+ * @return     1 if bitrate or decimator changed, 0 otherwise
+ */
+int rate_control_update(rate_control_t *rc, const rate_control_report_t *report,
+                        int64_t now_us);
+
+/**
+ * @brief      Close the decision log if there is one
+ *
+ * @param[in]  rc      The controller
+ */
+void rate_control_deinit(rate_control_t *rc);
+
+#endif // RATE_CONTROL_H
@@ -0,0 +1,108 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * @file tone_map.h
+ *
+ * This file contains the RAW16 to 8 bit tone mapper. Thermal and ToF sensors
+ * put out 16 bit samples but only use a small part of that range, so a
+ * plain shift down to 8 bits leaves a flat grey picture. The tone mapper
+ * stretches a window of the 16 bit range over the 8 bit output, either a
+ * fixed one from the config file or one that follows the scene using a
+ * running histogram, optionally with a gamma curve on top.
+ *
+ * Samples are big endian like GST_VIDEO_FORMAT_GRAY16_BE. Plain windows go
+ * through SSE2/NEON, anything with a curve goes through a lookup table.
+ */
+
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+#include <stdint.h>
+
+#define TONE_MAP_HIST_BINS 1024
+
+typedef enum tone_map_mode_t {
+    TONE_MAP_LINEAR,    // fixed window
+    TONE_MAP_AUTO       // window follows the histogram
+} tone_map_mode_t;
+
+typedef struct tone_map_t {
+    tone_map_mode_t mode;
+    double gamma;
+    uint16_t min;               // configured window
+    uint16_t max;
+
+    double lo;                  // window in use, smoothed in auto mode
+    double hi;
+    int have_window;
+
+    uint8_t *lut;               // 64K entries, indexed by the raw sample
+    int lut_lo;
+    int lut_hi;
+    uint32_t hist[TONE_MAP_HIST_BINS];
+} tone_map_t;
+
+/**
+ * @brief      Set up a tone mapper
+ *
+ * @param[in]  tm     The tone mapper
+ * @param[in]  mode   TONE_MAP_LINEAR or TONE_MAP_AUTO
+ * @param[in]  min    Bottom of the window for TONE_MAP_LINEAR
+ * @param[in]  max    Top of the window for TONE_MAP_LINEAR
+ * @param[in]  gamma  Gamma of the curve over the window, 1.0 for none
+ *
+ * @return     0 on success, -1 if the lookup table can't be allocated
+ */
+int tone_map_init(tone_map_t *tm, tone_map_mode_t mode, uint16_t min, uint16_t max, double gamma);
+
+/**
+ * @brief      Free the tone mapper's lookup table
+ *
+ * @param[in]  tm    The tone mapper
+ */
+void tone_map_deinit(tone_map_t *tm);
+
+/**
+ * @brief      Map a RAW16 frame to GRAY8, updating the window first in
+ *             auto mode
+ *
+ * @param[in]  tm      The tone mapper
+ * @param[in]  src     Big endian 16 bit samples, tightly packed
+ * @param[out] dst     8 bit samples, tightly packed
+ * @param[in]  width   Frame width
+ * @param[in]  height  Frame height
+ */
+void tone_map_gray8(tone_map_t *tm, const uint8_t *src, uint8_t *dst, int width, int height);
+
+#endif // TONE_MAP_H
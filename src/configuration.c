@@ -39,6 +39,7 @@
 #include <modal_pipe_client.h>
 #include <gst/video/video.h>
 #include "configuration.h"
+#include "frame_pool.h"
 
 #define CONF_FILE "/etc/modalai/voxl-streamer.conf"
 #define DEFAULT_INPUT_PIPE "hires_small_encoded"
@@ -64,9 +65,247 @@
  *    Decimate frames to drop framerate of RAW streams.\n\
  *    Ignored for H264 streams like hires_stream\n\
  *\n\
+ * encoder:\n\
+ *    Encoder for RAW streams. One of:\n\
+ *      auto:     the first installed encoder for the codec (default), in\n\
+ *                the order listed here\n\
+ *      omx-h264: hardware H264\n\
+ *      x264:     software H264 tuned for latency, for machines without OMX\n\
+ *      openh264: software H264, lighter than x264 but lower quality\n\
+ *      omx-h265: hardware H265\n\
+ *      x265:     software H265 tuned for latency, slow, for testing\n\
+ *    All of them use the same bitrate and gop-size and see the same\n\
+ *    rotated and scaled frames.\n\
+ *\n\
+ * codec:\n\
+ *    h264 or h265, what RAW streams are encoded to. H265 needs roughly 40%\n\
+ *    less bitrate for the same quality, but not every client can play it.\n\
+ *    Defaults to what the encoder makes, h264 for auto. Can be set per\n\
+ *    stream in the streams list.\n\
+ *    Ignored for H264/H265 streams like hires_stream\n\
+ *\n\
+ * gop-size:\n\
+ *    Frames from one keyframe to the next for RAW streams. Clients joining\n\
+ *    or losing packets get a keyframe on demand, see keyframe-on-demand,\n\
+ *    so this can be long to save bitrate. Lower it for clients that don't\n\
+ *    send PLI or FIR when keyframe-on-demand is off. Default 150\n\
+ *\n\
+ * keyframe-on-demand:\n\
+ *    Force a keyframe for RAW streams when a client starts playing or asks\n\
+ *    for one with an RTCP PLI or FIR after losing packets, instead of it\n\
+ *    waiting for the next one in the GOP. Default true\n\
+ *\n\
+ * keyframe-min-interval-ms:\n\
+ *    Least time between forced keyframes. Requests in between are held\n\
+ *    and served together so many clients can't flood the stream with\n\
+ *    keyframes. Default 500\n\
+ *\n\
+ * slices:\n\
+ *    Low latency mode for RAW streams. Each frame is encoded as this many\n\
+ *    slices and the payloader gets each slice on its own, so with an\n\
+ *    encoder that outputs slices as they finish the first packets leave\n\
+ *    before the whole frame is encoded. Costs a little bitrate for the\n\
+ *    slice headers and lost prediction across slice edges. 4 is a good\n\
+ *    start, at most 32. Default 0, whole frames.\n\
+ *\n\
+ * output-width, output-height:\n\
+ *    Size to encode RAW streams at, after rotation. Set just one of them to\n\
+ *    keep the aspect ratio. 0 for both keeps the input size (default).\n\
+ *    Sizes that divide the input evenly, like half or a third, are scaled\n\
+ *    with a box filter, anything else is bilinear.\n\
+ *    Ignored for H264 streams like hires_stream\n\
+ *\n\
+ * output-scale:\n\
+ *    Scale factor for the output size of RAW streams, e.g. 0.5 to encode a\n\
+ *    4K camera at 1080p. Only used when output-width and output-height\n\
+ *    aren't set. Default 1.0\n\
+ *\n\
  * port:\n\
  *    port to serve rtsp stream on, default is 8900\n\
  *\n\
+ * zero-copy-ingest:\n\
+ *    Read frames from the pipe directly into gstreamer buffers instead of\n\
+ *    copying them out of the pipe helper's buffer. Saves a full frame copy\n\
+ *    per frame, most noticeable on large raw streams. Default false.\n\
+ *\n\
+ * fused-convert:\n\
+ *    Convert raw frames to NV12 and rotate them in a single pass before\n\
+ *    they go into the pipeline, instead of through separate videoscale,\n\
+ *    videoconvert and videoflip elements. Much cheaper on the CPU for\n\
+ *    rotated or non-NV12 streams. Frames need an even width and height.\n\
+ *    RAW16 is tone mapped to 8 bits on the way, see raw16-tone-map.\n\
+ *    Default false.\n\
+ *\n\
+ * raw16-tone-map:\n\
+ *    How RAW16 streams, like thermal or ToF cameras, are brought down to\n\
+ *    8 bits for the encoder when fused-convert is on. One of:\n\
+ *      linear: stretch raw16-min to raw16-max over the full 8 bit range\n\
+ *      auto:   same but the window follows the scene, covering 98% of\n\
+ *              the samples (default)\n\
+ *    Without fused-convert the top 8 bits are used as they are.\n\
+ *\n\
+ * raw16-min, raw16-max:\n\
+ *    Window of 16 bit values for raw16-tone-map linear. Default 0 to 65535\n\
+ *\n\
+ * raw16-gamma:\n\
+ *    Gamma curve over the window, below 1.0 brings out detail in the\n\
+ *    darker (colder) part. Default 1.0, a straight line.\n\
+ *\n\
+ * frame-pool-buffers:\n\
+ *    Number of frame buffers to preallocate when a client connects. Frames\n\
+ *    are recycled through this pool instead of hitting the heap every frame.\n\
+ *    Set to 0 to disable the pool. Default 8.\n\
+ *\n\
+ * frame-pool-huge-pages:\n\
+ *    Back the frame pool with transparent huge pages. Default false.\n\
+ *\n\
+ * frame-queue-depth:\n\
+ *    Number of encoded frames that can wait between the pipe reader and\n\
+ *    the gstreamer feeder thread before new ones are dropped. Raw frames\n\
+ *    always use a single latest-frame-wins slot. Default 4.\n\
+ *\n\
+ * appsrc-max-latency-ms:\n\
+ *    How much video the gstreamer app source may buffer before it reports\n\
+ *    it is full. The byte limit is derived from this, frame size, and fps.\n\
+ *    Default 100.\n\
+ *\n\
+ * drop-policy:\n\
+ *    What to throw away when the encoder or network falls behind and the\n\
+ *    app source is full. One of:\n\
+ *      auto:      drop-oldest for raw streams, keyframe for encoded (default)\n\
+ *      drop-oldest: always send the newest frame\n\
+ *      drop-newest: keep the frames already waiting, drop new ones\n\
+ *      keyframe:  drop the rest of a GOP and resume at the next keyframe\n\
+ *\n\
+ * backlog-recovery:\n\
+ *    What to do when the source pipe backs up. Raw streams always flush.\n\
+ *      auto:         skip-to-idr for encoded streams (default)\n\
+ *      flush:        throw away everything in the pipe\n\
+ *      skip-to-idr:  discard frames until the next keyframe\n\
+ *      drop-non-ref: discard only frames nothing references, fall back to\n\
+ *                    skip-to-idr if that isn't enough to catch up\n\
+ *\n\
+ * gop-cache-replay:\n\
+ *    Encoded streams keep the frames since the last keyframe so a client\n\
+ *    that starts playing mid-GOP can be sent a decodable picture right\n\
+ *    away instead of waiting for the next keyframe. One of:\n\
+ *      off:          never replay\n\
+ *      first-client: only replay when nobody else is watching (default)\n\
+ *    The stream is shared, so clients joining one that is already being\n\
+ *    watched wait for the next keyframe instead. GOPs over 300 frames or\n\
+ *    16 MB aren't cached.\n\
+ *\n\
+ * standby-timeout-s:\n\
+ *    How long to keep the source pipe open and the pipeline prerolled\n\
+ *    after the last client leaves so the next one starts almost instantly.\n\
+ *    Frames are thrown away cheaply in the meantime. After the timeout\n\
+ *    everything is torn down to save power. 0 tears down right away\n\
+ *    (default), -1 stays in standby forever.\n\
+ *\n\
+ * source-recovery:\n\
+ *    Keep RTSP clients connected while the camera server restarts. Raw\n\
+ *    streams repeat the last frame until the pipe comes back. If it comes\n\
+ *    back with a different format, or a different size for raw streams,\n\
+ *    the whole server is restarted as if this was off. (default false)\n\
+ *\n\
+ * adaptive-bitrate:\n\
+ *    Follow the RTCP receiver reports clients send back and adjust the\n\
+ *    encoder bitrate to the link. Loss and a growing round trip time back\n\
+ *    off, a clean link is slowly probed upwards again. Only applies to\n\
+ *    streams voxl-streamer encodes itself, i.e. raw input pipes and\n\
+ *    simulcast renditions. Default false.\n\
+ *\n\
+ * abr-min-bitrate:\n\
+ *    Lowest bitrate adaptive-bitrate goes down to. Default 250000.\n\
+ *\n\
+ * abr-max-bitrate:\n\
+ *    Highest bitrate adaptive-bitrate goes up to, 0 to use the stream's\n\
+ *    configured bitrate, which is also where it starts. Default 0.\n\
+ *\n\
+ * abr-min-fps:\n\
+ *    Once at abr-min-bitrate raw streams drop frames too, down to this\n\
+ *    frame rate. 0 never drops frames. Default 5.\n\
+ *\n\
+ * abr-log-file:\n\
+ *    CSV file every adaptive-bitrate decision is appended to for tuning,\n\
+ *    empty for none. Default empty.\n\
+ *\n\
+ * fec-percentage:\n\
+ *    Send ULPFEC (RFC 5109) packets along with the video so clients can\n\
+ *    rebuild lost packets instead of showing a broken picture until the\n\
+ *    next keyframe. This is the bandwidth overhead in percent of the media\n\
+ *    packets, e.g. 20 sends one FEC packet for every 5 media packets.\n\
+ *    Advertised in the SDP, clients that don't understand it ignore it.\n\
+ *    Needs GStreamer 1.16 or newer. 0 turns FEC off (default).\n\
+ *\n\
+ * fec-pt:\n\
+ *    RTP payload type for the FEC packets. Default 122.\n\
+ *\n\
+ * rtx-time-ms:\n\
+ *    Keep the RTP packets sent in the last this many milliseconds and send\n\
+ *    them again (RFC 4588) when a client reports them lost with a NACK.\n\
+ *    Only clients using the AVPF profile ask for this, e.g. other\n\
+ *    gstreamer based ones. 0 turns retransmission off (default).\n\
+ *\n\
+ * rtx-history-bytes:\n\
+ *    Upper bound on the memory kept for retransmission per stream, on top\n\
+ *    of the rtx-time-ms limit. Default 1048576.\n\
+ *\n\
+ * pacing-window-ms:\n\
+ *    Spread the RTP packets of large frames, like keyframes, over this many\n\
+ *    milliseconds instead of sending them in one burst that can overrun a\n\
+ *    radio's buffer. Limited to half the frame period. 0 turns pacing off\n\
+ *    (default).\n\
+ *\n\
+ * pacing-burst-packets:\n\
+ *    Most RTP packets to send back to back while pacing, each burst goes to\n\
+ *    the network in a single sendmmsg. Default 16.\n\
+ *\n\
+ * multicast:\n\
+ *    Send RTP over multicast so a stream goes out once no matter how many\n\
+ *    clients are watching it. One of:\n\
+ *      off:   every client gets its own unicast stream (default)\n\
+ *      allow: clients that ask for multicast share one, others get unicast\n\
+ *      force: multicast only, clients that can't do it are turned away\n\
+ *    VLC asks for multicast with --rtsp-mcast, ffmpeg/ffplay with\n\
+ *    -rtsp_transport udp_multicast.\n\
+ *\n\
+ * multicast-address-min, multicast-address-max:\n\
+ *    Range of multicast groups to hand out, each stream uses one.\n\
+ *    Default 224.3.0.1 to 224.3.0.10\n\
+ *\n\
+ * multicast-port-min, multicast-port-max:\n\
+ *    UDP ports to send on, each stream needs an even RTP port and the odd\n\
+ *    RTCP port after it. Default 5000 to 5009\n\
+ *\n\
+ * multicast-ttl:\n\
+ *    Number of router hops multicast packets may cross. Default 1, the\n\
+ *    local network only.\n\
+ *\n\
+ * streams:\n\
+ *    Optional list of pipes to serve from this one process, all on the\n\
+ *    same port. Each entry is an object with an input-pipe and a mount\n\
+ *    point (default /<input-pipe>) and can override bitrate, rotation,\n\
+ *    decimator, codec, output-width, output-height and output-scale,\n\
+ *    everything else is shared. Without this list the single\n\
+ *    input-pipe above is served on /live. For example:\n\
+ *      \"streams\": [{\"input-pipe\": \"hires_small_encoded\", \"mount\": \"/hires\"},\n\
+ *                  {\"input-pipe\": \"tracking\", \"mount\": \"/tracking\"}]\n\
+ *\n\
+ * renditions:\n\
+ *    Optional list of renditions to simulcast a raw stream as, either at the\n\
+ *    top level or in an entry of the streams list. The format conversion and\n\
+ *    rotation run once and each rendition gets its own encoder and mount\n\
+ *    point (default <mount>/<index>), the stream itself is no longer served\n\
+ *    on its own mount. Each entry can set width, height, fps and bitrate,\n\
+ *    width, height and fps default to the stream's own, fps can only go\n\
+ *    down. Renditions count towards the 8 stream limit. For example:\n\
+ *      \"renditions\": [{\"mount\": \"/live/high\", \"bitrate\": 4000000},\n\
+ *                     {\"mount\": \"/live/low\", \"width\": 640, \"height\": 480,\n\
+ *                      \"bitrate\": 1000000},\n\
+ *                     {\"mount\": \"/live/thumb\", \"width\": 320, \"height\": 240,\n\
+ *                      \"fps\": 5, \"bitrate\": 200000}]\n\
+ *\n\
  */\n"
 
 
@@ -140,7 +379,146 @@ int configure_frame_format(const int format, context_data *ctx) {
     return 0;
 }
 
-int config_file_read(context_data *ctx) {
+static int _parse_drop_policy(const char* str, drop_policy_t* policy) {
+    if(!strcmp(str, "auto"))             *policy = DROP_POLICY_AUTO;
+    else if(!strcmp(str, "drop-oldest")) *policy = DROP_POLICY_OLDEST;
+    else if(!strcmp(str, "drop-newest")) *policy = DROP_POLICY_NEWEST;
+    else if(!strcmp(str, "keyframe"))    *policy = DROP_POLICY_KEYFRAME;
+    else return -1;
+    return 0;
+}
+
+static int _parse_backlog_recovery(const char* str, backlog_recovery_t* recovery) {
+    if(!strcmp(str, "auto"))              *recovery = BACKLOG_RECOVERY_AUTO;
+    else if(!strcmp(str, "flush"))        *recovery = BACKLOG_RECOVERY_FLUSH;
+    else if(!strcmp(str, "skip-to-idr"))  *recovery = BACKLOG_RECOVERY_SKIP_TO_IDR;
+    else if(!strcmp(str, "drop-non-ref")) *recovery = BACKLOG_RECOVERY_DROP_NON_REF;
+    else return -1;
+    return 0;
+}
+
+static int _parse_gop_replay(const char* str, gop_replay_t* replay) {
+    if(!strcmp(str, "off"))               *replay = GOP_REPLAY_OFF;
+    else if(!strcmp(str, "first-client")) *replay = GOP_REPLAY_FIRST_CLIENT;
+    else if(!strcmp(str, "all-clients")){
+        // clients already watching would see the replay as a rewind
+        fprintf(stderr, "gop-cache-replay all-clients is no longer supported, using first-client\n");
+        *replay = GOP_REPLAY_FIRST_CLIENT;
+    }
+    else return -1;
+    return 0;
+}
+
+// Renditions of a stream go on the end of the stream list, each one is
+// served on its own mount from a branch of its source's pipeline
+static int _read_renditions(cJSON* list, context_data *streams, int source,
+                            int max_streams, int *n_streams) {
+    context_data *src = &streams[source];
+    int i, n = cJSON_GetArraySize(list);
+
+    if(n < 1) return 0;
+
+    for(i = 0; i < n; i++){
+        if(*n_streams >= max_streams){
+            fprintf(stderr, "only %d streams supported, ignoring the rest of the renditions of %s\n",
+                    max_streams, src->input_pipe_name);
+            break;
+        }
+
+        cJSON* item = cJSON_GetArrayItem(list, i);
+        context_data *ctx = &streams[*n_streams];
+        char default_mount[MAX_MOUNT_POINT_LENGTH];
+
+        *ctx = *src;
+        ctx->simulcast_parent = src;
+        snprintf(default_mount, MAX_MOUNT_POINT_LENGTH, "%s/%d", src->mount_point, i);
+        json_fetch_string_with_default(item, "mount", ctx->mount_point, MAX_MOUNT_POINT_LENGTH, default_mount);
+        json_fetch_int_with_default(item, "width", (int*) &ctx->rendition_width, 0);
+        json_fetch_int_with_default(item, "height", (int*) &ctx->rendition_height, 0);
+        json_fetch_int_with_default(item, "fps", (int*) &ctx->rendition_fps, 0);
+        json_fetch_int_with_default(item, "bitrate", (int*) &ctx->output_stream_bitrate, src->output_stream_bitrate);
+
+        if(ctx->mount_point[0] != '/'){
+            fprintf(stderr, "mount point %s for a rendition of %s must start with /\n",
+                    ctx->mount_point, src->input_pipe_name);
+            return -1;
+        }
+        (*n_streams)++;
+    }
+
+    // the source is only there to feed its renditions
+    if(i > 0) src->mount_point[0] = '\0';
+    return 0;
+}
+
+static int _parse_tone_map(const char* str, tone_map_mode_t* mode) {
+    if(!strcmp(str, "linear"))    *mode = TONE_MAP_LINEAR;
+    else if(!strcmp(str, "auto")) *mode = TONE_MAP_AUTO;
+    else return -1;
+    return 0;
+}
+
+static int _parse_multicast(const char* str, multicast_mode_t* mode) {
+    if(!strcmp(str, "off"))        *mode = MULTICAST_OFF;
+    else if(!strcmp(str, "allow")) *mode = MULTICAST_ALLOW;
+    else if(!strcmp(str, "force")) *mode = MULTICAST_FORCE;
+    else return -1;
+    return 0;
+}
+
+// Fill in the per-stream settings for each entry of the streams list, the
+// rest is copied from the first stream's settings
+static int _read_stream_list(cJSON* list, context_data *streams, int max_streams, int *n_streams) {
+    int i, n = cJSON_GetArraySize(list);
+
+    if(n < 1) return 0;
+    if(n > max_streams){
+        fprintf(stderr, "only %d streams supported, ignoring the rest\n", max_streams);
+        n = max_streams;
+    }
+
+    context_data base = streams[0];
+    for(i = 0; i < n; i++){
+        cJSON* item = cJSON_GetArrayItem(list, i);
+        context_data *ctx = &streams[i];
+        char default_mount[MAX_MOUNT_POINT_LENGTH];
+
+        *ctx = base;
+        json_fetch_string_with_default(item, "input-pipe", ctx->input_pipe_name, MODAL_PIPE_MAX_PATH_LEN, base.input_pipe_name);
+        snprintf(default_mount, MAX_MOUNT_POINT_LENGTH, "/%s", ctx->input_pipe_name);
+        json_fetch_string_with_default(item, "mount", ctx->mount_point, MAX_MOUNT_POINT_LENGTH, default_mount);
+        json_fetch_int_with_default(item, "bitrate", (int*) &ctx->output_stream_bitrate, base.output_stream_bitrate);
+        json_fetch_int_with_default(item, "rotation", (int*) &ctx->output_stream_rotation, base.output_stream_rotation);
+        json_fetch_int_with_default(item, "decimator", (int*) &ctx->output_frame_decimator, base.output_frame_decimator);
+        char codec[MAX_CONFIG_OBJECT_STRING_LENGTH];
+        json_fetch_string_with_default(item, "codec", codec, MAX_CONFIG_OBJECT_STRING_LENGTH, encoder_codec_name(base.codec));
+        if(encoder_codec_from_name(codec, &ctx->codec)){
+            fprintf(stderr, "invalid codec %s for %s, using %s\n", codec, ctx->input_pipe_name, encoder_codec_name(base.codec));
+            ctx->codec = base.codec;
+        }
+        json_fetch_int_with_default(item, "output-width", (int*) &ctx->output_resize_width, base.output_resize_width);
+        json_fetch_int_with_default(item, "output-height", (int*) &ctx->output_resize_height, base.output_resize_height);
+        json_fetch_double_with_default(item, "output-scale", &ctx->output_scale, base.output_scale);
+
+        if(ctx->mount_point[0] != '/'){
+            fprintf(stderr, "mount point %s for %s must start with /\n", ctx->mount_point, ctx->input_pipe_name);
+            return -1;
+        }
+    }
+    *n_streams = n;
+
+    for(i = 0; i < n; i++){
+        cJSON* renditions = cJSON_GetObjectItem(cJSON_GetArrayItem(list, i), "renditions");
+        if(renditions == NULL || !cJSON_IsArray(renditions)) continue;
+        if(_read_renditions(renditions, streams, i, max_streams, n_streams)) return -1;
+    }
+
+    return 0;
+}
+
+int config_file_read(context_data *streams, int max_streams, int *n_streams) {
+
+    context_data *ctx = &streams[0];
 
     int ret = json_make_empty_file_with_header_if_missing(CONF_FILE, CONFIG_FILE_HEADER);
     if(ret < 0) return -1;
@@ -153,11 +531,143 @@ int config_file_read(context_data *ctx) {
     json_fetch_int_with_default(parent, "bitrate", (int*) &ctx->output_stream_bitrate, 1000000);
     json_fetch_int_with_default(parent, "rotation", (int*) &ctx->output_stream_rotation, 0);
     json_fetch_int_with_default(parent, "decimator", (int*) &ctx->output_frame_decimator, 1);
+    char encoder[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "encoder", encoder, MAX_CONFIG_OBJECT_STRING_LENGTH, "auto");
+    if(encoder_from_name(encoder, &ctx->encoder_backend)){
+        fprintf(stderr, "invalid encoder %s, using auto\n", encoder);
+        ctx->encoder_backend = ENCODER_AUTO;
+    }
+    char codec[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    const char *default_codec = encoder_codec_name(encoder_codec(ctx->encoder_backend));
+    json_fetch_string_with_default(parent, "codec", codec, MAX_CONFIG_OBJECT_STRING_LENGTH, default_codec);
+    if(encoder_codec_from_name(codec, &ctx->codec)){
+        fprintf(stderr, "invalid codec %s, using %s\n", codec, default_codec);
+        ctx->codec = encoder_codec(ctx->encoder_backend);
+    }
+    json_fetch_int_with_default(parent, "gop-size", (int*) &ctx->gop_size, 150);
+    if(ctx->gop_size < 1){
+        fprintf(stderr, "invalid gop-size %u, using 150\n", ctx->gop_size);
+        ctx->gop_size = 150;
+    }
+    json_fetch_bool_with_default(parent, "keyframe-on-demand", &ctx->keyframe_on_demand, 1);
+    json_fetch_int_with_default(parent, "keyframe-min-interval-ms", (int*) &ctx->keyframe_min_interval_ms, 500);
+    json_fetch_int_with_default(parent, "slices", (int*) &ctx->encode_slices, 0);
+    if(ctx->encode_slices > 32){
+        fprintf(stderr, "invalid slices %u, using 32\n", ctx->encode_slices);
+        ctx->encode_slices = 32;
+    }
+    json_fetch_int_with_default(parent, "output-width", (int*) &ctx->output_resize_width, 0);
+    json_fetch_int_with_default(parent, "output-height", (int*) &ctx->output_resize_height, 0);
+    json_fetch_double_with_default(parent, "output-scale", &ctx->output_scale, 1.0);
+    json_fetch_bool_with_default(parent, "zero-copy-ingest", &ctx->zero_copy_ingest, 0);
+    json_fetch_bool_with_default(parent, "fused-convert", &ctx->fused_convert_enable, 0);
+
+    char tone_map[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "raw16-tone-map", tone_map, MAX_CONFIG_OBJECT_STRING_LENGTH, "auto");
+    if(_parse_tone_map(tone_map, &ctx->raw16_tone_map)){
+        fprintf(stderr, "invalid raw16-tone-map %s, using auto\n", tone_map);
+        ctx->raw16_tone_map = TONE_MAP_AUTO;
+    }
+    json_fetch_int_with_default(parent, "raw16-min", (int*) &ctx->raw16_min, 0);
+    json_fetch_int_with_default(parent, "raw16-max", (int*) &ctx->raw16_max, 65535);
+    json_fetch_double_with_default(parent, "raw16-gamma", &ctx->raw16_gamma, 1.0);
+    if(ctx->raw16_min > 65535 || ctx->raw16_max > 65535 || ctx->raw16_min >= ctx->raw16_max){
+        fprintf(stderr, "invalid raw16-min/raw16-max %u/%u, using 0/65535\n", ctx->raw16_min, ctx->raw16_max);
+        ctx->raw16_min = 0;
+        ctx->raw16_max = 65535;
+    }
+    if(ctx->raw16_gamma <= 0.0){
+        fprintf(stderr, "invalid raw16-gamma %f, using 1.0\n", ctx->raw16_gamma);
+        ctx->raw16_gamma = 1.0;
+    }
+    json_fetch_int_with_default(parent, "frame-pool-buffers", &ctx->frame_pool_buffers, DEFAULT_FRAME_POOL_BUFFERS);
+    json_fetch_bool_with_default(parent, "frame-pool-huge-pages", &ctx->frame_pool_huge_pages, 0);
+    json_fetch_int_with_default(parent, "frame-queue-depth", &ctx->frame_queue_depth, DEFAULT_FRAME_QUEUE_DEPTH);
+    json_fetch_int_with_default(parent, "appsrc-max-latency-ms", (int*) &ctx->appsrc_max_latency_ms, DEFAULT_APPSRC_MAX_LATENCY_MS);
+
+    char drop_policy[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "drop-policy", drop_policy, MAX_CONFIG_OBJECT_STRING_LENGTH, "auto");
+    if(_parse_drop_policy(drop_policy, &ctx->drop_policy)){
+        fprintf(stderr, "invalid drop-policy %s, using auto\n", drop_policy);
+        ctx->drop_policy = DROP_POLICY_AUTO;
+    }
+
+    char backlog_recovery[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "backlog-recovery", backlog_recovery, MAX_CONFIG_OBJECT_STRING_LENGTH, "auto");
+    if(_parse_backlog_recovery(backlog_recovery, &ctx->backlog_recovery)){
+        fprintf(stderr, "invalid backlog-recovery %s, using auto\n", backlog_recovery);
+        ctx->backlog_recovery = BACKLOG_RECOVERY_AUTO;
+    }
+
+    char gop_replay[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "gop-cache-replay", gop_replay, MAX_CONFIG_OBJECT_STRING_LENGTH, "first-client");
+    if(_parse_gop_replay(gop_replay, &ctx->gop_replay)){
+        fprintf(stderr, "invalid gop-cache-replay %s, using first-client\n", gop_replay);
+        ctx->gop_replay = GOP_REPLAY_FIRST_CLIENT;
+    }
+
+    json_fetch_int_with_default(parent, "standby-timeout-s", &ctx->standby_timeout_s, 0);
+    json_fetch_bool_with_default(parent, "source-recovery", &ctx->source_recovery, 0);
+    json_fetch_bool_with_default(parent, "adaptive-bitrate", &ctx->abr_enable, 0);
+    json_fetch_int_with_default(parent, "abr-min-bitrate", (int*) &ctx->abr_min_bitrate, 250000);
+    json_fetch_int_with_default(parent, "abr-max-bitrate", (int*) &ctx->abr_max_bitrate, 0);
+    json_fetch_int_with_default(parent, "abr-min-fps", (int*) &ctx->abr_min_fps, 5);
+    json_fetch_string_with_default(parent, "abr-log-file", ctx->abr_log_file, MODAL_PIPE_MAX_PATH_LEN, "");
+
+    json_fetch_int_with_default(parent, "fec-percentage", (int*) &ctx->fec_percentage, 0);
+    json_fetch_int_with_default(parent, "fec-pt", (int*) &ctx->fec_pt, 122);
+    if(ctx->fec_percentage > 100){
+        fprintf(stderr, "fec-percentage %u is more than 100, using 100\n", ctx->fec_percentage);
+        ctx->fec_percentage = 100;
+    }
+    // dynamic range, 96 is taken by the video
+    if(ctx->fec_pt <= 96 || ctx->fec_pt > 127){
+        fprintf(stderr, "invalid fec-pt %u, using 122\n", ctx->fec_pt);
+        ctx->fec_pt = 122;
+    }
+    json_fetch_int_with_default(parent, "rtx-time-ms", (int*) &ctx->rtx_time_ms, 0);
+    json_fetch_int_with_default(parent, "rtx-history-bytes", (int*) &ctx->rtx_history_bytes, 1024*1024);
+    // the history is counted in packets, which are at most one MTU
+    ctx->rtx_history_packets = ctx->rtx_history_bytes / RTP_MTU_BYTES;
+    if(ctx->rtx_history_packets < 1) ctx->rtx_history_packets = 1;
+    json_fetch_int_with_default(parent, "pacing-window-ms", (int*) &ctx->pacing_window_ms, 0);
+    json_fetch_int_with_default(parent, "pacing-burst-packets", (int*) &ctx->pacing_burst_packets, 16);
+    if(ctx->pacing_burst_packets < 1) ctx->pacing_burst_packets = 1;
+
+    char multicast[MAX_CONFIG_OBJECT_STRING_LENGTH];
+    json_fetch_string_with_default(parent, "multicast", multicast, MAX_CONFIG_OBJECT_STRING_LENGTH, "off");
+    if(_parse_multicast(multicast, &ctx->multicast)){
+        fprintf(stderr, "invalid multicast %s, using off\n", multicast);
+        ctx->multicast = MULTICAST_OFF;
+    }
+    json_fetch_string_with_default(parent, "multicast-address-min", ctx->multicast_address_min, MAX_MULTICAST_ADDRESS_LENGTH, "224.3.0.1");
+    json_fetch_string_with_default(parent, "multicast-address-max", ctx->multicast_address_max, MAX_MULTICAST_ADDRESS_LENGTH, "224.3.0.10");
+    json_fetch_int_with_default(parent, "multicast-port-min", &ctx->multicast_port_min, 5000);
+    json_fetch_int_with_default(parent, "multicast-port-max", &ctx->multicast_port_max, 5009);
+    json_fetch_int_with_default(parent, "multicast-ttl", &ctx->multicast_ttl, 1);
 
     int tmp;
     json_fetch_int_with_default(parent, "port", &tmp, 8900);
     snprintf(ctx->rtsp_server_port, 7 , "%u", tmp);
 
+    ctx->input_parameters_initialized = 0;
+    strncpy(ctx->mount_point, DEFAULT_MOUNT_POINT, MAX_MOUNT_POINT_LENGTH);
+    *n_streams = 1;
+
+    cJSON* stream_list = cJSON_GetObjectItem(parent, "streams");
+    cJSON* renditions = cJSON_GetObjectItem(parent, "renditions");
+    if(stream_list != NULL && cJSON_IsArray(stream_list)){
+        if(_read_stream_list(stream_list, streams, max_streams, n_streams)){
+            cJSON_Delete(parent);
+            return -1;
+        }
+    } else if(renditions != NULL && cJSON_IsArray(renditions)){
+        if(_read_renditions(renditions, streams, 0, max_streams, n_streams)){
+            cJSON_Delete(parent);
+            return -1;
+        }
+    }
+
 
     if(json_get_parse_error_flag()){
         fprintf(stderr, "failed to parse config file %s\n", CONF_FILE);
@@ -172,7 +682,5 @@ int config_file_read(context_data *ctx) {
     }
     cJSON_Delete(parent);
 
-    ctx->input_parameters_initialized = 0;
-
     return 0;
 }
@@ -0,0 +1,235 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <modal_pipe_server.h>
+#include <modal_journal.h>
+
+#include "control.h"
+
+#define CONTROL_PIPE_NAME "voxl-streamer"
+#define CONTROL_QUEUE_DEPTH 16
+#define CONTROL_MAX_COMMAND 256
+
+#define CONTROL_COMMANDS "set_bitrate,set_gop,set_decimator,set_resolution,status"
+
+static int _ch = -1;
+static control_apply_cb _apply;
+
+// commands waiting for the main loop, protected by _lock
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static control_request_t _queue[CONTROL_QUEUE_DEPTH];
+static int _queue_head;
+static int _queue_count;
+static GMainContext *_context;
+static int _dispatch_scheduled;
+
+
+// Runs on the main loop, carries out everything that's waiting
+static gboolean _dispatch(gpointer data)
+{
+    control_request_t request;
+
+    while(1){
+        pthread_mutex_lock(&_lock);
+        if(_queue_count == 0){
+            _dispatch_scheduled = 0;
+            pthread_mutex_unlock(&_lock);
+            break;
+        }
+        request = _queue[_queue_head];
+        _queue_head = (_queue_head + 1) % CONTROL_QUEUE_DEPTH;
+        _queue_count--;
+        pthread_mutex_unlock(&_lock);
+
+        _apply(&request);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// call with _lock held
+static void _schedule_dispatch(void)
+{
+    if(_context == NULL || _dispatch_scheduled || _queue_count == 0) return;
+
+    GSource *source = g_idle_source_new();
+    g_source_set_callback(source, _dispatch, NULL, NULL);
+    g_source_attach(source, _context);
+    g_source_unref(source);
+    _dispatch_scheduled = 1;
+}
+
+static void _enqueue(const control_request_t *request)
+{
+    pthread_mutex_lock(&_lock);
+    if(_queue_count == CONTROL_QUEUE_DEPTH){
+        pthread_mutex_unlock(&_lock);
+        control_reply("too many control commands waiting, ignoring\n");
+        return;
+    }
+    _queue[(_queue_head + _queue_count) % CONTROL_QUEUE_DEPTH] = *request;
+    _queue_count++;
+    _schedule_dispatch();
+    pthread_mutex_unlock(&_lock);
+}
+
+// Parse one line, "<command> [mount] [value]"
+static int _parse(char *line, control_request_t *request)
+{
+    char *save = NULL;
+    char *command = strtok_r(line, " \t", &save);
+    char *arg = strtok_r(NULL, " \t", &save);
+
+    if(command == NULL) return -1;
+
+    memset(request, 0, sizeof(*request));
+    if(arg && arg[0] == '/'){
+        snprintf(request->mount, sizeof(request->mount), "%s", arg);
+        arg = strtok_r(NULL, " \t", &save);
+    }
+
+    if(!strcmp(command, "status")){
+        request->command = CONTROL_STATUS;
+        return 0;
+    }
+
+    if(!strcmp(command, "set_bitrate"))         request->command = CONTROL_SET_BITRATE;
+    else if(!strcmp(command, "set_gop"))        request->command = CONTROL_SET_GOP;
+    else if(!strcmp(command, "set_decimator"))  request->command = CONTROL_SET_DECIMATOR;
+    else if(!strcmp(command, "set_resolution")) request->command = CONTROL_SET_RESOLUTION;
+    else {
+        control_reply("unknown control command %s, expected one of %s\n", command, CONTROL_COMMANDS);
+        return -1;
+    }
+
+    if(arg == NULL){
+        control_reply("%s needs a value\n", command);
+        return -1;
+    }
+    if(request->command == CONTROL_SET_RESOLUTION){
+        if(sscanf(arg, "%ux%u", &request->width, &request->height) != 2){
+            control_reply("invalid resolution %s, expected WIDTHxHEIGHT\n", arg);
+            return -1;
+        }
+    } else if(sscanf(arg, "%u", &request->value) != 1 || request->value == 0){
+        control_reply("invalid value %s for %s\n", arg, command);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs on the pipe's own thread, a write can hold several commands
+static void _control_cb(int ch, char *string, int bytes, void *context)
+{
+    char buf[CONTROL_MAX_COMMAND];
+    char *save = NULL;
+    char *line;
+    control_request_t request;
+
+    if(bytes <= 0) return;
+    if(bytes >= CONTROL_MAX_COMMAND) bytes = CONTROL_MAX_COMMAND - 1;
+    memcpy(buf, string, bytes);
+    buf[bytes] = '\0';
+
+    for(line = strtok_r(buf, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)){
+        M_DEBUG("control command: %s\n", line);
+        if(_parse(line, &request) == 0) _enqueue(&request);
+    }
+}
+
+
+int control_init(control_apply_cb apply)
+{
+    pipe_info_t info;
+
+    _apply = apply;
+
+    memset(&info, 0, sizeof(info));
+    snprintf(info.name, sizeof(info.name), "%s", CONTROL_PIPE_NAME);
+    snprintf(info.location, sizeof(info.location), "%s", CONTROL_PIPE_NAME);
+    snprintf(info.type, sizeof(info.type), "text");
+    snprintf(info.server_name, sizeof(info.server_name), "%s", CONTROL_PIPE_NAME);
+    info.size_bytes = 4096;
+
+    _ch = pipe_server_get_next_available_channel();
+    if(_ch < 0 || pipe_server_create(_ch, info, SERVER_FLAG_EN_CONTROL_PIPE)){
+        M_ERROR("Couldn't make the control pipe %s\n", CONTROL_PIPE_NAME);
+        _ch = -1;
+        return -1;
+    }
+    pipe_server_set_control_cb(_ch, _control_cb, NULL);
+    pipe_server_set_available_control_commands(_ch, CONTROL_COMMANDS);
+    M_DEBUG("Listening for control commands on %s\n", CONTROL_PIPE_NAME);
+    return 0;
+}
+
+void control_attach(GMainContext *context)
+{
+    pthread_mutex_lock(&_lock);
+    if(_context) g_main_context_unref(_context);
+    _context = context ? g_main_context_ref(context) : NULL;
+    // an idle source on the old context went away with it
+    _dispatch_scheduled = 0;
+    _schedule_dispatch();
+    pthread_mutex_unlock(&_lock);
+}
+
+void control_reply(const char *format, ...)
+{
+    char str[256];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(str, sizeof(str), format, args);
+    va_end(args);
+
+    M_PRINT("%s", str);
+    if(_ch >= 0) pipe_server_write_string(_ch, str);
+}
+
+void control_deinit(void)
+{
+    if(_ch >= 0) pipe_server_close(_ch);
+    _ch = -1;
+    control_attach(NULL);
+
+    pthread_mutex_lock(&_lock);
+    _queue_count = 0;
+    pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,316 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <modal_journal.h>
+
+#include "encoder.h"
+
+typedef struct encoder_info_t {
+    const char *name;
+    const char *factory;
+    encoder_codec_t codec;
+} encoder_info_t;
+
+static const encoder_info_t _encoders[] = {
+    [ENCODER_AUTO]     = {"auto",     NULL,          ENCODER_CODEC_H264},
+    [ENCODER_OMX_H264] = {"omx-h264", "omxh264enc",  ENCODER_CODEC_H264},
+    [ENCODER_OMX_H265] = {"omx-h265", "omxh265enc",  ENCODER_CODEC_H265},
+    [ENCODER_X264]     = {"x264",     "x264enc",     ENCODER_CODEC_H264},
+    [ENCODER_OPENH264] = {"openh264", "openh264enc", ENCODER_CODEC_H264},
+    [ENCODER_X265]     = {"x265",     "x265enc",     ENCODER_CODEC_H265},
+};
+
+#define N_ENCODERS ((int) (sizeof(_encoders) / sizeof(_encoders[0])))
+
+// hardware first, then the software encoders in order of speed
+static const encoder_backend_t _auto_h264[] = {
+    ENCODER_OMX_H264, ENCODER_X264, ENCODER_OPENH264
+};
+static const encoder_backend_t _auto_h265[] = {
+    ENCODER_OMX_H265, ENCODER_X265
+};
+
+static const char *_codec_names[] = {
+    [ENCODER_CODEC_H264] = "h264",
+    [ENCODER_CODEC_H265] = "h265",
+};
+
+
+const char *encoder_codec_name(encoder_codec_t codec)
+{
+    return _codec_names[codec];
+}
+
+int encoder_codec_from_name(const char *name, encoder_codec_t *codec)
+{
+    if(!strcmp(name, "h264"))      *codec = ENCODER_CODEC_H264;
+    else if(!strcmp(name, "h265")) *codec = ENCODER_CODEC_H265;
+    else return -1;
+    return 0;
+}
+
+const char *encoder_name(encoder_backend_t backend)
+{
+    return _encoders[backend].name;
+}
+
+int encoder_from_name(const char *name, encoder_backend_t *backend)
+{
+    int i;
+
+    for(i = 0; i < N_ENCODERS; i++){
+        if(!strcmp(name, _encoders[i].name)){
+            *backend = (encoder_backend_t) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int _installed(encoder_backend_t backend)
+{
+    GstElementFactory *factory = gst_element_factory_find(_encoders[backend].factory);
+    if(factory == NULL) return 0;
+    gst_object_unref(factory);
+    return 1;
+}
+
+int encoder_resolve(encoder_backend_t requested, encoder_codec_t codec,
+                    encoder_backend_t *resolved)
+{
+    const encoder_backend_t *order = (codec == ENCODER_CODEC_H265) ? _auto_h265 : _auto_h264;
+    int i, n = (codec == ENCODER_CODEC_H265) ? (int) (sizeof(_auto_h265) / sizeof(_auto_h265[0]))
+                                             : (int) (sizeof(_auto_h264) / sizeof(_auto_h264[0]));
+
+    if(requested != ENCODER_AUTO && _encoders[requested].codec != codec){
+        M_WARN("Encoder %s doesn't make %s, picking one that does\n",
+               _encoders[requested].name, _codec_names[codec]);
+        requested = ENCODER_AUTO;
+    }
+
+    if(requested != ENCODER_AUTO){
+        if(!_installed(requested)){
+            M_ERROR("Encoder %s needs the %s element, which isn't installed\n",
+                    _encoders[requested].name, _encoders[requested].factory);
+            return -1;
+        }
+        *resolved = requested;
+        return 0;
+    }
+
+    for(i = 0; i < n; i++){
+        if(_installed(order[i])){
+            *resolved = order[i];
+            return 0;
+        }
+    }
+    if(codec == ENCODER_CODEC_H265){
+        M_ERROR("No H265 encoder installed, need one of omxh265enc or x265enc\n");
+    } else {
+        M_ERROR("No H264 encoder installed, need one of omxh264enc, x264enc or openh264enc\n");
+    }
+    return -1;
+}
+
+encoder_codec_t encoder_codec(encoder_backend_t backend)
+{
+    return _encoders[backend].codec;
+}
+
+int encoder_is_h265(encoder_backend_t backend)
+{
+    return _encoders[backend].codec == ENCODER_CODEC_H265;
+}
+
+
+// Set a property from a string if the element has it, so enums can be set
+// by nick and older plugin versions missing a property still work
+static void _set(GstElement *element, const char *property, const char *value)
+{
+    if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), property) == NULL){
+        M_DEBUG("%s has no property %s, skipping\n", GST_ELEMENT_NAME(element), property);
+        return;
+    }
+    gst_util_set_object_arg(G_OBJECT(element), property, value);
+}
+
+static void _set_uint(GstElement *element, const char *property, uint32_t value)
+{
+    char str[16];
+    snprintf(str, sizeof(str), "%u", value);
+    _set(element, property, str);
+}
+
+GstElement *encoder_create(encoder_backend_t backend, const char *name,
+                           uint32_t bitrate, uint32_t gop_size, uint32_t slices)
+{
+    GstElement *encoder = gst_element_factory_make(_encoders[backend].factory, name);
+    char options[32];
+
+    if(encoder == NULL){
+        M_ERROR("Couldn't make %s encoder\n", _encoders[backend].name);
+        return NULL;
+    }
+
+    switch(backend){
+        case ENCODER_OMX_H264:
+        case ENCODER_OMX_H265:
+            _set(encoder, "control-rate", "1");
+            // not every OMX build exposes slices, frames stay whole then
+            if(slices > 1){
+                if(g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), "num-slices")){
+                    _set_uint(encoder, "num-slices", slices);
+                } else {
+                    M_WARN("%s can't split frames into slices, encoding whole frames\n",
+                           _encoders[backend].factory);
+                }
+            }
+            break;
+
+        case ENCODER_X264:
+            // no lookahead or B frames, and slices encoded in parallel
+            // instead of whole frames, so a frame comes out as soon as it
+            // can rather than a few frames later
+            _set(encoder, "tune", "zerolatency");
+            _set(encoder, "speed-preset", "ultrafast");
+            _set(encoder, "sliced-threads", "true");
+            if(slices > 1){
+                snprintf(options, sizeof(options), "slices=%u", slices);
+                _set(encoder, "option-string", options);
+            }
+            break;
+
+        case ENCODER_OPENH264:
+            _set(encoder, "usage-type", "camera");
+            _set(encoder, "complexity", "low");
+            _set(encoder, "rate-control", "bitrate");
+            if(slices > 1){
+                _set(encoder, "slice-mode", "n-slices");
+                _set_uint(encoder, "num-slices", slices);
+            }
+            break;
+
+        case ENCODER_X265:
+            _set(encoder, "tune", "zerolatency");
+            _set(encoder, "speed-preset", "ultrafast");
+            if(slices > 1){
+                snprintf(options, sizeof(options), "slices=%u", slices);
+                _set(encoder, "option-string", options);
+            }
+            break;
+
+        case ENCODER_AUTO:
+            break;
+    }
+
+    encoder_set_bitrate(encoder, backend, bitrate);
+    encoder_set_gop(encoder, backend, gop_size);
+    return encoder;
+}
+
+void encoder_set_bitrate(GstElement *encoder, encoder_backend_t backend, uint32_t bitrate)
+{
+    switch(backend){
+        case ENCODER_OMX_H264:
+        case ENCODER_OMX_H265:
+            _set_uint(encoder, "target-bitrate", bitrate);
+            break;
+        case ENCODER_X264:
+        case ENCODER_X265:
+            // x264enc and x265enc count in kbit/s
+            _set_uint(encoder, "bitrate", (bitrate + 500) / 1000);
+            break;
+        case ENCODER_OPENH264:
+            _set_uint(encoder, "bitrate", bitrate);
+            break;
+        case ENCODER_AUTO:
+            break;
+    }
+}
+
+// Property holding the keyframe interval for a backend
+static const char *_gop_property(encoder_backend_t backend)
+{
+    switch(backend){
+        case ENCODER_OMX_H264:
+        case ENCODER_OMX_H265:
+            return "interval-intraframes";
+        case ENCODER_X264:
+        case ENCODER_X265:
+            return "key-int-max";
+        case ENCODER_OPENH264:
+            return "gop-size";
+        case ENCODER_AUTO:
+            break;
+    }
+    return NULL;
+}
+
+void encoder_set_gop(GstElement *encoder, encoder_backend_t backend, uint32_t gop_size)
+{
+    const char *property = _gop_property(backend);
+    if(property) _set_uint(encoder, property, gop_size);
+}
+
+int encoder_gop_is_live(GstElement *encoder, encoder_backend_t backend)
+{
+    const char *property = _gop_property(backend);
+    if(property == NULL) return 0;
+
+    GParamSpec *pspec = g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), property);
+    return pspec && (pspec->flags & GST_PARAM_MUTABLE_PLAYING);
+}
+
+GstCaps *encoder_caps(encoder_backend_t backend)
+{
+    if(_encoders[backend].codec == ENCODER_CODEC_H265){
+        return gst_caps_new_simple("video/x-h265",
+                                   "stream-format", G_TYPE_STRING, "byte-stream",
+                                   NULL);
+    }
+
+    // openh264enc only advertises constrained-baseline, the others are
+    // asked for baseline like the OMX encoder always was
+    if(backend == ENCODER_OPENH264){
+        return gst_caps_new_simple("video/x-h264",
+                                   "stream-format", G_TYPE_STRING, "byte-stream",
+                                   NULL);
+    }
+    return gst_caps_new_simple("video/x-h264",
+                               "profile", G_TYPE_STRING, "baseline",
+                               "stream-format", G_TYPE_STRING, "byte-stream",
+                               NULL);
+}
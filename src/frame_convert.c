@@ -0,0 +1,516 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <modal_pipe.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "frame_convert.h"
+
+#define BAND_ROWS FRAME_CONVERT_BAND_ROWS
+
+
+int frame_convert_supported(int format, int width, int height, int rotation)
+{
+    if(width < 2 || height < 2 || (width & 1) || (height & 1)) return 0;
+    if(rotation != 0 && rotation != 90 && rotation != 180 && rotation != 270) return 0;
+
+    switch(format){
+        case IMAGE_FORMAT_RAW8:
+        case IMAGE_FORMAT_STEREO_RAW8:
+        case IMAGE_FORMAT_NV12:
+        case IMAGE_FORMAT_STEREO_NV12:
+        case IMAGE_FORMAT_NV21:
+        case IMAGE_FORMAT_STEREO_NV21:
+        case IMAGE_FORMAT_YUV420:
+        case IMAGE_FORMAT_YUV422:
+        case IMAGE_FORMAT_YUV422_UYVY:
+        case IMAGE_FORMAT_RGB:
+        case IMAGE_FORMAT_STEREO_RGB:
+            return 1;
+    }
+    return 0;
+}
+
+
+size_t frame_convert_band_size(int width)
+{
+    // luma rows plus the interleaved chroma rows that go with them
+    return (size_t) width * BAND_ROWS + (size_t) width * (BAND_ROWS / 2);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Conversion of one band of rows to NV12
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint8_t _avg(int a, int b)
+{
+    return (uint8_t) ((a + b + 1) >> 1);
+}
+
+// BT.601 limited range, the same as videoconvert picks for these sizes
+static inline uint8_t _rgb_to_y(int r, int g, int b)
+{
+    return (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t _rgb_to_u(int r, int g, int b)
+{
+    return (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t _rgb_to_v(int r, int g, int b)
+{
+    return (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+// Row kernels, each does as much as it can 16 pixels at a time and finishes
+// the rest one pixel at a time
+
+// NV21 VU pairs to NV12 UV pairs, width bytes
+static void _swap_uv_row(const uint8_t *vu, uint8_t *uv, int width)
+{
+    int x = 0;
+
+#if defined(__SSE2__)
+    for(; x + 16 <= width; x += 16){
+        __m128i p = _mm_loadu_si128((const __m128i*) (vu + x));
+        p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+        _mm_storeu_si128((__m128i*) (uv + x), p);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; x + 16 <= width; x += 16){
+        vst1q_u8(uv + x, vrev16q_u8(vld1q_u8(vu + x)));
+    }
+#endif
+
+    for(; x < width; x += 2){
+        uv[x]     = vu[x + 1];
+        uv[x + 1] = vu[x];
+    }
+}
+
+// Separate U and V rows of n samples each into n UV pairs
+static void _interleave_uv_row(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n)
+{
+    int x = 0;
+
+#if defined(__SSE2__)
+    for(; x + 16 <= n; x += 16){
+        __m128i pu = _mm_loadu_si128((const __m128i*) (u + x));
+        __m128i pv = _mm_loadu_si128((const __m128i*) (v + x));
+        _mm_storeu_si128((__m128i*) (uv + 2 * x),      _mm_unpacklo_epi8(pu, pv));
+        _mm_storeu_si128((__m128i*) (uv + 2 * x + 16), _mm_unpackhi_epi8(pu, pv));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; x + 16 <= n; x += 16){
+        uint8x16x2_t p = {{vld1q_u8(u + x), vld1q_u8(v + x)}};
+        vst2q_u8(uv + 2 * x, p);
+    }
+#endif
+
+    for(; x < n; x++){
+        uv[2 * x]     = u[x];
+        uv[2 * x + 1] = v[x];
+    }
+}
+
+// Two rows of YUYV (yo 0) or UYVY (yo 1) to two luma rows and one row of
+// chroma averaged between them, 4:2:2 to 4:2:0
+static void _yuv422_rows(const uint8_t *s0, const uint8_t *s1, uint8_t *y0, uint8_t *y1,
+                         uint8_t *uv, int width, int yo)
+{
+    const int co = 1 - yo;
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    for(; x + 16 <= width; x += 16){
+        __m128i a0 = _mm_loadu_si128((const __m128i*) (s0 + 2 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i*) (s0 + 2 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i*) (s1 + 2 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i*) (s1 + 2 * x + 16));
+        // even bytes and odd bytes of each row, 16 of each
+        __m128i even0 = _mm_packus_epi16(_mm_and_si128(a0, low), _mm_and_si128(b0, low));
+        __m128i odd0  = _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8));
+        __m128i even1 = _mm_packus_epi16(_mm_and_si128(a1, low), _mm_and_si128(b1, low));
+        __m128i odd1  = _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8));
+        _mm_storeu_si128((__m128i*) (y0 + x), yo ? odd0 : even0);
+        _mm_storeu_si128((__m128i*) (y1 + x), yo ? odd1 : even1);
+        _mm_storeu_si128((__m128i*) (uv + x), yo ? _mm_avg_epu8(even0, even1)
+                                                 : _mm_avg_epu8(odd0, odd1));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; x + 16 <= width; x += 16){
+        uint8x16x2_t p0 = vld2q_u8(s0 + 2 * x);
+        uint8x16x2_t p1 = vld2q_u8(s1 + 2 * x);
+        vst1q_u8(y0 + x, p0.val[yo]);
+        vst1q_u8(y1 + x, p1.val[yo]);
+        vst1q_u8(uv + x, vrhaddq_u8(p0.val[co], p1.val[co]));
+    }
+#endif
+
+    int done = x;
+    for(x = done; x < width; x++){
+        y0[x] = s0[2 * x + yo];
+        y1[x] = s1[2 * x + yo];
+    }
+    for(x = done; x < width; x++){
+        uv[x] = _avg(s0[2 * x + co], s1[2 * x + co]);
+    }
+}
+
+// Two rows of packed RGB to two luma rows and one row of chroma from each
+// 2x2 block. SSE2 has no byte shuffle to pull the channels apart cheaply so
+// only NEON gets a vector version, that's what the targets run anyway.
+static void _rgb_rows(const uint8_t *s0, const uint8_t *s1, uint8_t *y0, uint8_t *y1,
+                      uint8_t *uv, int width)
+{
+    int x = 0;
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for(; x + 16 <= width; x += 16){
+        uint8x16x3_t p0 = vld3q_u8(s0 + 3 * x);
+        uint8x16x3_t p1 = vld3q_u8(s1 + 3 * x);
+        uint8x16x3_t *rows[2] = {&p0, &p1};
+        uint8_t *ys[2] = {y0, y1};
+        int i;
+
+        for(i = 0; i < 2; i++){
+            uint8x16_t r = rows[i]->val[0], g = rows[i]->val[1], b = rows[i]->val[2];
+            uint16x8_t lo = vmull_u8(vget_low_u8(r), vdup_n_u8(66));
+            uint16x8_t hi = vmull_u8(vget_high_u8(r), vdup_n_u8(66));
+            lo = vmlal_u8(lo, vget_low_u8(g), vdup_n_u8(129));
+            hi = vmlal_u8(hi, vget_high_u8(g), vdup_n_u8(129));
+            lo = vmlal_u8(lo, vget_low_u8(b), vdup_n_u8(25));
+            hi = vmlal_u8(hi, vget_high_u8(b), vdup_n_u8(25));
+            lo = vaddq_u16(lo, vdupq_n_u16(128));
+            hi = vaddq_u16(hi, vdupq_n_u16(128));
+            uint8x16_t y = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+            vst1q_u8(ys[i] + x, vaddq_u8(y, vdupq_n_u8(16)));
+        }
+
+        // average of each 2x2 block, rounded like the scalar version
+        int16x8_t c[3];
+        for(i = 0; i < 3; i++){
+            uint16x8_t sum = vaddq_u16(vpaddlq_u8(p0.val[i]), vpaddlq_u8(p1.val[i]));
+            c[i] = vreinterpretq_s16_u16(vshrq_n_u16(vaddq_u16(sum, vdupq_n_u16(2)), 2));
+        }
+        int16x8_t u = vmulq_n_s16(c[0], -38);
+        u = vmlaq_n_s16(u, c[1], -74);
+        u = vmlaq_n_s16(u, c[2], 112);
+        u = vaddq_s16(vshrq_n_s16(vaddq_s16(u, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+        int16x8_t v = vmulq_n_s16(c[0], 112);
+        v = vmlaq_n_s16(v, c[1], -94);
+        v = vmlaq_n_s16(v, c[2], -18);
+        v = vaddq_s16(vshrq_n_s16(vaddq_s16(v, vdupq_n_s16(128)), 8), vdupq_n_s16(128));
+        uint8x8x2_t out = {{vqmovun_s16(u), vqmovun_s16(v)}};
+        vst2_u8(uv + x, out);
+    }
+#endif
+
+    for(; x < width; x += 2){
+        const uint8_t *p00 = s0 + x * 3, *p01 = p00 + 3;
+        const uint8_t *p10 = s1 + x * 3, *p11 = p10 + 3;
+        y0[x]     = _rgb_to_y(p00[0], p00[1], p00[2]);
+        y0[x + 1] = _rgb_to_y(p01[0], p01[1], p01[2]);
+        y1[x]     = _rgb_to_y(p10[0], p10[1], p10[2]);
+        y1[x + 1] = _rgb_to_y(p11[0], p11[1], p11[2]);
+        int r4 = p00[0] + p01[0] + p10[0] + p11[0];
+        int g4 = p00[1] + p01[1] + p10[1] + p11[1];
+        int b4 = p00[2] + p01[2] + p10[2] + p11[2];
+        uv[x]     = _rgb_to_u((r4 + 2) >> 2, (g4 + 2) >> 2, (b4 + 2) >> 2);
+        uv[x + 1] = _rgb_to_v((r4 + 2) >> 2, (g4 + 2) >> 2, (b4 + 2) >> 2);
+    }
+}
+
+// Convert source rows y0 to y0+rows, rows is even. Luma goes to y, the
+// interleaved chroma for each pair of rows goes to uv.
+static void _convert_band(const uint8_t *src, int format, int width, int height,
+                          int y0, int rows, uint8_t *y, int y_stride,
+                          uint8_t *uv, int uv_stride)
+{
+    const size_t luma_size = (size_t) width * height;
+    int r;
+
+    for(r = 0; r < rows; r += 2){
+        uint8_t *y_row0 = y + (size_t) r * y_stride;
+        uint8_t *y_row1 = y_row0 + y_stride;
+        uint8_t *uv_row = uv + (size_t) (r / 2) * uv_stride;
+        int sy = y0 + r;
+
+        switch(format){
+            case IMAGE_FORMAT_RAW8:
+            case IMAGE_FORMAT_STEREO_RAW8:
+                memcpy(y_row0, src + (size_t) sy * width, width);
+                memcpy(y_row1, src + (size_t) (sy + 1) * width, width);
+                memset(uv_row, 128, width);
+                break;
+
+            case IMAGE_FORMAT_NV12:
+            case IMAGE_FORMAT_STEREO_NV12:
+                memcpy(y_row0, src + (size_t) sy * width, width);
+                memcpy(y_row1, src + (size_t) (sy + 1) * width, width);
+                memcpy(uv_row, src + luma_size + (size_t) (sy / 2) * width, width);
+                break;
+
+            case IMAGE_FORMAT_NV21:
+            case IMAGE_FORMAT_STEREO_NV21:
+                memcpy(y_row0, src + (size_t) sy * width, width);
+                memcpy(y_row1, src + (size_t) (sy + 1) * width, width);
+                _swap_uv_row(src + luma_size + (size_t) (sy / 2) * width, uv_row, width);
+                break;
+
+            case IMAGE_FORMAT_YUV420: {
+                const uint8_t *u = src + luma_size + (size_t) (sy / 2) * (width / 2);
+                const uint8_t *v = u + luma_size / 4;
+                memcpy(y_row0, src + (size_t) sy * width, width);
+                memcpy(y_row1, src + (size_t) (sy + 1) * width, width);
+                _interleave_uv_row(u, v, uv_row, width / 2);
+                break;
+            }
+
+            case IMAGE_FORMAT_YUV422:
+            case IMAGE_FORMAT_YUV422_UYVY: {
+                const uint8_t *s0 = src + (size_t) sy * width * 2;
+                _yuv422_rows(s0, s0 + (size_t) width * 2, y_row0, y_row1, uv_row, width,
+                             format == IMAGE_FORMAT_YUV422 ? 0 : 1);
+                break;
+            }
+
+            case IMAGE_FORMAT_RGB:
+            case IMAGE_FORMAT_STEREO_RGB: {
+                const uint8_t *s0 = src + (size_t) sy * width * 3;
+                _rgb_rows(s0, s0 + (size_t) width * 3, y_row0, y_row1, uv_row, width);
+                break;
+            }
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Block transposes for 90/270 rotation. Strides are in elements and can be
+// negative to flip the block on the way through.
+////////////////////////////////////////////////////////////////////////////////
+
+static void _transpose_generic(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds,
+                               int rows, int cols, int elem)
+{
+    int i, j;
+
+    for(i = 0; i < rows; i++){
+        for(j = 0; j < cols; j++){
+            memcpy(d + (j * ds + i) * elem, s + (i * ss + j) * elem, elem);
+        }
+    }
+}
+
+// Interleaving row i with row i+n/2 log2(n) times transposes an n x n block
+#if defined(__SSE2__)
+
+static void _transpose_16x16_u8(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    __m128i a[16], b[16];
+    int i, k;
+
+    for(i = 0; i < 16; i++) a[i] = _mm_loadu_si128((const __m128i*) (s + i * ss));
+    for(k = 0; k < 4; k++){
+        for(i = 0; i < 8; i++){
+            b[2 * i]     = _mm_unpacklo_epi8(a[i], a[i + 8]);
+            b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+        }
+        memcpy(a, b, sizeof(a));
+    }
+    for(i = 0; i < 16; i++) _mm_storeu_si128((__m128i*) (d + i * ds), a[i]);
+}
+
+static void _transpose_8x8_u16(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    __m128i a[8], b[8];
+    int i, k;
+
+    for(i = 0; i < 8; i++) a[i] = _mm_loadu_si128((const __m128i*) (s + i * ss * 2));
+    for(k = 0; k < 3; k++){
+        for(i = 0; i < 4; i++){
+            b[2 * i]     = _mm_unpacklo_epi16(a[i], a[i + 4]);
+            b[2 * i + 1] = _mm_unpackhi_epi16(a[i], a[i + 4]);
+        }
+        memcpy(a, b, sizeof(a));
+    }
+    for(i = 0; i < 8; i++) _mm_storeu_si128((__m128i*) (d + i * ds * 2), a[i]);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+static void _transpose_16x16_u8(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    uint8x16_t a[16], b[16];
+    int i, k;
+
+    for(i = 0; i < 16; i++) a[i] = vld1q_u8(s + i * ss);
+    for(k = 0; k < 4; k++){
+        for(i = 0; i < 8; i++){
+            b[2 * i]     = vzip1q_u8(a[i], a[i + 8]);
+            b[2 * i + 1] = vzip2q_u8(a[i], a[i + 8]);
+        }
+        memcpy(a, b, sizeof(a));
+    }
+    for(i = 0; i < 16; i++) vst1q_u8(d + i * ds, a[i]);
+}
+
+static void _transpose_8x8_u16(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    uint16x8_t a[8], b[8];
+    int i, k;
+
+    for(i = 0; i < 8; i++) a[i] = vld1q_u16((const uint16_t*) (s + i * ss * 2));
+    for(k = 0; k < 3; k++){
+        for(i = 0; i < 4; i++){
+            b[2 * i]     = vzip1q_u16(a[i], a[i + 4]);
+            b[2 * i + 1] = vzip2q_u16(a[i], a[i + 4]);
+        }
+        memcpy(a, b, sizeof(a));
+    }
+    for(i = 0; i < 8; i++) vst1q_u16((uint16_t*) (d + i * ds * 2), a[i]);
+}
+
+#else
+
+static void _transpose_16x16_u8(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    _transpose_generic(s, ss, d, ds, 16, 16, 1);
+}
+
+static void _transpose_8x8_u16(const uint8_t *s, ptrdiff_t ss, uint8_t *d, ptrdiff_t ds)
+{
+    _transpose_generic(s, ss, d, ds, 8, 8, 2);
+}
+
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Writing a converted band out to the rotated frame
+////////////////////////////////////////////////////////////////////////////////
+
+// One plane of a band, rows x cols elements of elem bytes starting at plane
+// row y0. The plane is plane_w x plane_h elements before rotation.
+static void _rotate_band(const uint8_t *band, int rows, int elem,
+                         int plane_w, int plane_h, int y0,
+                         uint8_t *dst, int rotation)
+{
+    const int block = (elem == 1) ? 16 : 8;
+    int i, j, x0;
+
+    if(rotation == 180){
+        // rows bottom up, elements right to left
+        for(i = 0; i < rows; i++){
+            const uint8_t *s = band + (size_t) i * plane_w * elem;
+            uint8_t *d = dst + ((size_t) (plane_h - 1 - y0 - i) * plane_w) * elem;
+            if(elem == 1){
+                for(j = 0; j < plane_w; j++) d[j] = s[plane_w - 1 - j];
+            } else {
+                for(j = 0; j < plane_w; j++) memcpy(d + j * 2, s + (plane_w - 1 - j) * 2, 2);
+            }
+        }
+        return;
+    }
+
+    // 90 and 270 turn band rows into output columns, plane_h elements wide
+    for(x0 = 0; x0 < plane_w; x0 += block){
+        int cols = plane_w - x0 < block ? plane_w - x0 : block;
+        const uint8_t *s;
+        uint8_t *d;
+        ptrdiff_t ss, ds;
+
+        if(rotation == 90){
+            // column x becomes row x, read the band bottom up so it lands
+            // right to left
+            s  = band + ((size_t) (rows - 1) * plane_w + x0) * elem;
+            ss = -plane_w;
+            d  = dst + ((size_t) x0 * plane_h + (plane_h - y0 - rows)) * elem;
+            ds = plane_h;
+        } else {
+            // column x becomes row plane_w-1-x
+            s  = band + (size_t) x0 * elem;
+            ss = plane_w;
+            d  = dst + ((size_t) (plane_w - 1 - x0) * plane_h + y0) * elem;
+            ds = -plane_h;
+        }
+
+        if(rows == block && cols == block){
+            if(elem == 1) _transpose_16x16_u8(s, ss, d, ds);
+            else          _transpose_8x8_u16(s, ss, d, ds);
+        } else {
+            _transpose_generic(s, ss, d, ds, rows, cols, elem);
+        }
+    }
+}
+
+
+void frame_convert_nv12(const uint8_t *src, int format, int width, int height,
+                        int rotation, uint8_t *dst, uint8_t *band)
+{
+    uint8_t *dst_uv = dst + (size_t) width * height;
+    int y0;
+
+    for(y0 = 0; y0 < height; y0 += BAND_ROWS){
+        int rows = height - y0 < BAND_ROWS ? height - y0 : BAND_ROWS;
+
+        // nothing to rotate, convert straight into place
+        if(rotation == 0){
+            _convert_band(src, format, width, height, y0, rows,
+                          dst + (size_t) y0 * width, width,
+                          dst_uv + (size_t) (y0 / 2) * width, width);
+            continue;
+        }
+
+        uint8_t *band_y = band;
+        uint8_t *band_uv = band + (size_t) width * BAND_ROWS;
+        _convert_band(src, format, width, height, y0, rows,
+                      band_y, width, band_uv, width);
+
+        // luma is width x height bytes, chroma width/2 x height/2 pairs
+        _rotate_band(band_y, rows, 1, width, height, y0, dst, rotation);
+        _rotate_band(band_uv, rows / 2, 2, width / 2, height / 2, y0 / 2, dst_uv, rotation);
+    }
+}
@@ -0,0 +1,183 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <modal_journal.h>
+
+#include "frame_pool.h"
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+// encoded frames change size, size slots for a very generous worst case
+// keyframe rather than a raw frame
+#define MIN_ENCODED_SLOT_SIZE (256*1024)
+
+
+gsize frame_pool_slot_size(context_data *ctx)
+{
+    if(ctx->input_format == IMAGE_FORMAT_H264 ||
+       ctx->input_format == IMAGE_FORMAT_H265){
+        gsize size = (ctx->input_frame_width * ctx->input_frame_height) / 4;
+        return size < MIN_ENCODED_SLOT_SIZE ? MIN_ENCODED_SLOT_SIZE : size;
+    }
+    // converted frames come out of the same pool as the ones from the pipe
+    if(ctx->fused_convert){
+        gsize nv12 = ctx->output_stream_width * ctx->output_stream_height * 3 / 2;
+        return MAX(ctx->input_frame_size, nv12);
+    }
+    return ctx->input_frame_size;
+}
+
+
+// Ask for transparent huge pages on every slot and touch all of the memory
+// now so the RSS is flat from the first frame instead of growing as pages
+// get faulted in mid flight.
+static void _prefault_pool(GstBufferPool *pool, int n_buffers, int huge_pages)
+{
+    GstBufferPoolAcquireParams params = {.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT};
+    GstBuffer *buffers[n_buffers];
+    GstMapInfo info;
+    int n = 0;
+
+    for(n = 0; n < n_buffers; n++){
+        if(gst_buffer_pool_acquire_buffer(pool, &buffers[n], &params) != GST_FLOW_OK) break;
+        if(!gst_buffer_map(buffers[n], &info, GST_MAP_WRITE)) continue;
+
+        if(huge_pages){
+            uintptr_t start = ((uintptr_t)info.data + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+            uintptr_t end   = ((uintptr_t)info.data + info.maxsize) & ~((uintptr_t)HUGE_PAGE_SIZE - 1);
+            if(end > start && madvise((void*)start, end - start, MADV_HUGEPAGE)){
+                M_WARN("madvise MADV_HUGEPAGE failed, using normal pages\n");
+                huge_pages = 0;
+            }
+        }
+        memset(info.data, 0, info.maxsize);
+        gst_buffer_unmap(buffers[n], &info);
+    }
+
+    while(n-- > 0) gst_buffer_unref(buffers[n]);
+}
+
+
+int frame_pool_create(context_data *ctx)
+{
+    GstAllocationParams params;
+    GstStructure *config;
+
+    frame_pool_destroy(ctx);
+
+    gsize size = frame_pool_slot_size(ctx);
+    int n_buffers = ctx->frame_pool_buffers;
+    if(size == 0 || n_buffers <= 0){
+        M_DEBUG("frame pool disabled\n");
+        return 0;
+    }
+
+    GstBufferPool *pool = gst_buffer_pool_new();
+    if(!pool){
+        M_ERROR("Couldn't make frame pool\n");
+        return -1;
+    }
+
+    // huge pages need the slots to start on a huge page boundary
+    gst_allocation_params_init(&params);
+    if(ctx->frame_pool_huge_pages) params.align = HUGE_PAGE_SIZE - 1;
+
+    config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, NULL, size, n_buffers, n_buffers);
+    gst_buffer_pool_config_set_allocator(config, NULL, &params);
+    if(!gst_buffer_pool_set_config(pool, config)){
+        M_ERROR("Couldn't configure frame pool\n");
+        gst_object_unref(pool);
+        return -1;
+    }
+    if(!gst_buffer_pool_set_active(pool, TRUE)){
+        M_ERROR("Couldn't preallocate frame pool of %d x %zu bytes\n", n_buffers, size);
+        gst_object_unref(pool);
+        return -1;
+    }
+
+    _prefault_pool(pool, n_buffers, ctx->frame_pool_huge_pages);
+
+    M_DEBUG("Made frame pool of %d x %zu bytes\n", n_buffers, size);
+    ctx->frame_pool = pool;
+    atomic_store(&ctx->frame_pool_hits, 0);
+    atomic_store(&ctx->frame_pool_misses, 0);
+    return 0;
+}
+
+
+GstBuffer *frame_pool_acquire(context_data *ctx, gsize size)
+{
+    GstBufferPoolAcquireParams params = {.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT};
+    GstBuffer *buffer = NULL;
+
+    if(ctx->frame_pool &&
+       gst_buffer_pool_acquire_buffer(ctx->frame_pool, &buffer, &params) == GST_FLOW_OK){
+        if(gst_buffer_get_size(buffer) >= size){
+            gst_buffer_set_size(buffer, size);
+            atomic_fetch_add(&ctx->frame_pool_hits, 1);
+            return buffer;
+        }
+        // frame too big for a slot, give it back and go to the heap
+        gst_buffer_unref(buffer);
+    }
+
+    atomic_fetch_add(&ctx->frame_pool_misses, 1);
+    return gst_buffer_new_and_alloc(size);
+}
+
+
+void frame_pool_destroy(context_data *ctx)
+{
+    if(!ctx->frame_pool) return;
+
+    gst_buffer_pool_set_active(ctx->frame_pool, FALSE);
+    gst_object_unref(ctx->frame_pool);
+    ctx->frame_pool = NULL;
+}
+
+
+void frame_pool_print_stats(context_data *ctx)
+{
+    unsigned int hits = atomic_exchange(&ctx->frame_pool_hits, 0);
+    unsigned int misses = atomic_exchange(&ctx->frame_pool_misses, 0);
+
+    if(hits + misses == 0) return;
+
+    M_PRINT("frame pool: %u hits, %u misses\n", hits, misses);
+}
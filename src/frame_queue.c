@@ -0,0 +1,186 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <gst/gst.h>
+#include <modal_journal.h>
+
+#include "frame_queue.h"
+
+
+int frame_queue_init(frame_queue_t *q, frame_queue_mode_t mode, unsigned int depth)
+{
+    if(depth < 1) depth = 1;
+    if(depth > FRAME_QUEUE_MAX_DEPTH){
+        M_WARN("frame queue depth %u too large, using %d\n", depth, FRAME_QUEUE_MAX_DEPTH);
+        depth = FRAME_QUEUE_MAX_DEPTH;
+    }
+
+    q->mode  = mode;
+    q->depth = depth;
+    atomic_init(&q->mailbox, NULL);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->overwritten, 0);
+    atomic_init(&q->dropped, 0);
+
+    if(sem_init(&q->ready, 0, 0)){
+        M_ERROR("failed to init frame queue semaphore\n");
+        return -1;
+    }
+    q->initialized = 1;
+    return 0;
+}
+
+
+void frame_queue_deinit(frame_queue_t *q)
+{
+    GstBuffer *buf;
+
+    if(!q->initialized) return;
+
+    while((buf = frame_queue_pop(q, 0)) != NULL) gst_buffer_unref(buf);
+
+    sem_destroy(&q->ready);
+    q->initialized = 0;
+}
+
+
+int frame_queue_push(frame_queue_t *q, GstBuffer *buf)
+{
+    int ret = 0;
+
+    if(q->mode == FRAME_QUEUE_MAILBOX){
+        GstBuffer *old = atomic_exchange_explicit(&q->mailbox, buf, memory_order_acq_rel);
+        if(old){
+            gst_buffer_unref(old);
+            atomic_fetch_add_explicit(&q->overwritten, 1, memory_order_relaxed);
+            ret = 1;
+        }
+    } else {
+        unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if(head - tail >= q->depth){
+            gst_buffer_unref(buf);
+            atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+            return -1;
+        }
+        q->ring[head % q->depth] = buf;
+        atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    }
+
+    sem_post(&q->ready);
+    return ret;
+}
+
+
+static GstBuffer *_try_pop(frame_queue_t *q)
+{
+    if(q->mode == FRAME_QUEUE_MAILBOX){
+        return atomic_exchange_explicit(&q->mailbox, NULL, memory_order_acq_rel);
+    }
+
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if(tail == head) return NULL;
+
+    GstBuffer *buf = q->ring[tail % q->depth];
+    q->ring[tail % q->depth] = NULL;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return buf;
+}
+
+
+// Timeouts run on the monotonic clock so the GPS or NTP setting the wall
+// clock after boot can't stall the feeder or make it spin
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+static int _sem_wait_until(sem_t *sem, const struct timespec *deadline)
+{
+    return sem_clockwait(sem, CLOCK_MONOTONIC, deadline);
+}
+#else
+// no sem_clockwait before glibc 2.30, poll against the monotonic clock
+#define SEM_POLL_NS 1000000L
+
+static int _sem_wait_until(sem_t *sem, const struct timespec *deadline)
+{
+    struct timespec now, nap = {0, SEM_POLL_NS};
+
+    while(sem_trywait(sem)){
+        if(errno != EAGAIN) return -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &nap, NULL);
+    }
+    return 0;
+}
+#endif
+
+GstBuffer *frame_queue_pop(frame_queue_t *q, int timeout_ms)
+{
+    struct timespec deadline;
+    GstBuffer *buf;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // the semaphore can run ahead of the queue when mailbox frames get
+    // overwritten, so an empty pop after a wakeup just means wait again
+    while((buf = _try_pop(q)) == NULL){
+        if(_sem_wait_until(&q->ready, &deadline)){
+            if(errno == EINTR) continue;
+            return _try_pop(q);
+        }
+    }
+    return buf;
+}
+
+
+unsigned int frame_queue_count(frame_queue_t *q)
+{
+    if(q->mode == FRAME_QUEUE_MAILBOX){
+        return atomic_load_explicit(&q->mailbox, memory_order_acquire) ? 1 : 0;
+    }
+    return atomic_load_explicit(&q->head, memory_order_acquire) -
+           atomic_load_explicit(&q->tail, memory_order_relaxed);
+}
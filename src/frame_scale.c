@@ -0,0 +1,308 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "frame_scale.h"
+
+
+size_t frame_scale_scratch_size(int src_width, int dst_width)
+{
+    // a row of 32 bit sums or blended bytes plus the bilinear column tables
+    return (size_t) src_width * 2 * sizeof(uint32_t) +
+           (size_t) dst_width * 2 * sizeof(int32_t) + 16;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// 2:1 box filter, averages 2x2 blocks of elements. out_bytes is the width of
+// the output row in bytes, the input rows are twice that.
+////////////////////////////////////////////////////////////////////////////////
+
+static int _box2_row_simd(const uint8_t *r0, const uint8_t *r1, uint8_t *d,
+                          int out_bytes, int elem)
+{
+    int o = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i low16 = _mm_set1_epi32(0xFFFF);
+
+    for(; o + 16 <= out_bytes; o += 16){
+        __m128i sums[2];
+        int h;
+        for(h = 0; h < 2; h++){
+            __m128i x = _mm_loadu_si128((const __m128i*) (r0 + 2 * o + 16 * h));
+            __m128i y = _mm_loadu_si128((const __m128i*) (r1 + 2 * o + 16 * h));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+            if(elem == 1){
+                // neighbouring 16 bit sums, keep the low half of each pair
+                lo = _mm_and_si128(_mm_add_epi16(lo, _mm_srli_epi32(lo, 16)), low16);
+                hi = _mm_and_si128(_mm_add_epi16(hi, _mm_srli_epi32(hi, 16)), low16);
+                sums[h] = _mm_packs_epi32(lo, hi);
+            } else {
+                // neighbouring UV pairs, keep the low pair of each 64 bits
+                lo = _mm_add_epi16(lo, _mm_srli_epi64(lo, 32));
+                hi = _mm_add_epi16(hi, _mm_srli_epi64(hi, 32));
+                lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+                hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+                sums[h] = _mm_unpacklo_epi64(lo, hi);
+            }
+            sums[h] = _mm_srli_epi16(_mm_add_epi16(sums[h], two), 2);
+        }
+        _mm_storeu_si128((__m128i*) (d + o), _mm_packus_epi16(sums[0], sums[1]));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; o + 16 <= out_bytes; o += 16){
+        if(elem == 1){
+            uint16x8_t a = vpaddlq_u8(vld1q_u8(r0 + 2 * o));
+            uint16x8_t b = vpaddlq_u8(vld1q_u8(r0 + 2 * o + 16));
+            a = vpadalq_u8(a, vld1q_u8(r1 + 2 * o));
+            b = vpadalq_u8(b, vld1q_u8(r1 + 2 * o + 16));
+            vst1q_u8(d + o, vcombine_u8(vrshrn_n_u16(a, 2), vrshrn_n_u16(b, 2)));
+        } else {
+            // U0 V0 U1 V1 split into four lanes, add the even and odd pairs
+            uint8x8x4_t x = vld4_u8(r0 + 2 * o);
+            uint8x8x4_t y = vld4_u8(r1 + 2 * o);
+            uint16x8_t u = vaddq_u16(vaddl_u8(x.val[0], x.val[2]), vaddl_u8(y.val[0], y.val[2]));
+            uint16x8_t v = vaddq_u16(vaddl_u8(x.val[1], x.val[3]), vaddl_u8(y.val[1], y.val[3]));
+            uint8x8x2_t out;
+            out.val[0] = vrshrn_n_u16(u, 2);
+            out.val[1] = vrshrn_n_u16(v, 2);
+            vst2_u8(d + o, out);
+        }
+    }
+#else
+    (void) r0; (void) r1; (void) d; (void) out_bytes; (void) elem;
+#endif
+
+    return o;
+}
+
+static void _box2(const uint8_t *src, int src_w, uint8_t *dst, int dst_w, int dst_h, int elem)
+{
+    const int src_stride = src_w * elem;
+    const int out_bytes = dst_w * elem;
+    int j, o;
+
+    for(j = 0; j < dst_h; j++){
+        const uint8_t *r0 = src + (size_t) (2 * j) * src_stride;
+        const uint8_t *r1 = r0 + src_stride;
+        uint8_t *d = dst + (size_t) j * out_bytes;
+
+        o = _box2_row_simd(r0, r1, d, out_bytes, elem);
+        for(; o < out_bytes; o++){
+            int i = (o / elem) * 2 * elem + (o % elem);
+            d[o] = (uint8_t) ((r0[i] + r0[i + elem] + r1[i] + r1[i + elem] + 2) >> 2);
+        }
+    }
+}
+
+// Any other whole number ratio, the rows are summed up first so the inner
+// loops are simple enough for the compiler to vectorize
+static void _box(const uint8_t *src, int src_w, uint8_t *dst, int dst_w, int dst_h,
+                 int fx, int fy, int elem, uint32_t *acc)
+{
+    const int src_stride = src_w * elem;
+    const uint32_t area = (uint32_t) (fx * fy);
+    int i, j, k, c;
+
+    for(j = 0; j < dst_h; j++){
+        const uint8_t *s = src + (size_t) j * fy * src_stride;
+        uint8_t *d = dst + (size_t) j * dst_w * elem;
+
+        for(i = 0; i < src_stride; i++) acc[i] = s[i];
+        for(k = 1; k < fy; k++){
+            s += src_stride;
+            for(i = 0; i < src_stride; i++) acc[i] += s[i];
+        }
+
+        for(i = 0; i < dst_w; i++){
+            for(c = 0; c < elem; c++){
+                uint32_t sum = 0;
+                for(k = 0; k < fx; k++) sum += acc[(i * fx + k) * elem + c];
+                d[i * elem + c] = (uint8_t) ((sum + area / 2) / area);
+            }
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bilinear, blends two source rows into a temporary row and then samples
+// that horizontally. Weights are 8 bit fixed point.
+////////////////////////////////////////////////////////////////////////////////
+
+// source position of the centre of output sample i, in 1/256ths
+static int _bilinear_pos(int i, int src_size, int dst_size)
+{
+    int64_t pos = ((int64_t) (2 * i + 1) * src_size - dst_size) * 256 / (2 * dst_size);
+    return pos < 0 ? 0 : (int) pos;
+}
+
+static void _blend_rows(const uint8_t *r0, const uint8_t *r1, uint8_t *d, int n, int f)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w0 = _mm_set1_epi16((short) (256 - f));
+    const __m128i w1 = _mm_set1_epi16((short) f);
+    const __m128i round = _mm_set1_epi16(128);
+
+    for(; i + 16 <= n; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*) (r0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (r1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128((__m128i*) (d + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // f is 1..255 here so both weights fit in a byte
+    const uint8x8_t w0 = vdup_n_u8((uint8_t) (256 - f));
+    const uint8x8_t w1 = vdup_n_u8((uint8_t) f);
+
+    for(; i + 16 <= n; i += 16){
+        uint8x16_t a = vld1q_u8(r0 + i);
+        uint8x16_t b = vld1q_u8(r1 + i);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), w0), vget_low_u8(b), w1);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), w0), vget_high_u8(b), w1);
+        vst1q_u8(d + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+#endif
+
+    for(; i < n; i++){
+        d[i] = (uint8_t) ((r0[i] * (256 - f) + r1[i] * f + 128) >> 8);
+    }
+}
+
+static void _bilinear(const uint8_t *src, int src_w, int src_h,
+                      uint8_t *dst, int dst_w, int dst_h, int elem, uint8_t *scratch)
+{
+    const int src_stride = src_w * elem;
+    uint8_t *row = scratch;
+    int32_t *x_offset = (int32_t*) (scratch + (((size_t) src_stride + 15) & ~(size_t) 15));
+    int32_t *x_frac = x_offset + dst_w;
+    int i, j, c;
+
+    // column positions are the same for every row
+    for(i = 0; i < dst_w; i++){
+        int pos = _bilinear_pos(i, src_w, dst_w);
+        int x = pos >> 8;
+        int f = pos & 0xFF;
+        if(x >= src_w - 1){
+            x = src_w - 2;
+            f = 256;
+        }
+        x_offset[i] = x * elem;
+        x_frac[i] = f;
+    }
+
+    for(j = 0; j < dst_h; j++){
+        int pos = _bilinear_pos(j, src_h, dst_h);
+        int y = pos >> 8;
+        int f = pos & 0xFF;
+        const uint8_t *s;
+
+        if(y >= src_h - 1){
+            s = src + (size_t) (src_h - 1) * src_stride;
+        } else if(f == 0){
+            s = src + (size_t) y * src_stride;
+        } else {
+            const uint8_t *r0 = src + (size_t) y * src_stride;
+            _blend_rows(r0, r0 + src_stride, row, src_stride, f);
+            s = row;
+        }
+
+        uint8_t *d = dst + (size_t) j * dst_w * elem;
+        for(i = 0; i < dst_w; i++){
+            const uint8_t *p = s + x_offset[i];
+            int w1 = x_frac[i];
+            int w0 = 256 - w1;
+            for(c = 0; c < elem; c++){
+                d[i * elem + c] = (uint8_t) ((p[c] * w0 + p[c + elem] * w1 + 128) >> 8);
+            }
+        }
+    }
+}
+
+
+void frame_scale_plane(const uint8_t *src, int src_w, int src_h,
+                       uint8_t *dst, int dst_w, int dst_h,
+                       int elem, uint8_t *scratch)
+{
+    if(src_w == dst_w && src_h == dst_h){
+        memcpy(dst, src, (size_t) src_w * src_h * elem);
+        return;
+    }
+
+    // box filter whenever the source splits into whole blocks, it's both
+    // cheaper and sharper than bilinear for large ratios
+    if(dst_w <= src_w && dst_h <= src_h &&
+       src_w % dst_w == 0 && src_h % dst_h == 0){
+        int fx = src_w / dst_w;
+        int fy = src_h / dst_h;
+        if(fx == 2 && fy == 2){
+            _box2(src, src_w, dst, dst_w, dst_h, elem);
+        } else {
+            uint32_t *acc = (uint32_t*) (((uintptr_t) scratch + 15) & ~(uintptr_t) 15);
+            _box(src, src_w, dst, dst_w, dst_h, fx, fy, elem, acc);
+        }
+        return;
+    }
+
+    _bilinear(src, src_w, src_h, dst, dst_w, dst_h, elem, scratch);
+}
+
+
+void frame_scale_nv12(const uint8_t *src, int src_w, int src_h,
+                      uint8_t *dst, int dst_w, int dst_h, uint8_t *scratch)
+{
+    frame_scale_plane(src, src_w, src_h, dst, dst_w, dst_h, 1, scratch);
+    frame_scale_plane(src + (size_t) src_w * src_h, src_w / 2, src_h / 2,
+                      dst + (size_t) dst_w * dst_h, dst_w / 2, dst_h / 2, 2, scratch);
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#include <gst/gst.h>
+
+#include "gop_cache.h"
+
+
+void gop_cache_clear(gop_cache_t *cache)
+{
+    cache->n_frames = 0;
+    cache->n_bytes = 0;
+    cache->overflowed = 0;
+}
+
+
+void gop_cache_free(gop_cache_t *cache)
+{
+    gop_cache_clear(cache);
+    g_free(cache->data);
+    cache->data = NULL;
+}
+
+
+void gop_cache_add(gop_cache_t *cache, GstBuffer *buf)
+{
+    gsize size = gst_buffer_get_size(buf);
+
+    if(!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT)){
+        gop_cache_clear(cache);
+    } else if(cache->n_frames == 0 || cache->overflowed){
+        // we never saw the start of this GOP
+        return;
+    }
+
+    if(cache->data == NULL) cache->data = g_try_malloc(GOP_CACHE_MAX_BYTES);
+
+    if(cache->data == NULL ||
+       cache->n_frames >= GOP_CACHE_MAX_FRAMES ||
+       cache->n_bytes + size > GOP_CACHE_MAX_BYTES){
+        gop_cache_clear(cache);
+        cache->overflowed = 1;
+        return;
+    }
+
+    gop_cache_frame_t *frame = &cache->frames[cache->n_frames++];
+    frame->offset = cache->n_bytes;
+    frame->size = gst_buffer_extract(buf, 0, cache->data + cache->n_bytes, size);
+    frame->duration = GST_BUFFER_DURATION(buf);
+    frame->flags = GST_BUFFER_FLAGS(buf);
+    cache->n_bytes += frame->size;
+}
+
+
+int gop_cache_replayable(gop_cache_t *cache)
+{
+    if(cache->overflowed) return 0;
+    return cache->n_frames;
+}
+
+
+GstBuffer *gop_cache_get_frame(gop_cache_t *cache, int i)
+{
+    const gop_cache_frame_t *frame = &cache->frames[i];
+
+    GstBuffer *buf = gst_buffer_new_allocate(NULL, frame->size, NULL);
+    if(buf == NULL) return NULL;
+
+    gst_buffer_fill(buf, 0, cache->data + frame->offset, frame->size);
+    GST_BUFFER_DURATION(buf) = frame->duration;
+    GST_BUFFER_FLAGS(buf) = frame->flags;
+    return buf;
+}
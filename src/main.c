@@ -38,6 +38,7 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <gst/gst.h>
@@ -50,20 +51,46 @@
 #include "context.h"
 #include "pipeline.h"
 #include "configuration.h"
+#include "pipe_reader.h"
+#include "frame_pool.h"
+#include "nal_parser.h"
+#include "frame_convert.h"
+#include "frame_scale.h"
+#include "control.h"
 #include "gst/rtsp/rtsp.h"
 
 #define PROCESS_NAME "voxl-streamer"
-#define PIPE_CH 0
 
-// This is the main data structure for the application. It is passed / shared
-// with other modules as needed.
-static context_data context;
-static int first_client = 0;
-static int first_run = 0;
+// These are the main data structures for the application, one per stream.
+// They are passed / shared with other modules as needed. Stream i reads
+// from pipe channel i.
+static context_data streams[MAX_STREAMS];
+static int n_streams = 1;
 static int is_standalone = 0;
-static int closing_pipe_intentionally = 0;
 static int source_pipe_disconnected = 0;
 
+// Tracks a client from connect until the first keyframe goes out after it
+// starts playing so we can report its time to first frame
+typedef struct client_ttff_t {
+    GstRTSPClient* client;
+    gchar* uri;
+    gint64 connect_us;
+    int playing;
+} client_ttff_t;
+
+// feeder thread that pushes frames from the frame queue into the app source
+#define FEEDER_POLL_TIMEOUT_MS 100
+#define FEEDER_FLOW_WAIT_MS 5
+
+// cached GOP replays fit in at most this long
+#define GOP_REPLAY_MAX_PERIOD_NS (100 * GST_MSECOND)
+
+// how often to print egress stats while there are clients
+#define EGRESS_REPORT_PERIOD_S 10
+
+// warn when adaptive bitrate has had clients but no receiver report for this long
+#define ABR_REPORT_TIMEOUT_S 10
+
 // called whenever we connect or reconnect to the server
 static void _cam_connect_cb(__attribute__((unused)) int ch, __attribute__((unused)) void* context)
 {
@@ -71,33 +98,117 @@ static void _cam_connect_cb(__attribute__((unused)) int ch, __attribute__((unuse
 }
 
 
+// Start riding out a lost source pipe with the RTSP server still up. The
+// main loop reattaches when the pipe comes back. Returns 1 if recovery is
+// in progress, 0 if the caller should fall back to restarting everything.
+static int _start_source_outage(context_data* ctx)
+{
+    if(!ctx->source_recovery) return 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if(!ctx->source_outage){
+        ctx->source_outage = 1;
+        ctx->outage_last_frame_us = ctx->last_frame_us;
+        ctx->outage_filler_frames = 0;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    M_PRINT("Keeping clients connected, waiting for pipe %s to come back\n", ctx->input_pipe_name);
+    return 1;
+}
+
 // called whenever we disconnect from the server
-static void _cam_disconnect_cb(__attribute__((unused)) int ch, __attribute__((unused)) void* context)
+static void _cam_disconnect_cb(__attribute__((unused)) int ch, void* context)
 {
-    if(!closing_pipe_intentionally){
+    context_data* ctx = (context_data*) context;
+
+    if(!ctx->closing_pipe_intentionally){
         M_PRINT("Camera server Disconnected Unintentionally\n");
+        if(_start_source_outage(ctx)) return;
         source_pipe_disconnected = 1;
     }
     else{
         M_PRINT("Camera server Disconnected Intentionally\n");
-        closing_pipe_intentionally = 0;
+        ctx->closing_pipe_intentionally = 0;
     }
 }
 
-// camera helper callback whenever a frame arrives
-static void _cam_helper_cb(int ch,
-                           camera_image_metadata_t meta,
-                           char* frame,
-                           void* context)
+static int _is_encoded(int format)
 {
-    static int dump_meta_data = 1;
-    static int pipe_size = 0;
-    context_data *ctx = (context_data*) context;
-    GstMapInfo info;
-    GstFlowReturn status;
+    return format == IMAGE_FORMAT_H264 || format == IMAGE_FORMAT_H265;
+}
+
+// true if the encoder for this stream runs in our pipeline instead of the
+// camera server
+static int _encodes_itself(context_data* ctx)
+{
+    return ctx->simulcast_parent || !_is_encoded(ctx->input_format);
+}
+
+// Get a reference to the stream header for an encoded format, may be NULL
+static GstBuffer* _get_stream_header(context_data* ctx, int format)
+{
+    GstBuffer* header;
 
+    pthread_mutex_lock(&ctx->lock);
+    header = (format == IMAGE_FORMAT_H265) ? ctx->h265_sps_nal : ctx->h264_sps_nal;
+    if (header) gst_buffer_ref(header);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return header;
+}
+
+// Replace the stream header for an encoded format
+static void _set_stream_header(context_data* ctx, int format, const void* data, size_t size)
+{
+    GstBuffer* header = gst_buffer_new_and_alloc(size);
+    gst_buffer_fill(header, 0, data, size);
+    GST_BUFFER_FLAG_SET(header, GST_BUFFER_FLAG_HEADER);
+
+    pthread_mutex_lock(&ctx->lock);
+    GstBuffer** slot = (format == IMAGE_FORMAT_H265) ? &ctx->h265_sps_nal : &ctx->h264_sps_nal;
+    GstBuffer* old = *slot;
+    *slot = header;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (old) gst_buffer_unref(old);
+}
+
+// Look inside every frame once as it comes off the pipe. For encoded streams
+// this picks up encoder reconfigurations in the camera server so the stream
+// header and caps follow along. Raw frames are all keyframes.
+static void _ingest_parse(camera_image_metadata_t meta, const uint8_t* data,
+                          size_t size, context_data* ctx, nal_au_info_t* au)
+{
+    uint8_t header[NAL_PARAM_SETS_MAX_HEADER];
+
+    if (!_is_encoded(meta.format)) {
+        memset(au, 0, sizeof(*au));
+        au->keyframe = 1;
+        return;
+    }
+
+    nal_parse_au(&ctx->param_sets, data, size, meta.format == IMAGE_FORMAT_H265, au);
+    if (!au->param_sets_changed) return;
+
+    size_t n = nal_param_sets_write(&ctx->param_sets, header, sizeof(header));
+    if (n == 0) return;
+
+    if (ctx->first_run) M_PRINT("Encoder parameter sets changed\n");
+    _set_stream_header(ctx, meta.format, header, n);
+
+    if (meta.width > 0 && meta.height > 0) {
+        pipeline_set_encoded_size(ctx, (uint32_t) meta.width, (uint32_t) meta.height);
+    }
+}
 
-    if (dump_meta_data) {
+// handle the first frame after the pipe opens, makes sure there is a stream
+// header for encoded streams and sanity checks the frame size for raw streams.
+// returns -1 if the streamer should stop
+static int _ingest_first_frame(int ch, camera_image_metadata_t meta,
+                               const char* frame, context_data* ctx)
+{
+    if (!ctx->meta_data_dumped) {
         M_DEBUG("Meta data from incoming frame:\n");
         M_DEBUG("\tmagic_number 0x%X \n", meta.magic_number);
         M_DEBUG("\ttimestamp_ns: %" PRIu64 "\n", meta.timestamp_ns);
@@ -109,128 +220,1284 @@ static void _cam_helper_cb(int ch,
         M_DEBUG("\texposure_ns: %d\n", meta.exposure_ns);
         M_DEBUG("\tgain: %d\n", meta.gain);
         M_DEBUG("\tformat: %d\n", meta.format);
-        dump_meta_data = 0;
-    }
-
-
-    if(first_run == 0){
-        ctx->last_timestamp = (guint64) meta.timestamp_ns;
-
-        if (meta.format == IMAGE_FORMAT_H264) {
-            M_DEBUG("Saving h264 SPS\n");
-            ctx->h264_sps_nal = gst_buffer_new_and_alloc(meta.size_bytes);
-            gst_buffer_map(ctx->h264_sps_nal, &ctx->sps_info, GST_MAP_WRITE);
-            memcpy(ctx->sps_info.data, frame, meta.size_bytes);
-        } else if (meta.format == IMAGE_FORMAT_H265){
-            M_DEBUG("Saving h265 SPS\n");
-            ctx->h265_sps_nal = gst_buffer_new_and_alloc(meta.size_bytes);
-            gst_buffer_map(ctx->h265_sps_nal, &ctx->sps_info, GST_MAP_WRITE);
-            memcpy(ctx->sps_info.data, frame, meta.size_bytes); 
-        }
-        if ( ! main_running) return;
-
-        // Encoded frames can change size dynamically
-        if (meta.format != IMAGE_FORMAT_H264 && meta.format != IMAGE_FORMAT_H265) {
-            if (ctx->input_frame_size != (uint32_t) meta.size_bytes) {
-                M_ERROR("Frame size mismatch: got %d bytes from pipe, expected %d\n",
-                        meta.size_bytes,
-                        ctx->input_frame_size);
-                M_ERROR("Most Likely the publisher of the camera data made a mistake\n");
-                M_ERROR("Shutting down voxl-streamer\n");
-                main_running = 0;
-                return;
+        ctx->meta_data_dumped = 1;
+    }
+
+    ctx->last_timestamp = (guint64) meta.timestamp_ns;
+
+    // The camera server opens encoded streams with a header only frame and
+    // the parameter sets have already been picked out of it. Only if there
+    // weren't any do we fall back to using the whole frame as the header.
+    if (_is_encoded(meta.format)) {
+        GstBuffer* header = _get_stream_header(ctx, meta.format);
+        if (header) {
+            gst_buffer_unref(header);
+        } else {
+            M_WARN("No parameter sets in the first frame, using it as the stream header\n");
+            _set_stream_header(ctx, meta.format, frame, meta.size_bytes);
+        }
+    }
+    if ( ! main_running) return -1;
+
+    // Encoded frames can change size dynamically
+    if (meta.format != IMAGE_FORMAT_H264 && meta.format != IMAGE_FORMAT_H265) {
+        if (ctx->input_frame_size != (uint32_t) meta.size_bytes) {
+            M_ERROR("Frame size mismatch: got %d bytes from pipe, expected %d\n",
+                    meta.size_bytes,
+                    ctx->input_frame_size);
+            M_ERROR("Most Likely the publisher of the camera data made a mistake\n");
+            M_ERROR("Shutting down voxl-streamer\n");
+            main_running = 0;
+            return -1;
+        }
+    }
+
+    // fetch the pipe size on first run to compare with later, renditions
+    // don't have a pipe to back up
+    ctx->source_pipe_size = ctx->simulcast_parent ? 0 : pipe_client_get_pipe_size(ch);
+    ctx->first_run = 1;
+
+    return 0;
+}
+
+// decide if the next frame from the pipe should go into the pipeline
+static int _ingest_want_frame(context_data* ctx)
+{
+    // The feeding flag is set once the pipeline first asks for data.
+    // Backpressure after that is handled by the feeder thread. In standby
+    // encoded frames still go through to keep the GOP cache current.
+    if (! ctx->feeding) return ctx->standby && _is_encoded(ctx->input_format);
+
+    ctx->input_frame_number++;
+
+    // adaptive bitrate can take the frame rate of raw streams down further
+    uint32_t decimator = ctx->output_frame_decimator;
+    if (ctx->abr_enable && !_is_encoded(ctx->input_format)) decimator *= ctx->rate_control.decimator;
+
+    if (ctx->input_frame_number % decimator) return 0;
+
+    return 1;
+}
+
+static backlog_recovery_t _effective_backlog_recovery(context_data* ctx)
+{
+    if(!_is_encoded(ctx->input_format)) return BACKLOG_RECOVERY_FLUSH;
+    if(ctx->backlog_recovery == BACKLOG_RECOVERY_AUTO) return BACKLOG_RECOVERY_SKIP_TO_IDR;
+    return ctx->backlog_recovery;
+}
+
+// While recovering from a backed up pipe, decide if this frame gets thrown
+// away. Frames are dropped before they are copied anywhere so the reader
+// can race through the backlog and catch up to live.
+static int _backlog_drop_frame(context_data* ctx, const nal_au_info_t* au)
+{
+    switch(ctx->backlog_state){
+        case BACKLOG_STATE_OK:
+            return 0;
+        case BACKLOG_STATE_DROP_NON_REF:
+            if(!au->droppable) return 0;
+            break;
+        case BACKLOG_STATE_SKIP_TO_IDR:
+            if(au->keyframe){
+                M_DEBUG("resuming at keyframe after skipping %u frames\n",
+                        ctx->backlog_frames_skipped);
+                ctx->backlog_state = BACKLOG_STATE_OK;
+                ctx->backlog_resync = 1;
+                return 0;
             }
+            break;
+    }
+
+    ctx->backlog_frames_skipped++;
+    return 1;
+}
+
+// check if we are filling up and start recovering if so
+static void _check_backlog(int ch, context_data* ctx)
+{
+    if(ctx->source_pipe_size <= 0) return;
+
+    int bytes = pipe_client_bytes_in_pipe(ch);
+    backlog_recovery_t recovery = _effective_backlog_recovery(ctx);
+
+    if(bytes > (ctx->source_pipe_size/2)){
+        if(recovery == BACKLOG_RECOVERY_FLUSH){
+            M_WARN("source pipe getting backed up, flushing\n");
+            pipe_client_flush(ch);
+        } else if(ctx->backlog_state == BACKLOG_STATE_OK){
+            if(recovery == BACKLOG_RECOVERY_DROP_NON_REF){
+                M_WARN("source pipe getting backed up, dropping non-reference frames\n");
+                ctx->backlog_state = BACKLOG_STATE_DROP_NON_REF;
+            } else {
+                M_WARN("source pipe getting backed up, skipping to next keyframe\n");
+                ctx->backlog_state = BACKLOG_STATE_SKIP_TO_IDR;
+            }
+        } else if(ctx->backlog_state == BACKLOG_STATE_DROP_NON_REF &&
+                  bytes > (ctx->source_pipe_size*3/4)){
+            // not enough droppable frames to keep up, give up on this GOP
+            M_WARN("source pipe still backing up, skipping to next keyframe\n");
+            ctx->backlog_state = BACKLOG_STATE_SKIP_TO_IDR;
         }
+    } else if(ctx->backlog_state == BACKLOG_STATE_DROP_NON_REF &&
+              bytes < (ctx->source_pipe_size/4)){
+        ctx->backlog_state = BACKLOG_STATE_OK;
+    }
+}
 
-        // fetch the pipe size on first run to compare with later
-        pipe_size = pipe_client_get_pipe_size(ch);
+// The feeder fell behind and the queue threw a frame away. Raw frames stand
+// on their own, but every encoded frame after a lost one references it, so
+// drop the rest of the GOP and start again with the header at the next
+// keyframe, same as backlog recovery does.
+static void _ingest_queue_full(context_data* ctx, int format)
+{
+    if (!_is_encoded(format)) return;
+
+    if (ctx->backlog_state != BACKLOG_STATE_SKIP_TO_IDR) {
+        M_WARN("frame queue full, skipping to next keyframe\n");
+        ctx->backlog_state = BACKLOG_STATE_SKIP_TO_IDR;
     }
-    first_run = 1;
+}
+
+// queue the saved parameter sets so the decoder can start from the next frame
+static int _ingest_enqueue_header(context_data* ctx, int format)
+{
+    if (!_is_encoded(format)) return 0;
+
+    GstBuffer* header = _get_stream_header(ctx, format);
+    if (header && frame_queue_push(&ctx->frame_queue, header) < 0) return -1;
+    return 0;
+}
+
+// hand a filled buffer off to the feeder thread. Takes ownership of the
+// buffer. This runs on the pipe reader thread so it must not block on
+// gstreamer, the feeder does the timestamping and pushing.
+static void _ingest_enqueue_frame(int ch, camera_image_metadata_t meta,
+                                  GstBuffer* gst_buffer, const nal_au_info_t* au,
+                                  context_data* ctx)
+{
+    // The first frame out, and the first one after skipping part of the
+    // stream, needs the header in front of it
+    if (ctx->input_frame_number == 1 || ctx->backlog_resync) {
+        ctx->backlog_resync = 0;
+        if (_ingest_enqueue_header(ctx, meta.format)) {
+            // no point sending a keyframe the decoder can't start from
+            gst_buffer_unref(gst_buffer);
+            _ingest_queue_full(ctx, meta.format);
+            ctx->backlog_frames_skipped++;
+            return;
+        }
+    }
+
+    // mark frames that can't be decoded on their own so the feeder knows
+    // where it can safely resume after dropping
+    if (!au->keyframe) GST_BUFFER_FLAG_SET(gst_buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    // carry the raw pipe timestamp along, the feeder makes it relative
+    GST_BUFFER_PTS(gst_buffer) = (guint64) meta.timestamp_ns;
+    if (frame_queue_push(&ctx->frame_queue, gst_buffer) < 0) {
+        _ingest_queue_full(ctx, meta.format);
+    }
+
+    _check_backlog(ch, ctx);
+
+    return;
+}
+
+// Print the time to first frame for every playing client that was waiting
+// on a keyframe
+static void _report_first_frame(context_data* ctx)
+{
+    gint64 now_us = g_get_monotonic_time();
+
+    pthread_mutex_lock(&ctx->lock);
+    GList* l = ctx->pending_clients;
+    while(l){
+        GList* next = l->next;
+        client_ttff_t* c = (client_ttff_t*) l->data;
+        if(c->playing){
+            M_PRINT("client %s time to first frame: %.1f ms\n",
+                    c->uri ? c->uri : "unknown",
+                    (now_us - c->connect_us) / 1000.0);
+            g_free(c->uri);
+            g_free(c);
+            ctx->pending_clients = g_list_delete_link(ctx->pending_clients, l);
+        }
+        l = next;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Push the cached GOP so a client that just started playing can decode
+// right away. The replay is squeezed in between the last frame that went
+// out and the next one so timestamps stay monotonic for everyone else.
+static void _replay_gop(context_data* ctx)
+{
+    GstFlowReturn status;
+    gop_cache_t* cache = &ctx->gop_cache;
+    int i, n = gop_cache_replayable(cache);
+
+    if(n == 0) return;
+
+    pthread_mutex_lock(&ctx->lock);
+    if(ctx->initial_timestamp == 0){
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    GstClockTime base = ctx->last_timestamp - ctx->initial_timestamp;
+    pthread_mutex_unlock(&ctx->lock);
+
+    GstClockTime period = cache->frames[n-1].duration;
+    if(!GST_CLOCK_TIME_IS_VALID(period) || period == 0 || period > GOP_REPLAY_MAX_PERIOD_NS){
+        period = GOP_REPLAY_MAX_PERIOD_NS;
+    }
+    GstClockTime step = period / (n + 1);
+    if(step == 0) step = 1;
+
+    GstBuffer* header = _get_stream_header(ctx, ctx->input_format);
+    if(header){
+        g_signal_emit_by_name(ctx->app_source, "push-buffer", header, &status);
+        gst_buffer_unref(header);
+    }
+
+    for(i = 0; i < n; i++){
+        GstBuffer* copy = gop_cache_get_frame(cache, i);
+        if(copy == NULL){
+            M_WARN("GOP replay stopped after %d of %d frames, out of memory\n", i, n);
+            return;
+        }
+        GST_BUFFER_PTS(copy) = base + step * (i + 1);
+        GST_BUFFER_DURATION(copy) = step;
+        g_signal_emit_by_name(ctx->app_source, "push-buffer", copy, &status);
+        gst_buffer_unref(copy);
+        if(status != GST_FLOW_OK){
+            M_WARN("GOP replay stopped after %d of %d frames, status = %d\n", i, n, status);
+            return;
+        }
+    }
+
+    M_DEBUG("replayed %d cached frames\n", n);
+    _report_first_frame(ctx);
+}
+
+static guint64 _frame_period_ns(context_data* ctx)
+{
+    if (ctx->input_frame_rate == 0) return 33 * GST_MSECOND;
+    return GST_SECOND / ctx->input_frame_rate;
+}
+
+// timestamp a buffer from the frame queue and push it into the app source.
+// Takes ownership of the buffer.
+static void _feed_buffer(context_data* ctx, GstBuffer* gst_buffer)
+{
+    GstFlowReturn status;
+
+    if (GST_BUFFER_FLAG_IS_SET(gst_buffer, GST_BUFFER_FLAG_HEADER)) {
+        // Signal that the header
+        g_signal_emit_by_name(ctx->app_source, "push-buffer", gst_buffer, &status);
+        gst_buffer_unref(gst_buffer);
+        if (status == GST_FLOW_OK) {
+            M_DEBUG("SPS accepted\n");
+        } else {
+            M_ERROR("SPS rejected\n");
+            raise(2);
+        }
+        return;
+    }
+
+    guint64 timestamp_ns = GST_BUFFER_PTS(gst_buffer);
+    pthread_mutex_lock(&ctx->lock);
+
+    // To get minimal latency make sure to set this to the timestamp of
+    // the very first frame that we will be sending through the pipeline.
+    if (ctx->initial_timestamp == 0) ctx->initial_timestamp = timestamp_ns;
+
+    // The pipeline was paused during warm standby, pick the timeline up
+    // one frame after where it stopped instead of jumping over the gap
+    if (ctx->standby_resume) {
+        guint64 period = _frame_period_ns(ctx);
+        ctx->initial_timestamp += timestamp_ns - ctx->last_timestamp - period;
+        ctx->last_timestamp = timestamp_ns - period;
+        ctx->standby_resume = 0;
+    }
+
+    // Do the timestamp calculations.
+    // It is very important to set these up accurately.
+    // Otherwise, the stream can look bad or just not work at all.
+    // TODO: Experiment with taking some time off of pts???
+    GST_BUFFER_TIMESTAMP(gst_buffer) = timestamp_ns - ctx->initial_timestamp;
+    GST_BUFFER_DURATION(gst_buffer) = timestamp_ns - ctx->last_timestamp;
+    ctx->last_timestamp = timestamp_ns;
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    ctx->output_frame_number++;
+
+    // Signal that the frame is ready for use
+    g_signal_emit_by_name(ctx->app_source, "push-buffer", gst_buffer, &status);
+    if (status == GST_FLOW_OK) {
+        M_VERBOSE("Frame %d accepted\n", ctx->output_frame_number);
+        if (_is_encoded(ctx->input_format)) {
+            if (ctx->gop_replay != GOP_REPLAY_OFF) gop_cache_add(&ctx->gop_cache, gst_buffer);
+        } else if (ctx->source_recovery && ctx->last_frame != gst_buffer) {
+            // keep it around to repeat if the source goes away
+            if (ctx->last_frame) gst_buffer_unref(ctx->last_frame);
+            ctx->last_frame = gst_buffer_ref(gst_buffer);
+        }
+        if (!GST_BUFFER_FLAG_IS_SET(gst_buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            _report_first_frame(ctx);
+        }
+    } else if (status == GST_FLOW_FLUSHING || status == GST_FLOW_EOS) {
+        // The pipeline is stopping or restarting, hold off until the app
+        // source asks for data again
+        M_DEBUG("App source not accepting frames, status = %d\n", status);
+        atomic_fetch_add(&ctx->frame_queue.dropped, 1);
+        ctx->need_data = 0;
+    } else {
+        atomic_fetch_add(&ctx->frame_queue.dropped, 1);
+        M_ERROR("New frame rejected, status = %d\n", status);
+    }
+
+    // Release the buffer so that we don't have a memory leak
+    gst_buffer_unref(gst_buffer);
+}
+
+static void _drop_buffer(context_data* ctx, GstBuffer* buf)
+{
+    atomic_fetch_add(&ctx->frame_queue.dropped, 1);
+    gst_buffer_unref(buf);
+}
+
+// wait a little while for the app source to ask for more data
+static void _wait_for_need_data(context_data* ctx, int timeout_ms)
+{
+    struct timespec deadline;
+
+    // flow_cond runs on the monotonic clock, see main()
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += timeout_ms * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ctx->flow_lock);
+    while(!ctx->need_data && ctx->feeder_running){
+        if(pthread_cond_timedwait(&ctx->flow_cond, &ctx->flow_lock, &deadline)) break;
+    }
+    pthread_mutex_unlock(&ctx->flow_lock);
+}
+
+static drop_policy_t _effective_drop_policy(context_data* ctx)
+{
+    if(ctx->drop_policy != DROP_POLICY_AUTO) return ctx->drop_policy;
+
+    if(ctx->input_format == IMAGE_FORMAT_H264 ||
+       ctx->input_format == IMAGE_FORMAT_H265) return DROP_POLICY_KEYFRAME;
+    return DROP_POLICY_OLDEST;
+}
+
+// Repeat the last raw frame while the source pipe is gone so the encoder
+// keeps producing and clients see a frozen picture. Encoded frames can't be
+// repeated without corrupting the decoder so those streams just pause.
+static void _feed_filler(context_data* ctx)
+{
+    if(!ctx->need_data || ctx->last_frame == NULL) return;
+
+    GstBuffer* filler = gst_buffer_copy(ctx->last_frame);
+    GST_BUFFER_PTS(filler) = ctx->last_timestamp + FEEDER_POLL_TIMEOUT_MS * GST_MSECOND;
+    _feed_buffer(ctx, filler);
+    ctx->outage_filler_frames++;
+}
+
+// Called after every real frame goes out, reports how long clients went
+// without one if we just recovered from losing the source
+static void _frame_delivered(context_data* ctx)
+{
+    gint64 now_us = g_get_monotonic_time();
+    gint64 outage_us = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    if(!ctx->source_outage && ctx->outage_last_frame_us){
+        outage_us = now_us - ctx->outage_last_frame_us;
+        ctx->outage_last_frame_us = 0;
+    }
+    ctx->last_frame_us = now_us;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if(outage_us){
+        M_PRINT("Source outage over, clients went %.2f s without a new frame (%u repeated)\n",
+                outage_us / 1000000.0, ctx->outage_filler_frames);
+    }
+}
+
+// size of the input frames once they're rotated, before any scaling
+static void _rotated_input_size(context_data* ctx, uint32_t* width, uint32_t* height)
+{
+    if(ctx->output_stream_rotation == 90 || ctx->output_stream_rotation == 270){
+        *width = ctx->input_frame_height;
+        *height = ctx->input_frame_width;
+    } else {
+        *width = ctx->input_frame_width;
+        *height = ctx->input_frame_height;
+    }
+}
+
+// Scale the output of raw streams to output-width/height or output-scale
+static int _apply_output_size(context_data* ctx)
+{
+    uint64_t width = ctx->output_stream_width;
+    uint64_t height = ctx->output_stream_height;
+
+    if(ctx->output_resize_width && ctx->output_resize_height){
+        width = ctx->output_resize_width;
+        height = ctx->output_resize_height;
+    } else if(ctx->output_resize_width){
+        height = height * ctx->output_resize_width / width;
+        width = ctx->output_resize_width;
+    } else if(ctx->output_resize_height){
+        width = width * ctx->output_resize_height / height;
+        height = ctx->output_resize_height;
+    } else if(ctx->output_scale > 0.0 && ctx->output_scale != 1.0){
+        width = (uint64_t) (width * ctx->output_scale + 0.5);
+        height = (uint64_t) (height * ctx->output_scale + 0.5);
+    }
+
+    // NV12 needs even sizes
+    width &= ~1ull;
+    height &= ~1ull;
+    if(width < 2 || height < 2 || width > 16384 || height > 16384){
+        M_ERROR("Invalid output size %" PRIu64 "x%" PRIu64 "\n", width, height);
+        return -1;
+    }
+
+    if(width != ctx->output_stream_width || height != ctx->output_stream_height){
+        M_PRINT("Scaling output from %ux%u to %" PRIu64 "x%" PRIu64 "\n",
+                ctx->output_stream_width, ctx->output_stream_height, width, height);
+    }
+    ctx->output_stream_width = width;
+    ctx->output_stream_height = height;
+    return 0;
+}
+
+// Convert a raw frame to rotated NV12 for the encoder, see fused-convert.
+// Takes ownership of the buffer, returns NULL if the frame is short.
+static GstBuffer* _convert_frame(context_data* ctx, GstBuffer* buf)
+{
+    GstMapInfo in, out;
+    gsize out_size = ctx->output_stream_width * ctx->output_stream_height * 3 / 2;
+
+    if(!gst_buffer_map(buf, &in, GST_MAP_READ)) {
+        gst_buffer_unref(buf);
+        return NULL;
+    }
+    if(in.size < ctx->input_frame_size) {
+        M_ERROR("Frame is %zu bytes, expected %u\n", in.size, ctx->input_frame_size);
+        gst_buffer_unmap(buf, &in);
+        gst_buffer_unref(buf);
+        return NULL;
+    }
+
+    gint64 start_us = g_get_monotonic_time();
+    const uint8_t* src = in.data;
+    int format = ctx->input_format;
+
+    // RAW16 goes down to GRAY8 first and carries on from there
+    if(format == IMAGE_FORMAT_RAW16){
+        tone_map_gray8(&ctx->tone_map, src, ctx->tone_mapped,
+                       ctx->input_frame_width, ctx->input_frame_height);
+        src = ctx->tone_mapped;
+        format = IMAGE_FORMAT_RAW8;
+    }
+
+    GstBuffer* converted = frame_pool_acquire(ctx, out_size);
+    if(converted == NULL || !gst_buffer_map(converted, &out, GST_MAP_WRITE)){
+        M_ERROR("Couldn't get a buffer for the converted frame\n");
+        if(converted) gst_buffer_unref(converted);
+        gst_buffer_unmap(buf, &in);
+        gst_buffer_unref(buf);
+        return NULL;
+    }
+    if(ctx->convert_full){
+        // scaled output, convert at full size and then scale into place
+        uint32_t width, height;
+        _rotated_input_size(ctx, &width, &height);
+        frame_convert_nv12(src, format,
+                           ctx->input_frame_width, ctx->input_frame_height,
+                           ctx->output_stream_rotation, ctx->convert_full, ctx->convert_band);
+        frame_scale_nv12(ctx->convert_full, width, height, out.data,
+                         ctx->output_stream_width, ctx->output_stream_height,
+                         ctx->scale_scratch);
+    } else {
+        frame_convert_nv12(src, format,
+                           ctx->input_frame_width, ctx->input_frame_height,
+                           ctx->output_stream_rotation, out.data, ctx->convert_band);
+    }
+    gst_buffer_unmap(converted, &out);
+    gst_buffer_unmap(buf, &in);
+
+    ctx->convert_frames++;
+    ctx->convert_time_us += g_get_monotonic_time() - start_us;
+
+    GST_BUFFER_PTS(converted) = GST_BUFFER_PTS(buf);
+    gst_buffer_unref(buf);
+    return converted;
+}
+
+static void _free_convert_buffers(context_data* ctx)
+{
+    free(ctx->convert_band);
+    free(ctx->convert_full);
+    free(ctx->scale_scratch);
+    free(ctx->tone_mapped);
+    ctx->convert_band = NULL;
+    ctx->convert_full = NULL;
+    ctx->scale_scratch = NULL;
+    ctx->tone_mapped = NULL;
+    tone_map_deinit(&ctx->tone_map);
+}
+
+// Buffers to convert at full size into and scale from, for the current
+// output size. Both stay NULL when the output isn't scaled.
+static int _alloc_scale_buffers(context_data* ctx, uint8_t** full, uint8_t** scratch)
+{
+    uint32_t width, height;
+
+    *full = NULL;
+    *scratch = NULL;
+
+    _rotated_input_size(ctx, &width, &height);
+    if(width == ctx->output_stream_width && height == ctx->output_stream_height) return 0;
+
+    *full = malloc((size_t) width * height * 3 / 2);
+    *scratch = malloc(frame_scale_scratch_size(width, ctx->output_stream_width));
+    if(!*full || !*scratch){
+        free(*full);
+        free(*scratch);
+        *full = NULL;
+        *scratch = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int _alloc_convert_buffers(context_data* ctx)
+{
+    ctx->convert_band = malloc(frame_convert_band_size(ctx->input_frame_width));
+    if(!ctx->convert_band) return -1;
+
+    if(ctx->input_format == IMAGE_FORMAT_RAW16){
+        if(tone_map_init(&ctx->tone_map, ctx->raw16_tone_map, ctx->raw16_min,
+                         ctx->raw16_max, ctx->raw16_gamma)) return -1;
+        ctx->tone_mapped = malloc((size_t) ctx->input_frame_width * ctx->input_frame_height);
+        if(!ctx->tone_mapped) return -1;
+    }
+
+    return _alloc_scale_buffers(ctx, &ctx->convert_full, &ctx->scale_scratch);
+}
+
+// Change the output size of a raw stream, see set_resolution. With
+// resize_buffers the scale buffers are replaced to match, only safe from the
+// feeder thread or while it isn't running. Nothing changes on failure.
+static int _resize_output(context_data* ctx, uint32_t width, uint32_t height, int resize_buffers)
+{
+    uint32_t old_width = ctx->output_stream_width;
+    uint32_t old_height = ctx->output_stream_height;
+    uint32_t old_resize_width = ctx->output_resize_width;
+    uint32_t old_resize_height = ctx->output_resize_height;
+    uint8_t *full = NULL, *scratch = NULL;
+
+    // kept in the config fields so the size survives a restart
+    ctx->output_resize_width = width;
+    ctx->output_resize_height = height;
+    _rotated_input_size(ctx, &ctx->output_stream_width, &ctx->output_stream_height);
+    if(_apply_output_size(ctx)) goto fail;
+
+    if(resize_buffers && ctx->fused_convert){
+        if(_alloc_scale_buffers(ctx, &full, &scratch)){
+            M_ERROR("Couldn't allocate scale buffers for %ux%u\n", width, height);
+            goto fail;
+        }
+        free(ctx->convert_full);
+        free(ctx->scale_scratch);
+        ctx->convert_full = full;
+        ctx->scale_scratch = scratch;
+    }
+    return 0;
+
+fail:
+    ctx->output_stream_width = old_width;
+    ctx->output_stream_height = old_height;
+    ctx->output_resize_width = old_resize_width;
+    ctx->output_resize_height = old_resize_height;
+    return -1;
+}
+
+// Change the frame rate of a raw stream, see set_decimator
+static void _set_decimator(context_data* ctx, uint32_t decimator)
+{
+    ctx->output_frame_decimator = decimator;
+    ctx->input_frame_rate = ctx->source_frame_rate / decimator;
+    if(ctx->input_frame_rate < 1) ctx->input_frame_rate = 1;
+    ctx->output_frame_rate = ctx->input_frame_rate;
+}
+
+// Carry out a size or frame rate change from the control pipe. Done in the
+// feeder so the conversion buffers and the new caps line up with the
+// frames going out.
+static void _apply_reconfigure(context_data* ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t width = ctx->reconfigure_width;
+    uint32_t height = ctx->reconfigure_height;
+    uint32_t decimator = ctx->reconfigure_decimator;
+    ctx->reconfigure_width = 0;
+    ctx->reconfigure_height = 0;
+    ctx->reconfigure_decimator = 0;
+    ctx->reconfigure_pending = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    int changed = 0;
+    if(decimator){
+        _set_decimator(ctx, decimator);
+        M_PRINT("%s now at %d fps\n", ctx->mount_point, ctx->input_frame_rate);
+        changed = 1;
+    }
+    if(width && _resize_output(ctx, width, height, 1) == 0) changed = 1;
+
+    if(!changed) return;
+
+    // the saved frame is the old size, repeating it under the new caps
+    // would hand the encoder a frame that doesn't match them
+    if(ctx->last_frame){
+        gst_buffer_unref(ctx->last_frame);
+        ctx->last_frame = NULL;
+    }
+    pipeline_update_raw_caps(ctx);
+}
+
+// Feeder thread, moves frames from the frame queue into gstreamer so a slow
+// pipeline never holds up the pipe reader. When the app source is full the
+// drop policy decides which frames get thrown away.
+static void* _feeder_thread_func(void* arg)
+{
+    context_data* ctx = (context_data*) arg;
+    drop_policy_t policy = _effective_drop_policy(ctx);
+    int skip_to_keyframe = 0;
+    GstBuffer* buf = NULL;
+
+    while(ctx->feeder_running){
+        if(!buf) buf = frame_queue_pop(&ctx->frame_queue, FEEDER_POLL_TIMEOUT_MS);
+        if(!buf){
+            if(ctx->source_outage) _feed_filler(ctx);
+            continue;
+        }
+
+        // nobody is watching, just keep the GOP cache current for the next
+        // client. The header is resent when feeding starts again.
+        if(ctx->standby){
+            if(!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER) &&
+               ctx->gop_replay != GOP_REPLAY_OFF){
+                gop_cache_add(&ctx->gop_cache, buf);
+            }
+            gst_buffer_unref(buf);
+            buf = NULL;
+            continue;
+        }
+
+        // headers always go through, everything else has to wait its turn
+        if(GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER)){
+            _feed_buffer(ctx, buf);
+            buf = NULL;
+            continue;
+        }
+
+        // once a frame of a GOP is gone the rest of it can't be decoded
+        if(skip_to_keyframe){
+            if(GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT)){
+                _drop_buffer(ctx, buf);
+                buf = NULL;
+                continue;
+            }
+            skip_to_keyframe = 0;
+        }
+
+        if(!ctx->need_data){
+            // drop-newest holds on to this frame and lets the queue fill up
+            // behind it, the others give it up as soon as something newer
+            // is waiting
+            if(policy != DROP_POLICY_NEWEST && frame_queue_count(&ctx->frame_queue) > 0){
+                if(policy == DROP_POLICY_KEYFRAME) skip_to_keyframe = 1;
+                _drop_buffer(ctx, buf);
+                buf = NULL;
+                continue;
+            }
+            _wait_for_need_data(ctx, FEEDER_FLOW_WAIT_MS);
+            continue;
+        }
+
+        // catch up a client that just started playing, unless this frame
+        // already gives it a fresh start
+        if(atomic_exchange(&ctx->gop_replay_pending, 0) &&
+           GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT)){
+            _replay_gop(ctx);
+        }
+
+        if(atomic_load(&ctx->reconfigure_pending)) _apply_reconfigure(ctx);
+
+        // done here rather than on the pipe thread so it only costs
+        // anything for frames that are actually going out
+        if(ctx->fused_convert){
+            buf = _convert_frame(ctx, buf);
+            if(!buf) continue;
+        }
+
+        _feed_buffer(ctx, buf);
+        buf = NULL;
+        _frame_delivered(ctx);
+    }
+
+    if(buf) gst_buffer_unref(buf);
+    return NULL;
+}
+
+static int _start_feeder(context_data* ctx)
+{
+    // encoded frames depend on each other so they can't be overwritten
+    frame_queue_mode_t mode = FRAME_QUEUE_MAILBOX;
+    if(ctx->input_format == IMAGE_FORMAT_H264 ||
+       ctx->input_format == IMAGE_FORMAT_H265) mode = FRAME_QUEUE_FIFO;
+
+    if(frame_queue_init(&ctx->frame_queue, mode, ctx->frame_queue_depth)) return -1;
+
+    if(ctx->fused_convert && _alloc_convert_buffers(ctx)){
+        M_ERROR("failed to allocate conversion buffers\n");
+        _free_convert_buffers(ctx);
+        frame_queue_deinit(&ctx->frame_queue);
+        return -1;
+    }
+
+    ctx->feeder_running = 1;
+    if(pthread_create(&ctx->feeder_thread, NULL, _feeder_thread_func, ctx)){
+        M_ERROR("failed to start feeder thread\n");
+        ctx->feeder_running = 0;
+        frame_queue_deinit(&ctx->frame_queue);
+        _free_convert_buffers(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+static void _stop_feeder(context_data* ctx)
+{
+    if(!ctx->feeder_running) return;
+
+    ctx->feeder_running = 0;
+    pthread_join(ctx->feeder_thread, NULL);
+    frame_queue_deinit(&ctx->frame_queue);
+    _free_convert_buffers(ctx);
+}
+
+// camera helper callback whenever a frame arrives
+static void _cam_helper_cb(int ch,
+                           camera_image_metadata_t meta,
+                           char* frame,
+                           void* context)
+{
+    context_data *ctx = (context_data*) context;
+    GstMapInfo info;
+    nal_au_info_t au;
+
+    _ingest_parse(meta, (const uint8_t*)frame, meta.size_bytes, ctx, &au);
+
+    if(ctx->first_run == 0){
+        if(_ingest_first_frame(ch, meta, frame, ctx)) return;
+    }
+
+    if(_backlog_drop_frame(ctx, &au)) return;
+
+    if(!_ingest_want_frame(ctx)) return;
+
+    gint64 start_us = g_get_monotonic_time();
+
+    // Grab a gstreamer buffer to hold the frame data. The helper owns
+    // frame and reuses it for the next read so it has to be copied out here,
+    // use zero-copy-ingest in the config file to skip this copy.
+    GstBuffer *gst_buffer = frame_pool_acquire(ctx, meta.size_bytes);
+    if (gst_buffer == NULL || !gst_buffer_map(gst_buffer, &info, GST_MAP_WRITE)) {
+        M_ERROR("Couldn't get a buffer for the frame\n");
+        if (gst_buffer) gst_buffer_unref(gst_buffer);
+        main_running = 0;
+        return;
+    }
+
+    if (info.size < (uint32_t) meta.size_bytes) {
+        M_ERROR("Not enough memory for the frame buffer\n");
+        gst_buffer_unmap(gst_buffer, &info);
+        gst_buffer_unref(gst_buffer);
+        main_running = 0;
+        return;
+    }
+
+    memcpy(info.data, frame, meta.size_bytes);
+    gst_buffer_unmap(gst_buffer, &info);
+
+    ctx->ingest_frames++;
+    ctx->ingest_bytes_copied += meta.size_bytes;
+    ctx->ingest_time_us += g_get_monotonic_time() - start_us;
+
+    _ingest_enqueue_frame(ch, meta, gst_buffer, &au, ctx);
+
+    return;
+}
+
+// direct pipe reader asking where to put the next frame
+static GstBuffer* _direct_alloc_cb(int ch, camera_image_metadata_t meta, void* context)
+{
+    context_data *ctx = (context_data*) context;
+
+    // Unwanted raw frames can be skipped without reading them. Encoded ones
+    // are always read in so _direct_frame_cb parses them like the copy path
+    // does and keeps the parameter sets current. The first frame is always
+    // needed for the SPS.
+    if(ctx->first_run != 0 && !_is_encoded(meta.format) && !_ingest_want_frame(ctx)) return NULL;
+
+    return frame_pool_acquire(ctx, meta.size_bytes);
+}
+
+// direct pipe reader callback, the frame is already in a gstreamer buffer
+static void _direct_frame_cb(int ch, camera_image_metadata_t meta, GstBuffer* buf, void* context)
+{
+    context_data *ctx = (context_data*) context;
+    GstMapInfo info;
+    nal_au_info_t au;
+    int ret = 0;
+
+    gst_buffer_map(buf, &info, GST_MAP_READ);
+    _ingest_parse(meta, info.data, info.size, ctx, &au);
+    if(ctx->first_run == 0){
+        ret = _ingest_first_frame(ch, meta, (const char*)info.data, ctx);
+        if(ret == 0 && !_ingest_want_frame(ctx)) ret = -1;
+    } else if(_is_encoded(meta.format) && !_ingest_want_frame(ctx)){
+        // raw frames were already decided on in _direct_alloc_cb
+        ret = -1;
+    }
+    gst_buffer_unmap(buf, &info);
+
+    if(ret || _backlog_drop_frame(ctx, &au)){
+        gst_buffer_unref(buf);
+        return;
+    }
+
+    ctx->ingest_frames++;
+
+    _ingest_enqueue_frame(ch, meta, buf, &au, ctx);
+
+    return;
+}
+
+// encoded frame from a rendition's branch of a simulcast pipeline
+static void _simulcast_frame_cb(int ch, camera_image_metadata_t meta, GstBuffer* buf, void* context)
+{
+    context_data *ctx = (context_data*) context;
+    GstMapInfo info;
+    nal_au_info_t au;
+    int ret = 0;
+
+    pthread_mutex_lock(&ctx->simulcast_lock);
+
+    // parse every frame, a rendition can get its first client long after
+    // the shared encoders started and needs the parameter sets by then
+    gst_buffer_map(buf, &info, GST_MAP_READ);
+    _ingest_parse(meta, info.data, info.size, ctx, &au);
+    if(!ctx->simulcast_active){
+        ret = -1;
+    } else if(ctx->first_run == 0){
+        ret = _ingest_first_frame(ch, meta, (const char*)info.data, ctx);
+    }
+    gst_buffer_unmap(buf, &info);
+
+    if(ret || !_ingest_want_frame(ctx) || _backlog_drop_frame(ctx, &au)){
+        gst_buffer_unref(buf);
+    } else {
+        ctx->ingest_frames++;
+        _ingest_enqueue_frame(ch, meta, buf, &au, ctx);
+    }
+
+    pthread_mutex_unlock(&ctx->simulcast_lock);
+}
+
+// direct pipe reader hit the end of the pipe
+static void _direct_disconnect_cb(int ch, void* context)
+{
+    _cam_disconnect_cb(ch, context);
+}
+
+static int _open_pipe(context_data* ctx);
+static int _open_rendition(context_data* ctx);
+static void _close_rendition(context_data* ctx);
+static void _close_source_pipe(context_data* ctx);
+
+// open the source pipe with either the camera helper or the direct reader,
+// anything started along the way is stopped again if it fails
+static int _open_source_pipe(context_data* ctx)
+{
+    if(ctx->simulcast_parent) return _open_rendition(ctx);
+
+    pipe_client_set_connect_cb(ctx->pipe_ch, _cam_connect_cb, NULL);
+    pipe_client_set_disconnect_cb(ctx->pipe_ch, _cam_disconnect_cb, ctx);
+
+    // not fatal, frames just come from the heap without a pool
+    if(frame_pool_create(ctx)){
+        M_WARN("failed to create frame pool, continuing without one\n");
+    }
+
+    ctx->backlog_state = BACKLOG_STATE_OK;
+    ctx->backlog_resync = 0;
+    memset(&ctx->param_sets, 0, sizeof(ctx->param_sets));
+
+    if(_start_feeder(ctx) || _open_pipe(ctx)){
+        ctx->closing_pipe_intentionally = 1;
+        _close_source_pipe(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+// subscribe to the source pipe with either the camera helper or the direct
+// reader. Reconnecting is left to us so we get a chance to check the pipe.
+static int _open_pipe(context_data* ctx)
+{
+    if(!ctx->zero_copy_ingest){
+        pipe_client_set_camera_helper_cb(ctx->pipe_ch, _cam_helper_cb, ctx);
+        return pipe_client_open(ctx->pipe_ch, ctx->input_pipe_name, PROCESS_NAME,
+                                EN_PIPE_CLIENT_CAMERA_HELPER | CLIENT_FLAG_DISABLE_AUTO_RECONNECT, 0);
+    }
+
+    // no helper, the reader thread does the reads itself
+    if(pipe_client_open(ctx->pipe_ch, ctx->input_pipe_name, PROCESS_NAME, CLIENT_FLAG_DISABLE_AUTO_RECONNECT, 0)){
+        M_ERROR("failed to open pipe %s for direct reading\n", ctx->input_pipe_name);
+        return -1;
+    }
+    return pipe_reader_start(ctx->pipe_ch, _direct_alloc_cb, _direct_frame_cb,
+                             _direct_disconnect_cb, ctx);
+}
+
+// close the source pipe and stop the direct reader if it was running
+static void _close_source_pipe(context_data* ctx)
+{
+    if(ctx->simulcast_parent){
+        _close_rendition(ctx);
+        return;
+    }
+
+    pipe_reader_stop(ctx->pipe_ch);
+    pipe_client_close(ctx->pipe_ch);
+    _stop_feeder(ctx);
+    gop_cache_free(&ctx->gop_cache);
+    if(ctx->last_frame){
+        gst_buffer_unref(ctx->last_frame);
+        ctx->last_frame = NULL;
+    }
+    frame_pool_destroy(ctx);
+}
+
+static void _print_ingest_stats(context_data* ctx)
+{
+    if(ctx->ingest_frames == 0) return;
+
+    M_PRINT("ingest: %u frames, %.1f us/frame copying, %.2f MB/frame copied\n",
+            ctx->ingest_frames,
+            (double) ctx->ingest_time_us / ctx->ingest_frames,
+            (double) ctx->ingest_bytes_copied / ctx->ingest_frames / (1024.0 * 1024.0));
+
+    if(ctx->convert_frames){
+        M_PRINT("fused convert: %u frames, %.1f us/frame\n", ctx->convert_frames,
+                (double) ctx->convert_time_us / ctx->convert_frames);
+        if(ctx->input_format == IMAGE_FORMAT_RAW16){
+            M_PRINT("raw16 tone map window: %.0f to %.0f\n", ctx->tone_map.lo, ctx->tone_map.hi);
+        }
+        ctx->convert_frames = 0;
+        ctx->convert_time_us = 0;
+    }
+
+    if(ctx->backlog_frames_skipped){
+        M_PRINT("backlog recovery: %u frames skipped\n", ctx->backlog_frames_skipped);
+        ctx->backlog_frames_skipped = 0;
+    }
+
+    M_PRINT("frame queue: %u overwritten, %u dropped\n",
+            atomic_exchange(&ctx->frame_queue.overwritten, 0),
+            atomic_exchange(&ctx->frame_queue.dropped, 0));
+
+    ctx->ingest_frames = 0;
+    ctx->ingest_bytes_copied = 0;
+    ctx->ingest_time_us = 0;
+}
+
+// Start the source's pipe and shared pipeline when the first of its
+// renditions gets a client. Later renditions just join in.
+static int _simulcast_acquire(context_data* src, context_data* rendition)
+{
+    context_data* renditions[MAX_STREAMS];
+    int i, n = 0;
+
+    if(src->simulcast_users++ > 0){
+        // the encoders are well into their GOPs, don't make the new
+        // client wait for the next keyframe
+        pipeline_request_keyframe(rendition);
+        return 0;
+    }
+
+    for(i = 0; i < n_streams; i++){
+        if(streams[i].simulcast_parent == src) renditions[n++] = &streams[i];
+    }
+
+    src->closing_pipe_intentionally = 0;
+    src->first_run = 0;
+    if(pipeline_create_simulcast(src, renditions, n, _simulcast_frame_cb) == NULL){
+        M_ERROR("failed to start simulcast for %s\n", src->input_pipe_name);
+        src->app_source = NULL;
+        src->simulcast_users = 0;
+        return -1;
+    }
+    if(_open_source_pipe(src)){
+        M_ERROR("failed to open %s for simulcast\n", src->input_pipe_name);
+        pipeline_deinit(src);
+        src->app_source = NULL;
+        src->simulcast_users = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Tear the source down again once none of its renditions have clients
+static void _simulcast_release(context_data* src)
+{
+    if(src->simulcast_users <= 0 || --src->simulcast_users > 0) return;
+
+    M_PRINT("no more clients on any rendition of %s, stopping simulcast\n", src->input_pipe_name);
+    src->closing_pipe_intentionally = 1;
+    _close_source_pipe(src);
+    pipeline_deinit(src);
+    src->app_source = NULL;
+    src->feeding = 0;
+    src->need_data = 0;
+    src->input_frame_number = 0;
+    src->initial_timestamp = 0;
+    src->last_timestamp = 0;
+    _print_ingest_stats(src);
+    frame_pool_print_stats(src);
+
+    for(int i = 0; i < n_streams; i++){
+        if(streams[i].simulcast_parent == src) streams[i].simulcast_encoder = NULL;
+    }
+}
+
+// A rendition has no pipe of its own, its frames come from its branch of
+// the source's pipeline once it is marked active
+static int _open_rendition(context_data* ctx)
+{
+    ctx->backlog_state = BACKLOG_STATE_OK;
+    ctx->backlog_resync = 0;
+
+    if(_start_feeder(ctx)) return -1;
+
+    pthread_mutex_lock(&ctx->simulcast_lock);
+    ctx->simulcast_active = 1;
+    pthread_mutex_unlock(&ctx->simulcast_lock);
+
+    if(_simulcast_acquire(ctx->simulcast_parent, ctx)){
+        pthread_mutex_lock(&ctx->simulcast_lock);
+        ctx->simulcast_active = 0;
+        pthread_mutex_unlock(&ctx->simulcast_lock);
+        _stop_feeder(ctx);
+        return -1;
+    }
+    return 0;
+}
 
+static void _close_rendition(context_data* ctx)
+{
+    // nothing is enqueued past this point, the feeder can go
+    pthread_mutex_lock(&ctx->simulcast_lock);
+    ctx->simulcast_active = 0;
+    pthread_mutex_unlock(&ctx->simulcast_lock);
+
+    _simulcast_release(ctx->simulcast_parent);
+    _stop_feeder(ctx);
+    gop_cache_free(&ctx->gop_cache);
+}
 
-    // The need_data flag is set by the pipeline callback asking for
-    // more data.
-    if (! ctx->need_data) return;
+// Resource usage of the whole process, for comparing one process serving
+// several streams against one process per stream
+static void _print_process_usage(void)
+{
+    struct rusage usage;
 
-    ctx->input_frame_number++;
+    if(getrusage(RUSAGE_SELF, &usage)) return;
 
-    if (ctx->input_frame_number % ctx->output_frame_decimator) return;
+    M_PRINT("process: %d stream(s), max rss %ld kB, cpu %.1f s user %.1f s sys\n",
+            n_streams, usage.ru_maxrss,
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+}
 
-    // Allocate a gstreamer buffer to hold the frame data
-    // TODO can we ditch the alloc and memcpy?
-    GstBuffer *gst_buffer = gst_buffer_new_and_alloc(meta.size_bytes);
-    gst_buffer_map(gst_buffer, &info, GST_MAP_WRITE);
+// Bytes sent per stream and CPU used by the whole process since the last
+// report, for comparing unicast against multicast as viewers come and go
+static void _print_egress_stats(void)
+{
+    static gint64 last_cpu_us = 0;
+    static gint64 last_wall_us = 0;
+    struct rusage usage;
+    int i, active = 0;
 
-    if (info.size < (uint32_t) meta.size_bytes) {
-        M_ERROR("Not enough memory for the frame buffer\n");
-        main_running = 0;
-        return;
-    }
+    gint64 now_us = g_get_monotonic_time();
 
-    memcpy(info.data, frame, meta.size_bytes);
+    for(i = 0; i < n_streams; i++){
+        context_data* ctx = &streams[i];
+        if(ctx->media == NULL || ctx->num_rtsp_clients == 0){
+            ctx->egress_last_us = 0;
+            continue;
+        }
+        active = 1;
 
-    if ((ctx->input_frame_number == 1) && (meta.format == IMAGE_FORMAT_H264)) {
-        // Signal that the header
-        g_signal_emit_by_name(ctx->app_source, "push-buffer", ctx->h264_sps_nal, &status);
-        if (status == GST_FLOW_OK) {
-            M_DEBUG("SPS accepted\n", ctx->output_frame_number);
-        } else {
-            M_ERROR("SPS rejected\n");
-            raise(2);
+        guint64 bytes = pipeline_get_bytes_served(ctx->media);
+        // a new media starts counting from zero again
+        if(ctx->egress_last_us == 0 || bytes < ctx->egress_last_bytes){
+            ctx->egress_last_bytes = bytes;
+            ctx->egress_last_us = now_us;
+            continue;
         }
-    } else if ((ctx->input_frame_number == 1) && (meta.format == IMAGE_FORMAT_H265)) {
-        // Signal that the header
-        g_signal_emit_by_name(ctx->app_source, "push-buffer", ctx->h265_sps_nal, &status);
-        if (status == GST_FLOW_OK) {
-            M_DEBUG("SPS accepted\n", ctx->output_frame_number);
-        } else {
-            M_ERROR("SPS rejected\n");
-            raise(2);
+
+        double seconds = (now_us - ctx->egress_last_us) / 1000000.0;
+        M_PRINT("egress %s: %d client(s), %.1f kB/s over udp%s\n",
+                ctx->mount_point, ctx->num_rtsp_clients,
+                (bytes - ctx->egress_last_bytes) / 1024.0 / seconds,
+                ctx->multicast == MULTICAST_OFF ? "" : " (multicast enabled)");
+        ctx->egress_last_bytes = bytes;
+        ctx->egress_last_us = now_us;
+
+        // with pacing on, sends are the bursts the sink turns into one
+        // sendmmsg each
+        unsigned packets = atomic_exchange(&ctx->pacing_packets, 0);
+        unsigned sends = atomic_exchange(&ctx->pacing_sends, 0);
+        if(ctx->pacing_window_ms && sends){
+            M_PRINT("pacing %s: %u packets in %u sends, %u frames paced, largest burst %u\n",
+                    ctx->mount_point, packets, sends,
+                    atomic_exchange(&ctx->pacing_frames_paced, 0),
+                    atomic_exchange(&ctx->pacing_max_burst, 0));
         }
-    }
-    GstBuffer *output_buffer = gst_buffer;
-    pthread_mutex_lock(&ctx->lock);
 
-    // To get minimal latency make sure to set this to the timestamp of
-    // the very first frame that we will be sending through the pipeline.
-    if (ctx->initial_timestamp == 0) ctx->initial_timestamp = (guint64) meta.timestamp_ns;
+        if(ctx->rtx_time_ms){
+            guint requests, resent;
+            pipeline_get_rtx_stats(ctx->media, &requests, &resent);
+            if(requests < ctx->rtx_last_requests) ctx->rtx_last_requests = 0;
+            if(resent < ctx->rtx_last_packets) ctx->rtx_last_packets = 0;
+            M_PRINT("rtx %s: %u packets requested, %u resent, history %ums / %u packets (%u kB max)\n",
+                    ctx->mount_point, requests - ctx->rtx_last_requests,
+                    resent - ctx->rtx_last_packets, ctx->rtx_time_ms,
+                    ctx->rtx_history_packets, ctx->rtx_history_packets * RTP_MTU_BYTES / 1024);
+            ctx->rtx_last_requests = requests;
+            ctx->rtx_last_packets = resent;
+        }
 
-    // Do the timestamp calculations.
-    // It is very important to set these up accurately.
-    // Otherwise, the stream can look bad or just not work at all.
-    // TODO: Experiment with taking some time off of pts???
-    GST_BUFFER_TIMESTAMP(output_buffer) = ((guint64) meta.timestamp_ns - ctx->initial_timestamp);
-    GST_BUFFER_DURATION(output_buffer) = ((guint64) meta.timestamp_ns) - ctx->last_timestamp;
-    ctx->last_timestamp = (guint64) meta.timestamp_ns;
+        unsigned int requests = atomic_exchange(&ctx->keyframe_requests, 0);
+        unsigned int forced = atomic_exchange(&ctx->keyframes_forced, 0);
+        if(requests || forced){
+            M_PRINT("keyframes %s: %u requested, %u forced\n", ctx->mount_point, requests, forced);
+        }
 
-    pthread_mutex_unlock(&ctx->lock);
+        pthread_mutex_lock(&ctx->lock);
+        if(ctx->encode_frames){
+            // in slice mode this is the time to the first slice
+            M_PRINT("encode %s: %s, %u slices, %u frames, %.1fms avg %.1fms max in the encoder\n",
+                    ctx->mount_point, encoder_name(ctx->encoder_backend),
+                    ctx->encode_slices > 1 ? ctx->encode_slices : 1, ctx->encode_frames,
+                    ctx->encode_latency_us / 1000.0 / ctx->encode_frames,
+                    ctx->encode_latency_max_us / 1000.0);
+            ctx->encode_frames = 0;
+            ctx->encode_latency_us = 0;
+            ctx->encode_latency_max_us = 0;
+        }
+        pthread_mutex_unlock(&ctx->lock);
 
-    ctx->output_frame_number++;
+        rate_control_report_t report;
+        if(pipeline_get_rtcp_report(ctx->media, &report) == 0){
+            M_PRINT("receiver report %s: loss %.1f%% jitter %.1fms rtt %.1fms\n",
+                    ctx->mount_point, report.fraction_lost * 100.0,
+                    report.jitter_ms, report.rtt_ms);
+        }
+    }
 
-    // Signal that the frame is ready for use
-    g_signal_emit_by_name(ctx->app_source, "push-buffer", output_buffer, &status);
-    if (status == GST_FLOW_OK) {
-        M_VERBOSE("Frame %d accepted\n", ctx->output_frame_number);
-    } else {
-        M_ERROR("New frame rejected, status = %d\n", status);
+    if(getrusage(RUSAGE_SELF, &usage)) return;
+    gint64 cpu_us = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec +
+                    usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+    if(active && last_wall_us){
+        M_PRINT("process cpu: %.1f%%\n",
+                100.0 * (cpu_us - last_cpu_us) / (now_us - last_wall_us));
     }
+    last_cpu_us = cpu_us;
+    last_wall_us = now_us;
+}
 
-    // Release the buffer so that we don't have a memory leak
-    gst_buffer_unmap(gst_buffer, &info);
-    gst_buffer_unref(gst_buffer);
+// Close the source pipe now that nobody is watching
+static void _shut_down_source(context_data* ctx)
+{
+    // Wait for the buffer processing thread to exit
+    ctx->closing_pipe_intentionally = 1;
+    M_PRINT("no more rtsp clients on %s, closing source pipe intentionally\n", ctx->mount_point);
+    _close_source_pipe(ctx);
+    _print_ingest_stats(ctx);
+    frame_pool_print_stats(ctx);
+    _print_process_usage();
+    ctx->first_client = 0;
+}
 
+// Called from the main loop, leaves warm standby and releases the pipeline
+// once it has been idle for standby-timeout-s
+static void _check_standby(context_data* ctx)
+{
+    GstRTSPMedia* media;
 
-    // check if we are filling up and flush the pipe if so
-    if(pipe_size>0){
-        if(pipe_client_bytes_in_pipe(ch)>(pipe_size/2)){
-            M_WARN("source pipe getting backed up, flushing\n");
-            pipe_client_flush(ch);
-        }
+    pthread_mutex_lock(&ctx->lock);
+    if(!ctx->standby || ctx->standby_timeout_s < 0 ||
+       g_get_monotonic_time() - ctx->standby_since_us < (gint64) ctx->standby_timeout_s * G_USEC_PER_SEC){
+        pthread_mutex_unlock(&ctx->lock);
+        return;
     }
+    ctx->standby = 0;
+    ctx->initial_timestamp = 0;
+    ctx->last_timestamp = 0;
+    media = ctx->standby_media;
+    ctx->standby_media = NULL;
+    pthread_mutex_unlock(&ctx->lock);
 
-    return;
+    M_PRINT("warm standby timed out after %ds\n", ctx->standby_timeout_s);
+    _shut_down_source(ctx);
+
+    // drop the prepare we took, the media is torn down once the last
+    // session lets go of it as well
+    if(media){
+        gst_rtsp_media_unprepare(media);
+        g_object_unref(media);
+    }
 }
 
+// Stop tracking time to first frame for a client
+static void _forget_client(context_data* ctx, GstRTSPClient* client)
+{
+    GList* l;
+
+    for(l = ctx->pending_clients; l; l = l->next){
+        client_ttff_t* c = (client_ttff_t*) l->data;
+        if(c->client != client) continue;
+        M_PRINT("client %s left before getting a keyframe\n", c->uri ? c->uri : "unknown");
+        g_free(c->uri);
+        g_free(c);
+        ctx->pending_clients = g_list_delete_link(ctx->pending_clients, l);
+        return;
+    }
+}
 
 // This callback lets us know when an RTSP client has disconnected so that
 // we can stop trying to feed video frames to the pipeline and reset everything
@@ -242,12 +1509,24 @@ static void rtsp_client_disconnected(GstRTSPClient* self, context_data *data)
     ctx->num_rtsp_clients--;
     if(ctx->num_rtsp_clients<0) ctx->num_rtsp_clients=0;
 
+    _forget_client(ctx, self);
+
+    int standby = ctx->num_rtsp_clients == 0 && ctx->standby_media != NULL;
+
     if(ctx->num_rtsp_clients==0) {
         ctx->input_frame_number = 0;
         ctx->output_frame_number = 0;
+        ctx->feeding = 0;
         ctx->need_data = 0;
-        ctx->initial_timestamp = 0;
-        ctx->last_timestamp = 0;
+
+        // standby keeps the timeline going, see _feed_buffer
+        if(standby){
+            ctx->standby = 1;
+            ctx->standby_since_us = g_get_monotonic_time();
+        } else {
+            ctx->initial_timestamp = 0;
+            ctx->last_timestamp = 0;
+        }
     }
 
     M_PRINT("rtsp client disconnected, total clients: %d\n", ctx->num_rtsp_clients);
@@ -255,26 +1534,129 @@ static void rtsp_client_disconnected(GstRTSPClient* self, context_data *data)
     pthread_mutex_unlock(&data->lock);
 
 
-    if(ctx->num_rtsp_clients == 0){
-        // Wait for the buffer processing thread to exit
-        closing_pipe_intentionally = 1;
-        M_PRINT("no more rtsp clients, closing source pipe intentionally\n");
-        pipe_client_close(PIPE_CH);
-        first_client = 0;
+    if(standby){
+        M_PRINT("no more rtsp clients on %s, staying in warm standby\n", ctx->mount_point);
+        _print_ingest_stats(ctx);
+        frame_pool_print_stats(ctx);
+        _print_process_usage();
+    } else if(ctx->num_rtsp_clients == 0){
+        _shut_down_source(ctx);
+    }
+
+
+}
+
+// Called when a client sends PLAY, from here on it can receive frames
+static void rtsp_client_play_request(GstRTSPClient* self, GstRTSPContext* rtsp_ctx,
+                                     context_data *data)
+{
+    GList* l;
+
+    pthread_mutex_lock(&data->lock);
+    for(l = data->pending_clients; l; l = l->next){
+        client_ttff_t* c = (client_ttff_t*) l->data;
+        if(c->client == self) c->playing = 1;
+    }
+
+    // the replay goes into the shared media, only do it when this client
+    // is the only one that would see it
+    if(data->gop_replay == GOP_REPLAY_FIRST_CLIENT && data->num_rtsp_clients == 1){
+        data->gop_replay_pending = 1;
+    }
+
+    // streams we encode ourselves don't need to replay anything, the
+    // encoder can start a new GOP for the client
+    if(data->keyframe_on_demand && _encodes_itself(data)) pipeline_request_keyframe(data);
+
+    // Hold an extra prepare on the shared media so it stays prerolled and
+    // cached by the factory after the last client leaves
+    if(data->standby_timeout_s != 0 && data->standby_media == NULL && rtsp_ctx->media){
+        if(gst_rtsp_media_prepare(rtsp_ctx->media, NULL)){
+            data->standby_media = g_object_ref(rtsp_ctx->media);
+        } else {
+            M_WARN("failed to hold the media for warm standby\n");
+        }
+    }
+    pthread_mutex_unlock(&data->lock);
+}
+
+// The media is unprepared once its last client is gone, including the
+// standby hold, and its encoder goes away with it
+static void rtsp_media_unprepared(GstRTSPMedia* media, context_data* ctx)
+{
+    if(ctx->media != media) return;
+    pipeline_stop_pacer(ctx);
+    ctx->media = NULL;
+    g_object_unref(media);
+}
+
+// A new shared media was made for a stream. Its encoder starts out at the
+// configured bitrate so the bitrate controller starts over too.
+static void rtsp_media_configure(GstRTSPMediaFactory* factory, GstRTSPMedia* media,
+                                 context_data* ctx)
+{
+    if(ctx->media) g_object_unref(ctx->media);
+    ctx->media = g_object_ref(media);
+    g_signal_connect(media, "unprepared", G_CALLBACK(rtsp_media_unprepared), ctx);
+
+    pipeline_configure_media(ctx, media);
+
+    if(!ctx->abr_enable || !_encodes_itself(ctx)) return;
+
+    ctx->abr_waiting_since_us = 0;
+    ctx->abr_no_report_warned = 0;
+
+    // renditions share their frames, only raw streams can drop their own
+    uint32_t max_decimator = 1;
+    if(!ctx->simulcast_parent && ctx->abr_min_fps > 0 &&
+       ctx->output_frame_rate > ctx->abr_min_fps){
+        max_decimator = ctx->output_frame_rate / ctx->abr_min_fps;
     }
 
+    rate_control_init(&ctx->rate_control, ctx->output_stream_bitrate,
+                      ctx->abr_min_bitrate,
+                      ctx->abr_max_bitrate ? ctx->abr_max_bitrate : ctx->output_stream_bitrate,
+                      max_decimator, ctx->abr_log_file, ctx->mount_point);
+}
+
+// Called from the main loop, adapts the encoder to the latest receiver
+// report from the stream's clients
+static void _update_bitrate(context_data* ctx)
+{
+    rate_control_report_t report;
+
+    if(!ctx->abr_enable || ctx->media == NULL || !_encodes_itself(ctx)) return;
+    if(pipeline_get_rtcp_report(ctx->media, &report)){
+        // clients that never send RTCP leave the bitrate where it is, say so
+        // once rather than have it look like the link is just fine
+        gint64 now_us = g_get_monotonic_time();
+        if(ctx->num_rtsp_clients == 0){
+            ctx->abr_waiting_since_us = 0;
+        } else if(ctx->abr_waiting_since_us == 0){
+            ctx->abr_waiting_since_us = now_us;
+        } else if(!ctx->abr_no_report_warned &&
+                  now_us - ctx->abr_waiting_since_us > ABR_REPORT_TIMEOUT_S * G_USEC_PER_SEC){
+            M_WARN("no RTCP receiver reports for %s after %ds, adaptive bitrate is idle\n",
+                   ctx->mount_point, ABR_REPORT_TIMEOUT_S);
+            ctx->abr_no_report_warned = 1;
+        }
+        return;
+    }
+    ctx->abr_waiting_since_us = 0;
+    if(!rate_control_update(&ctx->rate_control, &report, g_get_monotonic_time())) return;
 
+    pipeline_set_bitrate(ctx, ctx->rate_control.bitrate);
 }
 
-// Gts client information 
-static void print_client_info(GstRTSPClient* object)
+// Get the request uri of a client, free with g_free
+static gchar* _get_client_uri(GstRTSPClient* object)
 {
     GstRTSPConnection *connection = gst_rtsp_client_get_connection(object);
     if (connection == NULL)
     {
         M_PRINT("Could not get RTSP connection\n");
         // DEBUG_EXIT;
-        return;
+        return NULL;
     }
 
     GstRTSPUrl *url = gst_rtsp_connection_get_url(connection);
@@ -282,62 +1664,318 @@ static void print_client_info(GstRTSPClient* object)
     {
         M_PRINT("Could not get RTSP connection URL\n");
         // DEBUG_EXIT;
+        return NULL;
+    }
+    return gst_rtsp_url_get_request_uri(url);
+}
+
+
+// Find the stream a request path belongs to, e.g. /live/stream=0 is on /live
+static context_data* _find_stream(const char* path)
+{
+    context_data* found = NULL;
+    size_t found_len = 0;
+    int i;
+
+    if(path == NULL) return NULL;
+
+    // mounts can nest, e.g. renditions on /live and /live/low, so the
+    // longest match wins. Simulcast sources aren't mounted at all.
+    for(i = 0; i < n_streams; i++){
+        size_t len = strlen(streams[i].mount_point);
+        if(len == 0 || len <= found_len) continue;
+        if(strncmp(path, streams[i].mount_point, len)) continue;
+        if(path[len] == '\0' || path[len] == '/'){
+            found = &streams[i];
+            found_len = len;
+        }
+    }
+    return found;
+}
+
+// Stream a control command is for, the mount can be left out when there is
+// only the one
+static context_data* _control_stream(const char* mount)
+{
+    context_data* found = NULL;
+    int i, n = 0;
+
+    for(i = 0; i < n_streams; i++){
+        if(streams[i].mount_point[0] == '\0') continue;
+        if(mount[0] == '\0' || !strcmp(mount, streams[i].mount_point)){
+            found = &streams[i];
+            n++;
+        }
+    }
+    if(n == 1) return found;
+
+    if(n == 0) control_reply("no stream on %s\n", mount);
+    else control_reply("more than one stream, give the mount point too\n");
+    return NULL;
+}
+
+static void _control_bitrate(context_data* ctx, uint32_t bitrate)
+{
+    if(!_encodes_itself(ctx)){
+        control_reply("%s is encoded by the camera server, set its bitrate there\n", ctx->mount_point);
+        return;
+    }
+
+    // adaptive bitrate carries on from the new bitrate, which is also its
+    // ceiling unless it has its own
+    ctx->output_stream_bitrate = bitrate;
+    if(ctx->abr_enable && ctx->media){
+        rate_control_t* rc = &ctx->rate_control;
+        if(!ctx->abr_max_bitrate) rc->max_bitrate = bitrate;
+        rc->bitrate = CLAMP(bitrate, rc->min_bitrate, rc->max_bitrate);
+        bitrate = rc->bitrate;
+    }
+    pipeline_set_bitrate(ctx, bitrate);
+    control_reply("%s bitrate set to %u\n", ctx->mount_point, bitrate);
+}
+
+static void _control_gop(context_data* ctx, uint32_t gop_size)
+{
+    if(!_encodes_itself(ctx)){
+        control_reply("%s is encoded by the camera server, set its GOP there\n", ctx->mount_point);
         return;
     }
-    gchar* uri = gst_rtsp_url_get_request_uri(url);
-    M_PRINT("A new client %s has connected, total clients: %d\n",uri, context.num_rtsp_clients);
-    g_free(uri);
+
+    ctx->gop_size = gop_size;
+    switch(pipeline_set_gop(ctx, gop_size)){
+        case 0:
+            // start the new cadence from a keyframe right away
+            pipeline_request_keyframe(ctx);
+            control_reply("%s GOP set to %u frames\n", ctx->mount_point, gop_size);
+            break;
+        case 1:
+            control_reply("%s GOP set to %u frames, restarting %s for it\n",
+                          ctx->mount_point, gop_size, encoder_name(ctx->encoder_backend));
+            break;
+        default:
+            control_reply("%s isn't encoding, GOP will be %u frames from the next client\n",
+                          ctx->mount_point, gop_size);
+            break;
+    }
 }
 
+// Size and frame rate changes need new caps. The feeder picks them up
+// before its next frame, or they're just kept for the next pipeline if
+// it isn't running.
+static void _control_reconfigure(context_data* ctx, uint32_t width, uint32_t height,
+                                 uint32_t decimator)
+{
+    if(_is_encoded(ctx->input_format)){
+        control_reply("%s is encoded by the camera server, can't change its %s\n",
+                      ctx->mount_point, decimator ? "frame rate" : "size");
+        return;
+    }
+    if(ctx->simulcast_parent){
+        control_reply("%s is a rendition, its %s is set in the config file\n",
+                      ctx->mount_point, decimator ? "frame rate" : "size");
+        return;
+    }
+    if(decimator > (uint32_t) ctx->source_frame_rate){
+        control_reply("decimator %u would take %s below 1 fps\n", decimator, ctx->mount_point);
+        return;
+    }
+
+    // without fused-convert only an existing scaler can change its size
+    if(width && ctx->feeder_running && !ctx->fused_convert && !ctx->scaler){
+        control_reply("%s can only change size live with fused-convert on\n", ctx->mount_point);
+        return;
+    }
 
-// This is called by the RTSP server when a client has connected.
-static void rtsp_client_connected(GstRTSPServer* self, GstRTSPClient* object,
-                                  context_data *data)
+    if(!ctx->feeder_running){
+        if(decimator) _set_decimator(ctx, decimator);
+        if(width && _resize_output(ctx, width, height, 0)){
+            control_reply("invalid size %ux%u for %s\n", width, height, ctx->mount_point);
+            return;
+        }
+    } else {
+        pthread_mutex_lock(&ctx->lock);
+        if(decimator) ctx->reconfigure_decimator = decimator;
+        if(width){
+            ctx->reconfigure_width = width;
+            ctx->reconfigure_height = height;
+        }
+        ctx->reconfigure_pending = 1;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    if(decimator) control_reply("%s decimator set to %u\n", ctx->mount_point, decimator);
+    else control_reply("%s output size set to %ux%u\n", ctx->mount_point, width, height);
+}
+
+static void _control_status(void)
+{
+    int i;
+
+    for(i = 0; i < n_streams; i++){
+        context_data* ctx = &streams[i];
+        if(ctx->mount_point[0] == '\0') continue;
+        if(!_encodes_itself(ctx)){
+            control_reply("%s: %ux%u from the camera server, %d clients\n", ctx->mount_point,
+                          ctx->output_stream_width, ctx->output_stream_height,
+                          ctx->num_rtsp_clients);
+            continue;
+        }
+        control_reply("%s: %ux%u %ufps %ubps gop %u %s, %d clients\n", ctx->mount_point,
+                      ctx->output_stream_width, ctx->output_stream_height,
+                      ctx->output_frame_rate, ctx->output_stream_bitrate, ctx->gop_size,
+                      encoder_name(ctx->encoder_backend), ctx->num_rtsp_clients);
+    }
+}
+
+// Carry out a command from the control pipe, runs on the main loop
+static void _control_apply(const control_request_t* request)
+{
+    if(request->command == CONTROL_STATUS){
+        _control_status();
+        return;
+    }
+
+    context_data* ctx = _control_stream(request->mount);
+    if(ctx == NULL) return;
+
+    switch(request->command){
+        case CONTROL_SET_BITRATE:
+            _control_bitrate(ctx, request->value);
+            break;
+        case CONTROL_SET_GOP:
+            _control_gop(ctx, request->value);
+            break;
+        case CONTROL_SET_DECIMATOR:
+            _control_reconfigure(ctx, 0, 0, request->value);
+            break;
+        case CONTROL_SET_RESOLUTION:
+            _control_reconfigure(ctx, request->width, request->height, 0);
+            break;
+        case CONTROL_STATUS:
+            break;
+    }
+}
+
+// Attach a client to the stream it asked for. Clients connect to the server
+// as a whole, we only know which stream they want once a request comes in.
+static void rtsp_client_request(GstRTSPClient* object, GstRTSPContext* rtsp_ctx,
+                                gpointer user_data)
 {
-    if(first_client==0)
+    // only the first request from a client attaches it
+    if(g_object_get_data(G_OBJECT(object), "voxl-stream")) return;
+
+    context_data* data = _find_stream(rtsp_ctx->uri ? rtsp_ctx->uri->abspath : NULL);
+    if(data == NULL) return;
+    g_object_set_data(G_OBJECT(object), "voxl-stream", data);
+
+    if(data->first_client==0)
     {
-        closing_pipe_intentionally = 0;
-        first_client = 1;
-        first_run = 0;
-        pipe_client_set_connect_cb(PIPE_CH, _cam_connect_cb, NULL);
-        pipe_client_set_disconnect_cb(PIPE_CH, _cam_disconnect_cb, NULL);
-        pipe_client_set_camera_helper_cb(PIPE_CH, _cam_helper_cb, &context);
-        pipe_client_open(PIPE_CH, context.input_pipe_name, PROCESS_NAME, EN_PIPE_CLIENT_CAMERA_HELPER, 0);
+        data->closing_pipe_intentionally = 0;
+        data->first_client = 1;
+        data->first_run = 0;
+        if(_open_source_pipe(data)){
+            // nothing to stream, let the next client try again
+            M_ERROR("failed to open the source for %s, closing client\n", data->mount_point);
+            data->first_client = 0;
+            g_object_set_data(G_OBJECT(object), "voxl-stream", NULL);
+            gst_rtsp_client_close(object);
+            return;
+        }
     }
 
+    client_ttff_t* c = g_new0(client_ttff_t, 1);
+    c->client = object;
+    c->uri = _get_client_uri(object);
+    c->connect_us = g_get_monotonic_time();
+
     pthread_mutex_lock(&data->lock);
+    if(data->standby){
+        M_PRINT("leaving warm standby\n");
+        data->standby = 0;
+        data->standby_resume = 1;
+        // the encoder kept its place in the GOP while paused, get a fresh
+        // keyframe out for the new client. Encoded input uses the GOP cache.
+        if(!_is_encoded(data->input_format)) pipeline_request_keyframe(data);
+    }
      data->num_rtsp_clients++;
-    print_client_info(object);
+    M_PRINT("A new client %s has connected to %s, total clients: %d\n",
+            c->uri ? c->uri : "unknown", data->mount_point, data->num_rtsp_clients);
+    data->pending_clients = g_list_append(data->pending_clients, c);
 
     // Install the disconnect callback with the client.
     g_signal_connect(object, "closed", G_CALLBACK(rtsp_client_disconnected), data);
+    g_signal_connect(object, "play-request", G_CALLBACK(rtsp_client_play_request), data);
     pthread_mutex_unlock(&data->lock);
     return;
 }
 
+// This is called by the RTSP server when a client has connected.
+static void rtsp_client_connected(GstRTSPServer* self, GstRTSPClient* object,
+                                  gpointer user_data)
+{
+    // some clients skip DESCRIBE and go straight to SETUP
+    g_signal_connect(object, "describe-request", G_CALLBACK(rtsp_client_request), NULL);
+    g_signal_connect(object, "setup-request", G_CALLBACK(rtsp_client_request), NULL);
+}
+
+
+
+// Note which stream an expired session was watching, its medias are the
+// only link back since the session pool is shared by all of them
+static GstRTSPFilterResult _session_media_stream(GstRTSPSession* session,
+                                                 GstRTSPSessionMedia* session_media,
+                                                 gpointer user_data)
+{
+    int* expired = (int*) user_data;
+    GstRTSPMedia* media = gst_rtsp_session_media_get_media(session_media);
+    int i;
+
+    for(i = 0; i < n_streams; i++){
+        if(streams[i].media == media) expired[i]++;
+    }
+    return GST_RTSP_FILTER_KEEP;
+}
 
+static GstRTSPFilterResult _expire_session(GstRTSPSessionPool* pool,
+                                           GstRTSPSession* session,
+                                           gpointer user_data)
+{
+    if(!gst_rtsp_session_is_expired_usec(session, g_get_monotonic_time())){
+        return GST_RTSP_FILTER_KEEP;
+    }
+    gst_rtsp_session_filter(session, _session_media_stream, user_data);
+    return GST_RTSP_FILTER_REMOVE;
+}
 
 /* this timeout is periodically run to clean up the expired sessions from the
  * pool. This needs to be run explicitly currently but might be done
  * automatically as part of the mainloop. */
 static gboolean timeout(gpointer data)
 {
-  context_data* ctx = (context_data*)data;
+  int expired[MAX_STREAMS] = {0};
+  int i;
 
+  // same as gst_rtsp_session_pool_cleanup but tells us whose sessions went
   GstRTSPSessionPool *pool;
-  pool = gst_rtsp_server_get_session_pool(ctx->rtsp_server);
-  guint removed = gst_rtsp_session_pool_cleanup(pool);
+  pool = gst_rtsp_server_get_session_pool(streams[0].rtsp_server);
+  gst_rtsp_session_pool_filter(pool, _expire_session, expired);
   g_object_unref(pool);
 
-  if (removed > 0){
-    M_PRINT("Removed %d sessions\n", removed);
+  for(i = 0; i < n_streams; i++) _check_standby(&streams[i]);
+
+  for(i = 0; i < n_streams; i++){
+    context_data* ctx = &streams[i];
+    if(expired[i] == 0) continue;
+
+    M_PRINT("Removed %d sessions from %s\n", expired[i], ctx->mount_point);
     pthread_mutex_lock(&ctx->lock);
-    ctx->num_rtsp_clients--;
+    ctx->num_rtsp_clients -= expired[i];
     if(ctx->num_rtsp_clients<0) ctx->num_rtsp_clients=0;
 
     if(ctx->num_rtsp_clients == 0){
         ctx->input_frame_number = 0;
         ctx->output_frame_number = 0;
+        ctx->feeding = 0;
         ctx->need_data = 0;
         ctx->initial_timestamp = 0;
         ctx->last_timestamp = 0;
@@ -348,6 +1986,52 @@ static gboolean timeout(gpointer data)
 
   return TRUE;
 }
+// Called from the main loop while the source pipe is gone. Reattaches in
+// place when it comes back the same, otherwise falls back to restarting
+// the whole server.
+static void _try_reattach_source(context_data* ctx)
+{
+    int width, height, format;
+
+    if(!ctx->source_outage || !pipe_exists(ctx->input_pipe_name)) return;
+
+    // the server might still be setting the pipe up, try again next time
+    cJSON* json = pipe_get_info_json(ctx->input_pipe_name);
+    if(json == NULL) return;
+    int bad = json_fetch_int(json, "width", &width)   ||
+              json_fetch_int(json, "height", &height) ||
+              json_fetch_int(json, "int_format", &format);
+    cJSON_Delete(json);
+    if(bad) return;
+
+    if(format != ctx->input_format ||
+       (!_is_encoded(format) && (width != ctx->input_frame_width || height != ctx->input_frame_height))){
+        M_WARN("Pipe came back as %dx%d %s, restarting the stream\n",
+               width, height, pipe_image_format_to_string(format));
+        ctx->source_outage = 0;
+        source_pipe_disconnected = 1;
+        return;
+    }
+
+    ctx->closing_pipe_intentionally = 1;
+    pipe_reader_stop(ctx->pipe_ch);
+    pipe_client_close(ctx->pipe_ch);
+    ctx->closing_pipe_intentionally = 0;
+
+    // the new stream starts its own GOP, wait for it before sending anything
+    if(_is_encoded(format)) ctx->backlog_state = BACKLOG_STATE_SKIP_TO_IDR;
+
+    if(_open_pipe(ctx)){
+        M_WARN("Failed to reopen pipe %s, trying again\n", ctx->input_pipe_name);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->source_outage = 0;
+    pthread_mutex_unlock(&ctx->lock);
+    M_PRINT("Reattached to pipe %s\n", ctx->input_pipe_name);
+}
+
 // This callback is setup to happen at 1 second intervals so that we can
 // monitor when the program is ending and exit the main loop.
 gboolean loop_callback(gpointer data) {
@@ -360,6 +2044,16 @@ gboolean loop_callback(gpointer data) {
         g_main_loop_quit((GMainLoop*) data);
         source_pipe_disconnected = 0;
     }
+    for(int i = 0; i < n_streams; i++){
+        _try_reattach_source(&streams[i]);
+        _update_bitrate(&streams[i]);
+    }
+
+    static int egress_count = 0;
+    if(++egress_count >= EGRESS_REPORT_PERIOD_S){
+        _print_egress_stats();
+        egress_count = 0;
+    }
     return TRUE;
 }
 
@@ -373,14 +2067,16 @@ GstRTSPFilterResult stop_rtsp_clients(GstRTSPServer* server,
 static void PrintHelpMessage()
 {
     M_PRINT("\nCommand line arguments are as follows:\n\n");
-    M_PRINT("-b --bitrate    <#>     | Override bitrate specified in the config file\n");
+    M_PRINT("-b --bitrate    <#>     | Override bitrate specified in the config file for every stream\n");
     M_PRINT("-c --config             | Load config file only and quit (used for scripted setup)\n");
-    M_PRINT("-d --decimator  <#>     | Override the decimator specified in the config file\n");
+    M_PRINT("-d --decimator  <#>     | Override the decimator specified in the config file for every stream\n");
     M_PRINT("-h --help               | Print this help message\n");
-    M_PRINT("-i --input-pipe <name>  | Override the input pipe specified in the config file\n");
+    M_PRINT("-i --input-pipe <name>  | Override the input pipe of the first stream in the config file\n");
     M_PRINT("-p --port       <#>     | Override the RTSP port number specified in the config file\n");
+    M_PRINT("-r --resolution <WxH>   | Encode RAW streams at this size, 0 for either keeps the aspect ratio\n");
     M_PRINT("-s --standalone         | Use this to launch a new instance alongside the default service\n");
     M_PRINT("-v --verbosity  <#>     | Log verbosity level (Default 2)\n");
+    M_PRINT("-x --scale      <#>     | Scale factor for the output size of RAW streams, e.g. 0.5\n");
     M_PRINT("                      0 | Print verbose logs\n");
     M_PRINT("                      1 | Print >= info logs\n");
     M_PRINT("                      2 | Print >= warning logs\n");
@@ -414,14 +2110,21 @@ static int ParseArgs(int         argc,                 ///< Number of arguments
         {"help",             no_argument,        0, 'h'},
         {"input-pipe",       required_argument,  0, 'i'},
         {"port",             required_argument,  0, 'p'},
+        {"resolution",       required_argument,  0, 'r'},
         {"standalone",       no_argument,        0, 's'},
         {"verbosity",        required_argument,  0, 'v'},
+        {"scale",            required_argument,  0, 'x'},
     };
 
     int optionIndex = 0;
     int option;
+    int i;
 
-    while ((option = getopt_long (argc, argv, ":b:cd:hi:p:sv:", &LongOptions[0], &optionIndex)) != -1)
+    // size, rate and bitrate overrides go to every stream in the config file
+    uint32_t bitrate, decimator, width, height;
+    double scale;
+
+    while ((option = getopt_long (argc, argv, ":b:cd:hi:p:r:sv:x:", &LongOptions[0], &optionIndex)) != -1)
     {
         switch (option) {
             case 'v':{
@@ -442,27 +2145,52 @@ static int ParseArgs(int         argc,                 ///< Number of arguments
                 break;
             }
             case 'b':
-                if(sscanf(optarg, "%u", &context.output_stream_bitrate) != 1){
+                if(sscanf(optarg, "%u", &bitrate) != 1){
                     M_ERROR("Failed to get valid integer for bitrate from: %s\n", optarg);
                     return -1;
                 }
+                for(i = 0; i < n_streams; i++) streams[i].output_stream_bitrate = bitrate;
                 break;
             case 'c':
                 M_PRINT("parsed config file\n");
                 exit(0);
                 break;
             case 'd':
-                if(sscanf(optarg, "%u", &context.output_frame_decimator) != 1){
+                if(sscanf(optarg, "%u", &decimator) != 1){
                     M_ERROR("Failed to get valid integer for decimator from: %s\n", optarg);
                     return -1;
                 }
+                for(i = 0; i < n_streams; i++) streams[i].output_frame_decimator = decimator;
                 break;
                 break;
             case 'i':
-                strncpy(context.input_pipe_name, optarg, MODAL_PIPE_MAX_PATH_LEN);
+                // every stream needs its own pipe, only the first can take it
+                strncpy(streams[0].input_pipe_name, optarg, MODAL_PIPE_MAX_PATH_LEN);
                 break;
             case 'p':
-                strncpy(context.rtsp_server_port, optarg, MAX_RTSP_PORT_SIZE);
+                strncpy(streams[0].rtsp_server_port, optarg, MAX_RTSP_PORT_SIZE);
+                break;
+            case 'r':
+                if(sscanf(optarg, "%ux%u", &width, &height) != 2){
+                    M_ERROR("Failed to get valid WxH resolution from: %s\n", optarg);
+                    return -1;
+                }
+                for(i = 0; i < n_streams; i++){
+                    streams[i].output_resize_width = width;
+                    streams[i].output_resize_height = height;
+                }
+                break;
+            case 'x':
+                if(sscanf(optarg, "%lf", &scale) != 1 || scale <= 0.0){
+                    M_ERROR("Failed to get valid scale factor from: %s\n", optarg);
+                    return -1;
+                }
+                // an explicit scale replaces any size from the config file
+                for(i = 0; i < n_streams; i++){
+                    streams[i].output_scale = scale;
+                    streams[i].output_resize_width = 0;
+                    streams[i].output_resize_height = 0;
+                }
                 break;
             case 'h':
                 PrintHelpMessage();
@@ -496,12 +2224,12 @@ static int ParseArgs(int         argc,                 ///< Number of arguments
 
 
 
-int _setup_context(void)
+int _setup_context(context_data* ctx)
 {
     // Wait for pipe to appear
-    M_PRINT("Waiting for pipe %s to appear\n", context.input_pipe_name);
+    M_PRINT("Waiting for pipe %s to appear\n", ctx->input_pipe_name);
     while(main_running){
-        if(pipe_exists(context.input_pipe_name)){
+        if(pipe_exists(ctx->input_pipe_name)){
             M_PRINT("Found Pipe\n");
             break;
         }
@@ -509,7 +2237,7 @@ int _setup_context(void)
     }
 
     // make sure it's the right type
-    if(!pipe_is_type(context.input_pipe_name, "camera_image_metadata_t")){
+    if(!pipe_is_type(ctx->input_pipe_name, "camera_image_metadata_t")){
         M_ERROR("Pipe type mismatch for metadata\n");
         return -1;
     }
@@ -519,64 +2247,119 @@ int _setup_context(void)
 
     // wait for the server to finish setting up the pipe and fetch its info
     usleep(200000);
-    cJSON* json = pipe_get_info_json(context.input_pipe_name);
+    cJSON* json = pipe_get_info_json(ctx->input_pipe_name);
     if( json == NULL || \
-        json_fetch_int(json, "width", &context.input_frame_width)   || \
-        json_fetch_int(json, "height", &context.input_frame_height) || \
-        json_fetch_int(json, "int_format", &context.input_format)   || \
-        json_fetch_int(json, "framerate", &context.input_frame_rate)|| \
-        context.input_frame_width  < 1                              || \
-        context.input_frame_height < 1)
+        json_fetch_int(json, "width", &ctx->input_frame_width)   || \
+        json_fetch_int(json, "height", &ctx->input_frame_height) || \
+        json_fetch_int(json, "int_format", &ctx->input_format)   || \
+        json_fetch_int(json, "framerate", &ctx->input_frame_rate)|| \
+        ctx->input_frame_width  < 1                              || \
+        ctx->input_frame_height < 1)
     {
         M_WARN("Failed to fetch one or more of width, height, into_format, framerate from pipe info file\n");
         M_WARN("going to connect to the pipe for 1 frame to inspect it now\n");
-        if(metadataGrabber(PROCESS_NAME, &context)) return -1;
+        if(metadataGrabber(PROCESS_NAME, ctx)) return -1;
         M_WARN("grabbed the data from the actual pipe and closed it\n");
     }
 
     M_PRINT("detected following stats from pipe:\n");
     M_PRINT("w: %d h: %d fps: %d format: %s\n", \
-                context.input_frame_width,\
-                context.input_frame_height,\
-                context.input_frame_rate,\
-                pipe_image_format_to_string(context.input_format));
+                ctx->input_frame_width,\
+                ctx->input_frame_height,\
+                ctx->input_frame_rate,\
+                pipe_image_format_to_string(ctx->input_format));
 
 
     // final check that the data from either json or pipe metadata was good
     // the metadata grabber didn't do this check
-    if( context.input_frame_width  < 1 || \
-        context.input_frame_height < 1)
+    if( ctx->input_frame_width  < 1 || \
+        ctx->input_frame_height < 1)
     {
         M_ERROR("invalid width, height, or framerate\n");
         return -1;
     }
 
     // Cannot decimate encoded frames
-    if((context.input_format == IMAGE_FORMAT_H264 ||
-        context.input_format == IMAGE_FORMAT_H265) &&
-        context.output_frame_decimator != 1) {
+    if((ctx->input_format == IMAGE_FORMAT_H264 ||
+        ctx->input_format == IMAGE_FORMAT_H265) &&
+        ctx->output_frame_decimator != 1) {
         M_WARN("Streaming pre-encoded frames, will not be able to apply decimator\n");
-        context.output_frame_decimator = 1;
+        ctx->output_frame_decimator = 1;
     } else {
-        context.input_frame_rate = context.input_frame_rate / context.output_frame_decimator;
-        context.output_frame_rate = context.input_frame_rate;
-        M_DEBUG("Frame rate is: %u\n", context.input_frame_rate);
+        ctx->source_frame_rate = ctx->input_frame_rate;
+        ctx->input_frame_rate = ctx->input_frame_rate / ctx->output_frame_decimator;
+        ctx->output_frame_rate = ctx->input_frame_rate;
+        M_DEBUG("Frame rate is: %u\n", ctx->input_frame_rate);
     }
 
     // set output resolution based on input resolution and rotation
-    if(context.output_stream_rotation == 90 || context.output_stream_rotation == 270){
-        context.output_stream_height = context.input_frame_width;
-        context.output_stream_width = context.input_frame_height;
+    _rotated_input_size(ctx, &ctx->output_stream_width, &ctx->output_stream_height);
+    if(_is_encoded(ctx->input_format)){
+        if(ctx->output_resize_width || ctx->output_resize_height || ctx->output_scale != 1.0){
+            M_WARN("Streaming pre-encoded frames, will not be able to change the output size\n");
+        }
     } else {
-        context.output_stream_height = context.input_frame_height;
-        context.output_stream_width = context.input_frame_width;
+        if(_apply_output_size(ctx)) return -1;
+        if(encoder_resolve(ctx->encoder_backend, ctx->codec, &ctx->encoder_backend)){
+            main_running = 0;
+            return -1;
+        }
+        M_PRINT("Encoding %s to %s with %s\n", ctx->input_pipe_name,
+                encoder_codec_name(ctx->codec), encoder_name(ctx->encoder_backend));
     }
 
+    if(configure_frame_format(ctx->input_format, ctx)) return -1;
 
-    return configure_frame_format(context.input_format, &context);
+    // RAW16 is converted like RAW8 once it's tone mapped
+    ctx->fused_convert = ctx->fused_convert_enable &&
+                         frame_convert_supported(ctx->input_format == IMAGE_FORMAT_RAW16 ?
+                                                 IMAGE_FORMAT_RAW8 : ctx->input_format,
+                                                 ctx->input_frame_width,
+                                                 ctx->input_frame_height,
+                                                 ctx->output_stream_rotation);
+    if(ctx->fused_convert) M_DEBUG("Converting frames to NV12 in the feeder\n");
+    return 0;
 }
 
+// Renditions come after their source in the stream list so the source is
+// already set up. They take the source's output and scale it down.
+static int _setup_rendition(context_data* ctx)
+{
+    context_data* src = ctx->simulcast_parent;
+
+    if(_is_encoded(src->input_format)){
+        M_ERROR("Can only simulcast raw streams, %s is %s\n", src->input_pipe_name,
+                pipe_image_format_to_string(src->input_format));
+        main_running = 0;
+        return -1;
+    }
+
+    // NV12 needs even sizes
+    ctx->output_stream_width  = (ctx->rendition_width  ? ctx->rendition_width
+                                                       : src->output_stream_width) & ~1u;
+    ctx->output_stream_height = (ctx->rendition_height ? ctx->rendition_height
+                                                       : src->output_stream_height) & ~1u;
+    ctx->output_frame_rate = src->output_frame_rate;
+    if(ctx->rendition_fps && ctx->rendition_fps < src->output_frame_rate){
+        ctx->output_frame_rate = ctx->rendition_fps;
+    }
 
+    // same encoder as the source, which has already picked one
+    ctx->encoder_backend = src->encoder_backend;
+    ctx->codec = src->codec;
+    ctx->input_format = encoder_is_h265(ctx->encoder_backend) ? IMAGE_FORMAT_H265
+                                                               : IMAGE_FORMAT_H264;
+    ctx->input_frame_width = ctx->output_stream_width;
+    ctx->input_frame_height = ctx->output_stream_height;
+    ctx->input_frame_rate = ctx->output_frame_rate;
+    ctx->output_frame_decimator = 1;
+
+    M_PRINT("rendition %s of %s: %ux%u %ufps %ubps\n", ctx->mount_point, src->input_pipe_name,
+            ctx->output_stream_width, ctx->output_stream_height,
+            ctx->output_frame_rate, ctx->output_stream_bitrate);
+
+    return configure_frame_format(ctx->input_format, ctx);
+}
 
 
 
@@ -588,15 +2371,14 @@ int _run_gstreamer(void)
     GMainLoop *loop;
     GSource *loop_source;
     GSource *time_loop_source;
+    GstRTSPServer *server;
+    int i;
 
-    context.num_rtsp_clients = 0;
-
-    // Initialize Gstreamer
-    gst_init(NULL, NULL);
+    for(i = 0; i < n_streams; i++) streams[i].num_rtsp_clients = 0;
 
     // Create the RTSP server
-    context.rtsp_server = gst_rtsp_server_new();
-    if (context.rtsp_server) {
+    server = gst_rtsp_server_new();
+    if (server) {
         M_DEBUG("Made rtsp_server\n");
     } else {
         M_ERROR("couldn't make rtsp_server\n");
@@ -604,11 +2386,12 @@ int _run_gstreamer(void)
     }
 
     // Configure the RTSP server port
-    g_object_set(context.rtsp_server, "service", context.rtsp_server_port, NULL);
+    g_object_set(server, "service", streams[0].rtsp_server_port, NULL);
+    for(i = 0; i < n_streams; i++) streams[i].rtsp_server = server;
 
     // Setup the callback to alert when a new connection has come in
-    g_signal_connect(context.rtsp_server, "client-connected",
-                     G_CALLBACK(rtsp_client_connected), &context);
+    g_signal_connect(server, "client-connected",
+                     G_CALLBACK(rtsp_client_connected), NULL);
 
     // Setup the glib loop for the RTSP server to use
     loop_context = g_main_context_new();
@@ -647,7 +2430,7 @@ int _run_gstreamer(void)
         M_ERROR("Couldn't create timeout loop source for callback\n");
         return -1;
     }
-    g_source_set_callback(time_loop_source, timeout, &context, NULL);
+    g_source_set_callback(time_loop_source, timeout, NULL, NULL);
     g_source_attach(time_loop_source, loop_context);
 
     g_main_context_unref(loop_context);
@@ -656,33 +2439,81 @@ int _run_gstreamer(void)
 
     // get the mount points for the RTSP server, every server has a default object
     // that will be used to map uri mount points to media factories
-    mounts = gst_rtsp_server_get_mount_points(context.rtsp_server);
+    mounts = gst_rtsp_server_get_mount_points(server);
     if ( ! mounts) {
         M_ERROR("Couldn't get mount points\n");
         return -1;
     }
 
-    // We override the create element function with our own so that we can use
-    // our custom pipeline instead of a launch line.
-    factory = gst_rtsp_media_factory_new();
-    if ( ! factory) {
-        M_ERROR("Couldn't create new media factory\n");
-        return -1;
+    // One pool of multicast groups for all streams, every media that is
+    // streamed over multicast takes a group and port pair from it
+    GstRTSPAddressPool *address_pool = NULL;
+    if(streams[0].multicast != MULTICAST_OFF){
+        address_pool = gst_rtsp_address_pool_new();
+        if(!gst_rtsp_address_pool_add_range(address_pool,
+                                            streams[0].multicast_address_min,
+                                            streams[0].multicast_address_max,
+                                            streams[0].multicast_port_min,
+                                            streams[0].multicast_port_max,
+                                            streams[0].multicast_ttl)){
+            M_ERROR("Invalid multicast range %s-%s ports %d-%d\n",
+                    streams[0].multicast_address_min, streams[0].multicast_address_max,
+                    streams[0].multicast_port_min, streams[0].multicast_port_max);
+            g_object_unref(address_pool);
+            g_object_unref(mounts);
+            return -1;
+        }
     }
-    // Set as shared to consider video disconnects
-    gst_rtsp_media_factory_set_shared (factory, TRUE);
-    GstRTSPMediaFactoryClass *memberFunctions = GST_RTSP_MEDIA_FACTORY_GET_CLASS(factory);
-    if ( ! memberFunctions) {
-        M_ERROR("Couldn't get media factory class pointer\n");
-        return -1;
+
+    // We override the create element function with our own so that we can use
+    // our custom pipeline instead of a launch line. Every stream gets its own
+    // factory on its own mount point.
+    for(i = 0; i < n_streams; i++){
+        // simulcast sources are only served through their renditions
+        if(streams[i].mount_point[0] == '\0') continue;
+
+        factory = gst_rtsp_media_factory_new();
+        if ( ! factory) {
+            M_ERROR("Couldn't create new media factory\n");
+            g_object_unref(mounts);
+            return -1;
+        }
+        // Set as shared to consider video disconnects
+        gst_rtsp_media_factory_set_shared (factory, TRUE);
+        GstRTSPMediaFactoryClass *memberFunctions = GST_RTSP_MEDIA_FACTORY_GET_CLASS(factory);
+        if ( ! memberFunctions) {
+            M_ERROR("Couldn't get media factory class pointer\n");
+            g_object_unref(mounts);
+            return -1;
+        }
+        memberFunctions->create_element = create_custom_element;
+        pipeline_init(factory, &streams[i]);
+        g_signal_connect(factory, "media-configure",
+                         G_CALLBACK(rtsp_media_configure), &streams[i]);
+
+        if(address_pool){
+            GstRTSPLowerTrans protocols = GST_RTSP_LOWER_TRANS_UDP_MCAST;
+            if(streams[i].multicast == MULTICAST_ALLOW){
+                protocols |= GST_RTSP_LOWER_TRANS_UDP | GST_RTSP_LOWER_TRANS_TCP;
+            }
+            gst_rtsp_media_factory_set_address_pool(factory, address_pool);
+            gst_rtsp_media_factory_set_protocols(factory, protocols);
+        }
+        gst_rtsp_mount_points_add_factory(mounts, streams[i].mount_point, factory);
     }
-    memberFunctions->create_element = create_custom_element;
-    char *link_name = "/live";
-    gst_rtsp_mount_points_add_factory(mounts, link_name, factory);
     g_object_unref(mounts);
+    if(address_pool) g_object_unref(address_pool);
+
+    if(streams[0].multicast != MULTICAST_OFF){
+        M_PRINT("Multicast %s on %s-%s ports %d-%d ttl %d\n",
+                streams[0].multicast == MULTICAST_FORCE ? "only" : "allowed",
+                streams[0].multicast_address_min, streams[0].multicast_address_max,
+                streams[0].multicast_port_min, streams[0].multicast_port_max,
+                streams[0].multicast_ttl);
+    }
 
     // Attach the RTSP server to our loop
-    int source_id = gst_rtsp_server_attach(context.rtsp_server, loop_context);
+    int source_id = gst_rtsp_server_attach(server, loop_context);
     M_DEBUG("Got %d from gst_rtsp_server_attach\n", source_id);
     if ( ! source_id) {
         M_ERROR("gst_rtsp_server_attach failed\n");
@@ -692,19 +2523,24 @@ int _run_gstreamer(void)
 
 
     // Indicate how to connect to the stream
-    M_PRINT("Stream available at rtsp://127.0.0.1:%s%s\n", context.rtsp_server_port,
-           link_name);
+    for(i = 0; i < n_streams; i++){
+        if(streams[i].mount_point[0] == '\0') continue;
+        M_PRINT("Stream %s available at rtsp://127.0.0.1:%s%s\n", streams[i].input_pipe_name,
+                streams[0].rtsp_server_port, streams[i].mount_point);
+    }
 
     // Start the main loop that the RTSP Server is attached to. This will not
-    // exit until it is stopped.
+    // exit until it is stopped. Control commands are carried out on it too.
+    control_attach(g_main_loop_get_context(loop));
     g_main_loop_run(loop);
+    control_attach(NULL);
     g_main_loop_unref(loop);
 
     // Main loop has exited, time to clean up and exit the program
     M_DEBUG("g_main_loop exited\n");
 
     // Stop any remaining RTSP clients
-    (void) gst_rtsp_server_client_filter(context.rtsp_server, stop_rtsp_clients, NULL);
+    (void) gst_rtsp_server_client_filter(server, stop_rtsp_clients, NULL);
 
     return 0;
 }
@@ -723,16 +2559,32 @@ int _run_gstreamer(void)
 int main(int argc, char *argv[])
 {
 
-    strncpy(context.rtsp_server_port, DEFAULT_RTSP_PORT, MAX_RTSP_PORT_SIZE);
+    int i;
 
-    // Have the configuration module fill in the context data structure
+    strncpy(streams[0].rtsp_server_port, DEFAULT_RTSP_PORT, MAX_RTSP_PORT_SIZE);
+
+    // Have the configuration module fill in the context data structures
     // with all of the required parameters to support the given configuration
     // in the given configuration file.
-    if (config_file_read(&context)) {
+    if (config_file_read(streams, MAX_STREAMS, &n_streams)) {
         M_ERROR("Could not parse the configuration data\n");
         return -1;
     }
 
+    // the feeder's waits must not follow the wall clock when GPS or NTP set it
+    pthread_condattr_t flow_cond_attr;
+    pthread_condattr_init(&flow_cond_attr);
+    pthread_condattr_setclock(&flow_cond_attr, CLOCK_MONOTONIC);
+
+    for(i = 0; i < n_streams; i++){
+        streams[i].pipe_ch = i;
+        pthread_mutex_init(&streams[i].lock, NULL);
+        pthread_mutex_init(&streams[i].flow_lock, NULL);
+        pthread_cond_init(&streams[i].flow_cond, &flow_cond_attr);
+        pthread_mutex_init(&streams[i].simulcast_lock, NULL);
+    }
+    pthread_condattr_destroy(&flow_cond_attr);
+
     if(ParseArgs(argc, argv)){
         M_ERROR("Failed to parse args\n");
         return -1;
@@ -760,23 +2612,36 @@ int main(int argc, char *argv[])
     if(!is_standalone) make_pid_file(PROCESS_NAME);
     main_running = 1;
 
-    M_DEBUG("Using input:     %s\n", context.input_pipe_name);
-    M_DEBUG("Using RTSP port: %s\n", context.rtsp_server_port);
-    M_DEBUG("Using bitrate:   %d\n", context.output_stream_bitrate);
-    M_DEBUG("Using decimator: %d\n", context.output_frame_decimator);
+    M_DEBUG("Using RTSP port: %s\n", streams[0].rtsp_server_port);
+    for(i = 0; i < n_streams; i++){
+        M_DEBUG("Stream %d on %s\n", i, streams[i].mount_point);
+        M_DEBUG("Using input:     %s\n", streams[i].input_pipe_name);
+        M_DEBUG("Using bitrate:   %d\n", streams[i].output_stream_bitrate);
+        M_DEBUG("Using decimator: %d\n", streams[i].output_frame_decimator);
+    }
 
 
-    // Pass a pointer to the context to the pipeline module
-    pipeline_init(&context);
+    // needed before the stream setup can look for encoders
+    gst_init(NULL, NULL);
 
+    // settings can be changed live from here on, the streams just pick them
+    // up the next time they are set up if they aren't running yet
+    if(control_init(_control_apply)){
+        M_WARN("Stream settings can only be changed by restarting\n");
+    }
 
     // keep trying to run the streamer
     // a pipe disconnect will
     while(main_running)
     {
-        // try to get pipe info and set up context, retry if failed
-        if(_setup_context()){
-            M_WARN("failure setting up context based on requested pipe\n");
+        // try to get pipe info and set up each context, retry if failed
+        for(i = 0; i < n_streams && main_running; i++){
+            if(streams[i].simulcast_parent){
+                if(_setup_rendition(&streams[i])) break;
+            } else if(_setup_context(&streams[i])) break;
+        }
+        if(i < n_streams && main_running){
+            M_WARN("failure setting up context based on requested pipe %s\n", streams[i].input_pipe_name);
             M_WARN("waiting and trying again\n");
             usleep(500000);
             continue;
@@ -789,6 +2654,9 @@ int main(int argc, char *argv[])
         // or sigint handler
         _run_gstreamer();
 
+        // stop the direct readers before the pipes go away underneath them
+        for(i = 0; i < n_streams; i++) pipe_reader_stop(streams[i].pipe_ch);
+
         // if still running, sleep and go start the cycle again
         if(main_running) usleep(500000);
     }
@@ -798,7 +2666,9 @@ int main(int argc, char *argv[])
     gst_deinit();
 
 
+    control_deinit();
     pipe_client_close_all();
+    for(i = 0; i < n_streams; i++) rate_control_deinit(&streams[i].rate_control);
     if(!is_standalone) remove_pid_file(PROCESS_NAME);
     M_PRINT("Exited Cleanly\n");
 
@@ -0,0 +1,189 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "nal_parser.h"
+
+// H264 nal_unit_type values
+#define H264_NAL_SLICE     1
+#define H264_NAL_IDR       5
+#define H264_NAL_SPS       7
+#define H264_NAL_PPS       8
+
+// H265 nal_unit_type values. Even types below 16 are sub-layer non-reference
+// pictures, 16-23 are IRAP pictures (BLA, IDR, CRA), everything from 32 up is
+// non-VCL (parameter sets, SEI, ...)
+#define H265_NAL_IRAP_FIRST 16
+#define H265_NAL_IRAP_LAST  23
+#define H265_NAL_VCL_LAST   31
+#define H265_NAL_VPS        32
+#define H265_NAL_SPS        33
+#define H265_NAL_PPS        34
+
+
+// Find the first i in [start, end) where data[i] and data[i+1] are both
+// zero, every start code begins with one of these. data[end] must be
+// readable. Returns end if there are none.
+static size_t _find_zero_pair(const uint8_t *data, size_t start, size_t end)
+{
+    size_t i = start;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 16 < end; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), zero));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for(; i + 16 < end; i += 16){
+        uint8x16_t a = vld1q_u8(data + i);
+        uint8x16_t b = vld1q_u8(data + i + 1);
+        // no movemask on arm, let the scalar loop find it in this block
+        if(vmaxvq_u8(vceqzq_u8(vorrq_u8(a, b)))) break;
+    }
+#endif
+
+    for(; i < end; i++){
+        if(data[i] == 0 && data[i+1] == 0) return i;
+    }
+    return end;
+}
+
+// Find the next NAL header at or after *pos. Returns the offset of the byte
+// following the start code, or -1 if there are no more NAL units.
+static long _next_nal(const uint8_t *data, size_t size, size_t *pos)
+{
+    size_t i = *pos;
+
+    while(i + 3 < size){
+        i = _find_zero_pair(data, i, size - 3);
+        if(i + 3 >= size) break;
+        // 3 byte start code, also matches the tail of a 4 byte one
+        if(data[i+2] == 1){
+            *pos = i + 3;
+            return (long)(i + 3);
+        }
+        i++;
+    }
+    *pos = size;
+    return -1;
+}
+
+// Save a parameter set, returns 1 if it differs from the one we had
+static int _store_param_set(nal_param_set_t *set, const uint8_t *nal, size_t size)
+{
+    if(size > NAL_PARAM_SET_MAX_SIZE) return 0;
+    if(set->size == size && !memcmp(set->data, nal, size)) return 0;
+
+    memcpy(set->data, nal, size);
+    set->size = size;
+    return 1;
+}
+
+
+void nal_parse_au(nal_param_sets_t *ps, const uint8_t *data, size_t size,
+                  int is_h265, nal_au_info_t *info)
+{
+    size_t pos = 0;
+    long hdr, next;
+    int n_vcl = 0, n_ref = 0;
+
+    memset(info, 0, sizeof(*info));
+
+    for(hdr = _next_nal(data, size, &pos); hdr >= 0; hdr = next){
+        next = _next_nal(data, size, &pos);
+
+        nal_param_set_t *set = NULL;
+        if(is_h265){
+            int type = (data[hdr] >> 1) & 0x3F;
+            if(type <= H265_NAL_VCL_LAST){
+                n_vcl++;
+                if(type >= H265_NAL_IRAP_FIRST && type <= H265_NAL_IRAP_LAST) info->keyframe = 1;
+                if(type >= H265_NAL_IRAP_FIRST || (type & 1)) n_ref++;
+            }
+            else if(type == H265_NAL_VPS) set = &ps->vps;
+            else if(type == H265_NAL_SPS) set = &ps->sps;
+            else if(type == H265_NAL_PPS) set = &ps->pps;
+        } else {
+            int type = data[hdr] & 0x1F;
+            if(type >= H264_NAL_SLICE && type <= H264_NAL_IDR){
+                n_vcl++;
+                if(type == H264_NAL_IDR) info->keyframe = 1;
+                // nal_ref_idc of 0 means nothing references this slice
+                if(data[hdr] & 0x60) n_ref++;
+            }
+            else if(type == H264_NAL_SPS) set = &ps->sps;
+            else if(type == H264_NAL_PPS) set = &ps->pps;
+        }
+
+        if(set == NULL) continue;
+
+        // the NAL runs up to the next start code, minus the leading zero of a
+        // 4 byte start code or any trailing zero bytes
+        size_t end = (next >= 0) ? (size_t)next - 3 : size;
+        while(end > (size_t)hdr && data[end-1] == 0) end--;
+
+        info->has_param_sets = 1;
+        if(_store_param_set(set, data + hdr, end - hdr)) info->param_sets_changed = 1;
+    }
+
+    info->droppable = n_vcl > 0 && n_ref == 0;
+}
+
+
+size_t nal_param_sets_write(const nal_param_sets_t *ps, uint8_t *out, size_t max)
+{
+    static const uint8_t start_code[4] = {0, 0, 0, 1};
+    const nal_param_set_t *sets[3] = {&ps->vps, &ps->sps, &ps->pps};
+    size_t i, n = 0;
+
+    for(i = 0; i < 3; i++){
+        if(sets[i]->size == 0) continue;
+        if(n + sizeof(start_code) + sets[i]->size > max) return 0;
+        memcpy(out + n, start_code, sizeof(start_code));
+        n += sizeof(start_code);
+        memcpy(out + n, sets[i]->data, sets[i]->size);
+        n += sets[i]->size;
+    }
+    return n;
+}
@@ -0,0 +1,230 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <modal_pipe.h>
+#include <modal_journal.h>
+
+#include "pipe_reader.h"
+
+// how long to block in poll before checking if we were asked to stop
+#define READER_POLL_TIMEOUT_MS 100
+
+// size of the scratch buffer used to drain frames nobody wants
+#define DISCARD_CHUNK_BYTES (64*1024)
+
+typedef struct reader_t {
+    volatile int running;
+    int started;
+    pthread_t thread;
+    pipe_reader_alloc_cb alloc_cb;
+    pipe_reader_frame_cb frame_cb;
+    pipe_reader_disconnect_cb disconnect_cb;
+    void* context;
+} reader_t;
+
+static reader_t readers[PIPE_READER_MAX_CH];
+
+
+// block until the fd has data, returns -1 on hangup, error, or stop request
+static int _wait_readable(reader_t* r, int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    while(r->running){
+        int ret = poll(&pfd, 1, READER_POLL_TIMEOUT_MS);
+        if(ret < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(ret == 0) continue;
+        // POLLHUP can come along with POLLIN when the writer closed with data
+        // still in the pipe, drain that data first
+        if(pfd.revents & POLLIN) return 0;
+        if(pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) return -1;
+    }
+    return -1;
+}
+
+
+static int _read_exact(reader_t* r, int fd, void* dst, size_t len)
+{
+    char* p = (char*)dst;
+
+    while(len > 0){
+        if(_wait_readable(r, fd)) return -1;
+        ssize_t n = read(fd, p, len);
+        if(n == 0) return -1;
+        if(n < 0){
+            if(errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int _discard(reader_t* r, int fd, size_t len)
+{
+    static char scratch[DISCARD_CHUNK_BYTES];
+
+    while(len > 0){
+        size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+        if(_read_exact(r, fd, scratch, chunk)) return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+static void* _reader_thread(void* arg)
+{
+    int ch = (int)(intptr_t)arg;
+    reader_t* r = &readers[ch];
+    camera_image_metadata_t meta;
+    GstMapInfo info;
+
+    int fd = pipe_client_get_fd(ch);
+    if(fd < 0){
+        M_ERROR("pipe reader failed to get fd for channel %d\n", ch);
+        if(r->disconnect_cb) r->disconnect_cb(ch, r->context);
+        return NULL;
+    }
+
+    while(r->running){
+
+        if(_read_exact(r, fd, &meta, sizeof(meta))) break;
+
+        if(meta.magic_number != CAMERA_MAGIC_NUMBER){
+            M_ERROR("pipe reader got bad magic number 0x%X on channel %d, resyncing\n",
+                    meta.magic_number, ch);
+            pipe_client_flush(ch);
+            continue;
+        }
+        if(meta.size_bytes <= 0) continue;
+
+        GstBuffer* buf = r->alloc_cb(ch, meta, r->context);
+        if(buf == NULL){
+            if(_discard(r, fd, meta.size_bytes)) break;
+            continue;
+        }
+
+        if(!gst_buffer_map(buf, &info, GST_MAP_WRITE)){
+            M_ERROR("pipe reader failed to map buffer\n");
+            gst_buffer_unref(buf);
+            if(_discard(r, fd, meta.size_bytes)) break;
+            continue;
+        }
+        if(info.size < (gsize) meta.size_bytes){
+            M_ERROR("pipe reader buffer too small: %zu < %d\n", info.size, meta.size_bytes);
+            gst_buffer_unmap(buf, &info);
+            gst_buffer_unref(buf);
+            if(_discard(r, fd, meta.size_bytes)) break;
+            continue;
+        }
+
+        int ret = _read_exact(r, fd, info.data, meta.size_bytes);
+        gst_buffer_unmap(buf, &info);
+        if(ret){
+            gst_buffer_unref(buf);
+            break;
+        }
+        gst_buffer_set_size(buf, meta.size_bytes);
+
+        r->frame_cb(ch, meta, buf, r->context);
+    }
+
+    // only report a disconnect if we weren't asked to stop
+    if(r->running && r->disconnect_cb) r->disconnect_cb(ch, r->context);
+    return NULL;
+}
+
+
+int pipe_reader_start(int ch,
+                      pipe_reader_alloc_cb alloc_cb,
+                      pipe_reader_frame_cb frame_cb,
+                      pipe_reader_disconnect_cb disconnect_cb,
+                      void* context)
+{
+    if(ch < 0 || ch >= PIPE_READER_MAX_CH){
+        M_ERROR("pipe reader channel %d out of bounds\n", ch);
+        return -1;
+    }
+    if(alloc_cb == NULL || frame_cb == NULL){
+        M_ERROR("pipe reader needs an alloc and frame callback\n");
+        return -1;
+    }
+
+    reader_t* r = &readers[ch];
+    if(r->started){
+        M_ERROR("pipe reader already running on channel %d\n", ch);
+        return -1;
+    }
+
+    r->alloc_cb      = alloc_cb;
+    r->frame_cb      = frame_cb;
+    r->disconnect_cb = disconnect_cb;
+    r->context       = context;
+    r->running       = 1;
+
+    if(pthread_create(&r->thread, NULL, _reader_thread, (void*)(intptr_t)ch)){
+        M_ERROR("failed to start pipe reader thread\n");
+        r->running = 0;
+        return -1;
+    }
+    r->started = 1;
+    return 0;
+}
+
+
+void pipe_reader_stop(int ch)
+{
+    if(ch < 0 || ch >= PIPE_READER_MAX_CH) return;
+
+    reader_t* r = &readers[ch];
+    if(!r->started) return;
+
+    r->running = 0;
+    // don't join ourselves if a callback running on the reader thread asked
+    // us to stop, the loop will exit on its own
+    if(pthread_equal(r->thread, pthread_self())) pthread_detach(r->thread);
+    else pthread_join(r->thread, NULL);
+    r->started = 0;
+}
@@ -33,191 +33,147 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h> // for exit()
+#include <string.h>
 #include <gst/gst.h>
 #include <gst/video/video.h>
 #include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
 #include <modal_journal.h>
 
 #include "context.h"
+#include "frame_pool.h"
+#include "pipe_reader.h"
+#include "encoder.h"
+#include "pipeline.h"
 
 #define TODO_NEED_ENCODER 0
-static context_data *context;
-static GstElement* pipeline;
+// Key used to hang the stream context off its media factory
+#define FACTORY_CONTEXT_KEY "voxl-streamer-context"
 
-// Simple initialization. Just save a copy of the context pointer.
-void pipeline_init(context_data *ctx)
+// Simple initialization. Just tie the stream context to its factory so
+// create_custom_element knows which stream it is building for.
+void pipeline_init(GstRTSPMediaFactory *factory, context_data *ctx)
 {
-    context = ctx;
+    g_object_set_data(G_OBJECT(factory), FACTORY_CONTEXT_KEY, ctx);
+
+    // RTX (RFC 4588) needs the AVPF profile for clients to send NACKs,
+    // plain AVP clients still get the stream without retransmission
+    if (ctx->rtx_time_ms) {
+        gst_rtsp_media_factory_set_retransmission_time(factory,
+                                                       ctx->rtx_time_ms * GST_MSECOND);
+        gst_rtsp_media_factory_set_profiles(factory,
+                                            GST_RTSP_PROFILE_AVP | GST_RTSP_PROFILE_AVPF);
+    }
 }
 
-void pipeline_deinit(void)
+void pipeline_deinit(context_data *ctx)
 {
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(pipeline);
+    pipeline_stop_pacer(ctx);
+    if (ctx->pipeline == NULL) return;
+    gst_element_set_state(ctx->pipeline, GST_STATE_NULL);
+    gst_object_unref(ctx->pipeline);
+    ctx->pipeline = NULL;
 }
 
-static void create_elements(context_data *context) {
-    // Just create everything. We'll decide which ones to use later
-    context->test_source = gst_element_factory_make("videotestsrc", "frame_source_test");
-    context->test_caps_filter = gst_element_factory_make("capsfilter", "test_caps_filter");
-    context->app_source = gst_element_factory_make("appsrc", "frame_source_mpa");
-    context->app_source_filter = gst_element_factory_make("capsfilter", "appsrc_filter");
-    context->overlay_queue = gst_element_factory_make("queue", "overlay_queue");
-    context->image_overlay = gst_element_factory_make("gdkpixbufoverlay", "image_overlay");
-    context->scaler_queue = gst_element_factory_make("queue", "scaler_queue");
-    context->scaler = gst_element_factory_make("videoscale", "scaler");
-    context->converter_queue = gst_element_factory_make("queue", "converter_queue");
-    context->video_converter = gst_element_factory_make("videoconvert", "converter");
-    context->rotator_queue = gst_element_factory_make("queue", "rotator_queue");
-    context->video_rotate = gst_element_factory_make("videoflip", "video_rotate");
-    context->video_rotate_filter = gst_element_factory_make("capsfilter", "video_rotate_filter");
-    context->encoder_queue = gst_element_factory_make("queue", "encoder_queue");
-    context->omx_encoder = gst_element_factory_make("omxh264enc", "omx_encoder");
-#ifndef PLATFORM_APQ8096
-    context->omx_h265_encoder = gst_element_factory_make("omxh265enc", "omx_h265_encoder");
-#endif
-    context->h264_parser = gst_element_factory_make("h264parse", "h264_parser");
-    context->h265_parser = gst_element_factory_make("h265parse", "h265_parser");
-    context->rtp_filter = gst_element_factory_make("capsfilter", "rtp_filter");
-    context->rtp_queue = gst_element_factory_make("queue", "rtp_queue");
-    context->rtp_payload = gst_element_factory_make("rtph264pay", "rtp_payload");
-    context->rtp_h265_payload = gst_element_factory_make("rtph265pay", "rtp_h265_payload");
-}
+// Stages a raw stream needs between the app source and the encoder. Each
+// one is only built and linked if it would actually change the frames.
+typedef struct raw_stages_t {
+    int scale;
+    int convert;
+    int rotate;
+} raw_stages_t;
 
-static int verify_element_creation(context_data *context) {
-    if (context->test_source) {
-        M_DEBUG("Made test_source\n");
-    } else {
-        M_ERROR("Couldn't make test_source\n");
-        return -1;
-    }
-    if (context->test_caps_filter) {
-        M_DEBUG("Made test_caps_filter\n");
-    } else {
-        M_ERROR("Couldn't make test_caps_filter\n");
-        return -1;
-    }
-    if (context->overlay_queue) {
-        M_DEBUG("Made overlay_queue\n");
-    } else {
-        M_ERROR("Couldn't make overlay_queue\n");
-        return -1;
-    }
-    if (context->image_overlay) {
-        M_DEBUG("Made image_overlay\n");
-    } else {
-        M_ERROR("Couldn't make image_overlay\n");
-        return -1;
-    }
-    if (context->scaler_queue) {
-        M_DEBUG("Made scaler_queue\n");
-    } else {
-        M_ERROR("Couldn't make scaler_queue\n");
-        return -1;
-    }
-    if (context->scaler) {
-        M_DEBUG("Made scaler\n");
-    } else {
-        M_ERROR("Couldn't make scaler\n");
-        return -1;
-    }
-    if (context->converter_queue) {
-        M_DEBUG("Made converter_queue\n");
-    } else {
-        M_ERROR("Couldn't make converter_queue\n");
-        return -1;
-    }
-    if (context->video_converter) {
-        M_DEBUG("Made video_converter\n");
-    } else {
-        M_ERROR("Couldn't make video_converter\n");
-        return -1;
-    }
-    if (context->rotator_queue) {
-        M_DEBUG("Made rotator_queue\n");
-    } else {
-        M_ERROR("Couldn't make rotator_queue\n");
-        return -1;
-    }
-    if (context->video_rotate) {
-        M_DEBUG("Made video_rotate\n");
-    } else {
-        M_ERROR("Couldn't make video_rotate\n");
-        return -1;
-    }
-    if (context->video_rotate_filter) {
-        M_DEBUG("Made video_rotate_filter\n");
-    } else {
-        M_ERROR("Couldn't make video_rotate_filter\n");
-        return -1;
-    }
-    if (context->app_source) {
-        M_DEBUG("Made app_source\n");
-    } else {
-        M_ERROR("Couldn't make app_source\n");
-        return -1;
-    }
-    if (context->app_source_filter) {
-        M_DEBUG("Made app_source_filter\n");
-    } else {
-        M_ERROR("Couldn't make app_source_filter\n");
-        return -1;
+static void _plan_raw_stages(context_data *context, raw_stages_t *stages) {
+    uint32_t width = context->input_frame_width;
+    uint32_t height = context->input_frame_height;
+
+    memset(stages, 0, sizeof(*stages));
+
+    // the feeder already hands over what the encoder wants
+    if (context->fused_convert) return;
+
+    if (context->output_stream_rotation == 90 || context->output_stream_rotation == 270) {
+        width = context->input_frame_height;
+        height = context->input_frame_width;
     }
-    if (context->encoder_queue) {
-        M_DEBUG("Made encoder_queue\n");
+    stages->scale = (width != context->output_stream_width ||
+                     height != context->output_stream_height);
+    stages->convert = (context->input_frame_gst_format != GST_VIDEO_FORMAT_NV12);
+    stages->rotate = (context->output_stream_rotation != 0);
+}
+
+static GstElement* _make_element(const char *factory, const char *name) {
+    GstElement *element = gst_element_factory_make(factory, name);
+    if (element) {
+        M_DEBUG("Made %s\n", name);
     } else {
-        M_ERROR("Couldn't make encoder_queue\n");
-        return -1;
+        M_ERROR("Couldn't make %s (%s)\n", name, factory);
     }
-    if (context->omx_encoder) {
-        M_DEBUG("Made omx_encoder\n");
-    } else {
-        M_ERROR("Couldn't make omx_encoder\n");
-        return -1;
+    return element;
+}
+
+// Only make what's going to be linked. Anything not needed for this stream
+// stays NULL so nothing refers to elements of a previous pipeline.
+static int create_elements(context_data *context, const raw_stages_t *stages) {
+    context->app_source = NULL;
+    context->app_source_filter = NULL;
+    context->scaler_queue = NULL;
+    context->scaler = NULL;
+    context->converter_queue = NULL;
+    context->video_converter = NULL;
+    context->rotator_queue = NULL;
+    context->video_rotate = NULL;
+    context->video_rotate_filter = NULL;
+    context->encoder_queue = NULL;
+    context->encoder = NULL;
+    context->encoder_parser = NULL;
+    context->rtp_filter = NULL;
+    context->rtp_queue = NULL;
+    context->rtp_payload = NULL;
+    context->rtp_h265_payload = NULL;
+
+    if ( ! (context->app_source = _make_element("appsrc", "frame_source_mpa"))) return -1;
+
+    if (context->input_format == IMAGE_FORMAT_H264) {
+        if ( ! (context->rtp_payload = _make_element("rtph264pay", "rtp_payload"))) return -1;
+        return 0;
     }
-#ifndef PLATFORM_APQ8096
-    if (context->omx_h265_encoder) {
-        M_DEBUG("Made omx_h265_encoder\n");
-    } else {
-        M_ERROR("Couldn't make omx_h265_encoder\n");
-        return -1;
+    if (context->input_format == IMAGE_FORMAT_H265) {
+        if ( ! (context->rtp_h265_payload = _make_element("rtph265pay", "rtp_h265_payload"))) return -1;
+        return 0;
     }
-#endif
-    if (context->h264_parser) {
-        M_DEBUG("Made h264_parser\n");
-    } else {
-        M_ERROR("Couldn't make h264_parser\n");
-        return -1;
+
+    if ( ! (context->app_source_filter = _make_element("capsfilter", "appsrc_filter"))) return -1;
+    if (stages->scale) {
+        if ( ! (context->scaler_queue = _make_element("queue", "scaler_queue"))) return -1;
+        if ( ! (context->scaler = _make_element("videoscale", "scaler"))) return -1;
     }
-    if (context->h265_parser) {
-        M_DEBUG("Made h265_parser\n");
-    } else {
-        M_ERROR("Couldn't make h265_parser\n");
-        return -1;
+    if (stages->convert) {
+        if ( ! (context->converter_queue = _make_element("queue", "converter_queue"))) return -1;
+        if ( ! (context->video_converter = _make_element("videoconvert", "converter"))) return -1;
     }
-    if (context->rtp_filter) {
-        M_DEBUG("Made rtp_filter\n");
-    } else {
-        M_ERROR("Couldn't make rtp_filter\n");
-        return -1;
+    if (stages->rotate) {
+        if ( ! (context->rotator_queue = _make_element("queue", "rotator_queue"))) return -1;
+        if ( ! (context->video_rotate = _make_element("videoflip", "video_rotate"))) return -1;
     }
-    if (context->rtp_queue) {
-        M_DEBUG("Made rtp_queue\n");
-    } else {
-        M_ERROR("Couldn't make rtp_queue\n");
-        return -1;
+    if (stages->scale || stages->convert || stages->rotate) {
+        if ( ! (context->video_rotate_filter = _make_element("capsfilter", "video_rotate_filter"))) return -1;
     }
-    if (context->rtp_payload) {
-        M_DEBUG("Made rtp_payload\n");
-    } else {
-        M_ERROR("Couldn't make rtp_payload\n");
-        return -1;
+    if ( ! (context->encoder_queue = _make_element("queue", "encoder_queue"))) return -1;
+    if ( ! (context->encoder = encoder_create(context->encoder_backend, "encoder",
+                                              context->output_stream_bitrate,
+                                              context->gop_size,
+                                              context->encode_slices))) return -1;
+    if (context->encode_slices > 1) {
+        const char *parser = encoder_is_h265(context->encoder_backend) ? "h265parse" : "h264parse";
+        if ( ! (context->encoder_parser = _make_element(parser, "encoder_parser"))) return -1;
     }
-    if (context->rtp_h265_payload) {
-        M_DEBUG("Made rtp_h265_payload\n");
+    if ( ! (context->rtp_filter = _make_element("capsfilter", "rtp_filter"))) return -1;
+    if ( ! (context->rtp_queue = _make_element("queue", "rtp_queue"))) return -1;
+    if (encoder_is_h265(context->encoder_backend)) {
+        if ( ! (context->rtp_h265_payload = _make_element("rtph265pay", "rtp_h265_payload"))) return -1;
     } else {
-        M_ERROR("Couldn't make rtp_h265_payload\n");
-        return -1;
+        if ( ! (context->rtp_payload = _make_element("rtph264pay", "rtp_payload"))) return -1;
     }
     return 0;
 }
@@ -225,16 +181,31 @@ static int verify_element_creation(context_data *context) {
 // This is a callback to indicate when the pipeline needs data
 static void start_feed(GstElement *source, guint size, context_data *data) {
     M_VERBOSE("*** Start feeding ***\n");
+    pthread_mutex_lock(&data->flow_lock);
+    data->feeding = 1;
     data->need_data = 1;
+    pthread_cond_signal(&data->flow_cond);
+    pthread_mutex_unlock(&data->flow_lock);
 }
 
 // This is a callback to indicate when the pipeline no longer needs data.
-// This isn't called with our pipeline because we feed frames at the correct rate.
+// The app source queue is bounded by max-bytes so this fires whenever the
+// encoder falls behind, the feeder thread then applies the drop policy.
 static void stop_feed(GstElement *source, context_data *data) {
     M_VERBOSE("*** Stop feeding ***\n");
     data->need_data = 0;
 }
 
+// Size the app source queue to hold appsrc_max_latency_ms worth of frames
+static guint64 appsrc_max_bytes(context_data *context) {
+    guint64 frame_bytes = frame_pool_slot_size(context);
+    guint64 fps = context->input_frame_rate > 0 ? context->input_frame_rate : 30;
+    guint64 frames = (fps * context->appsrc_max_latency_ms + 999) / 1000;
+
+    if (frames < 1) frames = 1;
+    return frames * frame_bytes;
+}
+
 // These are the callbacks to let us know of bus messages
 static void warn_cb(GstBus *bus, GstMessage *msg, context_data *data) {
     GError *err;
@@ -265,16 +236,434 @@ static void error_cb(GstBus *bus, GstMessage *msg, context_data *data) {
 }
 
 
+// videoflip method for the configured rotation, -1 if it isn't supported
+static int _rotation_method(context_data *context) {
+    switch (context->output_stream_rotation) {
+        case 0:   return 0;
+        case 90:  return 1;
+        case 180: return 2;
+        case 270: return 3;
+    }
+    M_ERROR("Rotation can only be 0, 90, 180, or 270, not %u\n",
+            context->output_stream_rotation);
+    return -1;
+}
+
+// Caps for raw frames coming from the pipe
+static GstCaps* _raw_input_caps(context_data *context) {
+    GstVideoInfo* video_info;
+    GstCaps* video_caps;
+
+    // Configure the application source
+    video_info = gst_video_info_new();
+    if (video_info) {
+        M_DEBUG("Made video_info\n");
+    } else {
+        M_ERROR("Couldn't make video_info\n");
+        return NULL;
+    }
+    // the feeder hands over NV12 that's already rotated
+    if (context->fused_convert) {
+        gst_video_info_set_format(video_info,
+                                  GST_VIDEO_FORMAT_NV12,
+                                  context->output_stream_width,
+                                  context->output_stream_height);
+    } else {
+        gst_video_info_set_format(video_info,
+                                  context->input_frame_gst_format,
+                                  context->input_frame_width,
+                                  context->input_frame_height);
+        video_info->size = context->input_frame_size;
+    }
+    video_info->par_n = context->input_frame_width;
+    video_info->par_d = context->input_frame_height;
+    video_info->fps_n = context->input_frame_rate;
+    video_info->fps_d = 1;
+    video_info->chroma_site = GST_VIDEO_CHROMA_SITE_UNKNOWN;
+
+    video_caps = gst_video_info_to_caps(video_info);
+    gst_video_info_free(video_info);
+    M_DEBUG("Finished setting up video capture\n");
+    return video_caps;
+}
+
+static void _configure_app_source(context_data *context, GstCaps *video_caps) {
+    g_object_set(context->app_source, "caps", video_caps, NULL);
+    g_object_set(context->app_source, "format", GST_FORMAT_TIME, NULL);
+    g_object_set(context->app_source, "is-live", 1, NULL);
+
+    // Bound the app source queue so memory and latency stay predictable
+    // if the encoder falls behind
+    g_object_set(context->app_source, "block", FALSE, NULL);
+    g_object_set(context->app_source, "max-bytes", appsrc_max_bytes(context), NULL);
+    g_object_set(context->app_source, "max-latency",
+                 (gint64) context->appsrc_max_latency_ms * GST_MSECOND, NULL);
+
+    g_signal_connect(context->app_source, "need-data", G_CALLBACK(start_feed), context);
+    g_signal_connect(context->app_source, "enough-data", G_CALLBACK(stop_feed), context);
+}
+
+// Caps for pre-encoded frames coming straight from the pipe at the current
+// stream size. There is no parser in this path, each pipe frame is pushed
+// as is and we keep track of the parameter sets ourselves.
+static GstCaps* _encoded_input_caps(context_data *context) {
+    const char* media = (context->input_format == IMAGE_FORMAT_H265) ? "video/x-h265"
+                                                                     : "video/x-h264";
+    return gst_caps_new_simple(media,
+                               "width", G_TYPE_INT, context->output_stream_width,
+                               "height", G_TYPE_INT, context->output_stream_height,
+                               "profile", G_TYPE_STRING, "baseline",
+                               "stream-format", G_TYPE_STRING, "byte-stream",
+                               "alignment", G_TYPE_STRING, "nal",
+                               NULL);
+}
+
+void pipeline_set_encoded_size(context_data *ctx, uint32_t width, uint32_t height)
+{
+    if (ctx->output_stream_width == width && ctx->output_stream_height == height) return;
+
+    M_PRINT("Encoded stream changed size from %ux%u to %ux%u\n",
+            ctx->output_stream_width, ctx->output_stream_height, width, height);
+    ctx->output_stream_width = width;
+    ctx->output_stream_height = height;
+
+    // nothing to update until a client has had a pipeline built
+    if (ctx->pipeline == NULL || ctx->app_source == NULL) return;
+
+    GstCaps* caps = _encoded_input_caps(ctx);
+    if ( ! caps) {
+        M_ERROR("Failed to create caps for new stream size\n");
+        return;
+    }
+    g_object_set(ctx->app_source, "caps", caps, NULL);
+    gst_caps_unref(caps);
+}
+
+void pipeline_update_raw_caps(context_data *ctx)
+{
+    GstCaps *caps;
+
+    // nothing to update until a client has had a pipeline built
+    if (ctx->pipeline == NULL || ctx->app_source == NULL) return;
+
+    caps = _raw_input_caps(ctx);
+    if ( ! caps) {
+        M_ERROR("Failed to create caps for new output\n");
+        return;
+    }
+    g_object_set(ctx->app_source, "caps", caps, NULL);
+    g_object_set(ctx->app_source, "max-bytes", appsrc_max_bytes(ctx), NULL);
+
+    // The app source keeps the caps in order with the frames it has queued
+    // but the filters further down change straight away. Loosen them to
+    // what stays the same so the frames still in flight get through.
+    if (ctx->app_source_filter) {
+        gst_structure_remove_fields(gst_caps_get_structure(caps, 0),
+                                    "width", "height", "framerate", NULL);
+        g_object_set(ctx->app_source_filter, "caps", caps, NULL);
+    }
+    gst_caps_unref(caps);
+
+    // this one sets what the scaler makes, only the frame rate can go
+    if (ctx->video_rotate_filter) {
+        caps = gst_caps_new_simple("video/x-raw",
+                                   "format", G_TYPE_STRING, "NV12",
+                                   "width", G_TYPE_INT, ctx->output_stream_width,
+                                   "height", G_TYPE_INT, ctx->output_stream_height,
+                                   NULL);
+        g_object_set(ctx->video_rotate_filter, "caps", caps, NULL);
+        gst_caps_unref(caps);
+    }
+
+    if (ctx->rtp_filter) {
+        caps = encoder_caps(ctx->encoder_backend);
+        if (ctx->encoder_parser) {
+            gst_caps_set_simple(caps, "alignment", G_TYPE_STRING, "nal", NULL);
+        }
+        g_object_set(ctx->rtp_filter, "caps", caps, NULL);
+        gst_caps_unref(caps);
+    }
+}
+
+// Pushed to the pacing queue to stop its thread
+static int pacing_stop;
+
+static void _count_send(context_data *context, guint n)
+{
+    atomic_fetch_add(&context->pacing_packets, n);
+    atomic_fetch_add(&context->pacing_sends, 1);
+    if (n > atomic_load(&context->pacing_max_burst)) {
+        atomic_store(&context->pacing_max_burst, n);
+    }
+}
+
+// Split a frame's packets into bursts spread over the pacing window
+static void _pace_list(context_data *context, GstBufferList *list)
+{
+    guint burst = context->pacing_burst_packets;
+    guint n = gst_buffer_list_length(list);
+    guint n_bursts = (n + burst - 1) / burst;
+    gulong gap_us = context->pacing_window_us / n_bursts;
+    guint i, j;
+
+    if (n_bursts > 1) atomic_fetch_add(&context->pacing_frames_paced, 1);
+    for (i = 0; i < n; i += burst) {
+        guint end = MIN(i + burst, n);
+        GstBufferList *chunk = gst_buffer_list_new_sized(end - i);
+        for (j = i; j < end; j++) {
+            gst_buffer_list_add(chunk, gst_buffer_ref(gst_buffer_list_get(list, j)));
+        }
+        _count_send(context, end - i);
+        if (gst_pad_push_list(context->pacing_pad, chunk) != GST_FLOW_OK) break;
+        if (end < n) g_usleep(gap_us);
+    }
+    gst_buffer_list_unref(list);
+}
+
+static void* _pacing_thread_func(void *arg)
+{
+    context_data *context = (context_data*) arg;
+    gpointer data;
+
+    while ((data = g_async_queue_pop(context->pacing_queue)) != &pacing_stop) {
+        if (GST_IS_BUFFER_LIST(data)) {
+            _pace_list(context, GST_BUFFER_LIST(data));
+        } else {
+            _count_send(context, 1);
+            gst_pad_push(context->pacing_pad, GST_BUFFER(data));
+        }
+        atomic_fetch_sub(&context->pacing_pending, 1);
+    }
+    return NULL;
+}
+
+// The payloaders push all the packets of a frame as one buffer list, which
+// multiudpsink sends with a single sendmmsg. Big frames go to the pacing
+// thread to be split into bursts, along with anything that comes after them
+// while they are still going out so nothing gets reordered. The bursts come
+// back through here from the pacing thread and go straight on.
+static GstPadProbeReturn _pace_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+{
+    context_data *context = (context_data*) user_data;
+    guint n = 1;
+
+    if ( ! context->pacing_running) return GST_PAD_PROBE_OK;
+    if (pthread_equal(pthread_self(), context->pacing_thread)) return GST_PAD_PROBE_OK;
+
+    if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        n = gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    }
+
+    if (n <= context->pacing_burst_packets && atomic_load(&context->pacing_pending) == 0) {
+        _count_send(context, n);
+        return GST_PAD_PROBE_OK;
+    }
+
+    atomic_fetch_add(&context->pacing_pending, 1);
+    g_async_queue_push(context->pacing_queue,
+                       gst_mini_object_ref(GST_PAD_PROBE_INFO_DATA(info)));
+    return GST_PAD_PROBE_DROP;
+}
+
+void pipeline_stop_pacer(context_data *ctx)
+{
+    gpointer data;
+
+    if ( ! ctx->pacing_running) return;
+
+    g_async_queue_push(ctx->pacing_queue, &pacing_stop);
+    pthread_join(ctx->pacing_thread, NULL);
+    ctx->pacing_running = 0;
+
+    while ((data = g_async_queue_try_pop(ctx->pacing_queue)) != NULL) {
+        gst_mini_object_unref(GST_MINI_OBJECT_CAST(data));
+    }
+    g_async_queue_unref(ctx->pacing_queue);
+    ctx->pacing_queue = NULL;
+    gst_object_unref(ctx->pacing_pad);
+    ctx->pacing_pad = NULL;
+    atomic_store(&ctx->pacing_pending, 0);
+}
+
+// Note when each frame goes into the encoder
+static GstPadProbeReturn _encode_in_probe(GstPad *pad, GstPadProbeInfo *info,
+                                          gpointer user_data)
+{
+    context_data *context = user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    if ( ! GST_BUFFER_PTS_IS_VALID(buf)) return GST_PAD_PROBE_OK;
+
+    pthread_mutex_lock(&context->lock);
+    unsigned int slot = context->encode_slot++ % ENCODE_LATENCY_SLOTS;
+    context->encode_pts[slot] = GST_BUFFER_PTS(buf);
+    context->encode_in_us[slot] = g_get_monotonic_time();
+    pthread_mutex_unlock(&context->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+// and when the first of its data comes out the other side
+static GstPadProbeReturn _encode_out_probe(GstPad *pad, GstPadProbeInfo *info,
+                                           gpointer user_data)
+{
+    context_data *context = user_data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    int i;
+
+    if ( ! GST_BUFFER_PTS_IS_VALID(buf)) return GST_PAD_PROBE_OK;
+
+    gint64 now_us = g_get_monotonic_time();
+    pthread_mutex_lock(&context->lock);
+    for (i = 0; i < ENCODE_LATENCY_SLOTS; i++) {
+        if (context->encode_in_us[i] == 0 ||
+            context->encode_pts[i] != GST_BUFFER_PTS(buf)) continue;
+
+        gint64 latency_us = now_us - context->encode_in_us[i];
+        context->encode_in_us[i] = 0;
+        context->encode_frames++;
+        context->encode_latency_us += latency_us;
+        if (latency_us > context->encode_latency_max_us) {
+            context->encode_latency_max_us = latency_us;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&context->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+static void _attach_encode_probes(context_data *context, GstElement *encoder)
+{
+    GstPad *sink = gst_element_get_static_pad(encoder, "sink");
+    GstPad *src = gst_element_get_static_pad(encoder, "src");
+
+    memset(context->encode_in_us, 0, sizeof(context->encode_in_us));
+    if (sink) {
+        gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, _encode_in_probe, context, NULL);
+        gst_object_unref(sink);
+    }
+    if (src) {
+        gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, _encode_out_probe, context, NULL);
+        gst_object_unref(src);
+    }
+}
+
+// Turn a pending keyframe request into a force key unit event ahead of the
+// next frame into the encoder, at most once per keyframe_min_interval_ms so
+// a room full of clients joining or losing packets can't fill the stream
+// with keyframes
+static GstPadProbeReturn _keyframe_probe(GstPad *pad, GstPadProbeInfo *info,
+                                         gpointer user_data)
+{
+    context_data *context = user_data;
+
+    if ( ! atomic_load(&context->keyframe_pending)) return GST_PAD_PROBE_OK;
+
+    gint64 now_us = g_get_monotonic_time();
+    if (context->keyframe_last_us &&
+        now_us - context->keyframe_last_us < (gint64) context->keyframe_min_interval_ms * 1000) {
+        return GST_PAD_PROBE_OK;
+    }
+
+    atomic_store(&context->keyframe_pending, 0);
+    context->keyframe_last_us = now_us;
+    atomic_fetch_add(&context->keyframes_forced, 1);
+    gst_pad_send_event(pad, gst_video_event_new_downstream_force_key_unit(
+        GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE, TRUE, 0));
+    return GST_PAD_PROBE_OK;
+}
+
+static void _attach_keyframe_probe(context_data *context, GstElement *encoder)
+{
+    GstPad *sink = gst_element_get_static_pad(encoder, "sink");
+    if (sink == NULL) return;
+
+    atomic_store(&context->keyframe_pending, 0);
+    context->keyframe_last_us = 0;
+    gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER, _keyframe_probe, context, NULL);
+    gst_object_unref(sink);
+}
+
+// rtpsession asks upstream for a keyframe when a client sends PLI or FIR.
+// Catch it at the payloader and let the keyframe probe pace it instead of
+// every request going straight to the encoder.
+static GstPadProbeReturn _keyframe_request_probe(GstPad *pad, GstPadProbeInfo *info,
+                                                 gpointer user_data)
+{
+    context_data *context = user_data;
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+    if ( ! gst_video_event_is_force_key_unit(event)) return GST_PAD_PROBE_OK;
+
+    M_DEBUG("keyframe requested by a client of %s\n", context->mount_point);
+    pipeline_request_keyframe(context);
+    return GST_PAD_PROBE_DROP;
+}
+
+static void _attach_keyframe_requests(context_data *context, GstElement *payloader)
+{
+    GstPad *src = gst_element_get_static_pad(payloader, "src");
+    if (src == NULL) return;
+
+    gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM,
+                      _keyframe_request_probe, context, NULL);
+    gst_object_unref(src);
+}
+
+static void _attach_pacer(context_data *context, GstElement *payloader)
+{
+    if (context->pacing_window_ms == 0) return;
+
+    // never let one frame's packets run into the next frame
+    context->pacing_window_us = (gint64) context->pacing_window_ms * 1000;
+    int fps = context->output_frame_rate ? (int) context->output_frame_rate
+                                         : context->input_frame_rate;
+    if (fps > 0 && context->pacing_window_us > 500000 / fps) {
+        context->pacing_window_us = 500000 / fps;
+    }
+    // slices come to the payloader one at a time, each gets its share
+    if (context->encoder_parser) {
+        context->pacing_window_us /= context->encode_slices;
+    }
+
+    // left over from the last media if it never got unprepared
+    pipeline_stop_pacer(context);
+
+    GstPad *pad = gst_element_get_static_pad(payloader, "src");
+    if (pad == NULL) {
+        M_ERROR("Couldn't get the payloader pad for pacing\n");
+        return;
+    }
+
+    context->pacing_pad = pad;
+    context->pacing_queue = g_async_queue_new();
+    atomic_store(&context->pacing_pending, 0);
+    if (pthread_create(&context->pacing_thread, NULL, _pacing_thread_func, context)) {
+        M_ERROR("Couldn't start the pacing thread\n");
+        g_async_queue_unref(context->pacing_queue);
+        context->pacing_queue = NULL;
+        gst_object_unref(pad);
+        context->pacing_pad = NULL;
+        return;
+    }
+    context->pacing_running = 1;
+
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                      _pace_probe, context, NULL);
+    M_DEBUG("Pacing frames over %" G_GINT64_FORMAT "us in bursts of %u packets\n",
+            context->pacing_window_us, context->pacing_burst_packets);
+}
 
 // This is used to override the standard element creator that relies on having
 // a gstreamer launch line. This allows us to use our custom pipeline.
 GstElement *create_custom_element(GstRTSPMediaFactory *factory, const GstRTSPUrl *url)
 {
 
-    M_DEBUG("Creating media pipeline for RTSP client\n");
+    context_data *context = g_object_get_data(G_OBJECT(factory), FACTORY_CONTEXT_KEY);
+    GstElement* pipeline;
+
+    M_DEBUG("Creating media pipeline for RTSP client on %s\n", context->mount_point);
 
 
-    GstVideoInfo* video_info;
     GstCaps* video_caps;
     GstBus* bus;
 
@@ -293,64 +682,25 @@ GstElement *create_custom_element(GstRTSPMediaFactory *factory, const GstRTSPUrl
 
     // Figure out what kinds of transformations are required to get the
     // video ready for the encoder
-    int rotation_method = 0;
-    if (context->output_stream_rotation == 90) {
-        rotation_method = 1;
-    } else if (context->output_stream_rotation == 180) {
-        rotation_method = 2;
-    } else if (context->output_stream_rotation == 270) {
-        rotation_method = 3;
-    } else if (context->output_stream_rotation) {
-        M_ERROR("Rotation can only be 0, 90, 180, or 270, not %u\n",
-                context->output_stream_rotation);
-        return NULL;
-    }
+    int rotation_method = _rotation_method(context);
+    if (rotation_method < 0) return NULL;
 
-    // Create all of the needed elements
-    create_elements(context);
+    raw_stages_t stages;
+    _plan_raw_stages(context, &stages);
+    if (context->input_format != IMAGE_FORMAT_H264 &&
+        context->input_format != IMAGE_FORMAT_H265) {
+        M_DEBUG("Raw stages: scale %d convert %d rotate %d\n",
+                stages.scale, stages.convert, stages.rotate);
+    }
 
-    // Verify that all needed elements were created
-    if (verify_element_creation(context)) return NULL;
+    // Create only the elements this stream needs
+    if (create_elements(context, &stages)) return NULL;
 
-    if(context->input_format == IMAGE_FORMAT_H264){
-        video_caps = gst_caps_new_simple("video/x-h264",
-                                        "width", G_TYPE_INT, context->output_stream_width,
-                                        "height", G_TYPE_INT, context->output_stream_height,
-                                        "profile", G_TYPE_STRING, "baseline",
-                                        "stream-format", G_TYPE_STRING, "byte-stream",
-                                        "alignment", G_TYPE_STRING, "nal",
-                                        NULL);
-    } else if(context->input_format == IMAGE_FORMAT_H265){
-        video_caps = gst_caps_new_simple("video/x-h265",
-                                        "width", G_TYPE_INT, context->output_stream_width,
-                                        "height", G_TYPE_INT, context->output_stream_height,
-                                        "profile", G_TYPE_STRING, "baseline",
-                                        "stream-format", G_TYPE_STRING, "byte-stream",
-                                        "alignment", G_TYPE_STRING, "nal",
-                                        NULL);
+    if(context->input_format == IMAGE_FORMAT_H264 ||
+       context->input_format == IMAGE_FORMAT_H265){
+        video_caps = _encoded_input_caps(context);
     } else {
-        // Configure the application source
-        video_info = gst_video_info_new();
-        if (video_info) {
-            M_DEBUG("Made video_info\n");
-        } else {
-            M_ERROR("Couldn't make video_info\n");
-            return NULL;
-        }
-        gst_video_info_set_format(video_info,
-                                  context->input_frame_gst_format,
-                                  context->input_frame_width,
-                                  context->input_frame_height);
-        video_info->size = context->input_frame_size;
-        video_info->par_n = context->input_frame_width;
-        video_info->par_d = context->input_frame_height;
-        video_info->fps_n = context->input_frame_rate;
-        video_info->fps_d = 1;
-        video_info->chroma_site = GST_VIDEO_CHROMA_SITE_UNKNOWN;
-
-        video_caps = gst_video_info_to_caps(video_info);
-        gst_video_info_free(video_info);
-        M_DEBUG("Finished setting up video capture\n");
+        video_caps = _raw_input_caps(context);
     }
 
     if ( ! video_caps) {
@@ -358,203 +708,694 @@ GstElement *create_custom_element(GstRTSPMediaFactory *factory, const GstRTSPUrl
         return NULL;
     }
 
-    g_object_set(context->app_source, "caps", video_caps, NULL);
-    g_object_set(context->app_source, "format", GST_FORMAT_TIME, NULL);
-    g_object_set(context->app_source, "is-live", 1, NULL);
+    _configure_app_source(context, video_caps);
 
-    g_signal_connect(context->app_source, "need-data", G_CALLBACK(start_feed), context);
-    g_signal_connect(context->app_source, "enough-data", G_CALLBACK(stop_feed), context);
+    // Pre-encoded frames go straight into the payloader
+    if(context->input_format == IMAGE_FORMAT_H264 ||
+       context->input_format == IMAGE_FORMAT_H265){
+        GstElement *payload = context->input_format == IMAGE_FORMAT_H264 ?
+                              context->rtp_payload : context->rtp_h265_payload;
+        gst_caps_unref(video_caps);
 
-    g_object_set(context->app_source_filter, "caps", video_caps, NULL);
-    gst_caps_unref(video_caps);
-
-    // Configure the image overlay input queue
-    g_object_set(context->overlay_queue, "leaky", 1, NULL);
-    g_object_set(context->overlay_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the video scaler input queue
-    g_object_set(context->scaler_queue, "leaky", 1, NULL);
-    g_object_set(context->scaler_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the video converter input queue
-    g_object_set(context->converter_queue, "leaky", 1, NULL);
-    g_object_set(context->converter_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the video rotator input queue
-    g_object_set(context->rotator_queue, "leaky", 1, NULL);
-    g_object_set(context->rotator_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the rotator
-    g_object_set(context->video_rotate, "method", rotation_method, NULL);
-
-    // Configure the encoder queue
-    g_object_set(context->encoder_queue, "leaky", 1, NULL);
-    g_object_set(context->encoder_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the h264 parser
-    // stream-format: { (string)avc, (string)avc3, (string)byte-stream }
-    // alignment: { (string)au, (string)nal }
-    // g_object_set(context->h264_parser, "stream-format", "byte-stream", NULL);
-    // g_object_set(context->h264_parser, "alignment", "nal", NULL);
-
-    // Configure the OMX encoder
-    g_object_set(context->omx_encoder, "control-rate", 1, 
-                                       "interval-intraframes", 30, NULL);
-    g_object_set(context->omx_encoder, "target-bitrate",
-                 context->output_stream_bitrate, NULL);
-
-    // Configure the RTP input queue
-    g_object_set(context->rtp_queue, "leaky", 1, NULL);
-    g_object_set(context->rtp_queue, "max-size-buffers", 100, NULL);
-
-    // Configure the RTP payload
-    g_object_set(context->rtp_payload, "name", "pay0", NULL);
-    g_object_set(context->rtp_payload, "pt", 96, NULL);
-    g_object_set(context->rtp_h265_payload, "name", "pay0", NULL);
-    g_object_set(context->rtp_h265_payload, "pt", 96, NULL);
-
-    // Configure the caps filter to reflect the output of the OMX encoder
-    GstCaps *filtercaps;
-    if(context->input_format == IMAGE_FORMAT_H264){
-        filtercaps = gst_caps_new_simple("video/x-h264",
-                                                "width", G_TYPE_INT, context->output_stream_width,
-                                                "height", G_TYPE_INT, context->output_stream_height,
-                                                "profile", G_TYPE_STRING, "baseline",
-                                                NULL);
-    } else if(context->input_format == IMAGE_FORMAT_H265){
-        filtercaps = gst_caps_new_simple("video/x-h265",
-                                                "width", G_TYPE_INT, context->output_stream_width,
-                                                "height", G_TYPE_INT, context->output_stream_height,
-                                                "profile", G_TYPE_STRING, "baseline",
-                                                NULL);
-    } else {
-        filtercaps = gst_caps_new_simple("video/x-raw",
-                                                "format", G_TYPE_STRING, "NV12",
-                                                "width", G_TYPE_INT, context->output_stream_width,
-                                                "height", G_TYPE_INT, context->output_stream_height,
-                                                "framerate", GST_TYPE_FRACTION,
-                                                context->input_frame_rate, 1,
-                                                NULL);
-        if ( ! filtercaps) {
-            M_ERROR("Failed to create filtercaps object\n");
+        g_object_set(payload, "name", "pay0", NULL);
+        g_object_set(payload, "pt", 96, NULL);
+
+        gst_bin_add_many(GST_BIN(pipeline), context->app_source, payload, NULL);
+        if ( ! gst_element_link(context->app_source, payload)) {
+            M_ERROR("Couldn't link app source and payloader\n");
+            gst_object_unref(pipeline);
             return NULL;
         }
-        g_object_set(context->video_rotate_filter, "caps", filtercaps, NULL);
-        gst_caps_unref(filtercaps);
+    } else {
+        GstElement *last_element;
+        GstCaps *filtercaps;
 
-        // Configure the caps filter to reflect the output of the OMX encoder
-        filtercaps = gst_caps_new_simple("video/x-h264",
-                                        "width", G_TYPE_INT, context->output_stream_width,
-                                        "height", G_TYPE_INT, context->output_stream_height,
-                                        "profile", G_TYPE_STRING, "baseline",
-                                        NULL);
-    }
-    if ( ! filtercaps) {
-        M_ERROR("Failed to create filtercaps object\n");
-        return NULL;
-    }
-    g_object_set(context->rtp_filter, "caps", filtercaps, NULL);
-    gst_caps_unref(filtercaps);
+        g_object_set(context->app_source_filter, "caps", video_caps, NULL);
+        gst_caps_unref(video_caps);
 
-    if(context->input_format == IMAGE_FORMAT_H264){
-        gst_bin_add_many(GST_BIN(pipeline),
-                        context->app_source,
-                        context->h264_parser,
-                        context->rtp_payload,
-                        NULL);
-    } else if(context->input_format == IMAGE_FORMAT_H265){
-        gst_bin_add_many(GST_BIN(pipeline),
-                        context->app_source,
-                        context->h265_parser,
-                        context->rtp_h265_payload,
-                        NULL);
-    } else {
         gst_bin_add_many(GST_BIN(pipeline),
                         context->app_source,
                         context->app_source_filter,
                         NULL);
-        gst_bin_add_many(GST_BIN(pipeline),
-                        context->scaler_queue,
-                        context->scaler,
-                        context->converter_queue,
-                        context->video_converter,
-                        context->rotator_queue,
-                        context->video_rotate,
-                        context->video_rotate_filter,
-                        context->encoder_queue,
-                        context->omx_encoder,
-                        context->rtp_filter,
-                        context->rtp_queue,
-                        context->rtp_payload,
-                        NULL);
-    }
-
-    if(context->input_format == IMAGE_FORMAT_H264){
-        if ( ! gst_element_link_many(context->app_source,
-                                    context->h264_parser,
-                                    // context->rtp_filter,
-                                    // context->rtp_queue,
-                                    context->rtp_payload,
-                                    NULL)) {
-            M_ERROR("Couldn't finish pipeline linking part 2\n");
-            return NULL;
-        }
-    } else if(context->input_format == IMAGE_FORMAT_H265){
-        if ( ! gst_element_link_many(context->app_source,
-                                    context->h265_parser,
-                                    // context->rtp_filter,
-                                    // context->rtp_queue,
-                                    context->rtp_h265_payload,
-                                    NULL)) {
-            M_ERROR("Couldn't finish pipeline linking part 3\n");
-            return NULL;
-        }
-    } else {
-        GstElement *last_element = NULL;
-
-        // Link all elements in the pipeline
         if ( ! gst_element_link(context->app_source,
                                 context->app_source_filter)) {
             M_ERROR("Couldn't link app_source and app_source_filter\n");
+            gst_object_unref(pipeline);
             return NULL;
         }
         M_DEBUG("Linked app source and filter\n");
         last_element = context->app_source_filter;
 
-        if ( ! gst_element_link_many(last_element,
-                                    context->scaler_queue,
-                                    context->scaler,
-                                    context->converter_queue,
-                                    context->video_converter,
-                                    context->rotator_queue,
-                                    context->video_rotate,
-                                    context->video_rotate_filter,
-                                    NULL)) {
-            M_ERROR("Couldn't finish pipeline linking part 1\n");
+        // Each stage gets a leaky queue in front of it so it runs on its
+        // own thread
+        if (stages.scale) {
+            g_object_set(context->scaler_queue, "leaky", 1, NULL);
+            g_object_set(context->scaler_queue, "max-size-buffers", 100, NULL);
+            gst_bin_add_many(GST_BIN(pipeline), context->scaler_queue,
+                             context->scaler, NULL);
+            if ( ! gst_element_link_many(last_element, context->scaler_queue,
+                                         context->scaler, NULL)) {
+                M_ERROR("Couldn't link scaler\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            last_element = context->scaler;
+        }
+        if (stages.convert) {
+            g_object_set(context->converter_queue, "leaky", 1, NULL);
+            g_object_set(context->converter_queue, "max-size-buffers", 100, NULL);
+            gst_bin_add_many(GST_BIN(pipeline), context->converter_queue,
+                             context->video_converter, NULL);
+            if ( ! gst_element_link_many(last_element, context->converter_queue,
+                                         context->video_converter, NULL)) {
+                M_ERROR("Couldn't link converter\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            last_element = context->video_converter;
+        }
+        if (stages.rotate) {
+            g_object_set(context->rotator_queue, "leaky", 1, NULL);
+            g_object_set(context->rotator_queue, "max-size-buffers", 100, NULL);
+            g_object_set(context->video_rotate, "method", rotation_method, NULL);
+            gst_bin_add_many(GST_BIN(pipeline), context->rotator_queue,
+                             context->video_rotate, NULL);
+            if ( ! gst_element_link_many(last_element, context->rotator_queue,
+                                         context->video_rotate, NULL)) {
+                M_ERROR("Couldn't link rotator\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            last_element = context->video_rotate;
+        }
+
+        // Pin down what the stages have to produce for the encoder
+        if (context->video_rotate_filter) {
+            filtercaps = gst_caps_new_simple("video/x-raw",
+                                             "format", G_TYPE_STRING, "NV12",
+                                             "width", G_TYPE_INT, context->output_stream_width,
+                                             "height", G_TYPE_INT, context->output_stream_height,
+                                             "framerate", GST_TYPE_FRACTION,
+                                             context->input_frame_rate, 1,
+                                             NULL);
+            if ( ! filtercaps) {
+                M_ERROR("Failed to create filtercaps object\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            g_object_set(context->video_rotate_filter, "caps", filtercaps, NULL);
+            gst_caps_unref(filtercaps);
+            gst_bin_add(GST_BIN(pipeline), context->video_rotate_filter);
+            if ( ! gst_element_link(last_element, context->video_rotate_filter)) {
+                M_ERROR("Couldn't link video_rotate_filter\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            last_element = context->video_rotate_filter;
+        }
+
+        // Configure the encoder queue
+        g_object_set(context->encoder_queue, "leaky", 1, NULL);
+        g_object_set(context->encoder_queue, "max-size-buffers", 100, NULL);
+
+        // Configure the caps filter to reflect the output of the encoder
+        filtercaps = encoder_caps(context->encoder_backend);
+        if ( ! filtercaps) {
+            M_ERROR("Failed to create filtercaps object\n");
+            gst_object_unref(pipeline);
             return NULL;
         }
-        last_element = context->video_rotate_filter;
+        gst_caps_set_simple(filtercaps,
+                            "width", G_TYPE_INT, context->output_stream_width,
+                            "height", G_TYPE_INT, context->output_stream_height,
+                            NULL);
+        // in slice mode the parser hands each slice to the payloader on its
+        // own so its packets can go out before the rest of the frame
+        if (context->encoder_parser) {
+            gst_caps_set_simple(filtercaps, "alignment", G_TYPE_STRING, "nal", NULL);
+        }
+        g_object_set(context->rtp_filter, "caps", filtercaps, NULL);
+        gst_caps_unref(filtercaps);
+
+        // Configure the RTP input queue
+        g_object_set(context->rtp_queue, "leaky", 1, NULL);
+        g_object_set(context->rtp_queue, "max-size-buffers", 100, NULL);
+
+        // Configure the RTP payload for whichever codec the encoder makes
+        GstElement *payload = encoder_is_h265(context->encoder_backend) ?
+                              context->rtp_h265_payload : context->rtp_payload;
+        g_object_set(payload, "name", "pay0", NULL);
+        g_object_set(payload, "pt", 96, NULL);
+
+        gst_bin_add_many(GST_BIN(pipeline),
+                        context->encoder_queue,
+                        context->encoder,
+                        context->rtp_filter,
+                        context->rtp_queue,
+                        payload,
+                        NULL);
         if ( ! gst_element_link_many(last_element,
                                      context->encoder_queue,
-                                     context->omx_encoder,
+                                     context->encoder,
+                                     NULL)) {
+            M_ERROR("Couldn't link encoder\n");
+            gst_object_unref(pipeline);
+            return NULL;
+        }
+        last_element = context->encoder;
+
+        if (context->encoder_parser) {
+            gst_bin_add(GST_BIN(pipeline), context->encoder_parser);
+            if ( ! gst_element_link(last_element, context->encoder_parser)) {
+                M_ERROR("Couldn't link encoder_parser\n");
+                gst_object_unref(pipeline);
+                return NULL;
+            }
+            last_element = context->encoder_parser;
+        }
+
+        if ( ! gst_element_link_many(last_element,
                                      context->rtp_filter,
                                      context->rtp_queue,
-                                     context->rtp_payload,
+                                     payload,
                                      NULL)) {
-            M_ERROR("Couldn't finish pipeline linking part 4\n");
+            M_ERROR("Couldn't finish pipeline linking\n");
+            gst_object_unref(pipeline);
             return NULL;
         }
+
+        _attach_encode_probes(context, context->encoder);
+        _attach_keyframe_probe(context, context->encoder);
+    }
+
+    // only one of the payloaders was made
+    GstElement *payloader = context->rtp_h265_payload ? context->rtp_h265_payload
+                                                      : context->rtp_payload;
+    _attach_pacer(context, payloader);
+
+    // renditions are encoded in their source's pipeline but their clients'
+    // requests arrive here
+    if (context->keyframe_on_demand && (context->encoder || context->simulcast_parent)) {
+        _attach_keyframe_requests(context, payloader);
     }
 
     // Set up our bus and callback for messages
     bus = gst_element_get_bus(pipeline);
     if (bus) {
         gst_bus_add_signal_watch(bus);
-        g_signal_connect(G_OBJECT(bus), "message::error", (GCallback) error_cb, &context);
+        g_signal_connect(G_OBJECT(bus), "message::error", (GCallback) error_cb, context);
         gst_object_unref(bus);
     } else {
         M_ERROR("Could not attach error callback to pipeline\n");
     }
 
+    context->pipeline = pipeline;
+    return pipeline;
+}
+
+// Where the encoded frames of one simulcast rendition get handed back to
+typedef struct simulcast_sink_t {
+    context_data *src;
+    context_data *rendition;
+    pipe_reader_frame_cb frame_cb;
+} simulcast_sink_t;
+
+// Encoded frame out of one rendition's branch. It is dressed up like a frame
+// off a pipe so the rendition goes through the same ingest path as a stream
+// that was encoded by the camera server.
+static GstFlowReturn _simulcast_new_sample(GstAppSink *appsink, gpointer user_data)
+{
+    simulcast_sink_t *sink = (simulcast_sink_t*) user_data;
+    camera_image_metadata_t meta;
+
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+    if (sample == NULL) return GST_FLOW_EOS;
+
+    GstBuffer *buf = gst_sample_get_buffer(sample);
+    if (buf == NULL) {
+        gst_sample_unref(sample);
+        return GST_FLOW_OK;
+    }
+    gst_buffer_ref(buf);
+    gst_sample_unref(sample);
+
+    memset(&meta, 0, sizeof(meta));
+    meta.magic_number = CAMERA_MAGIC_NUMBER;
+    // H.264 or H.265, whichever the rendition's encoder makes
+    meta.format = sink->rendition->input_format;
+    meta.width = sink->rendition->output_stream_width;
+    meta.height = sink->rendition->output_stream_height;
+    meta.size_bytes = gst_buffer_get_size(buf);
+    meta.framerate = sink->rendition->output_frame_rate;
+
+    // back to the pipe timestamps the source frames were pushed with
+    if (GST_BUFFER_PTS_IS_VALID(buf)) {
+        meta.timestamp_ns = GST_BUFFER_PTS(buf) + sink->src->initial_timestamp;
+    } else {
+        meta.timestamp_ns = g_get_monotonic_time() * 1000;
+    }
+
+    sink->frame_cb(sink->rendition->pipe_ch, meta, buf, sink->rendition);
+    return GST_FLOW_OK;
+}
+
+// Make an element straight into a bin, which then owns it
+static GstElement *_make_in_bin(GstElement *bin, const char *factory)
+{
+    GstElement *element = gst_element_factory_make(factory, NULL);
+    if (element) gst_bin_add(GST_BIN(bin), element);
+    return element;
+}
+
+// One encoder branch off the tee, scaled and rate limited for its rendition
+static int _add_simulcast_branch(GstElement *pipeline, GstElement *tee,
+                                 context_data *src, context_data *rendition,
+                                 pipe_reader_frame_cb frame_cb)
+{
+    // in the pipeline right away so it cleans them up if anything fails
+    GstElement *queue = _make_in_bin(pipeline, "queue");
+    GstElement *scaler = _make_in_bin(pipeline, "videoscale");
+    GstElement *rate = _make_in_bin(pipeline, "videorate");
+    GstElement *raw_filter = _make_in_bin(pipeline, "capsfilter");
+    GstElement *encoder = encoder_create(rendition->encoder_backend, NULL,
+                                         rendition->output_stream_bitrate,
+                                         rendition->gop_size,
+                                         rendition->encode_slices);
+    if (encoder) gst_bin_add(GST_BIN(pipeline), encoder);
+    GstElement *codec_filter = _make_in_bin(pipeline, "capsfilter");
+    GstElement *appsink = _make_in_bin(pipeline, "appsink");
+
+    if ( ! queue || ! scaler || ! rate || ! raw_filter ||
+         ! encoder || ! codec_filter || ! appsink) {
+        M_ERROR("Couldn't make simulcast elements for %s\n", rendition->mount_point);
+        return -1;
+    }
+
+    // a slow encoder only holds back its own rendition
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 2, NULL);
+    g_object_set(rate, "drop-only", TRUE, NULL);
+
+    GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                                        "format", G_TYPE_STRING, "NV12",
+                                        "width", G_TYPE_INT, rendition->output_stream_width,
+                                        "height", G_TYPE_INT, rendition->output_stream_height,
+                                        "framerate", GST_TYPE_FRACTION,
+                                        rendition->output_frame_rate, 1,
+                                        NULL);
+    g_object_set(raw_filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    // whole frames, the rendition's pipe reader expects one per sample
+    caps = encoder_caps(rendition->encoder_backend);
+    gst_caps_set_simple(caps, "alignment", G_TYPE_STRING, "au", NULL);
+    g_object_set(codec_filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    // the rendition's own feeder does the pacing, never hold up the branch
+    g_object_set(appsink, "sync", FALSE, "max-buffers", 4, "drop", TRUE, NULL);
+
+    simulcast_sink_t *sink = g_new0(simulcast_sink_t, 1);
+    sink->src = src;
+    sink->rendition = rendition;
+    sink->frame_cb = frame_cb;
+    GstAppSinkCallbacks callbacks = { .new_sample = _simulcast_new_sample };
+    gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, sink, g_free);
+
+    if ( ! gst_element_link_many(tee, queue, scaler, rate, raw_filter,
+                                 encoder, codec_filter, appsink, NULL)) {
+        M_ERROR("Couldn't link simulcast branch for %s\n", rendition->mount_point);
+        return -1;
+    }
+
+    _attach_encode_probes(rendition, encoder);
+    _attach_keyframe_probe(rendition, encoder);
+    rendition->simulcast_encoder = encoder;
+    return 0;
+}
+
+GstElement *pipeline_create_simulcast(context_data *src, context_data *renditions[],
+                                      int n_renditions, pipe_reader_frame_cb frame_cb)
+{
+    GstElement *pipeline;
+    GstElement *converter, *rotator, *scaler, *rotate_filter, *tee;
+    GstCaps *caps;
+    GstBus *bus = NULL;
+    raw_stages_t stages;
+    int i;
+
+    int rotation_method = _rotation_method(src);
+    if (rotation_method < 0) return NULL;
+    _plan_raw_stages(src, &stages);
+
+    // the feeder already rotated it, convert and flip are passthrough
+    if (src->fused_convert) rotation_method = 0;
+
+    pipeline = gst_pipeline_new(NULL);
+    if ( ! pipeline) {
+        M_ERROR("Couldn't make simulcast pipeline for %s\n", src->input_pipe_name);
+        return NULL;
+    }
+
+    // the pipeline owns everything from here, unreffing it frees the lot
+    src->app_source = _make_in_bin(pipeline, "appsrc");
+    converter = _make_in_bin(pipeline, "videoconvert");
+    rotator = _make_in_bin(pipeline, "videoflip");
+    scaler = stages.scale ? _make_in_bin(pipeline, "videoscale") : NULL;
+    rotate_filter = _make_in_bin(pipeline, "capsfilter");
+    tee = _make_in_bin(pipeline, "tee");
+
+    if ( ! src->app_source || ! converter ||
+         ! rotator || (stages.scale && ! scaler) || ! rotate_filter || ! tee) {
+        M_ERROR("Couldn't make simulcast pipeline for %s\n", src->input_pipe_name);
+        goto fail;
+    }
+
+    caps = _raw_input_caps(src);
+    if ( ! caps) {
+        M_ERROR("Failed to create video_caps object\n");
+        goto fail;
+    }
+    _configure_app_source(src, caps);
+    gst_caps_unref(caps);
+
+    // Convert and rotate once, every rendition scales from the result
+    g_object_set(rotator, "method", rotation_method, NULL);
+    caps = gst_caps_new_simple("video/x-raw",
+                               "format", G_TYPE_STRING, "NV12",
+                               "width", G_TYPE_INT, src->output_stream_width,
+                               "height", G_TYPE_INT, src->output_stream_height,
+                               NULL);
+    g_object_set(rotate_filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    if ( ! gst_element_link_many(src->app_source, converter, rotator, NULL)) {
+        M_ERROR("Couldn't link simulcast conversion for %s\n", src->input_pipe_name);
+        goto fail;
+    }
+
+    // down to the output size when the feeder didn't already do it
+    GstElement *last = rotator;
+    if (scaler) {
+        if ( ! gst_element_link(rotator, scaler)) {
+            M_ERROR("Couldn't link simulcast scaler for %s\n", src->input_pipe_name);
+            goto fail;
+        }
+        last = scaler;
+    }
+    if ( ! gst_element_link_many(last, rotate_filter, tee, NULL)) {
+        M_ERROR("Couldn't link simulcast conversion for %s\n", src->input_pipe_name);
+        goto fail;
+    }
+
+    for (i = 0; i < n_renditions; i++) {
+        if (_add_simulcast_branch(pipeline, tee, src, renditions[i], frame_cb)) {
+            goto fail;
+        }
+    }
+
+    bus = gst_element_get_bus(pipeline);
+    if (bus) {
+        gst_bus_add_signal_watch(bus);
+        g_signal_connect(G_OBJECT(bus), "message::error", (GCallback) error_cb, src);
+    } else {
+        M_ERROR("Could not attach error callback to pipeline\n");
+    }
+
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        M_ERROR("Couldn't start simulcast pipeline for %s\n", src->input_pipe_name);
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        if (bus) gst_bus_remove_signal_watch(bus);
+        goto fail;
+    }
+
+    if (bus) gst_object_unref(bus);
+    M_PRINT("Simulcasting %s as %d renditions\n", src->input_pipe_name, n_renditions);
+    src->pipeline = pipeline;
     return pipeline;
+
+fail:
+    if (bus) gst_object_unref(bus);
+    // the app source and encoders went with the pipeline
+    src->app_source = NULL;
+    for (i = 0; i < n_renditions; i++) renditions[i]->simulcast_encoder = NULL;
+    gst_object_unref(pipeline);
+    return NULL;
+}
+
+// The bin the media puts our element, rtpbin and the sinks in
+static GstObject* _media_bin(GstRTSPMedia *media)
+{
+    GstElement *element = gst_rtsp_media_get_element(media);
+    if (element == NULL) return NULL;
+    GstObject *bin = gst_object_get_parent(GST_OBJECT(element));
+    gst_object_unref(element);
+    return bin;
+}
+
+static gboolean _is_factory(GstElement *element, const char *name)
+{
+    GstElementFactory *factory = gst_element_get_factory(element);
+    return factory && !strcmp(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), name);
+}
+
+// The RTX sender is only made when the media is prepared, the history
+// time comes from the factory but the size bound has to be set here
+static void _deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element,
+                                context_data *ctx)
+{
+    if (!_is_factory(element, "rtprtxsend")) return;
+
+    g_object_set(element, "max-size-packets", ctx->rtx_history_packets, NULL);
+    M_DEBUG("RTX history for %s: %ums, %u packets\n", ctx->mount_point,
+            ctx->rtx_time_ms, ctx->rtx_history_packets);
+}
+
+void pipeline_configure_media(context_data *ctx, GstRTSPMedia *media)
+{
+    guint i;
+
+    if (ctx->rtx_time_ms) {
+        GstObject *bin = _media_bin(media);
+        if (bin) {
+            g_signal_connect(bin, "deep-element-added", G_CALLBACK(_deep_element_added), ctx);
+            gst_object_unref(bin);
+        }
+    }
+
+    if (ctx->fec_percentage == 0) return;
+
+#if GST_CHECK_VERSION(1,16,0)
+    // The stream adds an rtpulpfecenc to rtpbin and the FEC payload type to
+    // the SDP once it has one
+    for (i = 0; i < gst_rtsp_media_n_streams(media); i++) {
+        GstRTSPStream *stream = gst_rtsp_media_get_stream(media, i);
+        gst_rtsp_stream_set_ulpfec_pt(stream, ctx->fec_pt);
+        gst_rtsp_stream_set_ulpfec_percentage(stream, ctx->fec_percentage);
+    }
+    M_DEBUG("ULPFEC at %u%% on pt %u for %s\n", ctx->fec_percentage, ctx->fec_pt, ctx->mount_point);
+#else
+    (void) i;
+    M_WARN("fec-percentage needs gstreamer 1.16 or newer, sending %s without FEC\n", ctx->mount_point);
+#endif
+}
+
+// The session only hands out its sources as a GValueArray
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+int pipeline_get_rtcp_report(GstRTSPMedia *media, rate_control_report_t *report)
+{
+    GValueArray *sources = NULL;
+    guint our_ssrc = 0;
+    int have_ssrc = 0, found = 0;
+    guint i;
+
+    GstRTSPStream *stream = gst_rtsp_media_get_stream(media, 0);
+    if (stream == NULL) return -1;
+    GObject *session = gst_rtsp_stream_get_rtpsession(stream);
+    if (session == NULL) return -1;
+
+    g_object_get(session, "sources", &sources, NULL);
+
+    // our own source is the one sending the video
+    for (i = 0; sources && i < sources->n_values && !have_ssrc; i++) {
+        GObject *source = g_value_get_object(&sources->values[i]);
+        GstStructure *stats = NULL;
+        gboolean internal = FALSE, is_sender = FALSE;
+
+        g_object_get(source, "stats", &stats, NULL);
+        if (stats == NULL) continue;
+        gst_structure_get_boolean(stats, "internal", &internal);
+        gst_structure_get_boolean(stats, "is-sender", &is_sender);
+        if (internal && is_sender) have_ssrc = gst_structure_get_uint(stats, "ssrc", &our_ssrc);
+        gst_structure_free(stats);
+    }
+
+    // A receiver report block is kept on the remote source that sent it.
+    // With several clients on a shared media the worst one sets the pace.
+    for (i = 0; have_ssrc && i < sources->n_values; i++) {
+        GObject *source = g_value_get_object(&sources->values[i]);
+        GstStructure *stats = NULL;
+        gboolean internal = FALSE, have_rb = FALSE;
+        guint rb_ssrc = 0, fraction_lost = 0, jitter = 0, round_trip = 0, seq = 0;
+
+        g_object_get(source, "stats", &stats, NULL);
+        if (stats == NULL) continue;
+
+        gst_structure_get_boolean(stats, "internal", &internal);
+        gst_structure_get_boolean(stats, "have-rb", &have_rb);
+        if (!internal && have_rb &&
+            gst_structure_get_uint(stats, "rb-ssrc", &rb_ssrc) && rb_ssrc == our_ssrc &&
+            gst_structure_get_uint(stats, "rb-fractionlost", &fraction_lost) &&
+            gst_structure_get_uint(stats, "rb-jitter", &jitter) &&
+            gst_structure_get_uint(stats, "rb-round-trip", &round_trip) &&
+            gst_structure_get_uint(stats, "rb-exthighestseq", &seq) &&
+            (!found || fraction_lost / 256.0 > report->fraction_lost)) {
+            report->seq = seq;
+            report->fraction_lost = fraction_lost / 256.0;
+            // 90kHz video clock, round trip is in 1/65536 of a second
+            report->jitter_ms = jitter / 90.0;
+            report->rtt_ms = round_trip * 1000.0 / 65536.0;
+            found = 1;
+        }
+        gst_structure_free(stats);
+    }
+
+    if (sources) g_value_array_free(sources);
+    g_object_unref(session);
+    return found ? 0 : -1;
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+// Sum an unsigned property over every element made by one factory
+static guint64 _sum_media_property(GstRTSPMedia *media, const char *factory_name,
+                                   const char *property, gboolean is_uint64)
+{
+    GValue item = G_VALUE_INIT;
+    guint64 total = 0;
+    gboolean done = FALSE;
+
+    GstObject *bin = _media_bin(media);
+    if (bin == NULL) return 0;
+
+    GstIterator *it = gst_bin_iterate_recurse(GST_BIN(bin));
+    while (!done) {
+        switch (gst_iterator_next(it, &item)) {
+            case GST_ITERATOR_OK: {
+                GstElement *element = g_value_get_object(&item);
+                if (_is_factory(element, factory_name)) {
+                    if (is_uint64) {
+                        guint64 value = 0;
+                        g_object_get(element, property, &value, NULL);
+                        total += value;
+                    } else {
+                        guint value = 0;
+                        g_object_get(element, property, &value, NULL);
+                        total += value;
+                    }
+                }
+                g_value_reset(&item);
+                break;
+            }
+            case GST_ITERATOR_RESYNC:
+                gst_iterator_resync(it);
+                total = 0;
+                break;
+            default:
+                done = TRUE;
+                break;
+        }
+    }
+    g_value_unset(&item);
+    gst_iterator_free(it);
+    gst_object_unref(bin);
+
+    return total;
+}
+
+guint64 pipeline_get_bytes_served(GstRTSPMedia *media)
+{
+    return _sum_media_property(media, "multiudpsink", "bytes-served", TRUE);
+}
+
+void pipeline_get_rtx_stats(GstRTSPMedia *media, guint *requests, guint *packets)
+{
+    *requests = _sum_media_property(media, "rtprtxsend", "num-rtx-requests", FALSE);
+    *packets = _sum_media_property(media, "rtprtxsend", "num-rtx-packets", FALSE);
+}
+
+void pipeline_set_bitrate(context_data *ctx, uint32_t bitrate)
+{
+    GstElement *encoder = ctx->simulcast_parent ? ctx->simulcast_encoder
+                                                : ctx->encoder;
+    if (encoder == NULL) return;
+    encoder_set_bitrate(encoder, ctx->encoder_backend, bitrate);
+}
+
+typedef struct encoder_restart_t {
+    GstElement *encoder;
+    encoder_backend_t backend;
+    uint32_t gop_size;
+} encoder_restart_t;
+
+static void _free_encoder_restart(gpointer data)
+{
+    encoder_restart_t *restart = (encoder_restart_t*) data;
+    gst_object_unref(restart->encoder);
+    g_free(restart);
+}
+
+// Data is held up just ahead of the encoder, stop it to READY so it takes
+// the settings it only reads when it starts, then bring it back. Relinking
+// makes the upstream pad send its caps and segment again, which the encoder
+// lost when it stopped.
+static GstPadProbeReturn _restart_encoder_probe(GstPad *pad, GstPadProbeInfo *info,
+                                                gpointer user_data)
+{
+    encoder_restart_t *restart = (encoder_restart_t*) user_data;
+    GstPad *sink = gst_element_get_static_pad(restart->encoder, "sink");
+
+    gst_pad_unlink(pad, sink);
+    gst_element_set_state(restart->encoder, GST_STATE_READY);
+    encoder_set_gop(restart->encoder, restart->backend, restart->gop_size);
+    if (gst_pad_link(pad, sink) != GST_PAD_LINK_OK) {
+        M_ERROR("Couldn't relink the encoder after restarting it\n");
+    }
+    gst_element_sync_state_with_parent(restart->encoder);
+    gst_object_unref(sink);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+int pipeline_set_gop(context_data *ctx, uint32_t gop_size)
+{
+    GstElement *encoder = ctx->simulcast_parent ? ctx->simulcast_encoder
+                                                : ctx->encoder;
+    if (encoder == NULL) return -1;
+
+    if (GST_STATE(encoder) <= GST_STATE_READY ||
+        encoder_gop_is_live(encoder, ctx->encoder_backend)) {
+        encoder_set_gop(encoder, ctx->encoder_backend, gop_size);
+        return 0;
+    }
+
+    GstPad *sink = gst_element_get_static_pad(encoder, "sink");
+    GstPad *peer = sink ? gst_pad_get_peer(sink) : NULL;
+    if (sink) gst_object_unref(sink);
+    if (peer == NULL) {
+        M_ERROR("Couldn't find what feeds the encoder to restart it\n");
+        return -1;
+    }
+
+    encoder_restart_t *restart = g_new0(encoder_restart_t, 1);
+    restart->encoder = gst_object_ref(encoder);
+    restart->backend = ctx->encoder_backend;
+    restart->gop_size = gop_size;
+    gst_pad_add_probe(peer, GST_PAD_PROBE_TYPE_BLOCK | GST_PAD_PROBE_TYPE_BUFFER,
+                      _restart_encoder_probe, restart, _free_encoder_restart);
+    gst_object_unref(peer);
+    return 1;
+}
+
+void pipeline_request_keyframe(context_data *ctx)
+{
+    atomic_fetch_add(&ctx->keyframe_requests, 1);
+    atomic_store(&ctx->keyframe_pending, 1);
 }
@@ -0,0 +1,173 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <modal_journal.h>
+
+#include "rate_control.h"
+
+// loss above this backs off, below LOSS_LOW the link is considered clean
+#define LOSS_HIGH           0.10
+#define LOSS_LOW            0.02
+// round trip time this far above the lowest one seen means queueing
+#define RTT_QUEUE_FACTOR    2.0
+#define RTT_QUEUE_MARGIN_MS 20.0
+#define JITTER_HIGH_MS      50.0
+#define DELAY_BACKOFF       0.85
+#define PROBE_GAIN          1.05
+#define PROBE_MIN_STEP      20000
+// wait this long after backing off before probing upwards again
+#define PROBE_HOLDOFF_US    (4 * 1000000LL)
+// let the lowest rtt creep up slowly so a route change isn't mistaken
+// for a permanently congested link
+#define MIN_RTT_DRIFT       0.02
+
+
+void rate_control_init(rate_control_t *rc, uint32_t bitrate,
+                       uint32_t min_bitrate, uint32_t max_bitrate,
+                       uint32_t max_decimator, const char *log_file,
+                       const char *name)
+{
+    FILE *log = rc->log;
+
+    memset(rc, 0, sizeof(*rc));
+    rc->min_bitrate = min_bitrate;
+    rc->max_bitrate = max_bitrate > min_bitrate ? max_bitrate : min_bitrate;
+    rc->bitrate = bitrate;
+    if(rc->bitrate < rc->min_bitrate) rc->bitrate = rc->min_bitrate;
+    if(rc->bitrate > rc->max_bitrate) rc->bitrate = rc->max_bitrate;
+    rc->max_decimator = max_decimator ? max_decimator : 1;
+    rc->decimator = 1;
+    rc->name = name;
+
+    // keep the log open across restarts of the same stream
+    rc->log = log;
+    if(rc->log == NULL && log_file && log_file[0]){
+        rc->log = fopen(log_file, "a");
+        if(rc->log == NULL){
+            M_WARN("failed to open bitrate log %s\n", log_file);
+        } else {
+            fprintf(rc->log, "time_s,stream,loss,jitter_ms,rtt_ms,min_rtt_ms,bitrate,decimator,decision\n");
+        }
+    }
+}
+
+
+static void _log_decision(rate_control_t *rc, const rate_control_report_t *report,
+                          int64_t now_us, const char *decision)
+{
+    if(rc->log == NULL) return;
+
+    fprintf(rc->log, "%.3f,%s,%.3f,%.1f,%.1f,%.1f,%u,%u,%s\n",
+            (now_us - rc->start_us) / 1000000.0, rc->name,
+            report->fraction_lost, report->jitter_ms, report->rtt_ms,
+            rc->min_rtt_ms, rc->bitrate, rc->decimator, decision);
+    fflush(rc->log);
+}
+
+
+int rate_control_update(rate_control_t *rc, const rate_control_report_t *report,
+                        int64_t now_us)
+{
+    const char *decision = "hold";
+    uint32_t old_bitrate = rc->bitrate;
+    uint32_t old_decimator = rc->decimator;
+    double target = rc->bitrate;
+
+    // clients only report every few seconds, nothing new to go on
+    if(rc->have_report && report->seq == rc->last_seq) return 0;
+    if(!rc->have_report) rc->start_us = now_us;
+    rc->have_report = 1;
+    rc->last_seq = report->seq;
+
+    if(report->rtt_ms > 0){
+        if(rc->min_rtt_ms <= 0 || report->rtt_ms < rc->min_rtt_ms){
+            rc->min_rtt_ms = report->rtt_ms;
+        } else {
+            rc->min_rtt_ms += (report->rtt_ms - rc->min_rtt_ms) * MIN_RTT_DRIFT;
+        }
+    }
+
+    int queueing = (report->rtt_ms > 0 &&
+                    report->rtt_ms > rc->min_rtt_ms * RTT_QUEUE_FACTOR + RTT_QUEUE_MARGIN_MS) ||
+                   report->jitter_ms > JITTER_HIGH_MS;
+
+    int backoff = 0, probe = 0;
+    if(report->fraction_lost > LOSS_HIGH){
+        target = rc->bitrate * (1.0 - 0.5 * report->fraction_lost);
+        decision = "loss";
+        backoff = 1;
+    } else if(queueing){
+        target = rc->bitrate * DELAY_BACKOFF;
+        decision = "delay";
+        backoff = 1;
+    } else if(report->fraction_lost < LOSS_LOW &&
+              now_us - rc->last_decrease_us > PROBE_HOLDOFF_US){
+        target = rc->bitrate * PROBE_GAIN;
+        if(target < rc->bitrate + PROBE_MIN_STEP) target = rc->bitrate + PROBE_MIN_STEP;
+        decision = "probe";
+        probe = 1;
+    }
+
+    if(target < rc->min_bitrate) target = rc->min_bitrate;
+    if(target > rc->max_bitrate) target = rc->max_bitrate;
+    rc->bitrate = (uint32_t) target;
+    if(backoff) rc->last_decrease_us = now_us;
+
+    // at the bottom of the bitrate range the only thing left to give up is
+    // frame rate, and it's the first thing to come back once there is room
+    if(backoff && rc->bitrate == rc->min_bitrate && rc->decimator < rc->max_decimator){
+        rc->decimator *= 2;
+        if(rc->decimator > rc->max_decimator) rc->decimator = rc->max_decimator;
+    } else if(probe && rc->decimator > 1 && rc->bitrate >= rc->min_bitrate * 2){
+        rc->decimator /= 2;
+    }
+
+    _log_decision(rc, report, now_us, decision);
+
+    if(rc->bitrate == old_bitrate && rc->decimator == old_decimator) return 0;
+
+    M_PRINT("abr %s: %u -> %u bps, 1/%u frames (%s, loss %.1f%% rtt %.0fms jitter %.0fms)\n",
+            rc->name, old_bitrate, rc->bitrate, rc->decimator, decision,
+            report->fraction_lost * 100.0, report->rtt_ms, report->jitter_ms);
+    return 1;
+}
+
+
+void rate_control_deinit(rate_control_t *rc)
+{
+    if(rc->log) fclose(rc->log);
+    rc->log = NULL;
+}
@@ -0,0 +1,242 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "tone_map.h"
+
+#define HIST_SHIFT       6       // 65536 >> 6 = TONE_MAP_HIST_BINS
+#define AUTO_LOW         0.01    // ignore the coldest and hottest 1% so a
+#define AUTO_HIGH        0.99    // few dead or hot pixels don't matter
+#define AUTO_SMOOTHING   0.1     // how fast the window follows the scene
+#define AUTO_MIN_RANGE   256     // don't stretch sensor noise over 8 bits
+
+
+int tone_map_init(tone_map_t *tm, tone_map_mode_t mode, uint16_t min, uint16_t max, double gamma)
+{
+    memset(tm, 0, sizeof(*tm));
+    tm->mode = mode;
+    tm->gamma = gamma > 0.0 ? gamma : 1.0;
+    tm->min = min;
+    tm->max = max > min ? max : min + 1;
+    tm->lut_lo = -1;
+    tm->lut_hi = -1;
+
+    tm->lut = malloc(65536);
+    if(tm->lut == NULL) return -1;
+
+    if(mode == TONE_MAP_LINEAR){
+        tm->lo = tm->min;
+        tm->hi = tm->max;
+        tm->have_window = 1;
+    }
+    return 0;
+}
+
+
+void tone_map_deinit(tone_map_t *tm)
+{
+    free(tm->lut);
+    tm->lut = NULL;
+}
+
+
+// Find the window covering AUTO_LOW to AUTO_HIGH of the samples from a
+// histogram of every other sample of every other row
+static void _update_window(tone_map_t *tm, const uint8_t *src, int width, int height)
+{
+    uint32_t total = 0, cum = 0;
+    int x, y, bin, low_bin = -1, high_bin = TONE_MAP_HIST_BINS - 1;
+
+    memset(tm->hist, 0, sizeof(tm->hist));
+    for(y = 0; y < height; y += 2){
+        const uint8_t *row = src + (size_t) y * width * 2;
+        for(x = 0; x < width; x += 2){
+            uint16_t v = (uint16_t) ((row[2 * x] << 8) | row[2 * x + 1]);
+            tm->hist[v >> HIST_SHIFT]++;
+        }
+    }
+    for(bin = 0; bin < TONE_MAP_HIST_BINS; bin++) total += tm->hist[bin];
+    if(total == 0) return;
+
+    for(bin = 0; bin < TONE_MAP_HIST_BINS; bin++){
+        cum += tm->hist[bin];
+        if(low_bin < 0 && cum >= total * AUTO_LOW) low_bin = bin;
+        if(cum >= total * AUTO_HIGH){
+            high_bin = bin;
+            break;
+        }
+    }
+
+    double lo = (double) (low_bin << HIST_SHIFT);
+    // the top bin ends past the largest sample, which doesn't fit the
+    // 16 bit range the mapping works in
+    double hi = fmin((double) ((high_bin + 1) << HIST_SHIFT), 65535.0);
+
+    // flat scenes get a minimum window around their middle
+    if(hi - lo < AUTO_MIN_RANGE){
+        double mid = (lo + hi) / 2.0;
+        lo = mid - AUTO_MIN_RANGE / 2;
+        hi = mid + AUTO_MIN_RANGE / 2;
+        if(lo < 0.0){ hi -= lo; lo = 0.0; }
+        if(hi > 65535.0){ lo -= hi - 65535.0; hi = 65535.0; }
+    }
+
+    if(!tm->have_window){
+        tm->lo = lo;
+        tm->hi = hi;
+        tm->have_window = 1;
+    } else {
+        tm->lo += (lo - tm->lo) * AUTO_SMOOTHING;
+        tm->hi += (hi - tm->hi) * AUTO_SMOOTHING;
+    }
+}
+
+
+// Rebuild the table for the window unless it has moved by less than one
+// output level since the last time
+static void _update_lut(tone_map_t *tm, int lo, int hi)
+{
+    int range = hi - lo;
+    int slack = range / 512;
+    int v;
+
+    if(tm->lut_lo >= 0 && abs(lo - tm->lut_lo) <= slack && abs(hi - tm->lut_hi) <= slack) return;
+
+    for(v = 0; v < 65536; v++){
+        // the table is indexed by the sample as it sits in memory, so
+        // mapping needs no byte swap whatever the host order
+        uint8_t be[2] = {(uint8_t) (v >> 8), (uint8_t) v};
+        uint16_t index;
+        memcpy(&index, be, sizeof(index));
+
+        uint8_t out;
+        if(v <= lo)      out = 0;
+        else if(v >= hi) out = 255;
+        else out = (uint8_t) (255.0 * pow((double) (v - lo) / range, tm->gamma) + 0.5);
+        tm->lut[index] = out;
+    }
+    tm->lut_lo = lo;
+    tm->lut_hi = hi;
+}
+
+
+static void _map_lut(const tone_map_t *tm, const uint8_t *src, uint8_t *dst, size_t n)
+{
+    const uint16_t *s = (const uint16_t*) src;
+    size_t i;
+
+    for(i = 0; i < n; i++) dst[i] = tm->lut[s[i]];
+}
+
+
+// (v - lo) * 255 / range with 16 bit fixed point, range has to be at least
+// 256 for the factor to fit in 16 bits
+static void _map_linear(const uint8_t *src, uint8_t *dst, size_t n, int lo, int range)
+{
+    const uint32_t k = (255u * 65536u + range - 1) / range;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i vlo = _mm_set1_epi16((short) lo);
+    const __m128i vrange = _mm_set1_epi16((short) range);
+    const __m128i vk = _mm_set1_epi16((short) k);
+    __m128i y[2];
+    int h;
+
+    for(; i + 16 <= n; i += 16){
+        for(h = 0; h < 2; h++){
+            __m128i x = _mm_loadu_si128((const __m128i*) (src + 2 * i + 16 * h));
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            __m128i v = _mm_subs_epu16(x, vlo);
+            v = _mm_sub_epi16(v, _mm_subs_epu16(v, vrange));
+            y[h] = _mm_mulhi_epu16(v, vk);
+        }
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_packus_epi16(y[0], y[1]));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint16x8_t vlo = vdupq_n_u16((uint16_t) lo);
+    const uint16x8_t vrange = vdupq_n_u16((uint16_t) range);
+    const uint16x4_t vk = vdup_n_u16((uint16_t) k);
+    uint8x8_t y[2];
+    int h;
+
+    for(; i + 16 <= n; i += 16){
+        for(h = 0; h < 2; h++){
+            uint16x8_t x = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + 2 * i + 16 * h)));
+            uint16x8_t v = vminq_u16(vqsubq_u16(x, vlo), vrange);
+            uint32x4_t lo32 = vmull_u16(vget_low_u16(v), vk);
+            uint32x4_t hi32 = vmull_u16(vget_high_u16(v), vk);
+            y[h] = vmovn_u16(vcombine_u16(vshrn_n_u32(lo32, 16), vshrn_n_u32(hi32, 16)));
+        }
+        vst1q_u8(dst + i, vcombine_u8(y[0], y[1]));
+    }
+#endif
+
+    for(; i < n; i++){
+        int v = ((src[2 * i] << 8) | src[2 * i + 1]) - lo;
+        if(v < 0) v = 0;
+        if(v > range) v = range;
+        dst[i] = (uint8_t) (((uint32_t) v * k) >> 16);
+    }
+}
+
+
+void tone_map_gray8(tone_map_t *tm, const uint8_t *src, uint8_t *dst, int width, int height)
+{
+    size_t n = (size_t) width * height;
+
+    if(tm->mode == TONE_MAP_AUTO) _update_window(tm, src, width, height);
+
+    int lo = (int) (tm->lo + 0.5);
+    int hi = (int) (tm->hi + 0.5);
+    if(hi > 65535) hi = 65535;
+    if(lo > 65534) lo = 65534;
+    if(hi <= lo) hi = lo + 1;
+
+    if(tm->gamma == 1.0 && hi - lo >= 256){
+        _map_linear(src, dst, n, lo, hi - lo);
+    } else {
+        _update_lut(tm, lo, hi);
+        _map_lut(tm, src, dst, n);
+    }
+}
@@ -0,0 +1,231 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Conversion benchmark, the fused convert and rotate against the
+ * videoconvert and videoflip chain it replaces. Both get the same random
+ * frames and the per frame CPU time of the whole process is reported, so the
+ * gstreamer threads are counted too.
+ *
+ *   bench_convert [-f format] [-W width] [-H height] [-r rotation] [-n frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <modal_pipe.h>
+
+#include "frame_convert.h"
+
+static const struct {
+    const char *name;
+    int format;
+    const char *gst_format;
+    int bpp_num, bpp_den;
+} formats[] = {
+    {"raw8",   IMAGE_FORMAT_RAW8,        "GRAY8", 1, 1},
+    {"nv12",   IMAGE_FORMAT_NV12,        "NV12",  3, 2},
+    {"nv21",   IMAGE_FORMAT_NV21,        "NV21",  3, 2},
+    {"yuv420", IMAGE_FORMAT_YUV420,      "I420",  3, 2},
+    {"yuv422", IMAGE_FORMAT_YUV422,      "YUY2",  2, 1},
+    {"uyvy",   IMAGE_FORMAT_YUV422_UYVY, "UYVY",  2, 1},
+    {"rgb",    IMAGE_FORMAT_RGB,         "RGB",   3, 1},
+};
+
+#define N_FORMATS (int) (sizeof(formats) / sizeof(formats[0]))
+
+
+static int64_t _ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _print(const char *what, int64_t cpu_ns, int64_t wall_ns, int frames)
+{
+    printf("%-24s %8.3f ms cpu/frame %8.3f ms wall/frame\n", what,
+           cpu_ns / 1e6 / frames, wall_ns / 1e6 / frames);
+}
+
+static void _bench_fused(int f, int w, int h, int rotation, int frames, const uint8_t *src)
+{
+    uint8_t *dst = malloc((size_t) w * h * 3 / 2);
+    uint8_t *band = malloc(frame_convert_band_size(w));
+    int i;
+
+    // once untimed to fault the output in
+    frame_convert_nv12(src, formats[f].format, w, h, rotation, dst, band);
+
+    int64_t cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+    int64_t wall = _ns(CLOCK_MONOTONIC);
+    for(i = 0; i < frames; i++){
+        frame_convert_nv12(src, formats[f].format, w, h, rotation, dst, band);
+    }
+    _print("fused", _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu, _ns(CLOCK_MONOTONIC) - wall, frames);
+
+    free(dst);
+    free(band);
+}
+
+static int _bench_gst(int f, int w, int h, int rotation, int frames,
+                      const uint8_t *src, size_t src_size)
+{
+    GError *error = NULL;
+    int i;
+
+    // the same elements and order the streamer uses without fused-convert,
+    // each stage behind its own queue so it runs on its own thread
+    char *desc = g_strdup_printf(
+        "appsrc name=src format=time "
+        "caps=video/x-raw,format=%s,width=%d,height=%d,framerate=30/1 "
+        "! queue leaky=upstream max-size-buffers=100 "
+        "! videoconvert ! video/x-raw,format=NV12 "
+        "! queue leaky=upstream max-size-buffers=100 "
+        "! videoflip method=%d "
+        "! appsink name=sink sync=false",
+        formats[f].gst_format, w, h, rotation / 90);
+    GstElement *pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if(pipeline == NULL || error){
+        fprintf(stderr, "couldn't build the pipeline: %s\n", error ? error->message : "unknown");
+        if(error) g_error_free(error);
+        if(pipeline) gst_object_unref(pipeline);
+        return -1;
+    }
+
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    int64_t cpu = 0, wall = 0;
+    // the first frame negotiates and is left out of the timing
+    for(i = -1; i < frames; i++){
+        if(i == 0){
+            cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+            wall = _ns(CLOCK_MONOTONIC);
+        }
+
+        // the streamer wraps or copies every frame into a new buffer too
+        GstBuffer *buf = gst_buffer_new_allocate(NULL, src_size, NULL);
+        gst_buffer_fill(buf, 0, src, src_size);
+        GST_BUFFER_PTS(buf) = (i + 1) * GST_SECOND / 30;
+        GST_BUFFER_DURATION(buf) = GST_SECOND / 30;
+        if(gst_app_src_push_buffer(GST_APP_SRC(appsrc), buf) != GST_FLOW_OK) break;
+
+        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+        if(sample == NULL) break;
+        gst_sample_unref(sample);
+    }
+    if(i == frames){
+        _print("videoconvert+videoflip", _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu,
+               _ns(CLOCK_MONOTONIC) - wall, frames);
+    } else {
+        fprintf(stderr, "pipeline stopped after %d frames\n", i);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(appsrc);
+    gst_object_unref(appsink);
+    gst_object_unref(pipeline);
+    return i == frames ? 0 : -1;
+}
+
+static void _print_usage(const char *name)
+{
+    int f;
+
+    printf("usage: %s [options]\n"
+           "  -f FORMAT    source format, default yuv422, one of:", name);
+    for(f = 0; f < N_FORMATS; f++) printf(" %s", formats[f].name);
+    printf("\n"
+           "  -W WIDTH     default 1280\n"
+           "  -H HEIGHT    default 720\n"
+           "  -r ROTATION  0, 90, 180 or 270, default 90\n"
+           "  -n FRAMES    default 300\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int f = 4, w = 1280, h = 720, rotation = 90, frames = 300;
+    int c;
+    size_t i;
+
+    gst_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "f:W:H:r:n:h")) != -1){
+        switch(c){
+        case 'f':
+            for(f = 0; f < N_FORMATS; f++){
+                if(!strcmp(optarg, formats[f].name)) break;
+            }
+            if(f == N_FORMATS){
+                fprintf(stderr, "unknown format %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'W': w = atoi(optarg); break;
+        case 'H': h = atoi(optarg); break;
+        case 'r': rotation = atoi(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'h':
+            _print_usage(argv[0]);
+            return 0;
+        default:
+            _print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(frames <= 0 || !frame_convert_supported(formats[f].format, w, h, rotation)){
+        fprintf(stderr, "unsupported format, size or rotation\n");
+        return 1;
+    }
+
+    size_t src_size = (size_t) w * h * formats[f].bpp_num / formats[f].bpp_den;
+    uint8_t *src = malloc(src_size);
+    srand(1);
+    for(i = 0; i < src_size; i++) src[i] = (uint8_t) rand();
+
+    printf("%s %dx%d rotated %d to NV12, %d frames\n", formats[f].name, w, h, rotation, frames);
+    _bench_fused(f, w, h, rotation, frames, src);
+    int ret = _bench_gst(f, w, h, rotation, frames, src, src_size);
+
+    free(src);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Ingest benchmark, what getting a frame off a pipe and into a GstBuffer
+ * costs per frame with each of the ingest paths:
+ *
+ *   copy:   read into the reader's own buffer like the camera helper, then
+ *           gst_buffer_new_and_alloc and memcpy (the old default)
+ *   pool:   read into the reader's own buffer, then memcpy into a buffer
+ *           from a preallocated pool (zero-copy-ingest off)
+ *   direct: read straight into a pool buffer (zero-copy-ingest on)
+ *
+ * A writer thread plays the camera server and pushes frames into a pipe.
+ * CPU time is the reader thread's own, memory traffic counts the bytes the
+ * reader writes with read() plus the bytes memcpy reads and writes.
+ *
+ *   bench_ingest [width] [height] [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <gst/gst.h>
+
+#define POOL_BUFFERS 8
+// untimed frames first so every pool buffer has been touched once
+#define WARMUP_FRAMES POOL_BUFFERS
+
+typedef enum {
+    MODE_COPY,
+    MODE_POOL,
+    MODE_DIRECT
+} bench_mode_t;
+
+static const char *mode_names[] = {"copy", "pool", "direct"};
+
+typedef struct {
+    int fd;
+    size_t frame_size;
+    int frames;
+} writer_t;
+
+
+static int64_t _ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void* _writer(void *arg)
+{
+    writer_t *w = (writer_t*) arg;
+    uint8_t *frame = malloc(w->frame_size);
+    int i;
+
+    memset(frame, 0x80, w->frame_size);
+    for(i = 0; i < w->frames; i++){
+        size_t done = 0;
+        while(done < w->frame_size){
+            ssize_t n = write(w->fd, frame + done, w->frame_size - done);
+            if(n < 0){
+                if(errno == EINTR) continue;
+                perror("write");
+                goto out;
+            }
+            done += n;
+        }
+    }
+out:
+    close(w->fd);
+    free(frame);
+    return NULL;
+}
+
+static int _read_full(int fd, uint8_t *dst, size_t size)
+{
+    size_t done = 0;
+
+    while(done < size){
+        ssize_t n = read(fd, dst + done, size - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static GstBufferPool* _make_pool(size_t size)
+{
+    GstBufferPool *pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(pool);
+
+    gst_buffer_pool_config_set_params(config, NULL, size, POOL_BUFFERS, POOL_BUFFERS);
+    if(!gst_buffer_pool_set_config(pool, config) || !gst_buffer_pool_set_active(pool, TRUE)){
+        fprintf(stderr, "couldn't make a pool of %d x %zu bytes\n", POOL_BUFFERS, size);
+        gst_object_unref(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static int _run(bench_mode_t mode, int width, int height, int frames)
+{
+    const size_t frame_size = (size_t) width * height * 3 / 2;
+    int fds[2];
+    pthread_t thread;
+    writer_t writer;
+    GstMapInfo info;
+    struct rusage before, after;
+    int i;
+
+    if(pipe(fds)){
+        perror("pipe");
+        return -1;
+    }
+    // as big as the system lets us, like the camera server asks for
+    fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+
+    uint8_t *scratch = malloc(frame_size);
+    GstBufferPool *pool = mode == MODE_COPY ? NULL : _make_pool(frame_size);
+    if(scratch == NULL || (mode != MODE_COPY && pool == NULL)) return -1;
+
+    writer.fd = fds[1];
+    writer.frame_size = frame_size;
+    writer.frames = WARMUP_FRAMES + frames;
+    pthread_create(&thread, NULL, _writer, &writer);
+
+    int64_t cpu_start = 0, wall_start = 0;
+
+    for(i = -WARMUP_FRAMES; i < frames; i++){
+        GstBuffer *buf = NULL;
+
+        if(i == 0){
+            getrusage(RUSAGE_THREAD, &before);
+            cpu_start = _ns(CLOCK_THREAD_CPUTIME_ID);
+            wall_start = _ns(CLOCK_MONOTONIC);
+        }
+
+        if(mode == MODE_DIRECT){
+            gst_buffer_pool_acquire_buffer(pool, &buf, NULL);
+            gst_buffer_map(buf, &info, GST_MAP_WRITE);
+            int ret = _read_full(fds[0], info.data, frame_size);
+            gst_buffer_unmap(buf, &info);
+            if(ret){
+                gst_buffer_unref(buf);
+                break;
+            }
+        } else {
+            if(_read_full(fds[0], scratch, frame_size)) break;
+            if(mode == MODE_COPY) buf = gst_buffer_new_and_alloc(frame_size);
+            else gst_buffer_pool_acquire_buffer(pool, &buf, NULL);
+            gst_buffer_map(buf, &info, GST_MAP_WRITE);
+            memcpy(info.data, scratch, frame_size);
+            gst_buffer_unmap(buf, &info);
+        }
+
+        // the pipeline would hold on to it for a while, it's released here
+        gst_buffer_unref(buf);
+    }
+
+    int64_t cpu_ns = _ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    int64_t wall_ns = _ns(CLOCK_MONOTONIC) - wall_start;
+    getrusage(RUSAGE_THREAD, &after);
+
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    if(pool){
+        gst_buffer_pool_set_active(pool, FALSE);
+        gst_object_unref(pool);
+    }
+    free(scratch);
+
+    if(i < frames){
+        fprintf(stderr, "%s: writer stopped after %d frames\n", mode_names[mode],
+                WARMUP_FRAMES + i);
+        return -1;
+    }
+
+    // read() writes the frame once, a memcpy reads and writes it again
+    double traffic = mode == MODE_DIRECT ? frame_size : 3.0 * frame_size;
+    printf("%-7s %8.2f ms cpu/frame %8.2f ms wall/frame %8.1f MB traffic/frame %8.1f page faults/frame\n",
+           mode_names[mode], cpu_ns / 1e6 / frames, wall_ns / 1e6 / frames,
+           traffic / (1024 * 1024),
+           (double) (after.ru_minflt - before.ru_minflt) / frames);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 3840, height = 2160, frames = 120;
+
+    if(argc > 1 && !strcmp(argv[1], "-h")){
+        printf("usage: %s [width] [height] [frames], default 3840 2160 120\n", argv[0]);
+        return 0;
+    }
+    if(argc > 1) width = atoi(argv[1]);
+    if(argc > 2) height = atoi(argv[2]);
+    if(argc > 3) frames = atoi(argv[3]);
+    if(width <= 0 || height <= 0 || frames <= 0){
+        fprintf(stderr, "invalid size or frame count\n");
+        return 1;
+    }
+
+    gst_init(&argc, &argv);
+
+    printf("%dx%d NV12, %zu bytes/frame, %d frames\n", width, height,
+           (size_t) width * height * 3 / 2, frames);
+    if(_run(MODE_COPY, width, height, frames))   return 1;
+    if(_run(MODE_POOL, width, height, frames))   return 1;
+    if(_run(MODE_DIRECT, width, height, frames)) return 1;
+    return 0;
+}
@@ -0,0 +1,161 @@
+#!/bin/bash
+################################################################################
+# Copyright 2023 ModalAI Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+# 3. Neither the name of the copyright holder nor the names of its contributors
+#    may be used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# 4. The Software is used solely in conjunction with devices provided by
+#    ModalAI Inc.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+################################################################################
+#
+# Multicast benchmark. Starts N RTSP clients against a running voxl-streamer
+# and measures the server's CPU use and the bytes leaving the network
+# interface, first with unicast clients then with multicast ones, so the two
+# can be compared for 1 and N viewers.
+#
+# The stream needs "multicast": "allow" in voxl-streamer.conf. The clients run
+# on the same machine, only the streamer's own CPU time is counted.
+#
+# Needs gst-launch-1.0 with rtspsrc and fakesink.
+################################################################################
+
+URL="rtsp://127.0.0.1:8900/live"
+IFACE=""
+CLIENTS=5
+DURATION=20
+SETTLE=5
+
+print_usage () {
+	echo ""
+	echo "Usage: bench_multicast.sh [options]"
+	echo ""
+	echo "  -u URL       stream to pull, default ${URL}"
+	echo "  -i IFACE     interface to count egress bytes on, default is the"
+	echo "               one with the default route"
+	echo "  -n CLIENTS   number of clients for the N client runs, default ${CLIENTS}"
+	echo "  -t SECONDS   measurement time per run, default ${DURATION}"
+	echo "  -h           show this help"
+	echo ""
+}
+
+while getopts "u:i:n:t:h" opt; do
+	case $opt in
+		u) URL="$OPTARG" ;;
+		i) IFACE="$OPTARG" ;;
+		n) CLIENTS="$OPTARG" ;;
+		t) DURATION="$OPTARG" ;;
+		h) print_usage; exit 0 ;;
+		*) print_usage; exit 1 ;;
+	esac
+done
+
+if ! command -v gst-launch-1.0 > /dev/null; then
+	echo "gst-launch-1.0 not found"
+	exit 1
+fi
+
+PID=$(pidof voxl-streamer)
+if [ -z "$PID" ]; then
+	echo "voxl-streamer isn't running"
+	exit 1
+fi
+# more than one instance, take the first
+PID=${PID%% *}
+
+if [ -z "$IFACE" ]; then
+	IFACE=$(ip route show default 2>/dev/null | awk '{for(i=1;i<NF;i++) if($i=="dev") print $(i+1); exit}')
+fi
+if [ ! -e "/sys/class/net/${IFACE}/statistics/tx_bytes" ]; then
+	echo "no such interface: ${IFACE}"
+	exit 1
+fi
+
+CLK_TCK=$(getconf CLK_TCK)
+CLIENT_PIDS=""
+
+
+## utime + stime of the streamer in clock ticks
+cpu_ticks () {
+	awk '{print $14 + $15}' "/proc/${PID}/stat"
+}
+
+tx_bytes () {
+	cat "/sys/class/net/${IFACE}/statistics/tx_bytes"
+}
+
+stop_clients () {
+	if [ -n "$CLIENT_PIDS" ]; then
+		kill $CLIENT_PIDS 2> /dev/null
+		wait $CLIENT_PIDS 2> /dev/null
+	fi
+	CLIENT_PIDS=""
+}
+trap 'stop_clients; exit 1' INT TERM
+
+## run N clients over the given rtspsrc protocols and print one result line
+run () {
+	local n=$1
+	local proto=$2
+	local i
+
+	for i in $(seq 1 "$n"); do
+		gst-launch-1.0 -q rtspsrc location="$URL" protocols="$proto" latency=0 \
+			! fakesink sync=false > /dev/null 2>&1 &
+		CLIENT_PIDS="$CLIENT_PIDS $!"
+	done
+
+	# let every client finish the handshake and the encoder settle
+	sleep "$SETTLE"
+
+	local cpu0=$(cpu_ticks)
+	local tx0=$(tx_bytes)
+	sleep "$DURATION"
+	local cpu1=$(cpu_ticks)
+	local tx1=$(tx_bytes)
+
+	local alive=0
+	for i in $CLIENT_PIDS; do
+		kill -0 "$i" 2> /dev/null && alive=$((alive + 1))
+	done
+	stop_clients
+
+	awk -v n="$n" -v p="$proto" -v a="$alive" -v c=$((cpu1 - cpu0)) \
+		-v b=$((tx1 - tx0)) -v t="$DURATION" -v hz="$CLK_TCK" 'BEGIN {
+		printf "%-10s %3d clients (%d alive) %6.1f%% cpu %8.2f Mbit/s egress\n",
+			p, n, a, 100.0 * c / hz / t, b * 8 / t / 1000000
+	}'
+
+	# give the server time to time out the sessions before the next run
+	sleep "$SETTLE"
+}
+
+
+echo "voxl-streamer pid ${PID}, ${URL}, counting egress on ${IFACE}"
+run 1 udp
+run "$CLIENTS" udp
+run 1 udp-mcast
+run "$CLIENTS" udp-mcast
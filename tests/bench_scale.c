@@ -0,0 +1,191 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Scaling benchmark, frame_scale against videoscale on the same NV12
+ * frames. Process CPU time is reported so the gstreamer streaming threads
+ * are counted too.
+ *
+ *   bench_scale [-s WxH] [-o WxH] [-n frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#include "frame_scale.h"
+
+
+static int64_t _ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _print(const char *what, int64_t cpu_ns, int64_t wall_ns, int frames)
+{
+    printf("%-12s %8.3f ms cpu/frame %8.3f ms wall/frame\n", what,
+           cpu_ns / 1e6 / frames, wall_ns / 1e6 / frames);
+}
+
+static void _bench_frame_scale(int sw, int sh, int dw, int dh, int frames, const uint8_t *src)
+{
+    uint8_t *dst = malloc((size_t) dw * dh * 3 / 2);
+    uint8_t *scratch = malloc(frame_scale_scratch_size(sw, dw));
+    int i;
+
+    frame_scale_nv12(src, sw, sh, dst, dw, dh, scratch);
+
+    int64_t cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+    int64_t wall = _ns(CLOCK_MONOTONIC);
+    for(i = 0; i < frames; i++) frame_scale_nv12(src, sw, sh, dst, dw, dh, scratch);
+    _print("frame_scale", _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu, _ns(CLOCK_MONOTONIC) - wall, frames);
+
+    free(dst);
+    free(scratch);
+}
+
+static int _bench_videoscale(int sw, int sh, int dw, int dh, int frames,
+                             const uint8_t *src, size_t src_size)
+{
+    GError *error = NULL;
+    int i;
+
+    char *desc = g_strdup_printf(
+        "appsrc name=src format=time "
+        "caps=video/x-raw,format=NV12,width=%d,height=%d,framerate=30/1 "
+        "! videoscale ! video/x-raw,width=%d,height=%d "
+        "! appsink name=sink sync=false",
+        sw, sh, dw, dh);
+    GstElement *pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if(pipeline == NULL || error){
+        fprintf(stderr, "couldn't build the pipeline: %s\n", error ? error->message : "unknown");
+        if(error) g_error_free(error);
+        if(pipeline) gst_object_unref(pipeline);
+        return -1;
+    }
+
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    int64_t cpu = 0, wall = 0;
+    // the first frame negotiates and is left out of the timing
+    for(i = -1; i < frames; i++){
+        if(i == 0){
+            cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+            wall = _ns(CLOCK_MONOTONIC);
+        }
+
+        GstBuffer *buf = gst_buffer_new_allocate(NULL, src_size, NULL);
+        gst_buffer_fill(buf, 0, src, src_size);
+        GST_BUFFER_PTS(buf) = (i + 1) * GST_SECOND / 30;
+        GST_BUFFER_DURATION(buf) = GST_SECOND / 30;
+        if(gst_app_src_push_buffer(GST_APP_SRC(appsrc), buf) != GST_FLOW_OK) break;
+
+        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+        if(sample == NULL) break;
+        gst_sample_unref(sample);
+    }
+    if(i == frames){
+        _print("videoscale", _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu, _ns(CLOCK_MONOTONIC) - wall, frames);
+    } else {
+        fprintf(stderr, "pipeline stopped after %d frames\n", i);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(appsrc);
+    gst_object_unref(appsink);
+    gst_object_unref(pipeline);
+    return i == frames ? 0 : -1;
+}
+
+static void _print_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -s WxH      source size, default 1920x1080\n"
+           "  -o WxH      output size, default 1280x720\n"
+           "  -n FRAMES   default 300\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int sw = 1920, sh = 1080, dw = 1280, dh = 720, frames = 300;
+    int c;
+    size_t i;
+
+    gst_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "s:o:n:h")) != -1){
+        switch(c){
+        case 's':
+            if(sscanf(optarg, "%dx%d", &sw, &sh) != 2) sw = 0;
+            break;
+        case 'o':
+            if(sscanf(optarg, "%dx%d", &dw, &dh) != 2) dw = 0;
+            break;
+        case 'n': frames = atoi(optarg); break;
+        case 'h':
+            _print_usage(argv[0]);
+            return 0;
+        default:
+            _print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(frames <= 0 || sw < 2 || sh < 2 || dw < 2 || dh < 2 ||
+       (sw | sh | dw | dh) & 1){
+        fprintf(stderr, "sizes have to be even and at least 2\n");
+        return 1;
+    }
+
+    size_t src_size = (size_t) sw * sh * 3 / 2;
+    uint8_t *src = malloc(src_size);
+    srand(1);
+    for(i = 0; i < src_size; i++) src[i] = (uint8_t) rand();
+
+    printf("NV12 %dx%d to %dx%d, %d frames\n", sw, sh, dw, dh, frames);
+    _bench_frame_scale(sw, sh, dw, dh, frames, src);
+    int ret = _bench_videoscale(sw, sh, dw, dh, frames, src, src_size);
+
+    free(src);
+    return ret ? 1 : 0;
+}
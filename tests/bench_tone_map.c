@@ -0,0 +1,222 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Tone mapping benchmark at the thermal camera rate, 640x512 RAW16 at 60
+ * fps by default. Times each tone_map mode and, for comparison, the plain
+ * GRAY16_BE to GRAY8 videoconvert the raw path used before, which doesn't
+ * window at all. The share of the frame interval each one takes is printed
+ * next to its time.
+ *
+ *   bench_tone_map [-s WxH] [-f fps] [-n frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+#include "tone_map.h"
+
+
+static int64_t _ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void _print(const char *what, int64_t cpu_ns, int frames, int fps)
+{
+    double ms = cpu_ns / 1e6 / frames;
+    printf("%-20s %8.3f ms cpu/frame, %5.1f%% of a frame interval\n",
+           what, ms, ms * fps / 10.0);
+}
+
+// A thermal looking scene, a warm blob on a cooler gradient with noise,
+// drifting a little every frame so auto mode has something to follow
+static void _make_frames(uint8_t *src, int w, int h, int n)
+{
+    int f, x, y;
+
+    srand(1);
+    for(f = 0; f < n; f++){
+        uint8_t *p = src + (size_t) f * w * h * 2;
+        int cx = w / 2 + f % 40, cy = h / 2;
+        for(y = 0; y < h; y++){
+            for(x = 0; x < w; x++){
+                int d2 = (x - cx) * (x - cx) + (y - cy) * (y - cy);
+                int v = 7000 + y * 4 + (d2 < 4000 ? 3000 - d2 / 2 : 0) + rand() % 64;
+                p[0] = (uint8_t) (v >> 8);
+                p[1] = (uint8_t) v;
+                p += 2;
+            }
+        }
+    }
+}
+
+static void _bench_mode(const char *name, tone_map_mode_t mode, uint16_t min, uint16_t max,
+                        double gamma, const uint8_t *src, int n_src, int w, int h,
+                        int frames, int fps)
+{
+    uint8_t *dst = malloc((size_t) w * h);
+    tone_map_t tm;
+    int i;
+
+    if(tone_map_init(&tm, mode, min, max, gamma)){
+        fprintf(stderr, "tone_map_init failed\n");
+        free(dst);
+        return;
+    }
+    // builds the table if the mode needs one
+    tone_map_gray8(&tm, src, dst, w, h);
+
+    int64_t cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+    for(i = 0; i < frames; i++){
+        tone_map_gray8(&tm, src + (size_t) (i % n_src) * w * h * 2, dst, w, h);
+    }
+    _print(name, _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu, frames, fps);
+
+    tone_map_deinit(&tm);
+    free(dst);
+}
+
+static int _bench_videoconvert(const uint8_t *src, int n_src, int w, int h, int frames, int fps)
+{
+    GError *error = NULL;
+    size_t size = (size_t) w * h * 2;
+    int i;
+
+    char *desc = g_strdup_printf(
+        "appsrc name=src format=time "
+        "caps=video/x-raw,format=GRAY16_BE,width=%d,height=%d,framerate=%d/1 "
+        "! videoconvert ! video/x-raw,format=GRAY8 "
+        "! appsink name=sink sync=false",
+        w, h, fps);
+    GstElement *pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if(pipeline == NULL || error){
+        fprintf(stderr, "couldn't build the pipeline: %s\n", error ? error->message : "unknown");
+        if(error) g_error_free(error);
+        if(pipeline) gst_object_unref(pipeline);
+        return -1;
+    }
+
+    GstElement *appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement *appsink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    int64_t cpu = 0;
+    // the first frame negotiates and is left out of the timing
+    for(i = -1; i < frames; i++){
+        if(i == 0) cpu = _ns(CLOCK_PROCESS_CPUTIME_ID);
+
+        GstBuffer *buf = gst_buffer_new_allocate(NULL, size, NULL);
+        gst_buffer_fill(buf, 0, src + (size_t) ((i + n_src) % n_src) * size, size);
+        GST_BUFFER_PTS(buf) = (i + 1) * GST_SECOND / fps;
+        GST_BUFFER_DURATION(buf) = GST_SECOND / fps;
+        if(gst_app_src_push_buffer(GST_APP_SRC(appsrc), buf) != GST_FLOW_OK) break;
+
+        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink));
+        if(sample == NULL) break;
+        gst_sample_unref(sample);
+    }
+    if(i == frames){
+        _print("videoconvert", _ns(CLOCK_PROCESS_CPUTIME_ID) - cpu, frames, fps);
+    } else {
+        fprintf(stderr, "pipeline stopped after %d frames\n", i);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(appsrc);
+    gst_object_unref(appsink);
+    gst_object_unref(pipeline);
+    return i == frames ? 0 : -1;
+}
+
+static void _print_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -s WxH      frame size, default 640x512\n"
+           "  -f FPS      frame rate the budget is worked out for, default 60\n"
+           "  -n FRAMES   default 600\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const int n_src = 40;
+    int w = 640, h = 512, fps = 60, frames = 600;
+    int c;
+
+    gst_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "s:f:n:h")) != -1){
+        switch(c){
+        case 's':
+            if(sscanf(optarg, "%dx%d", &w, &h) != 2) w = 0;
+            break;
+        case 'f': fps = atoi(optarg); break;
+        case 'n': frames = atoi(optarg); break;
+        case 'h':
+            _print_usage(argv[0]);
+            return 0;
+        default:
+            _print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(w <= 0 || h <= 0 || fps <= 0 || frames <= 0){
+        fprintf(stderr, "invalid size, frame rate or frame count\n");
+        return 1;
+    }
+
+    uint8_t *src = malloc((size_t) w * h * 2 * n_src);
+    if(src == NULL) return 1;
+    _make_frames(src, w, h, n_src);
+
+    printf("RAW16 %dx%d, %d frames, %.2f ms per frame at %d fps\n",
+           w, h, frames, 1000.0 / fps, fps);
+    _bench_mode("linear", TONE_MAP_LINEAR, 6000, 12000, 1.0, src, n_src, w, h, frames, fps);
+    _bench_mode("linear gamma 0.5", TONE_MAP_LINEAR, 6000, 12000, 0.5, src, n_src, w, h, frames, fps);
+    _bench_mode("auto", TONE_MAP_AUTO, 0, 0, 1.0, src, n_src, w, h, frames, fps);
+    _bench_mode("auto gamma 0.5", TONE_MAP_AUTO, 0, 0, 0.5, src, n_src, w, h, frames, fps);
+    int ret = _bench_videoconvert(src, n_src, w, h, frames, fps);
+
+    free(src);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,321 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Loopback latency harness for slice mode. Runs a live test pattern through
+ * the encoder and payloader twice, once with whole frames the way the
+ * streamer does by default and once split into slices with a parser handing
+ * the payloader one slice at a time, like the slices option sets up.
+ *
+ * For every frame it measures the time from the frame entering the encoder
+ * to the first and to the last RTP packet of that frame leaving the
+ * payloader, which is where a client starts and finishes receiving it.
+ *
+ *   latency_harness -h for options
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <gst/gst.h>
+
+#define MAX_FRAMES      (60 * 600)
+#define WARMUP_FRAMES   30
+
+#define DEFAULT_ENCODER "x264enc tune=zerolatency speed-preset=ultrafast sliced-threads=true key-int-max=30 bitrate=4000"
+#define DEFAULT_SLICES  "option-string=slices=%d"
+
+typedef struct frame_times_t {
+    GstClockTime pts;
+    int64_t in_ns;
+    int64_t first_ns;
+    int64_t last_ns;
+} frame_times_t;
+
+typedef struct run_t {
+    frame_times_t frames[MAX_FRAMES];
+    int n_frames;
+    int n_packets;
+    GMutex lock;
+} run_t;
+
+static struct {
+    const char *encoder;
+    const char *slice_property;
+    int width, height, fps, seconds, slices;
+} opts = {DEFAULT_ENCODER, DEFAULT_SLICES, 1920, 1080, 30, 10, 4};
+
+
+static int64_t _ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static frame_times_t *_find(run_t *run, GstClockTime pts)
+{
+    int i;
+
+    // packets come out in order, the frame is almost always one of the last
+    for(i = run->n_frames - 1; i >= 0 && i >= run->n_frames - 8; i--){
+        if(run->frames[i].pts == pts) return &run->frames[i];
+    }
+    return NULL;
+}
+
+// a raw frame goes into the encoder
+static GstPadProbeReturn _in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    run_t *run = (run_t*) data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    g_mutex_lock(&run->lock);
+    if(run->n_frames < MAX_FRAMES){
+        frame_times_t *f = &run->frames[run->n_frames++];
+        f->pts = GST_BUFFER_PTS(buf);
+        f->in_ns = _ns();
+        f->first_ns = 0;
+        f->last_ns = 0;
+    }
+    g_mutex_unlock(&run->lock);
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean _packet(GstBuffer **buf, guint idx, gpointer data)
+{
+    run_t *run = (run_t*) data;
+    int64_t now = _ns();
+    guint8 header[2];
+
+    if(gst_buffer_extract(*buf, 0, header, 2) != 2) return TRUE;
+
+    g_mutex_lock(&run->lock);
+    frame_times_t *f = _find(run, GST_BUFFER_PTS(*buf));
+    if(f){
+        if(f->first_ns == 0) f->first_ns = now;
+        // the marker bit is set on the last packet of a frame
+        if(header[1] & 0x80) f->last_ns = now;
+    }
+    run->n_packets++;
+    g_mutex_unlock(&run->lock);
+    return TRUE;
+}
+
+// RTP packets leave the payloader, singly or as lists
+static GstPadProbeReturn _out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST){
+        gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST(info), _packet, data);
+    } else {
+        GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+        _packet(&buf, 0, data);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void _add_probe(GstElement *pipeline, const char *name, const char *pad_name,
+                       GstPadProbeType type, GstPadProbeCallback cb, run_t *run)
+{
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_pad_add_probe(pad, type, cb, run, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+}
+
+static int _run(run_t *run, int slices)
+{
+    GError *error = NULL;
+    GstMessage *msg;
+    char *encoder, *desc;
+    int ret = 0;
+
+    if(slices > 1){
+        char *property = g_strdup_printf(opts.slice_property, slices);
+        encoder = g_strdup_printf("%s %s name=encoder ! h264parse ! video/x-h264,alignment=nal",
+                                  opts.encoder, property);
+        g_free(property);
+    } else {
+        encoder = g_strdup_printf("%s name=encoder ! video/x-h264,alignment=au", opts.encoder);
+    }
+
+    desc = g_strdup_printf(
+        "videotestsrc is-live=true pattern=ball num-buffers=%d "
+        "! video/x-raw,format=I420,width=%d,height=%d,framerate=%d/1 "
+        "! queue "
+        "! %s "
+        "! rtph264pay name=pay mtu=1400 config-interval=-1 "
+        "! fakesink sync=false",
+        opts.fps * opts.seconds, opts.width, opts.height, opts.fps, encoder);
+    g_free(encoder);
+
+    GstElement *pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if(pipeline == NULL || error){
+        fprintf(stderr, "couldn't build the pipeline: %s\n", error ? error->message : "unknown");
+        if(error) g_error_free(error);
+        if(pipeline) gst_object_unref(pipeline);
+        return -1;
+    }
+
+    _add_probe(pipeline, "encoder", "sink", GST_PAD_PROBE_TYPE_BUFFER, _in_probe, run);
+    _add_probe(pipeline, "pay", "src",
+               GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, _out_probe, run);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    msg = gst_bus_timed_pop_filtered(bus, (opts.seconds + 10) * GST_SECOND,
+                                     GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if(msg == NULL){
+        fprintf(stderr, "timed out waiting for the end of the stream\n");
+        ret = -1;
+    } else {
+        if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR){
+            gst_message_parse_error(msg, &error, NULL);
+            fprintf(stderr, "pipeline error: %s\n", error->message);
+            g_error_free(error);
+            ret = -1;
+        }
+        gst_message_unref(msg);
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+    return ret;
+}
+
+static int _cmp(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void _stats(const char *what, double *ms, int n)
+{
+    double sum = 0;
+    int i;
+
+    if(n == 0){
+        printf("  %-13s no frames\n", what);
+        return;
+    }
+    qsort(ms, n, sizeof(double), _cmp);
+    for(i = 0; i < n; i++) sum += ms[i];
+    printf("  %-13s mean %6.2f ms  p50 %6.2f ms  p95 %6.2f ms  max %6.2f ms\n",
+           what, sum / n, ms[n / 2], ms[n * 95 / 100], ms[n - 1]);
+}
+
+static void _report(run_t *run, int slices)
+{
+    double *first = malloc(sizeof(double) * run->n_frames);
+    double *last = malloc(sizeof(double) * run->n_frames);
+    int i, n_first = 0, n_last = 0;
+
+    for(i = WARMUP_FRAMES; i < run->n_frames; i++){
+        frame_times_t *f = &run->frames[i];
+        if(f->first_ns) first[n_first++] = (f->first_ns - f->in_ns) / 1e6;
+        if(f->last_ns) last[n_last++] = (f->last_ns - f->in_ns) / 1e6;
+    }
+
+    if(slices > 1) printf("%d slices, %d frames, %d packets\n", slices, run->n_frames, run->n_packets);
+    else printf("whole frames, %d frames, %d packets\n", run->n_frames, run->n_packets);
+    _stats("first packet", first, n_first);
+    _stats("last packet", last, n_last);
+
+    free(first);
+    free(last);
+}
+
+static void _print_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -e ENCODER   encoder description, default \"%s\"\n"
+           "  -p PROPERTY  encoder property that sets the slice count, %%d is\n"
+           "               replaced with it, default \"%s\"\n"
+           "  -n SLICES    slices per frame for the sliced run, default %d\n"
+           "  -s WxH       frame size, default %dx%d\n"
+           "  -f FPS       default %d\n"
+           "  -t SECONDS   length of each run, default %d\n",
+           name, DEFAULT_ENCODER, DEFAULT_SLICES, opts.slices, opts.width, opts.height,
+           opts.fps, opts.seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+
+    gst_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "e:p:n:s:f:t:h")) != -1){
+        switch(c){
+        case 'e': opts.encoder = optarg; break;
+        case 'p': opts.slice_property = optarg; break;
+        case 'n': opts.slices = atoi(optarg); break;
+        case 's':
+            if(sscanf(optarg, "%dx%d", &opts.width, &opts.height) != 2) opts.width = 0;
+            break;
+        case 'f': opts.fps = atoi(optarg); break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'h':
+            _print_usage(argv[0]);
+            return 0;
+        default:
+            _print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(opts.width <= 0 || opts.height <= 0 || opts.fps <= 0 || opts.seconds <= 0 ||
+       opts.slices < 2 || opts.fps * opts.seconds > MAX_FRAMES){
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    printf("%dx%d at %d fps, %d s per run\n", opts.width, opts.height, opts.fps, opts.seconds);
+
+    int slices[2] = {0, opts.slices}, i;
+    for(i = 0; i < 2; i++){
+        run_t *run = g_new0(run_t, 1);
+        g_mutex_init(&run->lock);
+        if(_run(run, slices[i]) == 0) _report(run, slices[i]);
+        g_mutex_clear(&run->lock);
+        g_free(run);
+    }
+    return 0;
+}
@@ -0,0 +1,508 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Loopback loss harness for the FEC and RTX options. Encodes a test pattern,
+ * sends it through the same rtph264pay and rtpulpfecenc or rtprtxsend the
+ * RTSP media uses, drops packets on the way, and receives it again like a
+ * client's rtpbin would:
+ *
+ *   fec: rtpstorage, rtpjitterbuffer and rtpulpfecdec
+ *   rtx: rtprtxreceive and an rtpjitterbuffer that sends retransmission
+ *        requests back upstream, so retransmissions can be lost too
+ *
+ * For every combination of loss rate and FEC percentage or RTX history it
+ * reports the bandwidth overhead and how many frames would be visibly
+ * corrupted. A frame counts as corrupted when one of its packets never
+ * arrived, or when any frame it depends on since the last intact keyframe
+ * was.
+ *
+ *   loss_harness -h for options
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <gst/gst.h>
+
+#define MEDIA_PT        96
+#define FEC_PT          122
+#define RTX_PT          97
+#define MTU             1200
+#define MAX_PACKETS     65536
+#define MAX_LIST        16
+
+#define DEFAULT_ENCODER "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=30 bitrate=2000"
+
+typedef struct sent_packet_t {
+    uint8_t  media;         // 0 for FEC packets, RTX packets aren't kept
+    uint8_t  keyframe;      // carries part of an IDR
+    uint8_t  received;      // came out of the receiver, directly or recovered
+    uint32_t timestamp;     // RTP timestamp, one per frame
+} sent_packet_t;
+
+typedef struct run_t {
+    // loss model, a two state Gilbert channel. With a burst length of 1 it
+    // is plain independent loss
+    double loss;
+    double burst;
+    int in_burst;
+
+    sent_packet_t packets[MAX_PACKETS];
+    int first_seq;
+    int n_sent;
+    guint64 media_bytes;
+    guint64 repair_bytes;   // FEC or retransmissions
+    int n_dropped;
+    guint rtx_requests;
+    guint rtx_packets;
+} run_t;
+
+typedef enum {
+    MODE_FEC,
+    MODE_RTX
+} harness_mode_t;
+
+static struct {
+    harness_mode_t mode;
+    const char *encoder;
+    int width, height, fps, seconds;
+    double losses[MAX_LIST];
+    int n_losses;
+    int fec[MAX_LIST];
+    int n_fec;
+    int rtx_ms[MAX_LIST];
+    int n_rtx;
+    double burst;
+    unsigned int seed;
+} opts = {MODE_FEC, DEFAULT_ENCODER, 1280, 720, 30, 10, {0, 1, 2, 5, 10}, 5,
+        {0, 10, 20, 33, 50}, 5, {0, 100, 250, 1000}, 4, 1, 1};
+
+
+// The parts of an RTP header we need. Returns the payload offset or -1
+static int _parse_rtp(const uint8_t *d, gsize size, int *pt, int *seq, uint32_t *ts)
+{
+    if(size < 12 || (d[0] >> 6) != 2) return -1;
+
+    int offset = 12 + 4 * (d[0] & 0x0F);
+    if(d[0] & 0x10){
+        if(size < (gsize) offset + 4) return -1;
+        offset += 4 + 4 * ((d[offset + 2] << 8) | d[offset + 3]);
+    }
+    if(size < (gsize) offset + 1) return -1;
+
+    *pt  = d[1] & 0x7F;
+    *seq = (d[2] << 8) | d[3];
+    *ts  = ((uint32_t) d[4] << 24) | (d[5] << 16) | (d[6] << 8) | d[7];
+    return offset;
+}
+
+// Whether an H264 RTP payload carries part of an IDR picture
+static int _is_idr(const uint8_t *p, gsize size)
+{
+    int type = p[0] & 0x1F;
+
+    // FU-A, the real type is in the FU header
+    if(type == 28) return size > 1 && (p[1] & 0x1F) == 5;
+
+    // STAP-A, walk the aggregated units
+    if(type == 24){
+        gsize i = 1;
+        while(i + 2 < size){
+            gsize len = (p[i] << 8) | p[i + 1];
+            if((p[i + 2] & 0x1F) == 5) return 1;
+            i += 2 + len;
+        }
+        return 0;
+    }
+    return type == 5;
+}
+
+static int _drop(run_t *run)
+{
+    double p_enter, p_leave;
+
+    if(run->loss <= 0) return 0;
+
+    // a burst ends with probability 1/burst, and is entered often enough
+    // that the average loss comes out at run->loss
+    p_leave = 1.0 / run->burst;
+    p_enter = run->loss * p_leave / (1.0 - run->loss);
+    if(run->in_burst) run->in_burst = drand48() >= p_leave;
+    else run->in_burst = drand48() < p_enter;
+    return run->in_burst;
+}
+
+// Sender side, sees every packet after rtpulpfecenc or rtprtxsend and drops
+// some
+static GstPadProbeReturn _send_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    run_t *run = (run_t*) data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+    int pt, seq, offset;
+    uint32_t ts;
+
+    if(!gst_buffer_map(buf, &map, GST_MAP_READ)) return GST_PAD_PROBE_OK;
+    offset = _parse_rtp(map.data, map.size, &pt, &seq, &ts);
+
+    // retransmissions have their own sequence numbers, they only count
+    // towards the overhead
+    if(offset >= 0 && pt == RTX_PT){
+        run->repair_bytes += map.size;
+    }
+    // only as many as fit before the sequence numbers wrap
+    else if(offset >= 0 && run->n_sent < MAX_PACKETS){
+        if(run->first_seq < 0) run->first_seq = seq;
+        int index = (seq - run->first_seq) & 0xFFFF;
+        sent_packet_t *p = &run->packets[index];
+        if(index >= run->n_sent) run->n_sent = index + 1;
+
+        p->media = pt == MEDIA_PT;
+        p->timestamp = ts;
+        if(p->media){
+            p->keyframe = _is_idr(map.data + offset, map.size - offset);
+            run->media_bytes += map.size;
+        } else {
+            run->repair_bytes += map.size;
+        }
+    }
+    gst_buffer_unmap(buf, &map);
+
+    if(_drop(run)){
+        run->n_dropped++;
+        return GST_PAD_PROBE_DROP;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// Receiver side, sees the media packets that made it or were recovered
+static GstPadProbeReturn _receive_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+    run_t *run = (run_t*) data;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstMapInfo map;
+    int pt, seq;
+    uint32_t ts;
+
+    if(!gst_buffer_map(buf, &map, GST_MAP_READ)) return GST_PAD_PROBE_OK;
+    if(_parse_rtp(map.data, map.size, &pt, &seq, &ts) >= 0 && pt == MEDIA_PT && run->first_seq >= 0){
+        int index = (seq - run->first_seq) & 0xFFFF;
+        if(index < run->n_sent) run->packets[index].received = 1;
+    }
+    gst_buffer_unmap(buf, &map);
+    return GST_PAD_PROBE_OK;
+}
+
+static void _add_probe(GstElement *pipeline, const char *name, const char *pad_name,
+                       GstPadProbeCallback cb, run_t *run)
+{
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, cb, run, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+}
+
+// rtpulpfecdec recovers from the packets rtpstorage keeps
+static void _connect_storage(GstElement *pipeline)
+{
+    GstElement *storage = gst_bin_get_by_name(GST_BIN(pipeline), "storage");
+    GstElement *dec = gst_bin_get_by_name(GST_BIN(pipeline), "fecdec");
+    GObject *internal = NULL;
+
+    g_object_get(storage, "internal-storage", &internal, NULL);
+    g_object_set(dec, "storage", internal, NULL);
+    g_object_unref(internal);
+    gst_object_unref(storage);
+    gst_object_unref(dec);
+}
+
+// Both ends of RTX map the media payload type to the retransmission one
+static void _set_rtx_map(GstElement *pipeline, const char *name)
+{
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    GstStructure *map = gst_structure_new("application/x-rtp-pt-map",
+                                          G_STRINGIFY(MEDIA_PT), G_TYPE_UINT, RTX_PT, NULL);
+
+    g_object_set(element, "payload-type-map", map, NULL);
+    gst_structure_free(map);
+    gst_object_unref(element);
+}
+
+static void _get_rtx_stats(GstElement *pipeline, run_t *run)
+{
+    GstElement *element = gst_bin_get_by_name(GST_BIN(pipeline), "rtxsend");
+
+    g_object_get(element, "num-rtx-requests", &run->rtx_requests,
+                          "num-rtx-packets", &run->rtx_packets, NULL);
+    gst_object_unref(element);
+}
+
+// level is the fec percentage or the rtx history in ms
+static int _run(run_t *run, int level)
+{
+    GError *error = NULL;
+    GstMessage *msg;
+    char *desc, *repair;
+    int ret = 0;
+    int rtx = opts.mode == MODE_RTX && level > 0;
+
+    if(opts.mode == MODE_FEC){
+        repair = g_strdup_printf(
+            "! rtpulpfecenc pt=%d percentage=%d "
+            "! identity name=loss "
+            "! rtpstorage name=storage size-time=%" G_GUINT64_FORMAT " "
+            "! rtpjitterbuffer latency=200 do-lost=true "
+            "! rtpulpfecdec name=fecdec pt=%d ",
+            FEC_PT, level, (guint64) (500 * GST_MSECOND), FEC_PT);
+    } else if(rtx){
+        // the history is only bounded by time here, max-size-packets 0
+        // turns the packet bound off
+        repair = g_strdup_printf(
+            "! rtprtxsend name=rtxsend max-size-time=%d max-size-packets=0 "
+            "! identity name=loss "
+            "! rtprtxreceive name=rtxreceive "
+            "! rtpjitterbuffer latency=200 do-lost=true do-retransmission=true ",
+            level);
+    } else {
+        repair = g_strdup("! identity name=loss ! rtpjitterbuffer latency=200 do-lost=true ");
+    }
+
+    desc = g_strdup_printf(
+        "videotestsrc is-live=true pattern=ball num-buffers=%d "
+        "! video/x-raw,format=I420,width=%d,height=%d,framerate=%d/1 "
+        "! %s "
+        "! rtph264pay mtu=%d pt=%d config-interval=-1 "
+        "%s"
+        "! identity name=received "
+        "! rtph264depay ! fakesink sync=false",
+        opts.fps * opts.seconds, opts.width, opts.height, opts.fps, opts.encoder,
+        MTU, MEDIA_PT, repair);
+    g_free(repair);
+
+    GstElement *pipeline = gst_parse_launch(desc, &error);
+    g_free(desc);
+    if(pipeline == NULL || error){
+        fprintf(stderr, "couldn't build the pipeline: %s\n", error ? error->message : "unknown");
+        if(error) g_error_free(error);
+        if(pipeline) gst_object_unref(pipeline);
+        return -1;
+    }
+
+    if(opts.mode == MODE_FEC){
+        _connect_storage(pipeline);
+    } else if(rtx){
+        _set_rtx_map(pipeline, "rtxsend");
+        _set_rtx_map(pipeline, "rtxreceive");
+    }
+    _add_probe(pipeline, "loss", "src", _send_probe, run);
+    _add_probe(pipeline, "received", "sink", _receive_probe, run);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    msg = gst_bus_timed_pop_filtered(bus, (opts.seconds + 10) * GST_SECOND,
+                                     GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if(msg == NULL){
+        fprintf(stderr, "timed out waiting for the end of the stream\n");
+        ret = -1;
+    } else {
+        if(GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR){
+            gst_message_parse_error(msg, &error, NULL);
+            fprintf(stderr, "pipeline error: %s\n", error->message);
+            g_error_free(error);
+            ret = -1;
+        }
+        gst_message_unref(msg);
+    }
+
+    if(rtx) _get_rtx_stats(pipeline, run);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(pipeline);
+    return ret;
+}
+
+static void _report(run_t *run, int level)
+{
+    int i, n_media = 0, n_lost = 0, n_frames = 0, n_corrupt = 0;
+    int frame_broken = 0, frame_key = 0, chain_broken = 0, have_frame = 0;
+    uint32_t frame_ts = 0;
+
+    // walk the media packets in send order, grouped into frames by timestamp
+    for(i = 0; i <= run->n_sent; i++){
+        sent_packet_t *p = i < run->n_sent ? &run->packets[i] : NULL;
+        if(p && !p->media) continue;
+
+        if(have_frame && (p == NULL || p->timestamp != frame_ts)){
+            // an intact keyframe repairs the picture, anything broken
+            // stays broken until then
+            if(frame_key) chain_broken = frame_broken;
+            else chain_broken |= frame_broken;
+            n_frames++;
+            n_corrupt += chain_broken;
+            have_frame = 0;
+        }
+        if(p == NULL) break;
+
+        if(!have_frame){
+            have_frame = 1;
+            frame_ts = p->timestamp;
+            frame_broken = 0;
+            frame_key = 0;
+        }
+        n_media++;
+        frame_key |= p->keyframe;
+        if(!p->received){
+            n_lost++;
+            frame_broken = 1;
+        }
+    }
+
+    if(opts.mode == MODE_FEC){
+        printf("%5.1f%% loss %3d%% fec:    ", run->loss * 100, level);
+    } else {
+        printf("%5.1f%% loss %4dms rtx: ", run->loss * 100, level);
+    }
+    printf("%5.1f%% overhead, %5d packets dropped, %5d of %d media packets lost, "
+           "%6.2f%% of %d frames corrupted",
+           run->media_bytes ? 100.0 * run->repair_bytes / run->media_bytes : 0.0,
+           run->n_dropped, n_lost, n_media,
+           n_frames ? 100.0 * n_corrupt / n_frames : 0.0, n_frames);
+    if(opts.mode == MODE_RTX){
+        printf(", %u requests %u resent", run->rtx_requests, run->rtx_packets);
+    }
+    printf("\n");
+}
+
+static int _parse_list(const char *str, double *out, int max)
+{
+    char *copy = g_strdup(str), *tok, *save = NULL;
+    int n = 0;
+
+    for(tok = strtok_r(copy, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save)){
+        out[n++] = atof(tok);
+    }
+    g_free(copy);
+    return n;
+}
+
+static void _print_usage(const char *name)
+{
+    printf("usage: %s [options]\n"
+           "  -e ENCODER   encoder description, default \"%s\"\n"
+           "  -W WIDTH     default %d\n"
+           "  -H HEIGHT    default %d\n"
+           "  -f FPS       default %d\n"
+           "  -t SECONDS   length of each run, default %d\n"
+           "  -l LOSSES    comma separated packet loss percentages, default 0,1,2,5,10\n"
+           "  -m MODE      fec or rtx, default fec\n"
+           "  -p FEC       comma separated fec percentages, default 0,10,20,33,50\n"
+           "  -r RTX       comma separated rtx history lengths in ms, 0 for no\n"
+           "               rtx, default 0,100,250,1000\n"
+           "  -b BURST     mean loss burst length in packets, default 1\n"
+           "  -s SEED      random seed, default 1\n",
+           name, DEFAULT_ENCODER, opts.width, opts.height, opts.fps, opts.seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    double list[MAX_LIST];
+    int c, i, j;
+
+    gst_init(&argc, &argv);
+
+    while((c = getopt(argc, argv, "m:e:W:H:f:t:l:p:r:b:s:h")) != -1){
+        switch(c){
+        case 'm':
+            if(!strcmp(optarg, "fec")) opts.mode = MODE_FEC;
+            else if(!strcmp(optarg, "rtx")) opts.mode = MODE_RTX;
+            else {
+                fprintf(stderr, "unknown mode %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e': opts.encoder = optarg; break;
+        case 'W': opts.width = atoi(optarg); break;
+        case 'H': opts.height = atoi(optarg); break;
+        case 'f': opts.fps = atoi(optarg); break;
+        case 't': opts.seconds = atoi(optarg); break;
+        case 'l': opts.n_losses = _parse_list(optarg, opts.losses, MAX_LIST); break;
+        case 'p':
+            opts.n_fec = _parse_list(optarg, list, MAX_LIST);
+            for(i = 0; i < opts.n_fec; i++) opts.fec[i] = (int) list[i];
+            break;
+        case 'r':
+            opts.n_rtx = _parse_list(optarg, list, MAX_LIST);
+            for(i = 0; i < opts.n_rtx; i++) opts.rtx_ms[i] = (int) list[i];
+            break;
+        case 'b': opts.burst = atof(optarg); break;
+        case 's': opts.seed = atoi(optarg); break;
+        case 'h':
+            _print_usage(argv[0]);
+            return 0;
+        default:
+            _print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(opts.width <= 0 || opts.height <= 0 || opts.fps <= 0 || opts.seconds <= 0 || opts.burst < 1){
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    printf("%dx%d at %d fps, %d s per run, mean loss burst %.1f packets\n",
+           opts.width, opts.height, opts.fps, opts.seconds, opts.burst);
+
+    int *levels = opts.mode == MODE_FEC ? opts.fec : opts.rtx_ms;
+    int n_levels = opts.mode == MODE_FEC ? opts.n_fec : opts.n_rtx;
+
+    for(i = 0; i < opts.n_losses; i++){
+        for(j = 0; j < n_levels; j++){
+            run_t *run = g_new0(run_t, 1);
+            run->loss = opts.losses[i] / 100.0;
+            run->burst = opts.burst;
+            run->first_seq = -1;
+            // the same loss pattern for every fec percentage or history
+            srand48(opts.seed + i);
+
+            if(_run(run, levels[j]) == 0) _report(run, levels[j]);
+            g_free(run);
+        }
+    }
+    return 0;
+}
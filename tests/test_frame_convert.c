@@ -0,0 +1,247 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for frame_convert: every supported format at every rotation
+ * and a range of sizes, including widths that leave a scalar tail after the
+ * vector loops and heights that end in a partial band, against a simple per
+ * pixel reference.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <modal_pipe.h>
+
+#include "frame_convert.h"
+#include "test_util.h"
+
+static const struct {
+    int format;
+    const char *name;
+    int bpp_num, bpp_den;       // source bytes per pixel
+} formats[] = {
+    {IMAGE_FORMAT_RAW8,        "raw8",        1, 1},
+    {IMAGE_FORMAT_STEREO_RAW8, "stereo_raw8", 1, 1},
+    {IMAGE_FORMAT_NV12,        "nv12",        3, 2},
+    {IMAGE_FORMAT_STEREO_NV12, "stereo_nv12", 3, 2},
+    {IMAGE_FORMAT_NV21,        "nv21",        3, 2},
+    {IMAGE_FORMAT_STEREO_NV21, "stereo_nv21", 3, 2},
+    {IMAGE_FORMAT_YUV420,      "yuv420",      3, 2},
+    {IMAGE_FORMAT_YUV422,      "yuv422",      2, 1},
+    {IMAGE_FORMAT_YUV422_UYVY, "uyvy",        2, 1},
+    {IMAGE_FORMAT_RGB,         "rgb",         3, 1},
+    {IMAGE_FORMAT_STEREO_RGB,  "stereo_rgb",  3, 1},
+};
+
+static const int rotations[] = {0, 90, 180, 270};
+
+static const int sizes[][2] = {
+    {2, 2}, {16, 16}, {18, 2}, {34, 18}, {48, 32}, {66, 50}, {320, 240}, {642, 482},
+};
+
+#define N_FORMATS   (int) (sizeof(formats) / sizeof(formats[0]))
+#define N_ROTATIONS (int) (sizeof(rotations) / sizeof(rotations[0]))
+#define N_SIZES     (int) (sizeof(sizes) / sizeof(sizes[0]))
+
+
+static int _avg2(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+// Reference NV12 of one source pixel, luma at (x, y) and the chroma pair of
+// the 2x2 block it's in
+static int _ref_y(const uint8_t *s, int format, int w, int x, int y)
+{
+    switch(format){
+        case IMAGE_FORMAT_YUV422:      return s[(y * w + x) * 2];
+        case IMAGE_FORMAT_YUV422_UYVY: return s[(y * w + x) * 2 + 1];
+        case IMAGE_FORMAT_RGB:
+        case IMAGE_FORMAT_STEREO_RGB: {
+            const uint8_t *p = s + (y * w + x) * 3;
+            return ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+        }
+    }
+    return s[y * w + x];
+}
+
+static void _ref_uv(const uint8_t *s, int format, int w, int h, int cx, int cy, int *u, int *v)
+{
+    const uint8_t *chroma = s + w * h;
+
+    *u = *v = 128;
+    switch(format){
+        case IMAGE_FORMAT_NV12:
+        case IMAGE_FORMAT_STEREO_NV12:
+            *u = chroma[cy * w + cx * 2];
+            *v = chroma[cy * w + cx * 2 + 1];
+            return;
+        case IMAGE_FORMAT_NV21:
+        case IMAGE_FORMAT_STEREO_NV21:
+            *v = chroma[cy * w + cx * 2];
+            *u = chroma[cy * w + cx * 2 + 1];
+            return;
+        case IMAGE_FORMAT_YUV420:
+            *u = chroma[cy * (w / 2) + cx];
+            *v = chroma[(w / 2) * (h / 2) + cy * (w / 2) + cx];
+            return;
+        case IMAGE_FORMAT_YUV422:
+        case IMAGE_FORMAT_YUV422_UYVY: {
+            // YUYV and UYVY, 4:2:2 chroma averaged over the two rows
+            int o = format == IMAGE_FORMAT_YUV422 ? 1 : 0;
+            const uint8_t *r0 = s + ((2 * cy) * w + 2 * cx) * 2;
+            const uint8_t *r1 = r0 + w * 2;
+            *u = _avg2(r0[o], r1[o]);
+            *v = _avg2(r0[o + 2], r1[o + 2]);
+            return;
+        }
+        case IMAGE_FORMAT_RGB:
+        case IMAGE_FORMAT_STEREO_RGB: {
+            const uint8_t *p00 = s + ((2 * cy) * w + 2 * cx) * 3;
+            const uint8_t *p01 = p00 + 3, *p10 = p00 + w * 3, *p11 = p10 + 3;
+            int r = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+            int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+            int b = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+            *u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            *v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+            return;
+        }
+    }
+}
+
+// Where output pixel (ox, oy) comes from in a w x h source, clockwise
+static void _unrotate(int rotation, int w, int h, int ox, int oy, int *x, int *y)
+{
+    switch(rotation){
+        case 90:  *x = oy;         *y = h - 1 - ox; break;
+        case 180: *x = w - 1 - ox; *y = h - 1 - oy; break;
+        case 270: *x = w - 1 - oy; *y = ox;         break;
+        default:  *x = ox;         *y = oy;         break;
+    }
+}
+
+static int _check(int f, int w, int h, int rotation, const uint8_t *src, const uint8_t *dst)
+{
+    const int format = formats[f].format;
+    const int ow = (rotation % 180) ? h : w;
+    const int oh = (rotation % 180) ? w : h;
+    const uint8_t *dst_uv = dst + (size_t) w * h;
+    int ox, oy, x, y, u, v;
+
+    for(oy = 0; oy < oh; oy++){
+        for(ox = 0; ox < ow; ox++){
+            _unrotate(rotation, w, h, ox, oy, &x, &y);
+            int want = _ref_y(src, format, w, x, y);
+            int got = dst[(size_t) oy * ow + ox];
+            if(got != want){
+                CHECK_MSG(0, "%s %dx%d rot %d: luma (%d,%d) is %d, expected %d",
+                          formats[f].name, w, h, rotation, ox, oy, got, want);
+                return -1;
+            }
+        }
+    }
+
+    for(oy = 0; oy < oh / 2; oy++){
+        for(ox = 0; ox < ow / 2; ox++){
+            _unrotate(rotation, w / 2, h / 2, ox, oy, &x, &y);
+            _ref_uv(src, format, w, h, x, y, &u, &v);
+            const uint8_t *p = dst_uv + ((size_t) oy * (ow / 2) + ox) * 2;
+            if(p[0] != u || p[1] != v){
+                CHECK_MSG(0, "%s %dx%d rot %d: chroma (%d,%d) is %d,%d, expected %d,%d",
+                          formats[f].name, w, h, rotation, ox, oy, p[0], p[1], u, v);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void _test_convert(void)
+{
+    int f, r, s, n_ok = 0, n = 0;
+    size_t i;
+
+    for(s = 0; s < N_SIZES; s++){
+        const int w = sizes[s][0], h = sizes[s][1];
+        uint8_t *src = malloc((size_t) w * h * 3);
+        // guard bytes after the frame catch writes past the end
+        uint8_t *dst = malloc((size_t) w * h * 3 / 2 + 64);
+        uint8_t *band = malloc(frame_convert_band_size(w));
+
+        srand(w * 1000 + h);
+        for(i = 0; i < (size_t) w * h * 3; i++) src[i] = (uint8_t) rand();
+
+        for(f = 0; f < N_FORMATS; f++){
+            for(r = 0; r < N_ROTATIONS; r++){
+                CHECK(frame_convert_supported(formats[f].format, w, h, rotations[r]));
+
+                memset(dst, 0xA5, (size_t) w * h * 3 / 2 + 64);
+                frame_convert_nv12(src, formats[f].format, w, h, rotations[r], dst, band);
+
+                for(i = 0; i < 64; i++){
+                    if(dst[(size_t) w * h * 3 / 2 + i] != 0xA5) break;
+                }
+                CHECK_MSG(i == 64, "%s %dx%d rot %d wrote past the end of the frame",
+                          formats[f].name, w, h, rotations[r]);
+
+                n++;
+                if(_check(f, w, h, rotations[r], src, dst) == 0) n_ok++;
+            }
+        }
+        free(src);
+        free(dst);
+        free(band);
+    }
+    printf("%d of %d format, rotation and size combinations match\n", n_ok, n);
+}
+
+static void _test_supported(void)
+{
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_NV12, 641, 480, 0));
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_NV12, 640, 481, 0));
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_NV12, 0, 0, 0));
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_NV12, 640, 480, 45));
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_H264, 640, 480, 0));
+    CHECK(!frame_convert_supported(IMAGE_FORMAT_RAW16, 640, 480, 0));
+    CHECK(frame_convert_band_size(640) >= (size_t) 640 * FRAME_CONVERT_BAND_ROWS * 3 / 2);
+}
+
+int main(void)
+{
+    _test_supported();
+    _test_convert();
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,239 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for frame_queue: fifo order and overflow, mailbox overwrite,
+ * pop timeouts, and a producer and consumer thread running flat out against
+ * each other.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <gst/gst.h>
+
+#include "frame_queue.h"
+#include "test_util.h"
+
+#define STRESS_FRAMES 200000
+
+// failed pushes of the end marker, they count as drops too
+static unsigned int marker_retries;
+
+
+static GstBuffer *_tagged(guint64 n)
+{
+    GstBuffer *buf = gst_buffer_new();
+    GST_BUFFER_OFFSET(buf) = n;
+    return buf;
+}
+
+static int64_t _ms_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void _test_fifo(void)
+{
+    frame_queue_t q;
+    GstBuffer *buf;
+    int i;
+
+    CHECK(frame_queue_init(&q, FRAME_QUEUE_FIFO, 4) == 0);
+
+    for(i = 0; i < 4; i++) CHECK(frame_queue_push(&q, _tagged(i)) == 0);
+    CHECK(frame_queue_count(&q) == 4);
+
+    // full, the new frame is the one that gets dropped
+    CHECK(frame_queue_push(&q, _tagged(99)) == -1);
+    CHECK(atomic_load(&q.dropped) == 1);
+    CHECK(frame_queue_count(&q) == 4);
+
+    for(i = 0; i < 4; i++){
+        buf = frame_queue_pop(&q, 0);
+        CHECK(buf != NULL);
+        if(buf == NULL) break;
+        CHECK_MSG(GST_BUFFER_OFFSET(buf) == (guint64) i, "got %lu expected %d",
+                  (unsigned long) GST_BUFFER_OFFSET(buf), i);
+        gst_buffer_unref(buf);
+    }
+    CHECK(frame_queue_pop(&q, 0) == NULL);
+    CHECK(frame_queue_count(&q) == 0);
+
+    // wraps around the ring
+    for(i = 0; i < 10; i++){
+        CHECK(frame_queue_push(&q, _tagged(100 + i)) == 0);
+        buf = frame_queue_pop(&q, 0);
+        CHECK(buf != NULL && GST_BUFFER_OFFSET(buf) == (guint64) (100 + i));
+        if(buf) gst_buffer_unref(buf);
+    }
+
+    // left over buffers are released by deinit
+    frame_queue_push(&q, _tagged(0));
+    frame_queue_push(&q, _tagged(1));
+    frame_queue_deinit(&q);
+    CHECK(!q.initialized);
+}
+
+static void _test_depth_clamp(void)
+{
+    frame_queue_t q;
+
+    CHECK(frame_queue_init(&q, FRAME_QUEUE_FIFO, 0) == 0);
+    CHECK(q.depth == 1);
+    frame_queue_deinit(&q);
+
+    CHECK(frame_queue_init(&q, FRAME_QUEUE_FIFO, FRAME_QUEUE_MAX_DEPTH + 10) == 0);
+    CHECK(q.depth == FRAME_QUEUE_MAX_DEPTH);
+    frame_queue_deinit(&q);
+}
+
+static void _test_mailbox(void)
+{
+    frame_queue_t q;
+    GstBuffer *buf;
+
+    CHECK(frame_queue_init(&q, FRAME_QUEUE_MAILBOX, 4) == 0);
+
+    CHECK(frame_queue_push(&q, _tagged(1)) == 0);
+    CHECK(frame_queue_push(&q, _tagged(2)) == 1);
+    CHECK(frame_queue_push(&q, _tagged(3)) == 1);
+    CHECK(atomic_load(&q.overwritten) == 2);
+    CHECK(frame_queue_count(&q) == 1);
+
+    // only the newest is left
+    buf = frame_queue_pop(&q, 0);
+    CHECK(buf != NULL && GST_BUFFER_OFFSET(buf) == 3);
+    if(buf) gst_buffer_unref(buf);
+
+    // the semaphore was posted three times but there's nothing left, the
+    // extra posts must not turn into a bogus frame
+    CHECK(frame_queue_pop(&q, 0) == NULL);
+    CHECK(frame_queue_pop(&q, 10) == NULL);
+
+    frame_queue_deinit(&q);
+}
+
+static void _test_timeout(void)
+{
+    frame_queue_t q;
+    int64_t start, elapsed;
+
+    CHECK(frame_queue_init(&q, FRAME_QUEUE_FIFO, 4) == 0);
+
+    start = _ms_now();
+    CHECK(frame_queue_pop(&q, 0) == NULL);
+    elapsed = _ms_now() - start;
+    CHECK_MSG(elapsed < 20, "zero timeout took %ld ms", (long) elapsed);
+
+    start = _ms_now();
+    CHECK(frame_queue_pop(&q, 150) == NULL);
+    elapsed = _ms_now() - start;
+    CHECK_MSG(elapsed >= 145 && elapsed < 1000, "150 ms timeout took %ld ms", (long) elapsed);
+
+    // crossing a second boundary in the deadline math
+    start = _ms_now();
+    CHECK(frame_queue_pop(&q, 1100) == NULL);
+    elapsed = _ms_now() - start;
+    CHECK_MSG(elapsed >= 1095 && elapsed < 2000, "1100 ms timeout took %ld ms", (long) elapsed);
+
+    frame_queue_deinit(&q);
+}
+
+static void* _producer(void *arg)
+{
+    frame_queue_t *q = (frame_queue_t*) arg;
+    int i;
+
+    for(i = 0; i < STRESS_FRAMES; i++) frame_queue_push(q, _tagged(i));
+    // end marker, retried since the fifo drops when full
+    marker_retries = 0;
+    while(frame_queue_push(q, _tagged(UINT64_MAX)) < 0){
+        marker_retries++;
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void _test_threads(frame_queue_mode_t mode)
+{
+    frame_queue_t q;
+    pthread_t thread;
+    GstBuffer *buf;
+    guint64 last = 0;
+    int received = 0, out_of_order = 0, first = 1;
+
+    CHECK(frame_queue_init(&q, mode, 8) == 0);
+    pthread_create(&thread, NULL, _producer, &q);
+
+    while((buf = frame_queue_pop(&q, 1000)) != NULL){
+        guint64 n = GST_BUFFER_OFFSET(buf);
+        gst_buffer_unref(buf);
+        if(n == UINT64_MAX) break;
+        // frames can be dropped or overwritten but never reordered or repeated
+        if(!first && n <= last) out_of_order++;
+        last = n;
+        first = 0;
+        received++;
+    }
+    CHECK_MSG(buf != NULL, "consumer timed out after %d frames", received);
+    pthread_join(thread, NULL);
+
+    CHECK_MSG(out_of_order == 0, "%d frames out of order", out_of_order);
+    if(mode == FRAME_QUEUE_FIFO){
+        CHECK((unsigned int) received + atomic_load(&q.dropped) - marker_retries == STRESS_FRAMES);
+    } else {
+        CHECK((unsigned int) received + atomic_load(&q.overwritten) == STRESS_FRAMES);
+    }
+    printf("%s: %d of %d frames made it through\n",
+           mode == FRAME_QUEUE_FIFO ? "fifo" : "mailbox", received, STRESS_FRAMES);
+
+    frame_queue_deinit(&q);
+}
+
+int main(int argc, char *argv[])
+{
+    gst_init(&argc, &argv);
+
+    _test_fifo();
+    _test_depth_clamp();
+    _test_mailbox();
+    _test_timeout();
+    _test_threads(FRAME_QUEUE_FIFO);
+    _test_threads(FRAME_QUEUE_MAILBOX);
+
+    return TEST_RESULT();
+}
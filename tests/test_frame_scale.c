@@ -0,0 +1,198 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for frame_scale: the 2:1 box, other whole number box ratios,
+ * and bilinear down and up scaling of luma and interleaved chroma planes,
+ * against per element references. Guard bytes after the destination and the
+ * scratch buffer catch anything written out of bounds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "frame_scale.h"
+#include "test_util.h"
+
+#define GUARD 64
+
+static const int sizes[][4] = {
+    // src w, h -> dst w, h
+    {64, 48, 64, 48},
+    {64, 48, 32, 24},
+    {66, 50, 33, 25},
+    {1280, 720, 640, 360},
+    {90, 60, 30, 20},
+    {640, 480, 320, 160},
+    {640, 480, 160, 120},
+    {1920, 1080, 1280, 720},
+    {640, 480, 400, 300},
+    {100, 70, 37, 23},
+    {320, 240, 640, 480},
+    {30, 20, 47, 33},
+    {4, 4, 2, 2},
+};
+
+#define N_SIZES (int) (sizeof(sizes) / sizeof(sizes[0]))
+
+
+static int _ref_pos(int i, int src_size, int dst_size)
+{
+    int64_t pos = ((int64_t) (2 * i + 1) * src_size - dst_size) * 256 / (2 * dst_size);
+    return pos < 0 ? 0 : (int) pos;
+}
+
+// One element of the scaled plane, box average when the sizes divide and
+// bilinear, rows first then columns, otherwise
+static int _ref(const uint8_t *s, int sw, int sh, int dw, int dh, int elem, int x, int y, int c)
+{
+    if(sw == dw && sh == dh) return s[(y * sw + x) * elem + c];
+
+    if(dw <= sw && dh <= sh && sw % dw == 0 && sh % dh == 0){
+        int fx = sw / dw, fy = sh / dh, i, j, sum = 0;
+        for(j = 0; j < fy; j++){
+            for(i = 0; i < fx; i++) sum += s[((y * fy + j) * sw + x * fx + i) * elem + c];
+        }
+        return (sum + fx * fy / 2) / (fx * fy);
+    }
+
+    int py = _ref_pos(y, sh, dh), px = _ref_pos(x, sw, dw);
+    int sy = py >> 8, fy = py & 0xFF;
+    int sx = px >> 8, fx = px & 0xFF;
+    if(sx >= sw - 1){
+        sx = sw - 2;
+        fx = 256;
+    }
+
+    int col[2], k;
+    for(k = 0; k < 2; k++){
+        int xx = sx + k;
+        if(sy >= sh - 1){
+            col[k] = s[((sh - 1) * sw + xx) * elem + c];
+        } else {
+            int a = s[(sy * sw + xx) * elem + c];
+            int b = s[((sy + 1) * sw + xx) * elem + c];
+            col[k] = (a * (256 - fy) + b * fy + 128) >> 8;
+        }
+    }
+    return (col[0] * (256 - fx) + col[1] * fx + 128) >> 8;
+}
+
+static int _guard_ok(const uint8_t *p)
+{
+    int i;
+    for(i = 0; i < GUARD; i++){
+        if(p[i] != 0x5A) return 0;
+    }
+    return 1;
+}
+
+static void _test_plane(int sw, int sh, int dw, int dh, int elem)
+{
+    size_t src_size = (size_t) sw * sh * elem;
+    size_t dst_size = (size_t) dw * dh * elem;
+    size_t scratch_size = frame_scale_scratch_size(sw, dw);
+    uint8_t *src = malloc(src_size);
+    uint8_t *dst = malloc(dst_size + GUARD);
+    uint8_t *scratch = malloc(scratch_size + GUARD);
+    size_t i;
+    int x, y, c, bad = 0;
+
+    srand(sw * 7 + dw * 13 + elem);
+    for(i = 0; i < src_size; i++) src[i] = (uint8_t) rand();
+    memset(dst, 0x5A, dst_size + GUARD);
+    memset(scratch, 0x5A, scratch_size + GUARD);
+
+    frame_scale_plane(src, sw, sh, dst, dw, dh, elem, scratch);
+
+    for(y = 0; y < dh && !bad; y++){
+        for(x = 0; x < dw && !bad; x++){
+            for(c = 0; c < elem; c++){
+                int want = _ref(src, sw, sh, dw, dh, elem, x, y, c);
+                int got = dst[((size_t) y * dw + x) * elem + c];
+                if(got != want){
+                    CHECK_MSG(0, "%dx%d -> %dx%d elem %d: (%d,%d,%d) is %d, expected %d",
+                              sw, sh, dw, dh, elem, x, y, c, got, want);
+                    bad = 1;
+                    break;
+                }
+            }
+        }
+    }
+    CHECK_MSG(_guard_ok(dst + dst_size), "%dx%d -> %dx%d elem %d wrote past dst",
+              sw, sh, dw, dh, elem);
+    CHECK_MSG(_guard_ok(scratch + scratch_size), "%dx%d -> %dx%d elem %d wrote past scratch",
+              sw, sh, dw, dh, elem);
+
+    free(src);
+    free(dst);
+    free(scratch);
+}
+
+// A flat frame has to stay flat whatever the filter
+static void _test_flat(void)
+{
+    static uint8_t src[640 * 480 * 3 / 2], dst[400 * 300 * 3 / 2];
+    uint8_t *scratch = malloc(frame_scale_scratch_size(640, 400));
+    size_t i;
+
+    memset(src, 200, 640 * 480);
+    memset(src + 640 * 480, 77, 640 * 480 / 2);
+    frame_scale_nv12(src, 640, 480, dst, 400, 300, scratch);
+
+    for(i = 0; i < 400 * 300; i++){
+        if(dst[i] != 200) break;
+    }
+    CHECK_MSG(i == 400 * 300, "flat luma changed at %zu", i);
+    for(i = 400 * 300; i < sizeof(dst); i++){
+        if(dst[i] != 77) break;
+    }
+    CHECK_MSG(i == sizeof(dst), "flat chroma changed at %zu", i);
+    free(scratch);
+}
+
+int main(void)
+{
+    int s;
+
+    for(s = 0; s < N_SIZES; s++){
+        _test_plane(sizes[s][0], sizes[s][1], sizes[s][2], sizes[s][3], 1);
+        // the chroma plane of an NV12 frame of twice the size
+        _test_plane(sizes[s][0], sizes[s][1], sizes[s][2], sizes[s][3], 2);
+    }
+    _test_flat();
+
+    return TEST_RESULT();
+}
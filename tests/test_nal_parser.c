@@ -0,0 +1,378 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for nal_parser: picture classification and parameter set
+ * tracking for hand written H264 and H265 access units, then randomly built
+ * access units that put start codes at every alignment so both the SIMD and
+ * the scalar tail of the start code search get exercised.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "nal_parser.h"
+#include "test_util.h"
+
+#define RANDOM_AUS 20000
+#define AU_MAX_SIZE 8192
+
+// H264 NAL header bytes, nal_ref_idc in the top bits
+static const uint8_t h264_sps[]  = {0x67, 0x42, 0xC0, 0x1E, 0xD9, 0x00, 0xA0, 0x47, 0xFE, 0xC8};
+static const uint8_t h264_pps[]  = {0x68, 0xCE, 0x3C, 0x80};
+static const uint8_t h264_idr[]  = {0x65, 0x88, 0x84, 0x00, 0x33, 0xFF};
+static const uint8_t h264_p[]    = {0x41, 0x9A, 0x02, 0x04};
+static const uint8_t h264_b[]    = {0x01, 0x9E, 0x02, 0x04};   // nal_ref_idc 0
+static const uint8_t h264_sei[]  = {0x06, 0x05, 0x01, 0x80};
+
+// H265, two byte headers with the type in bits 1-6 of the first byte
+static const uint8_t h265_vps[]  = {0x40, 0x01, 0x0C, 0x01, 0xFF, 0xFF};
+static const uint8_t h265_sps[]  = {0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90};
+static const uint8_t h265_pps[]  = {0x44, 0x01, 0xC1, 0x72, 0xB4};
+static const uint8_t h265_idr[]  = {0x26, 0x01, 0xAF, 0x1D, 0x80};   // IDR_W_RADL
+static const uint8_t h265_cra[]  = {0x2A, 0x01, 0xAF, 0x1D, 0x80};   // CRA
+static const uint8_t h265_trail_r[] = {0x02, 0x01, 0xD0, 0x11};
+static const uint8_t h265_trail_n[] = {0x00, 0x01, 0xD0, 0x11};
+
+
+typedef struct {
+    uint8_t data[AU_MAX_SIZE];
+    size_t size;
+} au_t;
+
+static void _append(au_t *au, const uint8_t *nal, size_t size, int long_start_code)
+{
+    static const uint8_t sc[4] = {0, 0, 0, 1};
+    int n = long_start_code ? 4 : 3;
+
+    memcpy(au->data + au->size, sc + 4 - n, n);
+    au->size += n;
+    memcpy(au->data + au->size, nal, size);
+    au->size += size;
+}
+
+#define APPEND(au, nal, lsc) _append(au, nal, sizeof(nal), lsc)
+
+static int _same(const nal_param_set_t *set, const uint8_t *nal, size_t size)
+{
+    return set->size == size && !memcmp(set->data, nal, size);
+}
+
+
+static void _test_h264(void)
+{
+    nal_param_sets_t ps;
+    nal_au_info_t info;
+    au_t au;
+
+    memset(&ps, 0, sizeof(ps));
+
+    // keyframe with parameter sets, mixed start code lengths
+    au.size = 0;
+    APPEND(&au, h264_sps, 1);
+    APPEND(&au, h264_pps, 0);
+    APPEND(&au, h264_sei, 0);
+    APPEND(&au, h264_idr, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(info.keyframe);
+    CHECK(!info.droppable);
+    CHECK(info.has_param_sets);
+    CHECK(info.param_sets_changed);
+    CHECK(_same(&ps.sps, h264_sps, sizeof(h264_sps)));
+    CHECK(_same(&ps.pps, h264_pps, sizeof(h264_pps)));
+    CHECK(ps.vps.size == 0);
+
+    // the same again isn't a change
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(info.has_param_sets);
+    CHECK(!info.param_sets_changed);
+
+    // a different SPS is
+    uint8_t sps2[sizeof(h264_sps)];
+    memcpy(sps2, h264_sps, sizeof(sps2));
+    sps2[3] = 0x28;
+    au.size = 0;
+    APPEND(&au, sps2, 1);
+    APPEND(&au, h264_pps, 1);
+    APPEND(&au, h264_idr, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(info.param_sets_changed);
+    CHECK(_same(&ps.sps, sps2, sizeof(sps2)));
+
+    // reference P frame
+    au.size = 0;
+    APPEND(&au, h264_p, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(!info.keyframe);
+    CHECK(!info.droppable);
+    CHECK(!info.has_param_sets);
+
+    // non-reference B frame, with an SEI in front
+    au.size = 0;
+    APPEND(&au, h264_sei, 1);
+    APPEND(&au, h264_b, 0);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(!info.keyframe);
+    CHECK(info.droppable);
+
+    // an SEI alone has no slices so it isn't droppable
+    au.size = 0;
+    APPEND(&au, h264_sei, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(!info.droppable);
+
+    // trailing zero bytes after a parameter set aren't part of it
+    au.size = 0;
+    APPEND(&au, h264_sps, 1);
+    memset(au.data + au.size, 0, 3);
+    au.size += 3;
+    APPEND(&au, h264_idr, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(_same(&ps.sps, h264_sps, sizeof(h264_sps)));
+
+    // and at the very end of the access unit
+    au.size = 0;
+    APPEND(&au, h264_pps, 1);
+    au.data[au.size++] = 0;
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(_same(&ps.pps, h264_pps, sizeof(h264_pps)));
+
+    // a parameter set too big to keep is ignored, the old one stays
+    static uint8_t big[NAL_PARAM_SET_MAX_SIZE + 10];
+    memset(big, 0x55, sizeof(big));
+    big[0] = 0x67;
+    au.size = 0;
+    APPEND(&au, big, 1);
+    nal_parse_au(&ps, au.data, au.size, 0, &info);
+    CHECK(!info.param_sets_changed);
+    CHECK(_same(&ps.sps, h264_sps, sizeof(h264_sps)));
+}
+
+static void _test_h265(void)
+{
+    nal_param_sets_t ps;
+    nal_au_info_t info;
+    au_t au;
+
+    memset(&ps, 0, sizeof(ps));
+
+    au.size = 0;
+    APPEND(&au, h265_vps, 1);
+    APPEND(&au, h265_sps, 1);
+    APPEND(&au, h265_pps, 1);
+    APPEND(&au, h265_idr, 1);
+    nal_parse_au(&ps, au.data, au.size, 1, &info);
+    CHECK(info.keyframe);
+    CHECK(!info.droppable);
+    CHECK(info.param_sets_changed);
+    CHECK(_same(&ps.vps, h265_vps, sizeof(h265_vps)));
+    CHECK(_same(&ps.sps, h265_sps, sizeof(h265_sps)));
+    CHECK(_same(&ps.pps, h265_pps, sizeof(h265_pps)));
+
+    au.size = 0;
+    APPEND(&au, h265_cra, 0);
+    nal_parse_au(&ps, au.data, au.size, 1, &info);
+    CHECK(info.keyframe);
+
+    au.size = 0;
+    APPEND(&au, h265_trail_r, 1);
+    nal_parse_au(&ps, au.data, au.size, 1, &info);
+    CHECK(!info.keyframe);
+    CHECK(!info.droppable);
+
+    // TRAIL_N's header starts with a zero byte right after the start code
+    au.size = 0;
+    APPEND(&au, h265_trail_n, 1);
+    APPEND(&au, h265_trail_n, 0);
+    nal_parse_au(&ps, au.data, au.size, 1, &info);
+    CHECK(!info.keyframe);
+    CHECK(info.droppable);
+    CHECK(!info.has_param_sets);
+}
+
+static void _test_write(void)
+{
+    nal_param_sets_t ps, ps2;
+    nal_au_info_t info;
+    uint8_t out[NAL_PARAM_SETS_MAX_HEADER];
+    size_t n;
+    au_t au;
+
+    memset(&ps, 0, sizeof(ps));
+    CHECK(nal_param_sets_write(&ps, out, sizeof(out)) == 0);
+
+    au.size = 0;
+    APPEND(&au, h265_vps, 1);
+    APPEND(&au, h265_sps, 1);
+    APPEND(&au, h265_pps, 1);
+    nal_parse_au(&ps, au.data, au.size, 1, &info);
+
+    n = nal_param_sets_write(&ps, out, sizeof(out));
+    CHECK(n == au.size);
+    CHECK(!memcmp(out, au.data, n));
+
+    // reading the header back gives the same sets
+    memset(&ps2, 0, sizeof(ps2));
+    nal_parse_au(&ps2, out, n, 1, &info);
+    CHECK(!memcmp(&ps, &ps2, sizeof(ps)));
+
+    // too small to fit
+    CHECK(nal_param_sets_write(&ps, out, n - 1) == 0);
+}
+
+static void _test_short(void)
+{
+    static const uint8_t tiny[] = {0, 0, 1};
+    static const uint8_t junk[] = {0x12, 0x00, 0x00, 0x02, 0x00};
+    nal_param_sets_t ps;
+    nal_au_info_t info;
+
+    memset(&ps, 0, sizeof(ps));
+    nal_parse_au(&ps, tiny, 0, 0, &info);
+    CHECK(!info.keyframe && !info.droppable && !info.has_param_sets);
+    nal_parse_au(&ps, tiny, sizeof(tiny), 0, &info);
+    CHECK(!info.keyframe && !info.droppable && !info.has_param_sets);
+    nal_parse_au(&ps, junk, sizeof(junk), 1, &info);
+    CHECK(!info.keyframe && !info.droppable && !info.has_param_sets);
+}
+
+
+// Random NAL body after the header, with emulation prevention so there is no
+// start code inside it and a non-zero last byte like a real rbsp stop bit
+static size_t _random_body(uint8_t *out, size_t size)
+{
+    size_t i, n = 0;
+    int zeros = 0;
+
+    for(i = 0; i < size; i++){
+        // lots of zeros so the search hits plenty of near misses
+        uint8_t b = (rand() % 3 == 0) ? 0 : (uint8_t) rand();
+        if(zeros >= 2 && b <= 3){
+            out[n++] = 3;
+            zeros = 0;
+        }
+        out[n++] = b;
+        zeros = b == 0 ? zeros + 1 : 0;
+    }
+    out[n++] = 0x80;
+    return n;
+}
+
+static void _test_random(int is_h265)
+{
+    static au_t au;
+    nal_param_sets_t ps;
+    nal_au_info_t info;
+    uint8_t nal[600];
+    int i, j, failures = 0;
+
+    memset(&ps, 0, sizeof(ps));
+    srand(is_h265 ? 265 : 264);
+
+    for(i = 0; i < RANDOM_AUS && failures < 10; i++){
+        int n_nals = 1 + rand() % 6;
+        int keyframe = 0, n_vcl = 0, n_ref = 0;
+        nal_param_sets_t expect = ps;
+
+        au.size = 0;
+        for(j = 0; j < n_nals; j++){
+            nal_param_set_t *set = NULL;
+            int hdr_len = is_h265 ? 2 : 1;
+            int pick = rand() % 6;
+            int type;
+
+            if(is_h265){
+                static const int types[] = {32, 33, 34, 19, 1, 0};
+                type = types[pick];
+                nal[0] = type << 1;
+                nal[1] = 1;
+            } else {
+                static const int types[] = {7, 8, 6, 5, 1, 1};
+                type = types[pick];
+                // the last pick is a non-reference slice
+                nal[0] = (pick == 5 ? 0 : 0x60) | type;
+            }
+
+            // slices are sometimes bigger than a parameter set can be
+            size_t body = (pick >= 3 && rand() % 4 == 0) ? 300 + rand() % 200 : rand() % 200;
+            size_t len = hdr_len + _random_body(nal + hdr_len, body);
+            if(au.size + 4 + len + 1 > sizeof(au.data)) break;
+
+            if(pick == 0) set = is_h265 ? &expect.vps : &expect.sps;
+            else if(pick == 1) set = is_h265 ? &expect.sps : &expect.pps;
+            else if(pick == 2 && is_h265) set = &expect.pps;
+            else if(pick == 3) keyframe = 1;
+            if(pick >= 3){
+                n_vcl++;
+                if(pick != 5) n_ref++;
+            }
+            if(set){
+                memcpy(set->data, nal, len);
+                set->size = len;
+            }
+
+            _append(&au, nal, len, rand() & 1);
+            // trailing_zero_8bits between NAL units
+            if(rand() % 8 == 0) au.data[au.size++] = 0;
+        }
+
+        nal_parse_au(&ps, au.data, au.size, is_h265, &info);
+
+        int ok = info.keyframe == keyframe &&
+                 info.droppable == (n_vcl > 0 && n_ref == 0) &&
+                 !memcmp(&ps.vps, &expect.vps, sizeof(nal_param_set_t)) &&
+                 !memcmp(&ps.sps, &expect.sps, sizeof(nal_param_set_t)) &&
+                 !memcmp(&ps.pps, &expect.pps, sizeof(nal_param_set_t));
+        CHECK_MSG(ok, "%s random access unit %d: keyframe %d/%d droppable %d/%d",
+                  is_h265 ? "h265" : "h264", i, info.keyframe, keyframe,
+                  info.droppable, n_vcl > 0 && n_ref == 0);
+        if(!ok) failures++;
+
+        // resync the expectation so one failure doesn't cascade
+        ps = expect;
+    }
+}
+
+int main(void)
+{
+    _test_h264();
+    _test_h265();
+    _test_write();
+    _test_short();
+    _test_random(0);
+    _test_random(1);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,260 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for rate_control: each decision on its own (loss and delay
+ * back off, probing after the hold off, clamping, frame rate decimation at
+ * the bottom of the range) and then a simulated link whose capacity drops
+ * and recovers, checking the controller follows it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "rate_control.h"
+#include "test_util.h"
+
+#define SEC 1000000LL
+
+
+static rate_control_t _make(uint32_t bitrate, uint32_t min, uint32_t max, uint32_t max_dec)
+{
+    rate_control_t rc;
+    memset(&rc, 0, sizeof(rc));
+    rate_control_init(&rc, bitrate, min, max, max_dec, NULL, "test");
+    return rc;
+}
+
+static int _report(rate_control_t *rc, uint32_t seq, double loss, double rtt_ms,
+                   double jitter_ms, int64_t now_us)
+{
+    rate_control_report_t r = {seq, loss, jitter_ms, rtt_ms};
+    return rate_control_update(rc, &r, now_us);
+}
+
+
+static void _test_init(void)
+{
+    rate_control_t rc = _make(10000000, 1000000, 5000000, 0);
+    CHECK(rc.bitrate == 5000000);
+    CHECK(rc.max_decimator == 1);
+    CHECK(rc.decimator == 1);
+
+    rc = _make(100, 1000000, 5000000, 4);
+    CHECK(rc.bitrate == 1000000);
+
+    // a max below the min is raised to it
+    rc = _make(2000000, 1000000, 500000, 4);
+    CHECK(rc.max_bitrate == 1000000);
+    CHECK(rc.bitrate == 1000000);
+}
+
+static void _test_loss(void)
+{
+    rate_control_t rc = _make(4000000, 500000, 8000000, 1);
+
+    // 20% loss takes off 10%
+    CHECK(_report(&rc, 1, 0.20, 10, 1, 0) == 1);
+    CHECK(rc.bitrate == 3600000);
+
+    // the same report again is ignored
+    CHECK(_report(&rc, 1, 0.20, 10, 1, SEC) == 0);
+    CHECK(rc.bitrate == 3600000);
+
+    // moderate loss holds
+    CHECK(_report(&rc, 2, 0.05, 10, 1, 2 * SEC) == 0);
+    CHECK(rc.bitrate == 3600000);
+}
+
+static void _test_delay(void)
+{
+    rate_control_t rc = _make(4000000, 500000, 8000000, 1);
+
+    _report(&rc, 1, 0.0, 20, 1, 0);
+    // rtt at 2x the minimum plus margin is still fine
+    _report(&rc, 2, 0.0, 59, 1, SEC);
+    CHECK(rc.bitrate == 4000000);
+    // well above it means a queue is building
+    CHECK(_report(&rc, 3, 0.0, 150, 1, 2 * SEC) == 1);
+    CHECK(rc.bitrate == 3400000);
+    // and so does high jitter without an rtt
+    CHECK(_report(&rc, 4, 0.0, 0, 80, 3 * SEC) == 1);
+    CHECK(rc.bitrate == 2890000);
+}
+
+static void _test_probe(void)
+{
+    rate_control_t rc = _make(1000000, 500000, 1100000, 1);
+
+    // no back off yet so probing starts right away, by at least the min step
+    CHECK(_report(&rc, 1, 0.0, 10, 1, 10 * SEC) == 1);
+    CHECK(rc.bitrate == 1050000);
+    CHECK(_report(&rc, 2, 0.0, 10, 1, 11 * SEC) == 1);
+    CHECK(rc.bitrate == 1100000);
+    // clamped at the max
+    CHECK(_report(&rc, 3, 0.0, 10, 1, 12 * SEC) == 0);
+    CHECK(rc.bitrate == 1100000);
+
+    // after a back off it holds for a while before probing again
+    _report(&rc, 4, 0.5, 10, 1, 20 * SEC);
+    uint32_t low = rc.bitrate;
+    CHECK(_report(&rc, 5, 0.0, 10, 1, 22 * SEC) == 0);
+    CHECK(rc.bitrate == low);
+    CHECK(_report(&rc, 6, 0.0, 10, 1, 25 * SEC) == 1);
+    CHECK(rc.bitrate > low);
+
+    // small bitrates step up by the min step, not 5%
+    rc = _make(100000, 50000, 1000000, 1);
+    _report(&rc, 1, 0.0, 10, 1, 10 * SEC);
+    CHECK(rc.bitrate == 120000);
+}
+
+static void _test_decimator(void)
+{
+    rate_control_t rc = _make(600000, 500000, 4000000, 4);
+    uint32_t seq = 1;
+    int64_t t = 0;
+
+    // first back off lands on the min, frame rate goes next
+    _report(&rc, seq++, 0.5, 10, 1, t += SEC);
+    CHECK(rc.bitrate == 500000);
+    CHECK(rc.decimator == 2);
+    _report(&rc, seq++, 0.5, 10, 1, t += SEC);
+    CHECK(rc.decimator == 4);
+    _report(&rc, seq++, 0.5, 10, 1, t += SEC);
+    CHECK(rc.decimator == 4);
+
+    // frame rate comes back once the bitrate has doubled
+    t += 5 * SEC;
+    while(rc.bitrate < 1000000 && seq < 100){
+        CHECK(rc.decimator == 4);
+        _report(&rc, seq++, 0.0, 10, 1, t += SEC);
+    }
+    CHECK(rc.decimator == 2);
+    _report(&rc, seq++, 0.0, 10, 1, t += SEC);
+    CHECK(rc.decimator == 1);
+
+    // no decimation allowed
+    rc = _make(600000, 500000, 4000000, 1);
+    _report(&rc, 1, 0.5, 10, 1, SEC);
+    _report(&rc, 2, 0.5, 10, 1, 2 * SEC);
+    CHECK(rc.decimator == 1);
+}
+
+// a link that loses whatever goes over its capacity and queues a little
+// before it does
+static double _capacity_at(int64_t t)
+{
+    if(t < 60 * SEC) return 4000000;
+    if(t < 120 * SEC) return 1500000;
+    return 6000000;
+}
+
+static void _test_link(void)
+{
+    rate_control_t rc = _make(2000000, 300000, 8000000, 4);
+    double over_sum = 0;
+    int n_over = 0, seq = 1;
+    int64_t t, settled_at = -1;
+
+    for(t = 0; t < 180 * SEC; t += SEC){
+        double cap = _capacity_at(t);
+        double loss = rc.bitrate > cap ? (rc.bitrate - cap) / rc.bitrate : 0.0;
+        double rtt = rc.bitrate > 0.9 * cap ? 120 : 30;
+        _report(&rc, seq++, loss, rtt, 2, t);
+
+        // after the drop it must get under the new capacity quickly
+        if(t >= 60 * SEC && t < 120 * SEC && settled_at < 0 && rc.bitrate <= cap) settled_at = t;
+
+        // while settled it shouldn't sit above capacity or far below it
+        int64_t since = t % (60 * SEC);
+        if(since >= 30 * SEC){
+            if(rc.bitrate > cap) n_over++;
+            over_sum += rc.bitrate / cap;
+            CHECK_MSG(rc.bitrate > 0.5 * cap, "%.0f s: %u bps on a %.0f bps link",
+                      t / 1e6, rc.bitrate, cap);
+        }
+    }
+
+    CHECK_MSG(settled_at >= 0 && settled_at - 60 * SEC <= 5 * SEC,
+              "took until %.0f s to follow the capacity drop", settled_at / 1e6);
+    CHECK_MSG(n_over <= 10, "over capacity in %d of 90 settled reports", n_over);
+    printf("link: %.0f%% of capacity on average once settled, %d reports over\n",
+           over_sum / 90 * 100, n_over);
+}
+
+static void _test_log(void)
+{
+    char path[] = "/tmp/test_rate_control_XXXXXX";
+    char line[256];
+    rate_control_t rc;
+    int fd = mkstemp(path), lines = 0;
+
+    CHECK(fd >= 0);
+    if(fd < 0) return;
+    close(fd);
+
+    memset(&rc, 0, sizeof(rc));
+    rate_control_init(&rc, 1000000, 500000, 2000000, 1, path, "log");
+    _report(&rc, 1, 0.5, 10, 1, 0);
+    _report(&rc, 1, 0.5, 10, 1, SEC);
+    _report(&rc, 2, 0.0, 10, 1, 2 * SEC);
+    rate_control_deinit(&rc);
+    CHECK(rc.log == NULL);
+
+    FILE *f = fopen(path, "r");
+    CHECK(f != NULL);
+    if(f){
+        while(fgets(line, sizeof(line), f)) lines++;
+        fclose(f);
+    }
+    // header and one line per new report
+    CHECK_MSG(lines == 3, "%d lines in the log", lines);
+    unlink(path);
+}
+
+int main(void)
+{
+    _test_init();
+    _test_loss();
+    _test_delay();
+    _test_probe();
+    _test_decimator();
+    _test_link();
+    _test_log();
+
+    return TEST_RESULT();
+}
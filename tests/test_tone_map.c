@@ -0,0 +1,210 @@
+/*******************************************************************************
+ * Copyright 2023 ModalAI Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * 4. The Software is used solely in conjunction with devices provided by
+ *    ModalAI Inc.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+/**
+ * Unit checks for tone_map: the fixed point linear mapping against the
+ * exact one over every 16 bit value, the lookup table for gamma and narrow
+ * windows, and the auto window on scenes that are saturated, flat, or
+ * change under it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "tone_map.h"
+#include "test_util.h"
+
+// every 16 bit value once, the width leaves a tail after the vector loops
+#define ALL_W 4099
+#define ALL_H 16
+
+static uint8_t all_src[ALL_W * ALL_H * 2];
+static uint8_t all_dst[ALL_W * ALL_H];
+
+
+static void _put(uint8_t *src, size_t i, uint16_t v)
+{
+    src[2 * i] = (uint8_t) (v >> 8);
+    src[2 * i + 1] = (uint8_t) v;
+}
+
+static uint16_t _get(const uint8_t *src, size_t i)
+{
+    return (uint16_t) ((src[2 * i] << 8) | src[2 * i + 1]);
+}
+
+static void _fill_all(void)
+{
+    size_t i;
+    for(i = 0; i < (size_t) ALL_W * ALL_H; i++) _put(all_src, i, (uint16_t) (i * 16 + i / 4096));
+}
+
+static double _ideal(int v, int lo, int hi, double gamma)
+{
+    if(v <= lo) return 0;
+    if(v >= hi) return 255;
+    return 255.0 * pow((double) (v - lo) / (hi - lo), gamma);
+}
+
+static void _test_window(int lo, int hi, double gamma, double tolerance)
+{
+    tone_map_t tm;
+    size_t i;
+    int prev = -1, worst_i = -1;
+    double worst = 0;
+
+    CHECK(tone_map_init(&tm, TONE_MAP_LINEAR, lo, hi, gamma) == 0);
+    tone_map_gray8(&tm, all_src, all_dst, ALL_W, ALL_H);
+
+    for(i = 0; i < (size_t) ALL_W * ALL_H; i++){
+        int v = _get(all_src, i);
+        double err = fabs(all_dst[i] - _ideal(v, lo, hi, gamma));
+        if(err > worst){
+            worst = err;
+            worst_i = (int) i;
+        }
+        if(v <= lo) CHECK_MSG(all_dst[i] == 0, "%d in [%d,%d] gave %d", v, lo, hi, all_dst[i]);
+        if(v >= hi) CHECK_MSG(all_dst[i] == 255, "%d in [%d,%d] gave %d", v, lo, hi, all_dst[i]);
+    }
+    CHECK_MSG(worst <= tolerance, "[%d,%d] gamma %.2f: %d gave %d, off by %.2f",
+              lo, hi, gamma, _get(all_src, worst_i), all_dst[worst_i], worst);
+
+    // the mapping can't go backwards, checked along a sorted sweep
+    for(i = 0; i < 65536; i += 7){
+        uint8_t s[2], d;
+        _put(s, 0, (uint16_t) i);
+        tone_map_gray8(&tm, s, &d, 1, 1);
+        CHECK_MSG(d >= prev, "[%d,%d] gamma %.2f not monotonic at %zu", lo, hi, gamma, i);
+        if(d < prev) break;
+        prev = d;
+    }
+    tone_map_deinit(&tm);
+}
+
+static void _test_linear(void)
+{
+    // vector path, within one level of exact
+    _test_window(0, 65535, 1.0, 1.0);
+    _test_window(1000, 5000, 1.0, 1.0);
+    _test_window(30000, 30256, 1.0, 1.0);
+    // narrow windows go through the table, rounded
+    _test_window(2000, 2100, 1.0, 0.5);
+    _test_window(7, 9, 1.0, 0.5);
+    // gamma goes through the table
+    _test_window(1000, 40000, 0.5, 0.5);
+    _test_window(1000, 40000, 2.2, 0.5);
+
+    // a window past the top still maps the top value to white
+    tone_map_t tm;
+    uint8_t s[2], d;
+    CHECK(tone_map_init(&tm, TONE_MAP_LINEAR, 65535, 65535, 1.0) == 0);
+    _put(s, 0, 65535);
+    tone_map_gray8(&tm, s, &d, 1, 1);
+    CHECK(d == 255);
+    tone_map_deinit(&tm);
+}
+
+static void _frame(uint8_t *src, int n, int lo, int hi, unsigned int seed)
+{
+    int i;
+    srand(seed);
+    for(i = 0; i < n; i++) _put(src, i, (uint16_t) (lo + rand() % (hi - lo + 1)));
+}
+
+static void _test_auto(void)
+{
+    enum { W = 160, H = 128 };
+    static uint8_t src[W * H * 2], dst[W * H];
+    tone_map_t tm;
+    int i;
+
+    // a scene in 1000..5000 converges on roughly that window
+    CHECK(tone_map_init(&tm, TONE_MAP_AUTO, 0, 0, 1.0) == 0);
+    for(i = 0; i < 60; i++){
+        _frame(src, W * H, 1000, 5000, i);
+        tone_map_gray8(&tm, src, dst, W, H);
+    }
+    CHECK_MSG(fabs(tm.lo - 1000) < 150 && fabs(tm.hi - 5000) < 150,
+              "window %.0f..%.0f for a 1000..5000 scene", tm.lo, tm.hi);
+
+    // the scene warms up, the window follows gradually, not in one frame
+    _frame(src, W * H, 20000, 24000, 100);
+    tone_map_gray8(&tm, src, dst, W, H);
+    CHECK_MSG(tm.lo < 10000, "window jumped straight to %.0f", tm.lo);
+    for(i = 0; i < 80; i++){
+        _frame(src, W * H, 20000, 24000, 101 + i);
+        tone_map_gray8(&tm, src, dst, W, H);
+    }
+    CHECK_MSG(fabs(tm.lo - 20000) < 200 && fabs(tm.hi - 24000) < 200,
+              "window %.0f..%.0f for a 20000..24000 scene", tm.lo, tm.hi);
+    tone_map_deinit(&tm);
+
+    // a flat scene isn't stretched over the full output
+    CHECK(tone_map_init(&tm, TONE_MAP_AUTO, 0, 0, 1.0) == 0);
+    _frame(src, W * H, 3000, 3003, 7);
+    tone_map_gray8(&tm, src, dst, W, H);
+    CHECK_MSG(tm.hi - tm.lo >= 255, "flat scene window %.0f..%.0f", tm.lo, tm.hi);
+    for(i = 0; i < W * H; i++){
+        if(abs(dst[i] - dst[0]) > 8) break;
+    }
+    CHECK_MSG(i == W * H, "flat scene mapped to %d and %d", dst[0], dst[i]);
+    tone_map_deinit(&tm);
+
+    // mostly saturated, the window reaches the top of the range and
+    // saturated pixels have to come out white, not wrap around to black
+    CHECK(tone_map_init(&tm, TONE_MAP_AUTO, 0, 0, 1.0) == 0);
+    for(i = 0; i < W * H; i++) _put(src, i, i < W * H / 2 ? 10 : 65535);
+    tone_map_gray8(&tm, src, dst, W, H);
+    CHECK_MSG(dst[W * H - 1] == 255, "saturated pixel mapped to %d", dst[W * H - 1]);
+    CHECK_MSG(dst[0] == 0, "cold pixel mapped to %d", dst[0]);
+    tone_map_deinit(&tm);
+
+    // all at the top
+    CHECK(tone_map_init(&tm, TONE_MAP_AUTO, 0, 0, 1.0) == 0);
+    for(i = 0; i < W * H; i++) _put(src, i, 65535);
+    tone_map_gray8(&tm, src, dst, W, H);
+    CHECK_MSG(dst[0] == 255, "all saturated mapped to %d", dst[0]);
+    tone_map_deinit(&tm);
+}
+
+int main(void)
+{
+    _fill_all();
+    _test_linear();
+    _test_auto();
+
+    return TEST_RESULT();
+}